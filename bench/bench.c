@@ -0,0 +1,463 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Common helpers for the instruction emulator benchmarks.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#ifdef __FreeBSD__
+#include <sys/cpuset.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#ifdef __FreeBSD__
+#include <pmc.h>
+#endif
+#include <pthread.h>
+#ifdef __FreeBSD__
+#include <pthread_np.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "bench.h"
+
+uint64_t
+bench_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * Calibrate the TSC against CLOCK_MONOTONIC once.
+ */
+double
+bench_tsc_ghz(void)
+{
+	static double ghz;
+	uint64_t c0, c1, t0, t1;
+
+	if (ghz != 0)
+		return (ghz);
+
+	t0 = bench_nsec();
+	c0 = bench_rdtsc();
+	do {
+		t1 = bench_nsec();
+	} while (t1 - t0 < 50000000);
+	c1 = bench_rdtsc();
+
+	ghz = (double)(c1 - c0) / (t1 - t0);
+	return (ghz);
+}
+
+int
+bench_pin(int cpu)
+{
+#ifdef __FreeBSD__
+	cpuset_t set;
+#else
+	cpu_set_t set;
+#endif
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return (pthread_setaffinity_np(pthread_self(), sizeof(set), &set));
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	uint64_t x, y;
+
+	x = *(const uint64_t *)a;
+	y = *(const uint64_t *)b;
+	return ((x > y) - (x < y));
+}
+
+static double
+bench_pct(uint64_t *samples, size_t n, double pct)
+{
+	size_t idx;
+
+	idx = (size_t)(pct * (n - 1) + 0.5);
+	return (samples[idx]);
+}
+
+void
+bench_stats(uint64_t *samples, size_t n, double scale, struct bench_stats *st)
+{
+	double sum;
+	size_t i;
+
+	st->n = n;
+	if (n == 0) {
+		st->min = st->mean = st->p50 = st->p99 = st->p999 = 0;
+		st->max = 0;
+		return;
+	}
+
+	qsort(samples, n, sizeof(uint64_t), bench_cmp);
+
+	sum = 0;
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+
+	st->min = samples[0] * scale;
+	st->mean = sum / n * scale;
+	st->p50 = bench_pct(samples, n, 0.50) * scale;
+	st->p99 = bench_pct(samples, n, 0.99) * scale;
+	st->p999 = bench_pct(samples, n, 0.999) * scale;
+	st->max = samples[n - 1] * scale;
+}
+
+void
+bench_print(const char *name, const char *unit, struct bench_stats *st)
+{
+
+	printf("%-32s n=%-9ju min %8.1f  mean %8.1f  p50 %8.1f  "
+	    "p99 %8.1f  p99.9 %8.1f  max %9.1f %s\n", name, (uintmax_t)st->n,
+	    st->min, st->mean, st->p50, st->p99, st->p999, st->max, unit);
+}
+
+void
+bench_host(char *cpu, size_t cpulen, char *cc, size_t cclen)
+{
+	uint32_t brand[13];
+	char *p;
+	int i;
+
+	/* The processor brand string, CPUID 0x80000002 to 0x80000004 */
+	__asm __volatile("cpuid" : "=a" (brand[0]), "=b" (brand[1]),
+	    "=c" (brand[2]), "=d" (brand[3]) : "0" (0x80000000));
+	if (brand[0] >= 0x80000004) {
+		for (i = 0; i < 3; i++)
+			__asm __volatile("cpuid" : "=a" (brand[4 * i]),
+			    "=b" (brand[4 * i + 1]), "=c" (brand[4 * i + 2]),
+			    "=d" (brand[4 * i + 3]) : "0" (0x80000002 + i));
+		brand[12] = 0;
+		for (p = (char *)brand; *p == ' '; p++)
+			continue;
+		strlcpy(cpu, p, cpulen);
+	} else
+		strlcpy(cpu, "unknown", cpulen);
+
+#if defined(__clang__)
+	snprintf(cc, cclen, "clang %s", __clang_version__);
+#elif defined(__GNUC__)
+	snprintf(cc, cclen, "gcc %s", __VERSION__);
+#else
+	strlcpy(cc, "unknown", cclen);
+#endif
+	/* Tabs separate the fields of the results file */
+	for (p = cpu; *p != '\0'; p++)
+		if (*p == '\t')
+			*p = ' ';
+	for (p = cc; *p != '\0'; p++)
+		if (*p == '\t')
+			*p = ' ';
+}
+
+int
+bench_results_open(struct bench_results *br, const char *path,
+    const char *bench, const char *label)
+{
+	char cpu[64], cc[128];
+
+	if ((br->fp = fopen(path, "a")) == NULL)
+		return (errno);
+	bench_host(cpu, sizeof(cpu), cc, sizeof(cc));
+	fprintf(br->fp, "run\t%jd\t%s\t%s\t%s\t%s\n", (intmax_t)time(NULL),
+	    bench, label, cpu, cc);
+	return (0);
+}
+
+void
+bench_results_add(struct bench_results *br, const char *name,
+    const char *unit, const double *val, int nrep)
+{
+	int i;
+
+	fprintf(br->fp, "res\t%s\t%s\t", name, unit);
+	for (i = 0; i < nrep; i++)
+		fprintf(br->fp, "%s%.2f", i ? "," : "", val[i]);
+	fprintf(br->fp, "\n");
+}
+
+int
+bench_results_close(struct bench_results *br)
+{
+	int error;
+
+	error = ferror(br->fp) ? EIO : 0;
+	if (fclose(br->fp) != 0 && error == 0)
+		error = errno;
+	br->fp = NULL;
+	return (error);
+}
+
+const char *const bench_pmc_names[BENCH_PMC_NEVENTS] = {
+	[BENCH_PMC_CYCLES] = "cycles",
+	[BENCH_PMC_INSTR] = "instructions",
+	[BENCH_PMC_BRMISS] = "branch-misses",
+	[BENCH_PMC_L1DMISS] = "L1d-misses",
+	[BENCH_PMC_L1IMISS] = "L1i-misses",
+	[BENCH_PMC_ITLBMISS] = "iTLB-misses",
+	[BENCH_PMC_HITM] = "HITM-loads",
+};
+
+#ifdef __linux__
+#define	BENCH_PMC_CACHE(cache)						\
+	((cache) | PERF_COUNT_HW_CACHE_OP_READ << 8 |			\
+	 PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+/*
+ * MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM, XSNP_FWD since Ice Lake, event 0xd2
+ * umask 0x04 on Intel cores since Sandy Bridge
+ */
+#define	BENCH_PMC_INTEL_HITM	0x04d2
+
+static const struct {
+	uint32_t	type;
+	uint64_t	config;
+} bench_pmc_events[BENCH_PMC_NEVENTS] = {
+	[BENCH_PMC_CYCLES] =
+	    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[BENCH_PMC_INSTR] =
+	    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[BENCH_PMC_BRMISS] =
+	    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	[BENCH_PMC_L1DMISS] =
+	    { PERF_TYPE_HW_CACHE, BENCH_PMC_CACHE(PERF_COUNT_HW_CACHE_L1D) },
+	[BENCH_PMC_L1IMISS] =
+	    { PERF_TYPE_HW_CACHE, BENCH_PMC_CACHE(PERF_COUNT_HW_CACHE_L1I) },
+	[BENCH_PMC_ITLBMISS] =
+	    { PERF_TYPE_HW_CACHE, BENCH_PMC_CACHE(PERF_COUNT_HW_CACHE_ITLB) },
+	[BENCH_PMC_HITM] =
+	    { PERF_TYPE_RAW, BENCH_PMC_INTEL_HITM },
+};
+
+/* Raw events mean something else on other vendors' PMUs */
+static int
+bench_intel(void)
+{
+	uint32_t a, b, c, d;
+
+	__asm __volatile("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d)
+	    : "0" (0));
+	return (b == 0x756e6547 && d == 0x49656e69 && c == 0x6c65746e);
+}
+#endif
+
+#ifdef __FreeBSD__
+/*
+ * Event specifiers to try in turn: the libpmc(3) aliases, then the Intel
+ * and AMD event names. Those the PMU does not know fail to allocate.
+ */
+static const char *const bench_pmc_specs[BENCH_PMC_NEVENTS][4] = {
+	[BENCH_PMC_CYCLES] =
+	    { "unhalted-cycles", "cpu_clk_unhalted.thread_p",
+	      "ls_not_halted_cyc" },
+	[BENCH_PMC_INSTR] =
+	    { "instructions", "inst_retired.any_p", "ex_ret_instr" },
+	[BENCH_PMC_BRMISS] =
+	    { "branch-mispredicts", "br_misp_retired.all_branches",
+	      "ex_ret_brn_misp" },
+	[BENCH_PMC_L1DMISS] =
+	    { "dc-misses", "l1d.replacement" },
+	[BENCH_PMC_L1IMISS] =
+	    { "ic-misses", "icache_64b.iftag_miss", "icache.misses" },
+	[BENCH_PMC_ITLBMISS] =
+	    { "itlb_misses.walk_completed", "itlb_misses.miss_causes_a_walk" },
+	[BENCH_PMC_HITM] =
+	    { "mem_load_l3_hit_retired.xsnp_hitm",
+	      "mem_load_l3_hit_retired.xsnp_fwd",
+	      "mem_load_uops_l3_hit_retired.xsnp_hitm",
+	      "mem_load_uops_llc_hit_retired.xsnp_hitm" },
+};
+
+/*
+ * Allocate one user-space only process mode counter per event and attach
+ * it to this process. Process mode is the only one that follows a process
+ * across cpus, so the counters see every thread of it.
+ */
+int
+bench_pmc_open(struct bench_pmc *pmc)
+{
+	const char *const *spec;
+	int i, j, n;
+
+	memset(pmc, 0, sizeof(*pmc));
+	pmc->process = 1;
+	for (i = 0; i < BENCH_PMC_NEVENTS; i++)
+		pmc->fd[i] = -1;
+	if (pmc_init() != 0)
+		return (0);
+
+	n = 0;
+	for (i = 0; i < BENCH_PMC_NEVENTS; i++) {
+		spec = bench_pmc_specs[i];
+		for (j = 0; j < (int)nitems(bench_pmc_specs[i]) &&
+		    spec[j] != NULL; j++) {
+			if (pmc_allocate(spec[j], PMC_MODE_TC, 0, PMC_CPU_ANY,
+			    &pmc->id[i], 0) == 0)
+				break;
+		}
+		if (j == (int)nitems(bench_pmc_specs[i]) || spec[j] == NULL)
+			continue;
+		if (pmc_attach(pmc->id[i], 0) != 0) {
+			pmc_release(pmc->id[i]);
+			continue;
+		}
+		pmc->open[i] = 1;
+		n++;
+	}
+	return (n);
+}
+
+void
+bench_pmc_close(struct bench_pmc *pmc)
+{
+	int i;
+
+	for (i = 0; i < BENCH_PMC_NEVENTS; i++) {
+		if (!pmc->open[i])
+			continue;
+		pmc_detach(pmc->id[i], 0);
+		pmc_release(pmc->id[i]);
+		pmc->open[i] = 0;
+	}
+}
+
+void
+bench_pmc_start(struct bench_pmc *pmc)
+{
+	pmc_value_t v;
+	int i;
+
+	for (i = 0; i < BENCH_PMC_NEVENTS; i++) {
+		if (!pmc->open[i])
+			continue;
+		pmc->base[i] = pmc_read(pmc->id[i], &v) == 0 ? v : 0;
+		pmc_start(pmc->id[i]);
+	}
+}
+
+void
+bench_pmc_stop(struct bench_pmc *pmc, double val[BENCH_PMC_NEVENTS])
+{
+	pmc_value_t v;
+	int i;
+
+	for (i = 0; i < BENCH_PMC_NEVENTS; i++) {
+		val[i] = -1;
+		if (!pmc->open[i])
+			continue;
+		pmc_stop(pmc->id[i]);
+		if (pmc_read(pmc->id[i], &v) == 0)
+			val[i] = v - pmc->base[i];
+	}
+}
+#else	/* !__FreeBSD__ */
+/*
+ * Open one user-space only counter per event for the calling thread. They
+ * are independent rather than a group so that events the PMU cannot
+ * schedule together are multiplexed and scaled instead of all failing.
+ */
+int
+bench_pmc_open(struct bench_pmc *pmc)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+#endif
+	int i, n;
+
+	memset(pmc, 0, sizeof(*pmc));
+	n = 0;
+	for (i = 0; i < BENCH_PMC_NEVENTS; i++) {
+		pmc->fd[i] = -1;
+#ifdef __linux__
+		if (bench_pmc_events[i].type == PERF_TYPE_RAW &&
+		    !bench_intel())
+			continue;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = bench_pmc_events[i].type;
+		attr.config = bench_pmc_events[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+		    PERF_FORMAT_TOTAL_TIME_RUNNING;
+		pmc->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (pmc->fd[i] >= 0) {
+			pmc->open[i] = 1;
+			n++;
+		}
+#endif
+	}
+	return (n);
+}
+
+void
+bench_pmc_close(struct bench_pmc *pmc)
+{
+	int i;
+
+	for (i = 0; i < BENCH_PMC_NEVENTS; i++) {
+		if (pmc->open[i])
+			close(pmc->fd[i]);
+		pmc->open[i] = 0;
+		pmc->fd[i] = -1;
+	}
+}
+
+void
+bench_pmc_start(struct bench_pmc *pmc)
+{
+#ifdef __linux__
+	int i;
+
+	for (i = 0; i < BENCH_PMC_NEVENTS; i++) {
+		if (!pmc->open[i])
+			continue;
+		ioctl(pmc->fd[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(pmc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+void
+bench_pmc_stop(struct bench_pmc *pmc, double val[BENCH_PMC_NEVENTS])
+{
+#ifdef __linux__
+	uint64_t buf[3];	/* value, time enabled, time running */
+#endif
+	int i;
+
+	for (i = 0; i < BENCH_PMC_NEVENTS; i++) {
+		val[i] = -1;
+#ifdef __linux__
+		if (!pmc->open[i])
+			continue;
+		ioctl(pmc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(pmc->fd[i], buf, sizeof(buf)) != sizeof(buf) ||
+		    buf[2] == 0)
+			continue;
+		val[i] = (double)buf[0] * buf[1] / buf[2];
+#endif
+	}
+}
+#endif	/* __FreeBSD__ */
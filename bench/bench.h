@@ -0,0 +1,104 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Common helpers for the instruction emulator benchmarks.
+ */
+
+#ifndef	_BENCH_H_
+#define	_BENCH_H_
+
+#define	BENCH_MAXCPU	16
+
+#ifndef	CACHE_LINE_SIZE
+#define	CACHE_LINE_SIZE	64
+#endif
+
+struct bench_stats {
+	uint64_t	n;
+	double		min;
+	double		mean;
+	double		p50;
+	double		p99;
+	double		p999;
+	double		max;
+};
+
+/*
+ * Hardware performance counters around a measured region, through
+ * perf_event_open(2) on Linux and hwpmc(4) on FreeBSD. Counters that
+ * cannot be opened read as -1; bench_pmc_open() returns the number that
+ * could, 0 when the host has none. perf_event_open(2) counts the calling
+ * thread; hwpmc(4) process mode counters count every thread of the
+ * process, which 'process' says. BENCH_PMC_HITM needs an Intel PMU.
+ */
+#define	BENCH_PMC_CYCLES	0
+#define	BENCH_PMC_INSTR		1
+#define	BENCH_PMC_BRMISS	2
+#define	BENCH_PMC_L1DMISS	3
+#define	BENCH_PMC_L1IMISS	4
+#define	BENCH_PMC_ITLBMISS	5
+#define	BENCH_PMC_HITM		6	/* loads snooping a modified line */
+#define	BENCH_PMC_NEVENTS	7
+
+struct bench_pmc {
+	int		open[BENCH_PMC_NEVENTS];
+	int		fd[BENCH_PMC_NEVENTS];		/* perf_event_open(2) */
+	uint32_t	id[BENCH_PMC_NEVENTS];		/* pmc_id_t */
+	uint64_t	base[BENCH_PMC_NEVENTS];	/* hwpmc(4), at start */
+	int		process;
+};
+
+extern const char *const bench_pmc_names[BENCH_PMC_NEVENTS];
+
+static __inline uint64_t
+bench_rdtsc(void)
+{
+	uint32_t lo, hi;
+
+	__asm __volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32 | lo);
+}
+
+uint64_t	bench_nsec(void);
+double		bench_tsc_ghz(void);
+int		bench_pin(int cpu);
+
+/*
+ * Sort 'samples' in place and summarize them. The values are scaled by
+ * 'scale' (e.g. 1 / bench_tsc_ghz() to turn cycles into ns).
+ */
+void		bench_stats(uint64_t *samples, size_t n, double scale,
+		    struct bench_stats *st);
+void		bench_print(const char *name, const char *unit,
+		    struct bench_stats *st);
+
+int		bench_pmc_open(struct bench_pmc *pmc);
+void		bench_pmc_close(struct bench_pmc *pmc);
+void		bench_pmc_start(struct bench_pmc *pmc);
+void		bench_pmc_stop(struct bench_pmc *pmc,
+		    double val[BENCH_PMC_NEVENTS]);
+
+/*
+ * Results store, appended to by the benchmarks and read by bench_compare.
+ * It is a text file of tab separated lines. A run of one benchmark is a
+ * 'run' line, keyed by the host cpu model and the compiler, followed by a
+ * 'res' line per case with the value of each repetition:
+ *
+ *	run	<time_t>	<bench>	<label>	<cpu model>	<compiler>
+ *	res	<case>	<unit>	<value>,<value>,...
+ */
+#define	BENCH_RES_MAXREP	64
+
+struct bench_results {
+	FILE		*fp;
+};
+
+/* The cpu model and compiler that results are keyed by */
+void		bench_host(char *cpu, size_t cpulen, char *cc, size_t cclen);
+int		bench_results_open(struct bench_results *br, const char *path,
+		    const char *bench, const char *label);
+void		bench_results_add(struct bench_results *br, const char *name,
+		    const char *unit, const double *val, int nrep);
+int		bench_results_close(struct bench_results *br);
+
+#endif	/* _BENCH_H_ */
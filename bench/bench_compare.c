@@ -0,0 +1,343 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Compare benchmark results against a stored baseline.
+ *
+ * The results file (see bench.h) holds runs of the benchmarks, each keyed
+ * by the host cpu model and the compiler, with the value of every
+ * repetition of every case. For each benchmark the newest run is compared
+ * with the newest earlier run of the same benchmark, host and compiler
+ * labeled as the baseline. Each case that both runs have is tested with
+ * the one-sided Mann-Whitney U test of whether the new repetitions are
+ * slower than the baseline's, using the normal approximation with a tie
+ * and continuity correction. A case has regressed when the test is
+ * significant at 'alpha' and its median is more than 'threshold' percent
+ * above the baseline's; the exit status is then 1. A results file that
+ * cannot be read or has a malformed line, a case with more than
+ * BENCH_RES_MAXREP repetitions, or a benchmark named on the command line,
+ * or any benchmark in the file if none is named, that has no run or no
+ * baseline to compare with is an error like a usage error: 2. The
+ * benchmarks that do have a baseline are still compared first.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "bench.h"
+
+struct bc_res {
+	char		*name;
+	char		*unit;
+	double		val[BENCH_RES_MAXREP];
+	int		nrep;
+};
+
+struct bc_run {
+	time_t		time;
+	char		*bench;
+	char		*label;
+	char		*cpu;
+	char		*cc;
+	struct bc_res	*res;
+	int		nres;
+	int		maxres;
+};
+
+static struct bc_run *runs;
+static int	nrun;
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x, y;
+
+	x = *(const double *)a;
+	y = *(const double *)b;
+	return ((x > y) - (x < y));
+}
+
+static double
+median(const double *val, int n)
+{
+	double v[BENCH_RES_MAXREP];
+
+	memcpy(v, val, n * sizeof(double));
+	qsort(v, n, sizeof(double), cmp_double);
+	return (n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2);
+}
+
+/*
+ * One-sided p-value of the Mann-Whitney U test that 'x' tends to be larger
+ * than 'y'. U counts the pairs in which x is larger, ties as halves, and
+ * is approximately normal with mean nm/2 and variance
+ * nm/12 * (N + 1 - sum(t^3 - t) / (N(N - 1))) over the tie groups t.
+ */
+static double
+mann_whitney(const double *x, int n, const double *y, int m)
+{
+	double all[2 * BENCH_RES_MAXREP], mu, sd, ties, u, z;
+	int i, j, t, nm;
+
+	u = 0;
+	for (i = 0; i < n; i++)
+		for (j = 0; j < m; j++)
+			u += x[i] > y[j] ? 1 : x[i] == y[j] ? 0.5 : 0;
+
+	nm = n + m;
+	memcpy(all, x, n * sizeof(double));
+	memcpy(all + n, y, m * sizeof(double));
+	qsort(all, nm, sizeof(double), cmp_double);
+	ties = 0;
+	for (i = 0; i < nm; i += t) {
+		for (t = 1; i + t < nm && all[i + t] == all[i]; t++)
+			continue;
+		ties += (double)t * t * t - t;
+	}
+
+	mu = n * m / 2.0;
+	sd = sqrt(n * m / 12.0 * (nm + 1 - ties / ((double)nm * (nm - 1))));
+	if (sd == 0)
+		return (1);
+	z = (u - mu - 0.5) / sd;
+	return (0.5 * erfc(z / M_SQRT2));
+}
+
+static char *
+xstrdup(const char *s)
+{
+	char *p;
+
+	if ((p = strdup(s)) == NULL)
+		err(2, "strdup");
+	return (p);
+}
+
+static void
+load(const char *path)
+{
+	struct bc_run *run;
+	struct bc_res *res;
+	FILE *fp;
+	char *f[6], *line, *p, *v;
+	size_t cap;
+	int lineno, maxrun, nf;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(2, "%s", path);
+	line = NULL;
+	cap = 0;
+	maxrun = 0;
+	run = NULL;
+	for (lineno = 1; getline(&line, &cap, fp) > 0; lineno++) {
+		line[strcspn(line, "\n")] = '\0';
+		for (p = line, nf = 0; nf < 6 && (f[nf] = strsep(&p, "\t")) !=
+		    NULL; nf++)
+			continue;
+		if (nf == 6 && strcmp(f[0], "run") == 0) {
+			if (nrun == maxrun) {
+				maxrun = maxrun ? 2 * maxrun : 16;
+				runs = reallocf(runs, maxrun * sizeof(*runs));
+				if (runs == NULL)
+					err(2, "realloc");
+			}
+			run = &runs[nrun++];
+			memset(run, 0, sizeof(*run));
+			run->time = strtoll(f[1], NULL, 10);
+			run->bench = xstrdup(f[2]);
+			run->label = xstrdup(f[3]);
+			run->cpu = xstrdup(f[4]);
+			run->cc = xstrdup(f[5]);
+		} else if (nf == 4 && strcmp(f[0], "res") == 0 &&
+		    run != NULL) {
+			if (run->nres == run->maxres) {
+				run->maxres = run->maxres ? 2 * run->maxres :
+				    64;
+				run->res = reallocf(run->res, run->maxres *
+				    sizeof(*run->res));
+				if (run->res == NULL)
+					err(2, "realloc");
+			}
+			res = &run->res[run->nres++];
+			res->name = xstrdup(f[1]);
+			res->unit = xstrdup(f[2]);
+			for (p = f[3], res->nrep = 0; (v = strsep(&p, ",")) !=
+			    NULL;) {
+				if (res->nrep == BENCH_RES_MAXREP)
+					errx(2, "%s:%d: over %d repetitions",
+					    path, lineno, BENCH_RES_MAXREP);
+				res->val[res->nrep++] = strtod(v, NULL);
+			}
+		} else if (line[0] != '\0')
+			errx(2, "%s:%d: malformed line", path, lineno);
+	}
+	if (ferror(fp))
+		err(2, "%s", path);
+	free(line);
+	fclose(fp);
+}
+
+static const struct bc_res *
+find(const struct bc_run *run, const char *name)
+{
+	int i;
+
+	for (i = 0; i < run->nres; i++)
+		if (strcmp(run->res[i].name, name) == 0)
+			return (&run->res[i]);
+	return (NULL);
+}
+
+/*
+ * Compare the newest run of 'bench' with its baseline. Returns the number
+ * of regressed cases, or -1 if there is no baseline. The p-value shown is
+ * that of the test in the direction of the change.
+ */
+static int
+compare(const char *bench, const char *blabel, double alpha,
+    double threshold, int verbose)
+{
+	const struct bc_run *cur, *base;
+	const struct bc_res *cr, *br;
+	double change, mb, mc, p;
+	int i, nfaster, nslower;
+	const char *verdict;
+	char btm[32], ctm[32];
+
+	cur = base = NULL;
+	for (i = nrun - 1; i >= 0 && cur == NULL; i--)
+		if (strcmp(runs[i].bench, bench) == 0)
+			cur = &runs[i];
+	for (; i >= 0 && base == NULL; i--)
+		if (strcmp(runs[i].bench, bench) == 0 &&
+		    strcmp(runs[i].label, blabel) == 0 &&
+		    strcmp(runs[i].cpu, cur->cpu) == 0 &&
+		    strcmp(runs[i].cc, cur->cc) == 0)
+			base = &runs[i];
+	if (base == NULL) {
+		warnx("%s: no '%s' run on %s with %s", bench, blabel,
+		    cur->cpu, cur->cc);
+		return (-1);
+	}
+
+	strftime(ctm, sizeof(ctm), "%F %T", localtime(&cur->time));
+	strftime(btm, sizeof(btm), "%F %T", localtime(&base->time));
+	printf("%s: %s run of %s against %s run of %s\n", bench,
+	    cur->label[0] ? cur->label : "unlabeled", ctm, base->label,
+	    btm);
+	nslower = nfaster = 0;
+	for (i = 0; i < cur->nres; i++) {
+		cr = &cur->res[i];
+		if ((br = find(base, cr->name)) == NULL)
+			continue;
+		mc = median(cr->val, cr->nrep);
+		mb = median(br->val, br->nrep);
+		change = mb != 0 ? 100 * (mc - mb) / mb : 0;
+		if (change >= 0)
+			p = mann_whitney(cr->val, cr->nrep, br->val, br->nrep);
+		else
+			p = mann_whitney(br->val, br->nrep, cr->val, cr->nrep);
+		if (p < alpha && change > threshold) {
+			verdict = "SLOWER";
+			nslower++;
+		} else if (p < alpha && change < -threshold) {
+			verdict = "faster";
+			nfaster++;
+		} else if (verbose)
+			verdict = "";
+		else
+			continue;
+		printf("  %-40s %9.2f %9.2f %s %+7.1f%%  p %.3f  %s\n",
+		    cr->name, mb, mc, cr->unit, change, p, verdict);
+	}
+	printf("  %d cases, %d slower and %d faster by more than %g%% "
+	    "at p < %g\n", cur->nres, nslower, nfaster, threshold, alpha);
+	return (nslower);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: bench_compare [-v] [-a alpha] "
+	    "[-b baseline-label] [-t threshold%%]\n"
+	    "                     results [bench ...]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *blabel;
+	double alpha, threshold;
+	int ch, i, j, missing, n, regressed, verbose;
+
+	alpha = 0.05;
+	threshold = 5;
+	blabel = "baseline";
+	verbose = 0;
+	while ((ch = getopt(argc, argv, "a:b:t:v")) != -1) {
+		switch (ch) {
+		case 'a':
+			alpha = atof(optarg);
+			break;
+		case 'b':
+			blabel = optarg;
+			break;
+		case 't':
+			threshold = atof(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1 || alpha <= 0 || alpha >= 1 || threshold < 0)
+		usage();
+
+	load(argv[0]);
+	missing = regressed = 0;
+	for (i = 0; i < nrun; i++) {
+		/* Each benchmark once, at its first run in the file */
+		for (j = 0; j < i; j++)
+			if (strcmp(runs[j].bench, runs[i].bench) == 0)
+				break;
+		if (j < i)
+			continue;
+		for (j = 1; j < argc; j++)
+			if (strcmp(argv[j], runs[i].bench) == 0)
+				break;
+		if (argc > 1 && j == argc)
+			continue;
+		if ((n = compare(runs[i].bench, blabel, alpha, threshold,
+		    verbose)) < 0)
+			missing++;
+		else
+			regressed += n;
+	}
+	for (j = 1; j < argc; j++) {
+		for (i = 0; i < nrun; i++)
+			if (strcmp(argv[j], runs[i].bench) == 0)
+				break;
+		if (i == nrun) {
+			warnx("%s: no runs", argv[j]);
+			missing++;
+		}
+	}
+	if (nrun == 0)
+		errx(2, "nothing to compare");
+	if (missing != 0)
+		return (2);
+	return (regressed != 0);
+}
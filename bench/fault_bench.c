@@ -0,0 +1,372 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Exception and fault path benchmark.
+ *
+ * Each case is an MMIO exit that ends in a fault rather than a device
+ * access: a #GP from a segment limit, a NULL or read-only segment or a
+ * non-canonical address, a #SS from the same checks on the stack, an #AC
+ * from an alignment check, a #PF from a not present page and a decode
+ * failure. The vmm stubs stand in for the inject functions and record the
+ * exception; the not present page is the stubs' np range, which makes
+ * vm_copy_setup() and vm_gla2gpa() report a guest fault as _vm_gla2gpa()
+ * would. A few exits that do not fault are measured alongside for
+ * reference.
+ *
+ * Every exit is decoded and emulated from the same starting state and
+ * timed with the TSC. Besides the cost per fault the benchmark checks that
+ * each fault path does no more than it has to: the expected exception is
+ * injected, the registers are left alone, and no exit makes more calls to
+ * vm_copy_setup(), vm_gla2gpa() or the MMIO callbacks than its budget. A
+ * fault found by the segment, canonical or alignment checks has a budget
+ * of no calls at all; a #PF must not be preceded by a device access. The
+ * exit status is 1 if any case is over budget or injects the wrong
+ * exception.
+ *
+ * The emulator prints its gla mismatch reports on stdout; they are sent to
+ * stderr so that they do not end up in the middle of the table.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <x86/psl.h>
+#include <x86/specialreg.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "bench.h"
+
+#define	DEV_BASE	0xfeb00000UL	/* MMIO operand, in %rdx */
+#define	RAM_BASE	0x00100000UL	/* RAM for string sources and stack */
+#define	RAM_SIZE	0x1000
+#define	NP_BASE		0x00200000UL	/* not present page */
+#define	NP_SIZE		0x1000
+#define	NONCANON	0x0000800000000000UL
+
+#define	EXC_DECODE	(-1)		/* vmm_decode_instruction() fails */
+
+/* Protected mode descriptors: a 4KB data segment, NULL and read-only */
+#define	SEG_SMALL	{ 0, 0xfff, 0xc093 }
+#define	SEG_NULL	{ 0, 0, 0x10000 }
+#define	SEG_RDONLY	{ 0, 0xffffffff, 0xc091 }
+
+static const struct f_case {
+	const char	*name;
+	enum vm_cpu_mode mode;
+	uint8_t		inst[VIE_INST_SIZE];
+	int		len;
+	uint64_t	gla;		/* for decode, VIE_INVALID_GLA if 0 */
+	uint64_t	rsi;
+	uint64_t	rdi;
+	uint64_t	rsp;
+	int		seg;		/* segment loaded with 'desc', or 0 */
+	struct seg_desc	desc;
+	int		ac;		/* CPL 3 with CR0.AM and RFLAGS.AC */
+	int		exc;		/* expected exception, 0 for none */
+	int		maxcopy;	/* most calls allowed per exit */
+	int		maxgla2gpa;
+	int		maxmmio;
+} cases[] = {
+	/* Reference exits, without a fault */
+	{ "movsl ram->mmio", CPU_MODE_64BIT, { 0xa5 }, 1, 0,
+	    RAM_BASE, DEV_BASE, RAM_BASE + 0x100, 0, { 0 }, 0,
+	    0, 1, 0, 1 },
+	{ "movsl mmio->mmio", CPU_MODE_64BIT, { 0xa5 }, 1, 0,
+	    DEV_BASE + 0x10, DEV_BASE, RAM_BASE + 0x100, 0, { 0 }, 0,
+	    0, 2, 2, 2 },
+	{ "pushq (%rdx)", CPU_MODE_64BIT, { 0xff, 0x32 }, 2, 0,
+	    0, 0, RAM_BASE + 0x100, 0, { 0 }, 0,
+	    0, 1, 0, 1 },
+
+	/* #GP from vie_calculate_gla() and vie_canonical_check() */
+	{ "movsl src limit", CPU_MODE_PROTECTED, { 0xa5 }, 1, 0,
+	    0x2000, DEV_BASE, RAM_BASE + 0x100, VM_REG_GUEST_DS, SEG_SMALL, 0,
+	    VM_STUB_EXC_GP, 0, 0, 0 },
+	{ "movsl src null seg", CPU_MODE_PROTECTED, { 0xa5 }, 1, 0,
+	    RAM_BASE, DEV_BASE, RAM_BASE + 0x100, VM_REG_GUEST_DS, SEG_NULL, 0,
+	    VM_STUB_EXC_GP, 0, 0, 0 },
+	{ "movsl src noncanon", CPU_MODE_64BIT, { 0xa5 }, 1, 0,
+	    NONCANON, DEV_BASE, RAM_BASE + 0x100, 0, { 0 }, 0,
+	    VM_STUB_EXC_GP, 0, 0, 0 },
+	/* The source is MMIO: vm_copy_setup() on it tells case (4) apart */
+	{ "movsl dst read-only", CPU_MODE_PROTECTED, { 0xa5 }, 1, 0,
+	    DEV_BASE + 0x10, 0x2000, RAM_BASE + 0x100, VM_REG_GUEST_ES,
+	    SEG_RDONLY, 0,
+	    VM_STUB_EXC_GP, 1, 0, 0 },
+	{ "movsl dst noncanon", CPU_MODE_64BIT, { 0xa5 }, 1, 0,
+	    DEV_BASE + 0x10, NONCANON, RAM_BASE + 0x100, 0, { 0 }, 0,
+	    VM_STUB_EXC_GP, 1, 0, 0 },
+
+	/* #SS from the same checks on the stack */
+	{ "pushl (%edx) limit", CPU_MODE_PROTECTED, { 0xff, 0x32 }, 2, 0,
+	    0, 0, 0x2000, VM_REG_GUEST_SS, SEG_SMALL, 0,
+	    VM_STUB_EXC_SS, 0, 0, 0 },
+	{ "popl (%edx) limit", CPU_MODE_PROTECTED, { 0x8f, 0x02 }, 2, 0,
+	    0, 0, 0x2000, VM_REG_GUEST_SS, SEG_SMALL, 0,
+	    VM_STUB_EXC_SS, 0, 0, 0 },
+	{ "pushq (%rdx) noncanon", CPU_MODE_64BIT, { 0xff, 0x32 }, 2, 0,
+	    0, 0, NONCANON + 0x8, 0, { 0 }, 0,
+	    VM_STUB_EXC_SS, 0, 0, 0 },
+	{ "popq (%rdx) noncanon", CPU_MODE_64BIT, { 0x8f, 0x02 }, 2, 0,
+	    0, 0, NONCANON, 0, { 0 }, 0,
+	    VM_STUB_EXC_SS, 0, 0, 0 },
+
+	/* #AC from vie_alignment_check() */
+	{ "pushq (%rdx) unaligned", CPU_MODE_64BIT, { 0xff, 0x32 }, 2, 0,
+	    0, 0, RAM_BASE + 0x103, 0, { 0 }, 1,
+	    VM_STUB_EXC_AC, 0, 0, 0 },
+	{ "movsl src unaligned", CPU_MODE_64BIT, { 0xa5 }, 1, 0,
+	    RAM_BASE + 0x1, DEV_BASE, RAM_BASE + 0x100, 0, { 0 }, 1,
+	    VM_STUB_EXC_AC, 0, 0, 0 },
+
+	/* #PF from the address translation, before any device access */
+	{ "pushq (%rdx) np", CPU_MODE_64BIT, { 0xff, 0x32 }, 2, 0,
+	    0, 0, NP_BASE + 0x10, 0, { 0 }, 0,
+	    VM_STUB_EXC_PF, 1, 0, 0 },
+	{ "popq (%rdx) np", CPU_MODE_64BIT, { 0x8f, 0x02 }, 2, 0,
+	    0, 0, NP_BASE + 0x10, 0, { 0 }, 0,
+	    VM_STUB_EXC_PF, 1, 0, 0 },
+	{ "movsl src np", CPU_MODE_64BIT, { 0xa5 }, 1, 0,
+	    NP_BASE, DEV_BASE, RAM_BASE + 0x100, 0, { 0 }, 0,
+	    VM_STUB_EXC_PF, 1, 0, 0 },
+	{ "movsl dst np", CPU_MODE_64BIT, { 0xa5 }, 1, 0,
+	    DEV_BASE + 0x10, NP_BASE, RAM_BASE + 0x100, 0, { 0 }, 0,
+	    VM_STUB_EXC_PF, 2, 0, 0 },
+
+	/* Decode failures */
+	{ "ud2", CPU_MODE_64BIT, { 0x0f, 0x0b }, 2, 0,
+	    0, 0, RAM_BASE + 0x100, 0, { 0 }, 0,
+	    EXC_DECODE, 0, 0, 0 },
+	{ "movl truncated", CPU_MODE_64BIT, { 0x89 }, 1, 0,
+	    0, 0, RAM_BASE + 0x100, 0, { 0 }, 0,
+	    EXC_DECODE, 0, 0, 0 },
+	{ "movl gla mismatch", CPU_MODE_64BIT, { 0x89, 0x42, 0x10 }, 3,
+	    DEV_BASE + 0x20,
+	    0, 0, RAM_BASE + 0x100, 0, { 0 }, 0,
+	    EXC_DECODE, 0, 0, 0 },
+};
+
+static u_long nmmio;
+static uint8_t ram[RAM_SIZE] __aligned(CACHE_LINE_SIZE);
+
+static int
+f_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+
+	nmmio++;
+	*rval = 0;
+	return (0);
+}
+
+static int
+f_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+
+	nmmio++;
+	return (0);
+}
+
+static const char *
+exc_name(int exc)
+{
+
+	switch (exc) {
+	case 0:
+		return ("-");
+	case EXC_DECODE:
+		return ("decode");
+	case VM_STUB_EXC_SS:
+		return ("#SS");
+	case VM_STUB_EXC_GP:
+		return ("#GP");
+	case VM_STUB_EXC_PF:
+		return ("#PF");
+	case VM_STUB_EXC_AC:
+		return ("#AC");
+	default:
+		return ("?");
+	}
+}
+
+/* The state every exit of 'fc' starts from */
+static void
+load(struct vm_stub_vcpu *vc, const struct f_case *fc)
+{
+
+	vm_stub_reset(vc);
+	if (vm_stub_map(vc, RAM_BASE, RAM_SIZE, ram) != 0)
+		errx(1, "vm_stub_map");
+	vc->np_gla = NP_BASE;
+	vc->np_len = NP_SIZE;
+	vc->regs[VM_REG_GUEST_RDX] = DEV_BASE;
+	vc->regs[VM_REG_GUEST_RSI] = fc->rsi;
+	vc->regs[VM_REG_GUEST_RDI] = fc->rdi;
+	vc->regs[VM_REG_GUEST_RSP] = fc->rsp;
+	vc->regs[VM_REG_GUEST_RFLAGS] = 0x2;
+	if (fc->ac) {
+		vc->regs[VM_REG_GUEST_CR0] |= CR0_AM;
+		vc->regs[VM_REG_GUEST_RFLAGS] |= PSL_AC;
+	}
+	if (fc->seg != 0)
+		vc->segs[fc->seg - VM_REG_GUEST_ES] = fc->desc;
+}
+
+/* The GPA of the exit: a string move exits on its source if it is MMIO */
+static uint64_t
+exit_gpa(const struct f_case *fc)
+{
+
+	if (fc->inst[0] == 0xa5 && fc->rsi - DEV_BASE >= 0x1000)
+		return (fc->rdi);
+	if (fc->inst[0] == 0xa5)
+		return (fc->rsi);
+	return (DEV_BASE);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: fault_bench [-c cpu] [-n exits] [case ...]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct vm_stub_vcpu *vc, start;
+	struct vm_guest_paging paging;
+	struct bench_stats st;
+	struct vie vie;
+	const struct f_case *fc;
+	uint64_t *samples, gla, gpa, t0;
+	u_long maxcopy, maxgla2gpa, maxmmio;
+	size_t i, n, nwarm;
+	int ch, cpu, error, exc, failed, fd, j, k, over, ran, regs, wrong;
+	double ghz;
+	FILE *out;
+
+	n = 200000;
+	cpu = 0;
+	while ((ch = getopt(argc, argv, "c:n:")) != -1) {
+		switch (ch) {
+		case 'c':
+			cpu = atoi(optarg);
+			break;
+		case 'n':
+			n = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (n == 0)
+		usage();
+
+	if (cpu >= 0 && bench_pin(cpu) != 0)
+		warnx("cannot pin to cpu %d", cpu);
+	ghz = bench_tsc_ghz();
+	nwarm = n / 10;
+	if ((samples = calloc(n, sizeof(uint64_t))) == NULL)
+		err(1, "malloc");
+	vc = vm_stub_vcpu(NULL, 0);
+
+	if ((fd = dup(STDOUT_FILENO)) < 0 || (out = fdopen(fd, "w")) == NULL)
+		err(1, "dup");
+	if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+		err(1, "dup2");
+
+	fprintf(out, "%-24s %-6s %8s %8s %8s  %5s %5s %5s\n", "case", "fault",
+	    "mean", "p50", "p99", "copy", "g2g", "mmio");
+	failed = ran = 0;
+	for (j = 0; j < (int)nitems(cases); j++) {
+		fc = &cases[j];
+		for (k = 0; k < argc; k++)
+			if (strcmp(argv[k], fc->name) == 0)
+				break;
+		if (argc > 0 && k == argc)
+			continue;
+		ran++;
+
+		load(vc, fc);
+		start = *vc;
+		memset(&paging, 0, sizeof(paging));
+		paging.cpu_mode = fc->mode;
+		paging.paging_mode = fc->mode == CPU_MODE_64BIT ?
+		    PAGING_MODE_64 : PAGING_MODE_FLAT;
+		paging.cpl = fc->ac ? 3 : 0;
+		gla = fc->gla != 0 ? fc->gla : VIE_INVALID_GLA;
+		gpa = exit_gpa(fc);
+
+		maxcopy = maxgla2gpa = maxmmio = 0;
+		wrong = regs = 0;
+		for (i = 0; i < nwarm + n; i++) {
+			*vc = start;
+			nmmio = 0;
+
+			t0 = bench_rdtsc();
+			memset(&vie, 0, sizeof(vie));
+			vie.base_register = VM_REG_LAST;
+			vie.index_register = VM_REG_LAST;
+			vie.segment_register = VM_REG_LAST;
+			memcpy(vie.inst, fc->inst, fc->len);
+			vie.num_valid = fc->len;
+			error = vmm_decode_instruction(NULL, 0, gla, fc->mode,
+			    fc->mode != CPU_MODE_64BIT, &vie);
+			if (error == 0)
+				error = vmm_emulate_instruction(NULL, 0, gpa,
+				    &vie, &paging, f_mread, f_mwrite, NULL);
+			t0 = bench_rdtsc() - t0;
+			if (i >= nwarm)
+				samples[i - nwarm] = t0;
+
+			exc = error != 0 ? EXC_DECODE : vc->exception;
+			if (exc != fc->exc)
+				wrong++;
+			if (exc != 0 && memcmp(vc->regs, start.regs,
+			    sizeof(start.regs)) != 0)
+				regs++;
+			maxcopy = MAX(maxcopy, vc->ncopy_setup);
+			maxgla2gpa = MAX(maxgla2gpa, vc->ngla2gpa);
+			maxmmio = MAX(maxmmio, nmmio);
+		}
+		over = maxcopy > (u_long)fc->maxcopy ||
+		    maxgla2gpa > (u_long)fc->maxgla2gpa ||
+		    maxmmio > (u_long)fc->maxmmio;
+		bench_stats(samples, n, 1 / ghz, &st);
+		fprintf(out, "%-24s %-6s %8.1f %8.1f %8.1f  %5lu %5lu %5lu",
+		    fc->name, exc_name(fc->exc), st.mean, st.p50, st.p99,
+		    maxcopy, maxgla2gpa, maxmmio);
+		if (wrong != 0)
+			fprintf(out, "  WRONG: %s in %d exits", exc_name(exc),
+			    wrong);
+		if (regs != 0)
+			fprintf(out, "  REGS: changed by %d faults", regs);
+		if (over)
+			fprintf(out, "  OVER BUDGET: %d/%d/%d", fc->maxcopy,
+			    fc->maxgla2gpa, fc->maxmmio);
+		fprintf(out, "\n");
+		fflush(out);
+		if (wrong != 0 || regs != 0 || over)
+			failed++;
+	}
+	if (ran == 0)
+		errx(1, "no such case");
+
+	fprintf(out, "\nTimes are ns per exit. copy, g2g and mmio are the most "
+	    "vm_copy_setup(),\nvm_gla2gpa() and MMIO callback calls made "
+	    "by one exit. %d of %d cases failed.\n", failed, ran);
+	fclose(out);
+	free(samples);
+	return (failed != 0);
+}
@@ -0,0 +1,233 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Hot-site sketch accuracy and cost.
+ *
+ * Feeds a synthetic stream of emulation sites with Zipf distributed
+ * popularity to the per-vCPU sketches of vmm_hotsites.c, spread over a
+ * number of vCPUs, and counts the same stream exactly. Reports the cost of
+ * an update, then checks the merged sketches against the exact counts:
+ *
+ * - every reported site has its true count within [count - error, count];
+ * - every site seen more than N / VIE_HOT_NSITES times is reported.
+ *
+ * and prints the recall and the count error of the top sites. Exits with 1
+ * if a guarantee does not hold.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <err.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "vmm_hotsites.h"
+#include "bench.h"
+
+#define	SITE_RIP(id)	(0xffffffff80000000UL + (uint64_t)(id) * 0x13)
+#define	SITE_GPA(id)	(0xfe000000UL + ((uint64_t)(id) * 8 & 0xfff))
+#define	SITE_OP(id)	(1 + (id) % 14)
+
+static struct vie_hot hot;
+
+static uint64_t
+xorshift(uint64_t *state)
+{
+	uint64_t x;
+
+	x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return (*state = x);
+}
+
+/* Draw 'n' site ids out of 'nsites' with probability proportional to 1/i^z */
+static void
+zipf(uint32_t *ids, size_t n, uint32_t nsites, double z, uint64_t seed)
+{
+	double *cdf, u;
+	uint32_t lo, hi, mid;
+	size_t i;
+
+	cdf = malloc(nsites * sizeof(double));
+	if (cdf == NULL)
+		err(1, "malloc");
+	cdf[0] = 1;
+	for (i = 1; i < nsites; i++)
+		cdf[i] = cdf[i - 1] + pow(i + 1, -z);
+
+	for (i = 0; i < n; i++) {
+		u = (xorshift(&seed) >> 11) * 0x1p-53 * cdf[nsites - 1];
+		for (lo = 0, hi = nsites - 1; lo < hi;) {
+			mid = lo + (hi - lo) / 2;
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		ids[i] = lo;
+	}
+	free(cdf);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: hot_bench [-q] [-c vcpus] [-n updates] "
+	    "[-s sites] [-S seed] [-t top] [-z exponent]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct vie_hot_site *top;
+	uint64_t *exact, seed, t0, elapsed, threshold, kth;
+	uint32_t *ids, id, nsites;
+	uint8_t *vcpus, *reported;
+	size_t i, n;
+	double z, maxerr, relerr;
+	int ch, error, missed, ntop, nvcpu, quiet, recall, shown, violations;
+
+	nvcpu = 4;
+	n = 4000000;
+	nsites = 100000;
+	seed = 1;
+	shown = 16;
+	z = 1.1;
+	quiet = 0;
+	while ((ch = getopt(argc, argv, "c:n:qs:S:t:z:")) != -1) {
+		switch (ch) {
+		case 'c':
+			nvcpu = atoi(optarg);
+			break;
+		case 'n':
+			n = strtoull(optarg, NULL, 0);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 's':
+			nsites = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			shown = atoi(optarg);
+			break;
+		case 'z':
+			z = strtod(optarg, NULL);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || n == 0 || nsites == 0 || shown < 1 ||
+	    nvcpu < 1 || nvcpu > VIE_HOT_MAXCPU || seed == 0)
+		usage();
+
+	ids = malloc(n * sizeof(uint32_t));
+	vcpus = malloc(n);
+	exact = calloc(nsites, sizeof(uint64_t));
+	reported = calloc(nsites, 1);
+	ntop = VIE_HOT_MAXCPU * VIE_HOT_NSITES;
+	top = calloc(ntop, sizeof(struct vie_hot_site));
+	if (ids == NULL || vcpus == NULL || exact == NULL ||
+	    reported == NULL || top == NULL)
+		err(1, "malloc");
+
+	zipf(ids, n, nsites, z, seed);
+	for (i = 0; i < n; i++) {
+		vcpus[i] = xorshift(&seed) % nvcpu;
+		exact[ids[i]]++;
+	}
+
+	vie_hot_init(&hot);
+	t0 = bench_nsec();
+	for (i = 0; i < n; i++) {
+		id = ids[i];
+		vie_hot_record(&hot, vcpus[i], SITE_RIP(id), SITE_GPA(id),
+		    SITE_OP(id));
+	}
+	elapsed = bench_nsec() - t0;
+	printf("%zu updates of %u sites (zipf %.2f) on %d vcpus: "
+	    "%.1f ns/update\n", n, nsites, z, nvcpu, (double)elapsed / n);
+
+	if ((error = vie_hot_top(&hot, top, &ntop)) != 0)
+		errc(1, error, "vie_hot_top");
+
+	/* Bounds of every reported site */
+	violations = 0;
+	for (i = 0; i < (size_t)ntop; i++) {
+		id = (top[i].rip - SITE_RIP(0)) / 0x13;
+		if (id >= nsites || top[i].rip != SITE_RIP(id) ||
+		    top[i].gpa != SITE_GPA(id) ||
+		    top[i].op_type != SITE_OP(id))
+			errx(1, "bogus site %#jx", (uintmax_t)top[i].rip);
+		reported[id] = 1;
+		if (exact[id] > top[i].count ||
+		    exact[id] < top[i].count - top[i].error) {
+			warnx("site %u: true count %ju not in [%ju, %ju]", id,
+			    (uintmax_t)exact[id],
+			    (uintmax_t)(top[i].count - top[i].error),
+			    (uintmax_t)top[i].count);
+			violations++;
+		}
+	}
+
+	/* Every heavy hitter must be reported */
+	threshold = n / VIE_HOT_NSITES;
+	missed = 0;
+	for (id = 0; id < nsites; id++) {
+		if (exact[id] > threshold && !reported[id]) {
+			warnx("site %u: count %ju > %ju not reported", id,
+			    (uintmax_t)exact[id], (uintmax_t)threshold);
+			missed++;
+		}
+	}
+
+	/*
+	 * Recall of the top sites: site ids are in decreasing order of
+	 * popularity, so the true 'shown'-th count is a good cut off.
+	 */
+	shown = MIN(shown, ntop);
+	for (kth = UINT64_MAX, id = 0; id < nsites && id < (uint32_t)shown;
+	    id++)
+		kth = MIN(kth, exact[id]);
+	recall = 0;
+	maxerr = 0;
+	for (i = 0; i < (size_t)shown; i++) {
+		id = (top[i].rip - SITE_RIP(0)) / 0x13;
+		if (exact[id] >= kth)
+			recall++;
+		relerr = exact[id] ? (double)(top[i].count - exact[id]) /
+		    exact[id] : INFINITY;
+		maxerr = MAX(maxerr, relerr);
+		if (quiet)
+			continue;
+		printf("%3zu  rip %#018jx gpa %#010jx op %2d  count %9ju "
+		    "error %7ju  true %9ju\n", i + 1, (uintmax_t)top[i].rip,
+		    (uintmax_t)top[i].gpa, top[i].op_type,
+		    (uintmax_t)top[i].count, (uintmax_t)top[i].error,
+		    (uintmax_t)exact[id]);
+	}
+	printf("top %d: recall %.1f%%, max count error %.2f%%; "
+	    "%d sites reported, %d bound violations, %d heavy hitters "
+	    "missed\n", shown, 100.0 * recall / shown, 100 * maxerr, ntop,
+	    violations, missed);
+
+	free(top);
+	free(reported);
+	free(exact);
+	free(vcpus);
+	free(ids);
+	return (violations != 0 || missed != 0);
+}
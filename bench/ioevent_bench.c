@@ -0,0 +1,274 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * eventfd doorbell benchmark.
+ *
+ * A vCPU thread emulates the virtio-mmio queue notify store
+ * 'mov %eax,0x50(%rdx)' and a backend thread blocks in read(2) on the queue's
+ * eventfd. The notify is delivered either through vmm_emulate_instruction()
+ * and a device model write handler that signals the eventfd, or through the
+ * vie_ioevent_emulate() fast path.
+ *
+ * The latency test waits for the backend to wake up before the next notify
+ * and reports the notify-to-wakeup latency. The throughput test issues
+ * notifies back to back and reports the vCPU-side cost per notify and the
+ * number of backend wakeups.
+ *
+ * Both paths end in the same eventfd_write(2), about 500 ns, which dwarfs
+ * the difference between emulating the store and matching it, so with a
+ * free device model (-d 0) the two tie. What the fast path saves in a real
+ * VMM is the trip to the device model: the return from the vm run loop to
+ * userspace and back. Each device model call costs 1000 ns by default to
+ * stand for that trip; ioeventfd then avoids it on every notify.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/eventfd.h>
+
+#include <machine/atomic.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "vmm_ioevent.h"
+#include "bench.h"
+
+#define	VIRTIO_BASE		0xd0000000UL
+#define	VIRTIO_SIZE		0x200
+#define	VIRTIO_QUEUE_NOTIFY	0x50
+#define	VIRTIO_NQUEUES		4
+#define	DEV_NS			1000
+
+static int	queue_fd[VIRTIO_NQUEUES];
+static uint64_t	dev_cost;		/* simulated device model cost (tsc) */
+
+static struct vie_ioevents ioevents;
+
+static volatile uint64_t sent_tsc;
+static volatile uint64_t acked;
+static volatile uint64_t received;
+static uint64_t	*lat;
+static size_t	nlat;
+static int	backend_cpu = -1;
+
+/* Device model for the virtio-mmio register block */
+static int
+virtio_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+
+	*rval = 0;
+	return (0);
+}
+
+static int
+virtio_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+	uint64_t end;
+
+	if (dev_cost != 0) {
+		end = bench_rdtsc() + dev_cost;
+		while (bench_rdtsc() < end)
+			;
+	}
+
+	if (gpa - VIRTIO_BASE >= VIRTIO_SIZE)
+		return (EINVAL);
+
+	if (gpa - VIRTIO_BASE == VIRTIO_QUEUE_NOTIFY) {
+		if (wval >= VIRTIO_NQUEUES)
+			return (0);
+		eventfd_write(queue_fd[wval], 1);
+	}
+	return (0);
+}
+
+static void *
+backend_latency(void *arg)
+{
+	eventfd_t cnt;
+	size_t i;
+
+	if (backend_cpu >= 0)
+		bench_pin(backend_cpu);
+
+	for (i = 0; i < nlat; i++) {
+		if (eventfd_read(queue_fd[0], &cnt) != 0)
+			err(1, "eventfd_read");
+		lat[i] = bench_rdtsc() - sent_tsc;
+		atomic_store_rel_64(&acked, i + 1);
+	}
+	return (NULL);
+}
+
+static void *
+backend_throughput(void *arg)
+{
+	eventfd_t cnt;
+	uint64_t total, wakeups;
+	size_t n;
+
+	if (backend_cpu >= 0)
+		bench_pin(backend_cpu);
+
+	n = *(size_t *)arg;
+	total = wakeups = 0;
+	while (total < n) {
+		if (eventfd_read(queue_fd[0], &cnt) != 0)
+			err(1, "eventfd_read");
+		total += cnt;
+		wakeups++;
+	}
+	atomic_store_rel_64(&received, wakeups);
+	return (NULL);
+}
+
+static int
+notify(struct vie *vie, struct vm_guest_paging *paging, int fast)
+{
+	uint64_t gpa;
+	int error;
+
+	gpa = VIRTIO_BASE + VIRTIO_QUEUE_NOTIFY;
+	if (fast) {
+		error = vie_ioevent_emulate(&ioevents, NULL, 0, gpa, vie);
+		if (error != ENOENT)
+			return (error);
+	}
+	return (vmm_emulate_instruction(NULL, 0, gpa, vie, paging,
+	    virtio_mread, virtio_mwrite, NULL));
+}
+
+static void
+run(const char *name, int fast, size_t niter)
+{
+	static const uint8_t inst[] = { 0x89, 0x42, VIRTIO_QUEUE_NOTIFY };
+	struct vm_guest_paging paging;
+	struct bench_stats st;
+	struct vie vie;
+	pthread_t td;
+	uint64_t start, elapsed;
+	size_t i;
+
+	memset(&paging, 0, sizeof(paging));
+	paging.cpu_mode = CPU_MODE_64BIT;
+	paging.paging_mode = PAGING_MODE_64;
+
+	vm_set_register(NULL, 0, VM_REG_GUEST_RDX, VIRTIO_BASE);
+	vm_set_register(NULL, 0, VM_REG_GUEST_RAX, 0);	/* queue index */
+
+	memset(&vie, 0, sizeof(struct vie));
+	vie.base_register = VM_REG_LAST;
+	vie.index_register = VM_REG_LAST;
+	vie.segment_register = VM_REG_LAST;
+	memcpy(vie.inst, inst, sizeof(inst));
+	vie.num_valid = sizeof(inst);
+	if (vmm_decode_instruction(NULL, 0, VIE_INVALID_GLA, CPU_MODE_64BIT, 0,
+	    &vie))
+		errx(1, "cannot decode notify instruction");
+
+	/* Notify-to-wakeup latency, one notify in flight at a time */
+	nlat = niter / 10 ? niter / 10 : 1;
+	lat = calloc(nlat, sizeof(uint64_t));
+	if (lat == NULL)
+		err(1, "calloc");
+	acked = 0;
+	if (pthread_create(&td, NULL, backend_latency, NULL) != 0)
+		errx(1, "pthread_create");
+	for (i = 0; i < nlat; i++) {
+		sent_tsc = bench_rdtsc();
+		if (notify(&vie, &paging, fast))
+			errx(1, "notify failed");
+		while (atomic_load_acq_64(&acked) != i + 1)
+			__asm __volatile("pause");
+	}
+	pthread_join(td, NULL);
+	bench_stats(lat, nlat, 1 / bench_tsc_ghz(), &st);
+	bench_print(name, "ns wakeup", &st);
+	free(lat);
+
+	/* Back to back notifies */
+	received = 0;
+	if (pthread_create(&td, NULL, backend_throughput, &niter) != 0)
+		errx(1, "pthread_create");
+	start = bench_nsec();
+	for (i = 0; i < niter; i++) {
+		if (notify(&vie, &paging, fast))
+			errx(1, "notify failed");
+	}
+	elapsed = bench_nsec() - start;
+	pthread_join(td, NULL);
+	printf("%-32s %zu notifies, %.1f ns/notify (%.2f M/s), "
+	    "%ju backend wakeups\n", "", niter, (double)elapsed / niter,
+	    niter * 1e3 / elapsed, (uintmax_t)received);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: ioevent_bench [-n iterations] [-d device_ns] "
+	    "[-c vcpu_cpu,backend_cpu]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t devns;
+	size_t niter;
+	int ch, i, vcpu_cpu;
+
+	niter = 1000000;
+	vcpu_cpu = -1;
+	devns = DEV_NS;
+
+	while ((ch = getopt(argc, argv, "c:d:n:")) != -1) {
+		switch (ch) {
+		case 'c':
+			if (sscanf(optarg, "%d,%d", &vcpu_cpu,
+			    &backend_cpu) != 2)
+				usage();
+			break;
+		case 'd':
+			devns = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			niter = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (niter == 0)
+		usage();
+
+	if (vcpu_cpu >= 0)
+		bench_pin(vcpu_cpu);
+
+	dev_cost = devns * bench_tsc_ghz();
+	printf("%ju ns per device model call\n", (uintmax_t)devns);
+
+	if (vie_ioevents_init(&ioevents) != 0)
+		errx(1, "vie_ioevents_init");
+	for (i = 0; i < VIRTIO_NQUEUES; i++) {
+		queue_fd[i] = eventfd(0, 0);
+		if (queue_fd[i] < 0)
+			err(1, "eventfd");
+		if (vie_ioevent_register(&ioevents,
+		    VIRTIO_BASE + VIRTIO_QUEUE_NOTIFY, 4,
+		    VIE_IOEVENT_F_DATAMATCH, i, queue_fd[i]) != 0)
+			errx(1, "vie_ioevent_register");
+	}
+
+	run("device model", 0, niter);
+	run("ioeventfd", 1, niter);
+	return (0);
+}
@@ -0,0 +1,194 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * MMIO profiling benchmark.
+ *
+ * Emulates a mix of accesses to two device models, a cheap LAPIC-like one
+ * and a slower NVMe-like one with a simulated cost, plus stores to an
+ * unregistered framebuffer, through vie_prof_emulate(). Reports what the
+ * profiling wrappers cost per emulation compared to calling the device
+ * model directly, then dumps the profile (vie_prof_dump()).
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "vmm_mmio_prof.h"
+#include "bench.h"
+
+#define	LAPIC_BASE	0xfee00000UL
+#define	NVME_BASE	0xfebf0000UL
+#define	FB_BASE		0xfd000000UL
+#define	DEV_SIZE	0x1000
+
+static const struct pb_inst {
+	const char	*name;
+	uint8_t		inst[VIE_INST_SIZE];
+	int		len;
+	uint64_t	gpa;
+} insts[] = {
+	{ "movl %eax,0xb0(%rcx)", { 0x89, 0x81, 0xb0, 0, 0, 0 }, 6,
+	    LAPIC_BASE + 0xb0 },
+	{ "movl 0x10(%rdx),%ecx", { 0x8b, 0x4a, 0x10 }, 3, NVME_BASE + 0x10 },
+	{ "movq %rcx,0x10(%rdx)", { 0x48, 0x89, 0x4a, 0x10 }, 4,
+	    NVME_BASE + 0x10 },
+	{ "movw 0x1c(%rdx),%cx", { 0x66, 0x8b, 0x4a, 0x1c }, 4,
+	    NVME_BASE + 0x1c },
+	{ "movb %cl,(%rdi)", { 0x88, 0x0f }, 2, FB_BASE },
+};
+
+static uint64_t	nvme_cost;		/* simulated NVMe model cost (tsc) */
+
+static int
+dev_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+	uint64_t end;
+
+	if (gpa - NVME_BASE < DEV_SIZE) {
+		end = bench_rdtsc() + nvme_cost;
+		while (bench_rdtsc() < end)
+			;
+	}
+	*rval = 0;
+	return (0);
+}
+
+static int
+dev_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+	uint64_t end;
+
+	if (gpa - NVME_BASE < DEV_SIZE) {
+		end = bench_rdtsc() + nvme_cost;
+		while (bench_rdtsc() < end)
+			;
+	}
+	return (0);
+}
+
+static void
+decode(struct vie *vie, const struct pb_inst *pi)
+{
+
+	memset(vie, 0, sizeof(struct vie));
+	vie->base_register = VM_REG_LAST;
+	vie->index_register = VM_REG_LAST;
+	vie->segment_register = VM_REG_LAST;
+	memcpy(vie->inst, pi->inst, pi->len);
+	vie->num_valid = pi->len;
+
+	if (vmm_decode_instruction(NULL, 0, VIE_INVALID_GLA, CPU_MODE_64BIT, 0,
+	    vie))
+		errx(1, "%s: cannot decode", pi->name);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: prof_bench [-d nvme_cost_ns] [-n iterations] "
+	    "[-o dump]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct vie_prof prof;
+	struct vm_guest_paging paging;
+	struct vie vie[nitems(insts)];
+	const char *output;
+	uint64_t t0, plain, profiled;
+	size_t i, niter;
+	double ghz;
+	FILE *fp;
+	int ch, error, j, pass;
+
+	niter = 1000000;
+	nvme_cost = 0;
+	output = NULL;
+	while ((ch = getopt(argc, argv, "d:n:o:")) != -1) {
+		switch (ch) {
+		case 'd':
+			nvme_cost = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			niter = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (niter == 0 || optind != argc)
+		usage();
+
+	ghz = bench_tsc_ghz();
+	nvme_cost *= ghz;
+
+	memset(&paging, 0, sizeof(paging));
+	paging.cpu_mode = CPU_MODE_64BIT;
+	paging.paging_mode = PAGING_MODE_64;
+	vm_set_register(NULL, 0, VM_REG_GUEST_RCX, LAPIC_BASE);
+	vm_set_register(NULL, 0, VM_REG_GUEST_RDX, NVME_BASE);
+	vm_set_register(NULL, 0, VM_REG_GUEST_RDI, FB_BASE);
+	for (j = 0; j < (int)nitems(insts); j++)
+		decode(&vie[j], &insts[j]);
+
+	vie_prof_init(&prof, dev_mread, dev_mwrite, NULL);
+	if (vie_prof_add_range(&prof, "lapic", LAPIC_BASE, DEV_SIZE) != 0 ||
+	    vie_prof_add_range(&prof, "nvme", NVME_BASE, DEV_SIZE) != 0)
+		errx(1, "vie_prof_add_range");
+
+	/* Warm up, then time both paths */
+	plain = profiled = 0;
+	for (pass = 0; pass < 3; pass++) {
+		vie_prof_reset(&prof);
+		t0 = bench_rdtsc();
+		for (i = 0; i < niter; i++) {
+			j = i % nitems(insts);
+			/* The load clobbers %rcx */
+			vm_set_register(NULL, 0, VM_REG_GUEST_RCX, LAPIC_BASE);
+			error = vmm_emulate_instruction(NULL, 0, insts[j].gpa,
+			    &vie[j], &paging, dev_mread, dev_mwrite, NULL);
+			if (error != 0)
+				errx(1, "%s: error %d", insts[j].name, error);
+		}
+		plain = bench_rdtsc() - t0;
+
+		t0 = bench_rdtsc();
+		for (i = 0; i < niter; i++) {
+			j = i % nitems(insts);
+			vm_set_register(NULL, 0, VM_REG_GUEST_RCX, LAPIC_BASE);
+			error = vie_prof_emulate(&prof, NULL, 0, insts[j].gpa,
+			    &vie[j], &paging);
+			if (error != 0)
+				errx(1, "%s: error %d", insts[j].name, error);
+		}
+		profiled = bench_rdtsc() - t0;
+	}
+
+	printf("%zu emulations: %.1f ns plain, %.1f ns profiled "
+	    "(+%.1f ns)\n", niter, plain / ghz / niter,
+	    profiled / ghz / niter, ((double)profiled - plain) / ghz / niter);
+
+	fp = stdout;
+	if (output != NULL && (fp = fopen(output, "w")) == NULL)
+		err(1, "%s", output);
+	fprintf(fp, "# tsc %.3f GHz\n", ghz);
+	vie_prof_dump(&prof, fp);
+	if (fp != stdout)
+		fclose(fp);
+	return (0);
+}
@@ -0,0 +1,387 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Exit recording and replay benchmark.
+ *
+ * With -w it records a synthetic workload: 'vcpus' threads each emulate
+ * MMIO instructions from 'sites' code addresses, a few of them hot, on 64
+ * device pages and in four address spaces, against a device model whose
+ * reads return a different value every time. They run first directly and
+ * then through vie_rec_emulate(), and it reports what recording costs per
+ * exit and how many exits were dropped because the writer fell behind.
+ *
+ * Otherwise it replays a recording (see vmm_exitrec.h), made by -w or by a
+ * real VMM, 'passes' times through vie_replay_exit() and reports the exits
+ * replayed per second and the records that did not replay the way they
+ * were recorded, exiting 1 if there were any. The vCPUs are spread over
+ * 'threads' threads, each replaying its vCPUs' chunks in order; with -t it
+ * seeks each vCPU to 'percent' of the way through the recording first.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "vmm_exitrec.h"
+#include "bench.h"
+
+#define	DEV_BASE	0xfe000000UL
+#define	DEV_NPAGE	64
+#define	CODE_BASE	0xffffffff80200000UL
+#define	CR3_BASE	0x1000000UL
+#define	CR3_SWITCH	10000		/* exits between address spaces */
+
+/*
+ * The memory operand is 0x10(%rdx), or (%rdi) for STOS. A site always
+ * runs the same instruction on the same device page.
+ */
+static const struct rb_inst {
+	const char	*name;
+	uint8_t		inst[VIE_INST_SIZE];
+	int		len;
+} insts[] = {
+	{ "movl %ecx,0x10(%rdx)", { 0x89, 0x4a, 0x10 }, 3 },
+	{ "movl 0x10(%rdx),%ecx", { 0x8b, 0x4a, 0x10 }, 3 },
+	{ "movq 0x10(%rdx),%rax", { 0x48, 0x8b, 0x42, 0x10 }, 4 },
+	{ "movzbl 0x10(%rdx),%ecx", { 0x0f, 0xb6, 0x4a, 0x10 }, 4 },
+	{ "andl $0x7f,0x10(%rdx)", { 0x83, 0x62, 0x10, 0x7f }, 4 },
+	{ "orl 0x10(%rdx),%ecx", { 0x0b, 0x4a, 0x10 }, 3 },
+	{ "btl $3,0x10(%rdx)", { 0x0f, 0xba, 0x62, 0x10, 0x03 }, 5 },
+	{ "stosl", { 0xab }, 1 },
+};
+
+static struct vie_rec rec;
+static size_t niter;
+static int nsite;
+static double ghz;
+
+struct rb_vcpu {
+	pthread_t	td;
+	int		vcpuid;
+	uint64_t	seq;		/* device model state */
+	uint64_t	rng;
+	uint64_t	plain;		/* tsc */
+	uint64_t	recorded;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct rb_vcpu vcpus[VIE_REC_MAXCPU];
+
+static int
+dev_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+	uint64_t x;
+
+	/* A status register that changes on every read */
+	x = ++vcpus[cpuid].seq * 0x9e3779b97f4a7c15UL ^ gpa;
+	*rval = x ^ x >> 29;
+	return (0);
+}
+
+static int
+dev_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+
+	return (0);
+}
+
+/* The next site, skewed towards the low numbered ones */
+static int
+next_site(struct rb_vcpu *v)
+{
+	double u;
+
+	v->rng ^= v->rng << 13;
+	v->rng ^= v->rng >> 7;
+	v->rng ^= v->rng << 17;
+	u = (v->rng >> 11) * 0x1p-53;
+	return (nsite * u * u * u);
+}
+
+static void
+decode(struct vie *vie, const struct rb_inst *ri, int vcpuid)
+{
+
+	memset(vie, 0, sizeof(struct vie));
+	vie->base_register = VM_REG_LAST;
+	vie->index_register = VM_REG_LAST;
+	vie->segment_register = VM_REG_LAST;
+	memcpy(vie->inst, ri->inst, ri->len);
+	vie->num_valid = ri->len;
+
+	if (vmm_decode_instruction(NULL, vcpuid, VIE_INVALID_GLA,
+	    CPU_MODE_64BIT, 0, vie) != 0)
+		errx(1, "%s: cannot decode", ri->name);
+}
+
+static void *
+vcpu_thread(void *arg)
+{
+	struct rb_vcpu *v;
+	struct vm_guest_paging paging;
+	struct vie vie[nitems(insts)];
+	uint64_t gpa, t0;
+	size_t i;
+	int error, j, pass, site;
+
+	v = arg;
+	memset(&paging, 0, sizeof(paging));
+	paging.cpu_mode = CPU_MODE_64BIT;
+	paging.paging_mode = PAGING_MODE_64;
+	for (j = 0; j < (int)nitems(insts); j++)
+		decode(&vie[j], &insts[j], v->vcpuid);
+
+	for (pass = 0; pass < 2; pass++) {
+		v->rng = 0x9e3779b97f4a7c15UL * (v->vcpuid + 1);
+		t0 = bench_rdtsc();
+		for (i = 0; i < niter; i++) {
+			site = next_site(v);
+			j = site % nitems(insts);
+			gpa = DEV_BASE + (site % DEV_NPAGE) * 0x1000 + 0x10;
+			paging.cr3 = CR3_BASE + i / CR3_SWITCH % 4 * 0x1000;
+			vm_set_register(NULL, v->vcpuid, VM_REG_GUEST_RIP,
+			    CODE_BASE + site * 0x40);
+			vm_set_register(NULL, v->vcpuid, VM_REG_GUEST_RDX,
+			    gpa - 0x10);
+			vm_set_register(NULL, v->vcpuid, VM_REG_GUEST_RDI, gpa);
+			/* MMIO is mapped 1:1, so the GLA is the GPA */
+			if (pass == 0)
+				error = vmm_emulate_instruction(NULL, v->vcpuid,
+				    gpa, &vie[j], &paging, dev_mread,
+				    dev_mwrite, NULL);
+			else
+				error = vie_rec_emulate(&rec, NULL, v->vcpuid,
+				    gpa, 0, gpa, &vie[j], &paging);
+			if (error != 0)
+				errx(1, "%s: error %d", insts[j].name, error);
+		}
+		if (pass == 0)
+			v->plain = bench_rdtsc() - t0;
+		else
+			v->recorded = bench_rdtsc() - t0;
+	}
+	return (NULL);
+}
+
+static int
+record(const char *path, int nvcpu)
+{
+	uint64_t plain, recorded, exits, dropped;
+	int error, i;
+
+	if ((error = vie_rec_open(&rec, path, dev_mread, dev_mwrite,
+	    NULL)) != 0)
+		errc(1, error, "%s", path);
+	for (i = 0; i < nvcpu; i++) {
+		vcpus[i].vcpuid = i;
+		if (pthread_create(&vcpus[i].td, NULL, vcpu_thread,
+		    &vcpus[i]) != 0)
+			errx(1, "pthread_create");
+	}
+	plain = recorded = exits = dropped = 0;
+	for (i = 0; i < nvcpu; i++) {
+		pthread_join(vcpus[i].td, NULL);
+		plain += vcpus[i].plain;
+		recorded += vcpus[i].recorded;
+		exits += rec.vcpu[i].exits;
+		dropped += rec.vcpu[i].dropped;
+	}
+	if ((error = vie_rec_close(&rec)) != 0)
+		errc(1, error, "%s", path);
+
+	printf("%d vcpus, %zu exits each: %.1f ns plain, %.1f ns recorded "
+	    "(+%.1f ns)\n", nvcpu, niter, plain / ghz / niter / nvcpu,
+	    recorded / ghz / niter / nvcpu,
+	    ((double)recorded - plain) / ghz / niter / nvcpu);
+	printf("%ju exits recorded, %ju dropped\n", (uintmax_t)exits,
+	    (uintmax_t)dropped);
+	return (0);
+}
+
+/* A replay thread, taking the vCPUs that are 'id' modulo the threads */
+struct rb_worker {
+	pthread_t	td;
+	int		id;
+	uint64_t	exits;
+	uint64_t	bad;
+	uint64_t	kinds[5];	/* by VIE_REPLAY_* bit */
+	bool		malformed;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct vie_replay rp;
+static struct rb_worker workers[VIE_REC_MAXCPU];
+static int nworker;
+static uint64_t start_tsc;
+
+static void *
+replay_thread(void *arg)
+{
+	struct rb_worker *w;
+	struct vie_replay_cursor *c;
+	const struct vie_rec_exit *ex;
+	int k, r, v, vcpuid;
+
+	w = arg;
+	if ((c = malloc(sizeof(*c))) == NULL)
+		err(1, "malloc");
+	for (v = w->id; v < VIE_REC_MAXCPU; v += nworker) {
+		/* vCPU 'v' replays on stub vCPU 'v', only here and in order */
+		vie_replay_seek(&rp, c, v, start_tsc);
+		while ((ex = vie_replay_next(&rp, c, &vcpuid)) != NULL) {
+			w->exits++;
+			if ((r = vie_replay_exit(NULL, vcpuid, ex)) == 0)
+				continue;
+			w->bad++;
+			for (k = 0; k < (int)nitems(w->kinds); k++)
+				if (r & 1 << k)
+					w->kinds[k]++;
+		}
+		if (c->left != 0)
+			w->malformed = true;
+	}
+	free(c);
+	return (NULL);
+}
+
+static int
+replay(const char *path, int npass, double from)
+{
+	static const char *names[] = { "error", "access", "regs", "decode",
+	    "bad" };
+	uint64_t best, t0, n, bad, kinds[nitems(workers[0].kinds)];
+	uint64_t first, last;
+	size_t i;
+	int error, k, pass;
+
+	if ((error = vie_replay_open(&rp, path)) != 0)
+		errc(1, error, "%s", path);
+
+	/* Start 'from' percent of the way between the first and last exit */
+	first = rp.nchunk != 0 ? UINT64_MAX : 0;
+	last = 0;
+	for (i = 0; i < rp.nchunk; i++) {
+		first = MIN(first, rp.index[i].tsc);
+		last = MAX(last, rp.index[i].tsc_last);
+	}
+	start_tsc = first + (last - first) * (from / 100);
+
+	best = UINT64_MAX;
+	for (pass = 0; pass < npass; pass++) {
+		memset(workers, 0, sizeof(workers));
+		t0 = bench_nsec();
+		for (k = 0; k < nworker; k++) {
+			workers[k].id = k;
+			if (pthread_create(&workers[k].td, NULL,
+			    replay_thread, &workers[k]) != 0)
+				errx(1, "pthread_create");
+		}
+		for (k = 0; k < nworker; k++)
+			pthread_join(workers[k].td, NULL);
+		best = MIN(best, bench_nsec() - t0);
+	}
+
+	n = bad = 0;
+	memset(kinds, 0, sizeof(kinds));
+	for (k = 0; k < nworker; k++) {
+		n += workers[k].exits;
+		bad += workers[k].bad;
+		for (i = 0; i < nitems(kinds); i++)
+			kinds[i] += workers[k].kinds[i];
+		if (workers[k].malformed)
+			warnx("%s: malformed chunk", path);
+	}
+	if (from == 0 && n != rp.hdr->exits)
+		warnx("%s: %ju exits, header says %ju", path, (uintmax_t)n,
+		    (uintmax_t)rp.hdr->exits);
+
+	printf("%zu chunks, %.1f bytes/exit, %ju dropped while recording\n",
+	    rp.nchunk, rp.hdr->exits ? (double)rp.len / rp.hdr->exits : 0,
+	    (uintmax_t)rp.hdr->dropped);
+	printf("%ju exits, %d threads: %.1f ns/exit, %.2f M exits/s\n",
+	    (uintmax_t)n, nworker, n ? (double)best / n : 0,
+	    best ? n * 1e3 / best : 0);
+	if (bad != 0) {
+		printf("%ju mismatched:", (uintmax_t)bad);
+		for (i = 0; i < nitems(kinds); i++)
+			if (kinds[i] != 0)
+				printf(" %s=%ju", names[i],
+				    (uintmax_t)kinds[i]);
+		printf("\n");
+	}
+	vie_replay_close(&rp);
+	return (bad != 0);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: replay_bench -w recording [-c vcpus] "
+	    "[-n exits] [-s sites]\n"
+	    "       replay_bench [-j threads] [-p passes] [-t percent] "
+	    "recording\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *output;
+	double from;
+	int ch, npass, nvcpu;
+
+	niter = 1000000;
+	npass = 3;
+	nvcpu = 1;
+	nworker = 1;
+	nsite = 1024;
+	from = 0;
+	output = NULL;
+	while ((ch = getopt(argc, argv, "c:j:n:p:s:t:w:")) != -1) {
+		switch (ch) {
+		case 'c':
+			nvcpu = atoi(optarg);
+			break;
+		case 'j':
+			nworker = atoi(optarg);
+			break;
+		case 's':
+			nsite = atoi(optarg);
+			break;
+		case 't':
+			from = strtod(optarg, NULL);
+			break;
+		case 'n':
+			niter = strtoull(optarg, NULL, 0);
+			break;
+		case 'p':
+			npass = atoi(optarg);
+			break;
+		case 'w':
+			output = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (nvcpu < 1 || nvcpu > VIE_REC_MAXCPU || nworker < 1 ||
+	    nworker > VIE_REC_MAXCPU || niter == 0 || npass < 1 || nsite < 1 ||
+	    from < 0 || from > 100 || argc != (output == NULL))
+		usage();
+
+	ghz = bench_tsc_ghz();
+	if (output != NULL)
+		return (record(output, nvcpu));
+	return (replay(argv[0], npass, from));
+}
@@ -0,0 +1,258 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Read-modify-write contention benchmark.
+ *
+ * N vCPU threads share one device register. Thread 't' repeatedly sets and
+ * clears bit 't' of it with 'lock orl $(1 << t),0x10(%rcx)' and
+ * 'lock andl $~(1 << t),0x10(%rcx)', or with -b 'lock btsl $t,0x10(%rcx)'
+ * and 'lock btrl $t,0x10(%rcx)', and checks that its bit was set in
+ * between. The device model either provides separate read and write
+ * callbacks, each taking the device lock, or an atomic read-modify-write
+ * callback.
+ *
+ * Reports aggregate throughput, per-instruction latency and the number of
+ * updates lost because the read and the write were not atomic.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <machine/atomic.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "bench.h"
+
+#define	DEV_BASE	0xfec00000UL
+#define	DEV_REG		0x10
+
+static volatile uint64_t dev_reg;
+static pthread_mutex_t dev_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t	niter;
+static int	nthreads;
+static int	bitops;
+static volatile int start_flag;
+
+struct worker {
+	pthread_t	td;
+	int		vcpu;
+	int		rmw;
+	uint64_t	lost;
+	uint64_t	*samples;
+} __aligned(CACHE_LINE_SIZE);
+
+static int
+dev_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+
+	pthread_mutex_lock(&dev_mtx);
+	*rval = dev_reg & vie_size2mask(rsize);
+	pthread_mutex_unlock(&dev_mtx);
+	return (0);
+}
+
+static int
+dev_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+
+	pthread_mutex_lock(&dev_mtx);
+	dev_reg = wval & vie_size2mask(wsize);
+	pthread_mutex_unlock(&dev_mtx);
+	return (0);
+}
+
+static int
+dev_mrmw(void *vm, int cpuid, uint64_t gpa, enum vie_rmw_op op,
+    uint64_t operand, uint64_t *oldval, int size, int locked, void *arg)
+{
+	uint64_t old, new;
+
+	do {
+		old = dev_reg;
+		switch (op) {
+		case VIE_RMW_AND:
+			new = old & operand;
+			break;
+		case VIE_RMW_OR:
+			new = old | operand;
+			break;
+		case VIE_RMW_BTS:
+			new = old | (1UL << operand);
+			break;
+		case VIE_RMW_BTR:
+			new = old & ~(1UL << operand);
+			break;
+		default:
+			return (EINVAL);
+		}
+		new &= vie_size2mask(size);
+	} while (!atomic_cmpset_64(&dev_reg, old, new));
+
+	*oldval = old & vie_size2mask(size);
+	return (0);
+}
+
+static void
+decode(int vcpu, struct vie *vie, const uint8_t *inst, int len)
+{
+
+	memset(vie, 0, sizeof(struct vie));
+	vie->base_register = VM_REG_LAST;
+	vie->index_register = VM_REG_LAST;
+	vie->segment_register = VM_REG_LAST;
+	memcpy(vie->inst, inst, len);
+	vie->num_valid = len;
+
+	if (vmm_decode_instruction(NULL, vcpu, VIE_INVALID_GLA, CPU_MODE_64BIT,
+	    0, vie))
+		errx(1, "cannot decode benchmark instruction");
+}
+
+static void *
+worker_thread(void *arg)
+{
+	struct vm_guest_paging paging;
+	struct worker *w;
+	struct vie vie_or, vie_and;
+	uint64_t bit, t0;
+	uint32_t imm;
+	size_t i;
+	uint8_t or[] = { 0xf0, 0x81, 0x49, DEV_REG, 0, 0, 0, 0 };
+	uint8_t and[] = { 0xf0, 0x81, 0x61, DEV_REG, 0, 0, 0, 0 };
+	uint8_t bts[] = { 0xf0, 0x0f, 0xba, 0x69, DEV_REG, 0 };
+	uint8_t btr[] = { 0xf0, 0x0f, 0xba, 0x71, DEV_REG, 0 };
+
+	w = arg;
+	bit = 1UL << w->vcpu;
+
+	memset(&paging, 0, sizeof(paging));
+	paging.cpu_mode = CPU_MODE_64BIT;
+	paging.paging_mode = PAGING_MODE_64;
+	vm_set_register(NULL, w->vcpu, VM_REG_GUEST_RCX, DEV_BASE);
+
+	if (bitops) {
+		bts[5] = btr[5] = w->vcpu;
+		decode(w->vcpu, &vie_or, bts, sizeof(bts));
+		decode(w->vcpu, &vie_and, btr, sizeof(btr));
+	} else {
+		imm = bit;
+		memcpy(&or[4], &imm, sizeof(imm));
+		imm = ~bit;
+		memcpy(&and[4], &imm, sizeof(imm));
+		decode(w->vcpu, &vie_or, or, sizeof(or));
+		decode(w->vcpu, &vie_and, and, sizeof(and));
+	}
+
+	while (!start_flag)
+		__asm __volatile("pause");
+
+	for (i = 0; i < niter; i++) {
+		t0 = bench_rdtsc();
+		if (vmm_emulate_instruction_rmw(NULL, w->vcpu,
+		    DEV_BASE + DEV_REG, &vie_or, &paging, dev_mread,
+		    dev_mwrite, w->rmw ? dev_mrmw : NULL, NULL))
+			errx(1, "emulation failed");
+		w->samples[i] = bench_rdtsc() - t0;
+
+		if ((dev_reg & bit) == 0)
+			w->lost++;
+
+		if (vmm_emulate_instruction_rmw(NULL, w->vcpu,
+		    DEV_BASE + DEV_REG, &vie_and, &paging, dev_mread,
+		    dev_mwrite, w->rmw ? dev_mrmw : NULL, NULL))
+			errx(1, "emulation failed");
+	}
+	return (NULL);
+}
+
+static void
+run(const char *name, int rmw)
+{
+	struct bench_stats st;
+	struct worker *w;
+	uint64_t *all, lost, start, elapsed;
+	int i;
+
+	w = calloc(nthreads, sizeof(struct worker));
+	all = calloc(niter * nthreads, sizeof(uint64_t));
+	if (w == NULL || all == NULL)
+		err(1, "calloc");
+
+	dev_reg = 0;
+	start_flag = 0;
+	for (i = 0; i < nthreads; i++) {
+		w[i].vcpu = i;
+		w[i].rmw = rmw;
+		w[i].samples = &all[i * niter];
+		if (pthread_create(&w[i].td, NULL, worker_thread, &w[i]) != 0)
+			errx(1, "pthread_create");
+	}
+
+	start = bench_nsec();
+	start_flag = 1;
+	lost = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(w[i].td, NULL);
+		lost += w[i].lost;
+	}
+	elapsed = bench_nsec() - start;
+
+	bench_stats(all, niter * nthreads, 1 / bench_tsc_ghz(), &st);
+	bench_print(name, "ns", &st);
+	printf("%-32s %d threads, %.2f Mops/s, %ju lost updates, "
+	    "final register %#jx\n", "", nthreads,
+	    2 * niter * nthreads * 1e3 / elapsed, (uintmax_t)lost,
+	    (uintmax_t)dev_reg);
+
+	free(all);
+	free(w);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: rmw_bench [-b] [-n iterations] [-t threads]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch;
+
+	niter = 1000000;
+	nthreads = 4;
+
+	while ((ch = getopt(argc, argv, "bn:t:")) != -1) {
+		switch (ch) {
+		case 'b':
+			bitops = 1;
+			break;
+		case 'n':
+			niter = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (niter == 0 || nthreads < 1 || nthreads > BENCH_MAXCPU)
+		usage();
+
+	run("read+write", 0);
+	run("rmw", 1);
+	return (0);
+}
@@ -0,0 +1,416 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Multi-vCPU scaling benchmark.
+ *
+ * 'threads' threads, each pinned to its own cpu and emulating on its own
+ * vCPU with private register state, decode and emulate a mix of MMIO
+ * loads, stores and read-modify-writes. The device register behind the
+ * operand is, per mode:
+ *
+ *	private		one per vCPU, each on its own cache line
+ *	adjacent	one per vCPU, eight to a cache line (false sharing)
+ *	shared		a single register for all vCPUs
+ *
+ * For each mode the number of threads is swept from 1 to every cpu (or the
+ * counts given with -t) and each step reports the aggregate throughput,
+ * its speedup and efficiency against one thread, the per-operation latency
+ * across all threads, and the per-operation cycles, L1d misses and HITM
+ * loads of the bench_pmc_open() counters. A step whose efficiency is below
+ * -e percent is flagged with how much these grew against one thread. HITM
+ * loads, loads that found their line modified in another core's cache,
+ * are cache lines moving between cpus; without them L1d misses are only a
+ * proxy, as they also count capacity and conflict misses. Counters that
+ * count each thread are read by each worker and summed, counters that
+ * count the whole process (hwpmc(4)) are read once around each step.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "bench.h"
+
+#define	DEV_BASE	0xfe000000UL	/* MMIO operand */
+
+#define	MODE_PRIVATE	0
+#define	MODE_ADJACENT	1
+#define	MODE_SHARED	2
+#define	MODE_LAST	3
+
+static const char *mode_names[] = {
+	[MODE_PRIVATE] = "private",
+	[MODE_ADJACENT] = "adjacent",
+	[MODE_SHARED] = "shared",
+};
+
+/* The memory operand is 0x10(%rdx) */
+static const struct sb_inst {
+	uint8_t		inst[VIE_INST_SIZE];
+	int		len;
+} insts[] = {
+	{ { 0x89, 0x4a, 0x10 }, 3 },		/* movl %ecx,0x10(%rdx) */
+	{ { 0x8b, 0x4a, 0x10 }, 3 },		/* movl 0x10(%rdx),%ecx */
+	{ { 0x83, 0x62, 0x10, 0x7f }, 4 },	/* andl $0x7f,0x10(%rdx) */
+	{ { 0x0f, 0xb6, 0x42, 0x10 }, 4 },	/* movzbl 0x10(%rdx),%eax */
+};
+
+/* Device registers, eight to a cache line */
+static struct sb_line {
+	uint64_t	reg[CACHE_LINE_SIZE / sizeof(uint64_t)];
+} dev[VM_STUB_MAXCPU] __aligned(CACHE_LINE_SIZE);
+
+struct sb_worker {
+	pthread_t	td;
+	int		vcpuid;
+	int		cpu;
+	uint64_t	*reg;		/* device register */
+	uint64_t	*samples;	/* cycles per operation */
+	uint64_t	start;		/* ns */
+	uint64_t	end;
+	double		pmc[BENCH_PMC_NEVENTS];
+	struct bench_stats st;		/* of the samples, in ns */
+	int		error;
+} __aligned(CACHE_LINE_SIZE);
+
+static pthread_barrier_t barrier;
+static struct bench_pmc ppmc;	/* of the process, if ppmc.process */
+static size_t niter;
+static int ncpu;
+
+static int
+dev_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+
+	*rval = __atomic_load_n((uint64_t *)arg, __ATOMIC_RELAXED);
+	return (0);
+}
+
+static int
+dev_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+
+	__atomic_store_n((uint64_t *)arg, wval, __ATOMIC_RELAXED);
+	return (0);
+}
+
+static void *
+worker_thread(void *arg)
+{
+	struct sb_worker *w;
+	struct vm_guest_paging paging;
+	struct vm_stub_vcpu *vc;
+	struct bench_pmc pmc;
+	const struct sb_inst *si;
+	struct vie vie;
+	uint64_t t0;
+	size_t i;
+	int error;
+
+	w = arg;
+	if (bench_pin(w->cpu) != 0)
+		warnx("cannot pin to cpu %d", w->cpu);
+	if (!ppmc.process)
+		bench_pmc_open(&pmc);
+
+	vc = vm_stub_vcpu(NULL, w->vcpuid);
+	vm_stub_reset(vc);
+	vc->regs[VM_REG_GUEST_RCX] = 0x1122334455667788UL;
+	vc->regs[VM_REG_GUEST_RDX] = DEV_BASE;
+	vc->regs[VM_REG_GUEST_RFLAGS] = 0x2;
+	memset(&paging, 0, sizeof(paging));
+	paging.cpu_mode = CPU_MODE_64BIT;
+	paging.paging_mode = PAGING_MODE_64;
+
+	pthread_barrier_wait(&barrier);
+	w->start = bench_nsec();
+	if (!ppmc.process)
+		bench_pmc_start(&pmc);
+	error = 0;
+	for (i = 0; i < niter && error == 0; i++) {
+		si = &insts[i % nitems(insts)];
+		t0 = bench_rdtsc();
+		memset(&vie, 0, sizeof(vie));
+		vie.base_register = VM_REG_LAST;
+		vie.index_register = VM_REG_LAST;
+		vie.segment_register = VM_REG_LAST;
+		memcpy(vie.inst, si->inst, si->len);
+		vie.num_valid = si->len;
+		error = vmm_decode_instruction(NULL, w->vcpuid,
+		    VIE_INVALID_GLA, CPU_MODE_64BIT, 0, &vie);
+		if (error == 0)
+			error = vmm_emulate_instruction(NULL, w->vcpuid,
+			    DEV_BASE + 0x10, &vie, &paging, dev_mread,
+			    dev_mwrite, w->reg);
+		w->samples[i] = bench_rdtsc() - t0;
+	}
+	w->end = bench_nsec();
+	w->error = error;
+	if (!ppmc.process) {
+		bench_pmc_stop(&pmc, w->pmc);
+		bench_pmc_close(&pmc);
+	}
+	return (NULL);
+}
+
+/*
+ * Events per operation of the whole step, or summed over all workers, -1
+ * if any lacks it
+ */
+static double
+pmc_per_op(struct sb_worker *w, int nthreads, const double *step, int event)
+{
+	double sum;
+	int i;
+
+	if (ppmc.process)
+		return (step[event] < 0 ? -1 :
+		    step[event] / ((double)niter * nthreads));
+	sum = 0;
+	for (i = 0; i < nthreads; i++) {
+		if (w[i].pmc[event] < 0)
+			return (-1);
+		sum += w[i].pmc[event];
+	}
+	return (sum / ((double)niter * nthreads));
+}
+
+static void
+pmc_col(double val)
+{
+
+	if (val < 0)
+		printf(" %9s", "-");
+	else
+		printf(" %9.2f", val);
+}
+
+struct sb_result {
+	double		mops;
+	double		cycles;		/* per operation, -1 if unknown */
+	double		l1dmiss;
+	double		hitm;
+};
+
+static void
+run(int mode, int nthreads, struct sb_result *r, const struct sb_result *one,
+    double thresh, int verbose)
+{
+	struct bench_stats st;
+	struct sb_worker *w;
+	uint64_t *all, start, end;
+	double speedup, eff, step[BENCH_PMC_NEVENTS];
+	char label[64];
+	int i;
+
+	w = calloc(nthreads, sizeof(struct sb_worker));
+	all = calloc(niter * nthreads, sizeof(uint64_t));
+	if (w == NULL || all == NULL)
+		err(1, "calloc");
+	memset(dev, 0, sizeof(dev));
+	/* This thread starts the process counters and joins in */
+	if (pthread_barrier_init(&barrier, NULL, nthreads + 1) != 0)
+		errx(1, "pthread_barrier_init");
+
+	for (i = 0; i < nthreads; i++) {
+		w[i].vcpuid = i;
+		w[i].cpu = i % ncpu;
+		w[i].samples = &all[i * niter];
+		switch (mode) {
+		case MODE_PRIVATE:
+			w[i].reg = &dev[i].reg[0];
+			break;
+		case MODE_ADJACENT:
+			w[i].reg = &dev[i / nitems(dev[0].reg)].reg[i %
+			    nitems(dev[0].reg)];
+			break;
+		default:
+			w[i].reg = &dev[0].reg[0];
+			break;
+		}
+		if (pthread_create(&w[i].td, NULL, worker_thread, &w[i]) != 0)
+			errx(1, "pthread_create");
+	}
+	if (ppmc.process)
+		bench_pmc_start(&ppmc);
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(w[i].td, NULL);
+	if (ppmc.process)
+		bench_pmc_stop(&ppmc, step);
+	pthread_barrier_destroy(&barrier);
+
+	start = w[0].start;
+	end = w[0].end;
+	for (i = 0; i < nthreads; i++) {
+		if (w[i].error != 0)
+			errx(1, "vCPU %d: emulation failed: %d", i, w[i].error);
+		start = MIN(start, w[i].start);
+		end = MAX(end, w[i].end);
+		/* Before the samples of all vCPUs are sorted together */
+		bench_stats(w[i].samples, niter, 1 / bench_tsc_ghz(),
+		    &w[i].st);
+	}
+
+	r->mops = (double)niter * nthreads * 1e3 / (end - start);
+	r->cycles = pmc_per_op(w, nthreads, step, BENCH_PMC_CYCLES);
+	r->l1dmiss = pmc_per_op(w, nthreads, step, BENCH_PMC_L1DMISS);
+	r->hitm = pmc_per_op(w, nthreads, step, BENCH_PMC_HITM);
+	bench_stats(all, niter * nthreads, 1 / bench_tsc_ghz(), &st);
+	speedup = one != NULL ? r->mops / one->mops : 1;
+	eff = speedup / nthreads;
+
+	printf("%-8s %7d %9.2f %7.2f %5.0f%% %8.1f %8.1f %9.1f",
+	    mode_names[mode], nthreads, r->mops, speedup, eff * 100, st.p50,
+	    st.p99, st.max);
+	pmc_col(r->cycles);
+	pmc_col(r->l1dmiss);
+	pmc_col(r->hitm);
+	printf("\n");
+
+	if (one != NULL && eff * 100 < thresh) {
+		printf("%-8s sub-linear: %.0f%% efficiency", "", eff * 100);
+		if (r->cycles >= 0 && one->cycles > 0)
+			printf(", cycles/op x%.2f", r->cycles / one->cycles);
+		if (r->hitm >= 0 && one->hitm >= 0)
+			printf(", HITM loads/op %.3f -> %.3f", one->hitm,
+			    r->hitm);
+		else if (r->l1dmiss >= 0 && one->l1dmiss >= 0)
+			printf(", L1d misses/op (proxy) %.2f -> %.2f",
+			    one->l1dmiss, r->l1dmiss);
+		if (nthreads > ncpu)
+			printf(", %d threads on %d cpus", nthreads, ncpu);
+		printf("\n");
+	}
+
+	for (i = 0; verbose && i < nthreads; i++) {
+		snprintf(label, sizeof(label), "  vCPU %d (cpu %d)", i,
+		    w[i].cpu);
+		bench_print(label, "ns", &w[i].st);
+	}
+
+	free(all);
+	free(w);
+}
+
+/* 1, 2, 4, ... and 'max' */
+static int
+default_counts(int *counts, int max)
+{
+	int n, t;
+
+	n = 0;
+	for (t = 1; t < max; t *= 2)
+		counts[n++] = t;
+	counts[n++] = max;
+	return (n);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: scale_bench [-v] [-e efficiency] "
+	    "[-m mode,...] [-n iterations]\n"
+	    "                   [-t threads,...]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sb_result one, r;
+	double thresh;
+	char *p, *q;
+	int counts[VM_STUB_MAXCPU], modes[MODE_LAST];
+	int ch, hitm, i, m, ncount, nmode, npmc, verbose;
+
+	niter = 200000;
+	thresh = 80;
+	ncount = nmode = verbose = 0;
+	while ((ch = getopt(argc, argv, "e:m:n:t:v")) != -1) {
+		switch (ch) {
+		case 'e':
+			thresh = strtod(optarg, NULL);
+			break;
+		case 'm':
+			for (p = optarg; (q = strsep(&p, ",")) != NULL;) {
+				for (m = 0; m < MODE_LAST; m++)
+					if (strcmp(q, mode_names[m]) == 0)
+						break;
+				if (m == MODE_LAST || nmode == MODE_LAST)
+					usage();
+				modes[nmode++] = m;
+			}
+			break;
+		case 'n':
+			niter = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			for (p = optarg; (q = strsep(&p, ",")) != NULL;) {
+				if (ncount == nitems(counts))
+					usage();
+				counts[ncount] = atoi(q);
+				if (counts[ncount] < 1 ||
+				    counts[ncount] > VM_STUB_MAXCPU)
+					usage();
+				ncount++;
+			}
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (niter == 0 || optind != argc)
+		usage();
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+	if (ncount == 0)
+		ncount = default_counts(counts, MIN(ncpu, VM_STUB_MAXCPU));
+	if (nmode == 0) {
+		modes[nmode++] = MODE_PRIVATE;
+		modes[nmode++] = MODE_ADJACENT;
+		modes[nmode++] = MODE_SHARED;
+	}
+
+	bench_tsc_ghz();
+	/* Process counters stay open, the workers open per-thread ones */
+	npmc = bench_pmc_open(&ppmc);
+	hitm = ppmc.open[BENCH_PMC_HITM];
+	if (!ppmc.process)
+		bench_pmc_close(&ppmc);
+	printf("%d cpus, %zu operations per thread, latency in ns, "
+	    "counters per operation%s\n", ncpu, niter,
+	    npmc > 0 && ppmc.process ? " of the process" : "");
+	if (npmc > 0 && !hitm)
+		printf("no HITM load event, L1d misses are only a proxy for "
+		    "lines moving between cpus\n");
+	printf("\n%-8s %7s %9s %7s %6s %8s %8s %9s %9s %9s %9s\n", "mode",
+	    "threads", "Mops/s", "speedup", "eff", "p50", "p99", "max",
+	    "cycles", "L1d-miss", "HITM");
+
+	for (m = 0; m < nmode; m++) {
+		/* The baseline for speedup and efficiency is one thread */
+		run(modes[m], 1, &one, NULL, thresh, verbose);
+		for (i = 0; i < ncount; i++) {
+			if (counts[i] == 1)
+				continue;
+			run(modes[m], counts[i], &r, &one, thresh, verbose);
+		}
+	}
+	return (0);
+}
@@ -0,0 +1,231 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Typed memory region handler benchmark.
+ *
+ * The same register block is exposed through generic callbacks, which have
+ * to dispatch on the access size and mask the value, through typed
+ * per-width handlers and through the legacy adapter. Each instruction below
+ * is emulated in a loop against all three and the cost per emulated access
+ * is reported.
+ *
+ * Decoding and emulating the instruction dominate: summed over all cases the
+ * typed handlers are 0-10% cheaper than the generic callbacks, typically 3%,
+ * and single cases are within noise. The adapter adds an indirect call and
+ * is about 10% more expensive than the generic callbacks.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "bench.h"
+
+#define	DEV_BASE	0xfe000000UL
+#define	DEV_SIZE	0x100
+
+static uint8_t	dev_regs[DEV_SIZE] __aligned(8);
+
+static int
+gen_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+	uint64_t off;
+
+	off = gpa - DEV_BASE;
+	if (off > DEV_SIZE - rsize)
+		return (EINVAL);
+
+	switch (rsize) {
+	case 1:
+		*rval = dev_regs[off];
+		break;
+	case 2:
+		*rval = *(uint16_t *)&dev_regs[off];
+		break;
+	case 4:
+		*rval = *(uint32_t *)&dev_regs[off];
+		break;
+	case 8:
+		*rval = *(uint64_t *)&dev_regs[off];
+		break;
+	default:
+		return (EINVAL);
+	}
+	return (0);
+}
+
+static int
+gen_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+	uint64_t off;
+
+	off = gpa - DEV_BASE;
+	if (off > DEV_SIZE - wsize)
+		return (EINVAL);
+
+	switch (wsize) {
+	case 1:
+		dev_regs[off] = wval & 0xff;
+		break;
+	case 2:
+		*(uint16_t *)&dev_regs[off] = wval & 0xffff;
+		break;
+	case 4:
+		*(uint32_t *)&dev_regs[off] = wval & 0xffffffff;
+		break;
+	case 8:
+		*(uint64_t *)&dev_regs[off] = wval;
+		break;
+	default:
+		return (EINVAL);
+	}
+	return (0);
+}
+
+#define	TYPED_HANDLERS(sz)						\
+static int								\
+typed_read##sz(void *vm, int cpuid, uint64_t gpa, uint##sz##_t *rval,	\
+    void *arg)								\
+{									\
+	uint64_t off;							\
+									\
+	off = gpa - DEV_BASE;						\
+	if (off > DEV_SIZE - sz / 8)					\
+		return (EINVAL);					\
+	*rval = *(uint##sz##_t *)&dev_regs[off];			\
+	return (0);							\
+}									\
+									\
+static int								\
+typed_write##sz(void *vm, int cpuid, uint64_t gpa, uint##sz##_t wval,	\
+    void *arg)								\
+{									\
+	uint64_t off;							\
+									\
+	off = gpa - DEV_BASE;						\
+	if (off > DEV_SIZE - sz / 8)					\
+		return (EINVAL);					\
+	*(uint##sz##_t *)&dev_regs[off] = wval;				\
+	return (0);							\
+} struct __hack
+
+TYPED_HANDLERS(8);
+TYPED_HANDLERS(16);
+TYPED_HANDLERS(32);
+TYPED_HANDLERS(64);
+
+static const struct vie_mmio_ops typed_ops = {
+	.read8 = typed_read8,
+	.read16 = typed_read16,
+	.read32 = typed_read32,
+	.read64 = typed_read64,
+	.write8 = typed_write8,
+	.write16 = typed_write16,
+	.write32 = typed_write32,
+	.write64 = typed_write64,
+};
+
+static const struct {
+	const char	*name;
+	uint8_t		inst[VIE_INST_SIZE];
+	int		len;
+} insts[] = {
+	{ "movb %cl,0x10(%rdx)",	{ 0x88, 0x4a, 0x10 }, 3 },
+	{ "movw %cx,0x10(%rdx)",	{ 0x66, 0x89, 0x4a, 0x10 }, 4 },
+	{ "movl %ecx,0x10(%rdx)",	{ 0x89, 0x4a, 0x10 }, 3 },
+	{ "movq %rcx,0x10(%rdx)",	{ 0x48, 0x89, 0x4a, 0x10 }, 4 },
+	{ "movl 0x10(%rdx),%ecx",	{ 0x8b, 0x4a, 0x10 }, 3 },
+	{ "movq 0x10(%rdx),%rcx",	{ 0x48, 0x8b, 0x4a, 0x10 }, 4 },
+	{ "movzbl 0x10(%rdx),%ecx",	{ 0x0f, 0xb6, 0x4a, 0x10 }, 4 },
+	{ "andl $0x7f,0x10(%rdx)",	{ 0x83, 0x62, 0x10, 0x7f }, 4 },
+};
+
+static double
+run(struct vie *vie, struct vm_guest_paging *paging, int kind, size_t niter)
+{
+	struct vie_mmio_legacy legacy;
+	uint64_t start;
+	size_t i;
+	int error;
+
+	legacy.read = gen_mread;
+	legacy.write = gen_mwrite;
+	legacy.arg = NULL;
+
+	start = bench_rdtsc();
+	for (i = 0; i < niter; i++) {
+		switch (kind) {
+		case 0:
+			error = vmm_emulate_instruction(NULL, 0,
+			    DEV_BASE + 0x10, vie, paging, gen_mread,
+			    gen_mwrite, NULL);
+			break;
+		case 1:
+			error = vmm_emulate_instruction_ops(NULL, 0,
+			    DEV_BASE + 0x10, vie, paging, &typed_ops, NULL);
+			break;
+		default:
+			error = vmm_emulate_instruction_ops(NULL, 0,
+			    DEV_BASE + 0x10, vie, paging, &vie_mmio_legacy_ops,
+			    &legacy);
+			break;
+		}
+		if (error)
+			errx(1, "emulation failed: %d", error);
+	}
+	return ((bench_rdtsc() - start) / bench_tsc_ghz() / niter);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct vm_guest_paging paging;
+	struct vie vie;
+	size_t niter;
+	int ch, i;
+
+	niter = 10000000;
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			niter = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: typed_bench [-n iterations]\n");
+			exit(1);
+		}
+	}
+
+	memset(&paging, 0, sizeof(paging));
+	paging.cpu_mode = CPU_MODE_64BIT;
+	paging.paging_mode = PAGING_MODE_64;
+	vm_set_register(NULL, 0, VM_REG_GUEST_RDX, DEV_BASE);
+	vm_set_register(NULL, 0, VM_REG_GUEST_RCX, 0x1122334455667788UL);
+
+	printf("%-28s %10s %10s %10s  (ns/access)\n", "instruction", "generic",
+	    "typed", "adapter");
+	for (i = 0; i < (int)nitems(insts); i++) {
+		memset(&vie, 0, sizeof(struct vie));
+		vie.base_register = VM_REG_LAST;
+		vie.index_register = VM_REG_LAST;
+		vie.segment_register = VM_REG_LAST;
+		memcpy(vie.inst, insts[i].inst, insts[i].len);
+		vie.num_valid = insts[i].len;
+		if (vmm_decode_instruction(NULL, 0, VIE_INVALID_GLA,
+		    CPU_MODE_64BIT, 0, &vie))
+			errx(1, "cannot decode '%s'", insts[i].name);
+
+		printf("%-28s %10.2f %10.2f %10.2f\n", insts[i].name,
+		    run(&vie, &paging, 0, niter), run(&vie, &paging, 1, niter),
+		    run(&vie, &paging, 2, niter));
+	}
+	return (0);
+}
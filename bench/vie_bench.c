@@ -0,0 +1,525 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Per-instruction decode and emulate microbenchmark.
+ *
+ * Every supported op_type is measured across operand sizes, address sizes
+ * and cpu modes, in three phases: decode alone, emulate alone (reusing the
+ * decoded instruction) and decode followed by emulate. The memory callbacks
+ * do nothing so only the emulator's own cost is measured. Each operation is
+ * timed individually with the TSC after a warm-up, on a pinned thread.
+ *
+ * Results are printed as a table or written as JSON (-j) for comparing
+ * builds. With -p the hardware counters of bench_pmc_open() are read around
+ * the measured iterations of each phase and reported per operation, less
+ * the same counts for an empty iteration.
+ *
+ * With -R each phase is measured that many times over, and with -s the
+ * median of each repetition is appended to a results file (see bench.h)
+ * for bench_compare. The table and the JSON show the last repetition.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "bench.h"
+
+#define	DEV_BASE	0xfe000000UL	/* MMIO operand */
+#define	RAM_BASE	0x00100000UL	/* RAM for string sources and stack */
+#define	RAM_SIZE	0x1000
+
+#define	PHASE_DECODE	0
+#define	PHASE_EMULATE	1
+#define	PHASE_BOTH	2
+#define	PHASE_NONE	3	/* loop overhead, for the counters */
+
+static const char *phase_names[] = { "decode", "emulate", "decode+emulate" };
+
+static const char *mode_names[] = {
+	[CPU_MODE_REAL] = "real",
+	[CPU_MODE_PROTECTED] = "prot",
+	[CPU_MODE_COMPATIBILITY] = "compat",
+	[CPU_MODE_64BIT] = "64",
+};
+
+/*
+ * The memory operand is 0x10(%rdx), or %rdi for string instructions, and
+ * always at DEV_BASE + 0x10.
+ */
+static const struct vb_case {
+	const char	*name;
+	const char	*op;
+	enum vm_cpu_mode mode;
+	uint8_t		inst[VIE_INST_SIZE];
+	int		len;
+} cases[] = {
+	{ "movb %cl,0x10(%rdx)", "MOV", CPU_MODE_64BIT,
+	    { 0x88, 0x4a, 0x10 }, 3 },
+	{ "movw %cx,0x10(%rdx)", "MOV", CPU_MODE_64BIT,
+	    { 0x66, 0x89, 0x4a, 0x10 }, 4 },
+	{ "movl %ecx,0x10(%rdx)", "MOV", CPU_MODE_64BIT,
+	    { 0x89, 0x4a, 0x10 }, 3 },
+	{ "movq %rcx,0x10(%rdx)", "MOV", CPU_MODE_64BIT,
+	    { 0x48, 0x89, 0x4a, 0x10 }, 4 },
+	{ "movl %ecx,0x10(%edx)", "MOV", CPU_MODE_64BIT,
+	    { 0x67, 0x89, 0x4a, 0x10 }, 4 },
+	{ "movb 0x10(%rdx),%cl", "MOV", CPU_MODE_64BIT,
+	    { 0x8a, 0x4a, 0x10 }, 3 },
+	{ "movl 0x10(%rdx),%ecx", "MOV", CPU_MODE_64BIT,
+	    { 0x8b, 0x4a, 0x10 }, 3 },
+	{ "movq 0x10(%rdx),%rcx", "MOV", CPU_MODE_64BIT,
+	    { 0x48, 0x8b, 0x4a, 0x10 }, 4 },
+	{ "movb $0x7f,0x10(%rdx)", "MOV", CPU_MODE_64BIT,
+	    { 0xc6, 0x42, 0x10, 0x7f }, 4 },
+	{ "movl $imm32,0x10(%rdx)", "MOV", CPU_MODE_64BIT,
+	    { 0xc7, 0x42, 0x10, 0x78, 0x56, 0x34, 0x12 }, 7 },
+	{ "movq $imm32,0x10(%rdx)", "MOV", CPU_MODE_64BIT,
+	    { 0x48, 0xc7, 0x42, 0x10, 0x78, 0x56, 0x34, 0x12 }, 8 },
+	{ "movabs 0xfe000010,%eax", "MOV", CPU_MODE_64BIT,
+	    { 0xa1, 0x10, 0x00, 0x00, 0xfe, 0x00, 0x00, 0x00, 0x00 }, 9 },
+	{ "movabs %rax,0xfe000010", "MOV", CPU_MODE_64BIT,
+	    { 0x48, 0xa3, 0x10, 0x00, 0x00, 0xfe, 0x00, 0x00, 0x00, 0x00 },
+	    10 },
+	{ "movzbl 0x10(%rdx),%ecx", "MOVZX", CPU_MODE_64BIT,
+	    { 0x0f, 0xb6, 0x4a, 0x10 }, 4 },
+	{ "movzwl 0x10(%rdx),%ecx", "MOVZX", CPU_MODE_64BIT,
+	    { 0x0f, 0xb7, 0x4a, 0x10 }, 4 },
+	{ "movzbq 0x10(%rdx),%rcx", "MOVZX", CPU_MODE_64BIT,
+	    { 0x48, 0x0f, 0xb6, 0x4a, 0x10 }, 5 },
+	{ "movsbl 0x10(%rdx),%ecx", "MOVSX", CPU_MODE_64BIT,
+	    { 0x0f, 0xbe, 0x4a, 0x10 }, 4 },
+	{ "movsbq 0x10(%rdx),%rcx", "MOVSX", CPU_MODE_64BIT,
+	    { 0x48, 0x0f, 0xbe, 0x4a, 0x10 }, 5 },
+	{ "andl 0x10(%rdx),%ecx", "AND", CPU_MODE_64BIT,
+	    { 0x23, 0x4a, 0x10 }, 3 },
+	{ "andq 0x10(%rdx),%rcx", "AND", CPU_MODE_64BIT,
+	    { 0x48, 0x23, 0x4a, 0x10 }, 4 },
+	{ "orl 0x10(%rdx),%ecx", "OR", CPU_MODE_64BIT,
+	    { 0x0b, 0x4a, 0x10 }, 3 },
+	{ "orw 0x10(%rdx),%cx", "OR", CPU_MODE_64BIT,
+	    { 0x66, 0x0b, 0x4a, 0x10 }, 4 },
+	{ "subl 0x10(%rdx),%ecx", "SUB", CPU_MODE_64BIT,
+	    { 0x2b, 0x4a, 0x10 }, 3 },
+	{ "subq 0x10(%rdx),%rcx", "SUB", CPU_MODE_64BIT,
+	    { 0x48, 0x2b, 0x4a, 0x10 }, 4 },
+	{ "cmpl %ecx,0x10(%rdx)", "CMP", CPU_MODE_64BIT,
+	    { 0x39, 0x4a, 0x10 }, 3 },
+	{ "cmpq 0x10(%rdx),%rcx", "CMP", CPU_MODE_64BIT,
+	    { 0x48, 0x3b, 0x4a, 0x10 }, 4 },
+	{ "btl $3,0x10(%rdx)", "BT", CPU_MODE_64BIT,
+	    { 0x0f, 0xba, 0x62, 0x10, 0x03 }, 5 },
+	{ "btq $35,0x10(%rdx)", "BT", CPU_MODE_64BIT,
+	    { 0x48, 0x0f, 0xba, 0x62, 0x10, 0x23 }, 6 },
+	{ "orl $imm32,0x10(%rdx)", "GROUP1", CPU_MODE_64BIT,
+	    { 0x81, 0x4a, 0x10, 0x78, 0x56, 0x34, 0x12 }, 7 },
+	{ "andl $0x7f,0x10(%rdx)", "GROUP1", CPU_MODE_64BIT,
+	    { 0x83, 0x62, 0x10, 0x7f }, 4 },
+	{ "andq $0x7f,0x10(%rdx)", "GROUP1", CPU_MODE_64BIT,
+	    { 0x48, 0x83, 0x62, 0x10, 0x7f }, 5 },
+	{ "cmpb $0x7f,0x10(%rdx)", "GROUP1", CPU_MODE_64BIT,
+	    { 0x80, 0x7a, 0x10, 0x7f }, 4 },
+	{ "cmpl $1,0x10(%rdx)", "GROUP1", CPU_MODE_64BIT,
+	    { 0x83, 0x7a, 0x10, 0x01 }, 4 },
+	{ "pushq 0x10(%rdx)", "PUSH", CPU_MODE_64BIT,
+	    { 0xff, 0x72, 0x10 }, 3 },
+	{ "popq 0x10(%rdx)", "POP", CPU_MODE_64BIT,
+	    { 0x8f, 0x42, 0x10 }, 3 },
+	{ "movsb", "MOVS", CPU_MODE_64BIT, { 0xa4 }, 1 },
+	{ "movsl", "MOVS", CPU_MODE_64BIT, { 0xa5 }, 1 },
+	{ "movsq", "MOVS", CPU_MODE_64BIT, { 0x48, 0xa5 }, 2 },
+	{ "stosb", "STOS", CPU_MODE_64BIT, { 0xaa }, 1 },
+	{ "stosl", "STOS", CPU_MODE_64BIT, { 0xab }, 1 },
+	{ "stosq", "STOS", CPU_MODE_64BIT, { 0x48, 0xab }, 2 },
+	{ "rep stosl", "STOS", CPU_MODE_64BIT, { 0xf3, 0xab }, 2 },
+
+	{ "movl %ecx,0x10(%edx)", "MOV", CPU_MODE_COMPATIBILITY,
+	    { 0x89, 0x4a, 0x10 }, 3 },
+	{ "movzbl 0x10(%edx),%ecx", "MOVZX", CPU_MODE_COMPATIBILITY,
+	    { 0x0f, 0xb6, 0x4a, 0x10 }, 4 },
+
+	{ "movb %cl,0x10(%edx)", "MOV", CPU_MODE_PROTECTED,
+	    { 0x88, 0x4a, 0x10 }, 3 },
+	{ "movw %cx,0x10(%edx)", "MOV", CPU_MODE_PROTECTED,
+	    { 0x66, 0x89, 0x4a, 0x10 }, 4 },
+	{ "movl %ecx,0x10(%edx)", "MOV", CPU_MODE_PROTECTED,
+	    { 0x89, 0x4a, 0x10 }, 3 },
+	{ "movl 0x10(%edx),%ecx", "MOV", CPU_MODE_PROTECTED,
+	    { 0x8b, 0x4a, 0x10 }, 3 },
+	{ "movzbl 0x10(%edx),%ecx", "MOVZX", CPU_MODE_PROTECTED,
+	    { 0x0f, 0xb6, 0x4a, 0x10 }, 4 },
+	{ "andl $0x7f,0x10(%edx)", "GROUP1", CPU_MODE_PROTECTED,
+	    { 0x83, 0x62, 0x10, 0x7f }, 4 },
+	{ "pushl 0x10(%edx)", "PUSH", CPU_MODE_PROTECTED,
+	    { 0xff, 0x72, 0x10 }, 3 },
+	{ "stosl", "STOS", CPU_MODE_PROTECTED, { 0xab }, 1 },
+};
+
+static uint64_t	init_regs[VM_REG_LAST];
+static uint8_t	ram[RAM_SIZE] __aligned(64);
+
+static int
+null_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+
+	*rval = 0;
+	return (0);
+}
+
+static int
+null_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+
+	return (0);
+}
+
+static void
+vie_setup(struct vie *vie, const struct vb_case *c)
+{
+
+	memset(vie, 0, sizeof(struct vie));
+	vie->base_register = VM_REG_LAST;
+	vie->index_register = VM_REG_LAST;
+	vie->segment_register = VM_REG_LAST;
+	memcpy(vie->inst, c->inst, c->len);
+	vie->num_valid = c->len;
+}
+
+static __inline int
+decode(struct vie *vie, const struct vb_case *c)
+{
+
+	vie_setup(vie, c);
+	return (vmm_decode_instruction(NULL, 0, VIE_INVALID_GLA, c->mode,
+	    c->mode != CPU_MODE_64BIT, vie));
+}
+
+static __inline int
+emulate(struct vie *vie, struct vm_guest_paging *paging)
+{
+
+	return (vmm_emulate_instruction(NULL, 0, DEV_BASE + 0x10, vie, paging,
+	    null_mread, null_mwrite, NULL));
+}
+
+/*
+ * Time 'niter' operations of one phase after 'niter / 10' warm-up runs. If
+ * 'pmc' is not NULL its counts over the timed iterations go to 'val'.
+ */
+static int
+measure(const struct vb_case *c, int phase, uint64_t *samples, size_t niter,
+    struct bench_pmc *pmc, double *val)
+{
+	struct vm_guest_paging paging;
+	struct vm_stub_vcpu *vc;
+	struct vie vie, decoded;
+	uint64_t t0, t1;
+	size_t i, warmup;
+	int error;
+
+	vc = vm_stub_vcpu(NULL, 0);
+	memset(&paging, 0, sizeof(paging));
+	paging.cpu_mode = c->mode;
+	paging.paging_mode = c->mode == CPU_MODE_PROTECTED ?
+	    PAGING_MODE_FLAT : PAGING_MODE_64;
+
+	if ((error = decode(&decoded, c)) != 0)
+		return (error);
+
+	error = 0;
+	warmup = niter / 10;
+	for (i = 0; i < warmup + niter && error == 0; i++) {
+		if (pmc != NULL && i == warmup)
+			bench_pmc_start(pmc);
+		/* String and stack instructions update their registers */
+		memcpy(vc->regs, init_regs, sizeof(init_regs));
+		vie = decoded;
+
+		switch (phase) {
+		case PHASE_DECODE:
+			t0 = bench_rdtsc();
+			error = decode(&vie, c);
+			t1 = bench_rdtsc();
+			break;
+		case PHASE_EMULATE:
+			t0 = bench_rdtsc();
+			error = emulate(&vie, &paging);
+			t1 = bench_rdtsc();
+			break;
+		case PHASE_BOTH:
+			t0 = bench_rdtsc();
+			error = decode(&vie, c);
+			if (error == 0)
+				error = emulate(&vie, &paging);
+			t1 = bench_rdtsc();
+			break;
+		default:
+			t0 = bench_rdtsc();
+			t1 = bench_rdtsc();
+			break;
+		}
+		if (i >= warmup)
+			samples[i - warmup] = t1 - t0;
+	}
+	if (pmc != NULL)
+		bench_pmc_stop(pmc, val);
+	return (error);
+}
+
+static void
+json_stats(FILE *fp, const char *prefix, const struct bench_stats *st)
+{
+
+	fprintf(fp, "\"%s_min\": %.1f, \"%s_mean\": %.1f, \"%s_p50\": %.1f, "
+	    "\"%s_p99\": %.1f, \"%s_p999\": %.1f, \"%s_max\": %.1f",
+	    prefix, st->min, prefix, st->mean, prefix, st->p50, prefix,
+	    st->p99, prefix, st->p999, prefix, st->max);
+}
+
+/*
+ * Turn the counts of 'niter' operations into counts per operation, less
+ * the loop overhead in 'base'. Unavailable counters stay negative.
+ */
+static void
+pmc_per_op(double *val, const double *base, size_t niter)
+{
+	int i;
+
+	for (i = 0; i < BENCH_PMC_NEVENTS; i++) {
+		if (val[i] < 0 || base[i] < 0) {
+			val[i] = -1;
+			continue;
+		}
+		val[i] = MAX(val[i] - base[i], 0) / niter;
+	}
+}
+
+static void
+pmc_print(const double *val)
+{
+	int i;
+
+	printf("%32s", "");
+	for (i = 0; i < BENCH_PMC_NEVENTS; i++) {
+		if (val[i] < 0)
+			printf(" %s -", bench_pmc_names[i]);
+		else
+			printf(" %s %.2f", bench_pmc_names[i], val[i]);
+		if (i == BENCH_PMC_INSTR && val[BENCH_PMC_CYCLES] > 0 &&
+		    val[BENCH_PMC_INSTR] >= 0)
+			printf(" (IPC %.2f)",
+			    val[BENCH_PMC_INSTR] / val[BENCH_PMC_CYCLES]);
+	}
+	printf("\n");
+}
+
+static void
+json_pmc(FILE *fp, const double *val)
+{
+	int i;
+
+	fprintf(fp, "\"pmc\": {");
+	for (i = 0; i < BENCH_PMC_NEVENTS; i++) {
+		if (val[i] < 0)
+			fprintf(fp, "%s\"%s\": null", i ? ", " : " ",
+			    bench_pmc_names[i]);
+		else
+			fprintf(fp, "%s\"%s\": %.3f", i ? ", " : " ",
+			    bench_pmc_names[i], val[i]);
+	}
+	fprintf(fp, " }");
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: vie_bench [-pq] [-c cpu] [-f filter] "
+	    "[-j output.json] [-l label]\n"
+	    "                 [-n iterations] [-R repetitions] "
+	    "[-s results]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_stats ns, cyc;
+	struct bench_pmc pmc, *pmcp;
+	struct bench_results br;
+	double base[BENCH_PMC_NEVENTS], val[BENCH_PMC_NEVENTS];
+	double rep[BENCH_RES_MAXREP];
+	struct vm_stub_vcpu *vc;
+	struct vie vie;
+	const struct vb_case *c;
+	const char *filter, *json, *label_res, *results;
+	uint64_t *samples;
+	size_t niter;
+	double ghz;
+	char label[96];
+	FILE *fp;
+	int ch, cpu, error, i, nrep, phase, quiet, r, first, usepmc;
+
+	niter = 100000;
+	cpu = 0;
+	filter = json = results = NULL;
+	label_res = "";
+	quiet = usepmc = 0;
+	nrep = 1;
+	while ((ch = getopt(argc, argv, "c:f:j:l:n:pqR:s:")) != -1) {
+		switch (ch) {
+		case 'c':
+			cpu = atoi(optarg);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'j':
+			json = optarg;
+			break;
+		case 'l':
+			label_res = optarg;
+			break;
+		case 'n':
+			niter = strtoull(optarg, NULL, 0);
+			break;
+		case 'p':
+			usepmc = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'R':
+			nrep = atoi(optarg);
+			break;
+		case 's':
+			results = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (niter == 0 || nrep < 1 || nrep > BENCH_RES_MAXREP ||
+	    optind != argc)
+		usage();
+
+	if (cpu >= 0 && bench_pin(cpu) != 0)
+		warnx("cannot pin to cpu %d", cpu);
+	ghz = bench_tsc_ghz();
+
+	samples = calloc(niter, sizeof(uint64_t));
+	if (samples == NULL)
+		err(1, "calloc");
+
+	/* Sources of string instructions and the stack are RAM */
+	vc = vm_stub_vcpu(NULL, 0);
+	if (vm_stub_map(vc, RAM_BASE, RAM_SIZE, ram) != 0)
+		errx(1, "vm_stub_map");
+	init_regs[VM_REG_GUEST_RAX] = 0xff00ff00;
+	init_regs[VM_REG_GUEST_RCX] = 0x1122334455667788UL;
+	init_regs[VM_REG_GUEST_RDX] = DEV_BASE;
+	init_regs[VM_REG_GUEST_RSI] = RAM_BASE;
+	init_regs[VM_REG_GUEST_RDI] = DEV_BASE + 0x10;
+	init_regs[VM_REG_GUEST_RSP] = RAM_BASE + RAM_SIZE / 2;
+	init_regs[VM_REG_GUEST_RFLAGS] = 0x2;
+
+	pmcp = NULL;
+	if (usepmc) {
+		if (bench_pmc_open(&pmc) == 0)
+			warnx("no hardware counters, continuing without them");
+		else {
+			pmcp = &pmc;
+			measure(&cases[0], PHASE_NONE, samples, niter, pmcp,
+			    base);
+		}
+	}
+
+	fp = NULL;
+	if (json != NULL) {
+		if (strcmp(json, "-") == 0)
+			fp = stdout;
+		else if ((fp = fopen(json, "w")) == NULL)
+			err(1, "%s", json);
+		fprintf(fp, "{\n  \"tsc_ghz\": %.3f,\n  \"iterations\": %zu,\n"
+		    "  \"cpu\": %d,\n  \"results\": [", ghz, niter, cpu);
+	}
+
+	if (results != NULL && (error = bench_results_open(&br, results,
+	    "vie_bench", label_res)) != 0)
+		errc(1, error, "%s", results);
+
+	first = 1;
+	for (i = 0; i < (int)nitems(cases); i++) {
+		c = &cases[i];
+		if (filter != NULL && strstr(c->name, filter) == NULL &&
+		    strcmp(c->op, filter) != 0)
+			continue;
+		if (decode(&vie, c) != 0)
+			errx(1, "%s (%s): cannot decode", c->name,
+			    mode_names[c->mode]);
+
+		for (phase = PHASE_DECODE; phase <= PHASE_BOTH; phase++) {
+			for (r = 0; r < nrep; r++) {
+				error = measure(c, phase, samples, niter, pmcp,
+				    val);
+				if (error != 0)
+					errx(1, "%s (%s): %s failed: %d",
+					    c->name, mode_names[c->mode],
+					    phase_names[phase], error);
+				bench_stats(samples, niter, 1 / ghz, &ns);
+				rep[r] = ns.p50;
+			}
+			bench_stats(samples, niter, 1, &cyc);
+
+			snprintf(label, sizeof(label), "%s %s %s", c->name,
+			    mode_names[c->mode], phase == PHASE_DECODE ?
+			    "[d]" : phase == PHASE_EMULATE ? "[e]" : "[d+e]");
+			if (!quiet)
+				bench_print(label, "ns", &ns);
+			if (results != NULL)
+				bench_results_add(&br, label, "ns", rep, nrep);
+			if (pmcp != NULL) {
+				pmc_per_op(val, base, niter);
+				if (!quiet)
+					pmc_print(val);
+			}
+			if (fp == NULL)
+				continue;
+			fprintf(fp, "%s\n    { \"name\": \"%s\", "
+			    "\"op\": \"%s\", \"mode\": \"%s\", \"opsize\": %d, "
+			    "\"addrsize\": %d, \"phase\": \"%s\", \"n\": %zu,\n"
+			    "      ", first ? "" : ",", c->name, c->op,
+			    mode_names[c->mode], vie.opsize, vie.addrsize,
+			    phase_names[phase], niter);
+			json_stats(fp, "ns", &ns);
+			fprintf(fp, ",\n      ");
+			json_stats(fp, "cycles", &cyc);
+			if (pmcp != NULL) {
+				fprintf(fp, ",\n      ");
+				json_pmc(fp, val);
+			}
+			fprintf(fp, " }");
+			first = 0;
+		}
+	}
+
+	if (fp != NULL) {
+		fprintf(fp, "\n  ]\n}\n");
+		if (fp != stdout)
+			fclose(fp);
+	}
+	if (results != NULL && (error = bench_results_close(&br)) != 0)
+		errc(1, error, "%s", results);
+	if (pmcp != NULL)
+		bench_pmc_close(pmcp);
+	free(samples);
+	return (0);
+}
@@ -0,0 +1,307 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Write-combining framebuffer fill benchmark.
+ *
+ * A vCPU clears a 32bpp linear framebuffer, either with 'rep stosl' or with
+ * a loop of 'mov %eax,(%rdi)' stores, and the frame is closed with a
+ * serializing event. The framebuffer is emulated directly through the device
+ * model write callback or through a write-combining range with cache line
+ * and page sized bursts.
+ *
+ * Reports the number of device model calls, the stores combined and bursts
+ * delivered, all per frame, and the time per frame. Each device model call
+ * costs 100 ns by default (-d), about what an exit to a userspace device
+ * model costs. Combining only pays for itself when calls are that expensive:
+ * with -d 0 the copy into the burst buffer is not hidden and the combined
+ * fills are no faster than storing straight into the framebuffer, and up to
+ * 20% slower from run to run.
+ *
+ * Before the fill, checks that a locked read-modify-write drains the pending
+ * burst ahead of its own access, and exits with 1 if it does not.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "vmm_mmio_wc.h"
+#include "bench.h"
+
+#define	FB_BASE		0xc0000000UL
+#define	DEV_NS		100
+
+static uint8_t	*fb;
+static size_t	fb_size;
+static uint64_t	dev_cost;		/* simulated device model cost (tsc) */
+static uint64_t	dev_calls;
+
+static struct vie_wc wc;
+
+static __inline void
+dev_delay(void)
+{
+	uint64_t end;
+
+	dev_calls++;
+	if (dev_cost != 0) {
+		end = bench_rdtsc() + dev_cost;
+		while (bench_rdtsc() < end)
+			;
+	}
+}
+
+static int
+fb_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+
+	dev_delay();
+	if (gpa - FB_BASE > fb_size - rsize)
+		return (EINVAL);
+	*rval = 0;
+	memcpy(rval, &fb[gpa - FB_BASE], rsize);
+	return (0);
+}
+
+static int
+fb_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+
+	dev_delay();
+	if (gpa - FB_BASE > fb_size - wsize)
+		return (EINVAL);
+	memcpy(&fb[gpa - FB_BASE], &wval, wsize);
+	return (0);
+}
+
+static int
+fb_mbwrite(void *vm, int cpuid, uint64_t gpa, const void *buf, size_t len,
+    void *arg)
+{
+
+	dev_delay();
+	if (gpa - FB_BASE > fb_size - len)
+		return (EINVAL);
+	memcpy(&fb[gpa - FB_BASE], buf, len);
+	return (0);
+}
+
+static void
+decode(struct vie *vie, const uint8_t *inst, int len)
+{
+
+	memset(vie, 0, sizeof(struct vie));
+	vie->base_register = VM_REG_LAST;
+	vie->index_register = VM_REG_LAST;
+	vie->segment_register = VM_REG_LAST;
+	memcpy(vie->inst, inst, len);
+	vie->num_valid = len;
+	if (vmm_decode_instruction(NULL, 0, VIE_INVALID_GLA, CPU_MODE_64BIT, 0,
+	    vie))
+		errx(1, "cannot decode benchmark instruction");
+}
+
+/*
+ * Three stores of a burst are pending when 'lock orl $1,64(%rdi)' hits the
+ * next cache line. The stores must reach the device first and the locked
+ * access must not be buffered.
+ */
+static void
+check_lock(struct vm_guest_paging *paging)
+{
+	static const uint8_t movl[] = { 0x89, 0x07 };
+	static const uint8_t lock_orl[] = { 0xf0, 0x83, 0x4f, 0x40, 0x01 };
+	struct vie vie;
+	uint64_t *regs;
+	uint32_t v;
+	int i;
+
+	memset(fb, 0, 128);
+	vie_wc_init(&wc, NULL, fb_mread, fb_mwrite, NULL, fb_mbwrite, NULL);
+	if (vie_wc_add_range(&wc, FB_BASE, fb_size, 64) != 0)
+		errx(1, "vie_wc_add_range");
+
+	regs = vm_stub_vcpu(NULL, 0)->regs;
+	regs[VM_REG_GUEST_RAX] = 0x11223344;
+	regs[VM_REG_GUEST_RDI] = FB_BASE;
+	decode(&vie, movl, sizeof(movl));
+	for (i = 0; i < 3; i++) {
+		if (vmm_emulate_instruction_rmw(NULL, 0, FB_BASE + 4 * i,
+		    &vie, paging, vie_wc_mread, vie_wc_mwrite, vie_wc_rmw,
+		    &wc) != 0)
+			errx(1, "check: store failed");
+		regs[VM_REG_GUEST_RDI] += 4;
+	}
+	if (wc.buf[0].len != 12)
+		errx(1, "check: %zu bytes pending, expected 12",
+		    wc.buf[0].len);
+
+	regs[VM_REG_GUEST_RDI] = FB_BASE;
+	decode(&vie, lock_orl, sizeof(lock_orl));
+	if (vmm_emulate_instruction_rmw(NULL, 0, FB_BASE + 64, &vie, paging,
+	    vie_wc_mread, vie_wc_mwrite, vie_wc_rmw, &wc) != 0)
+		errx(1, "check: lock orl failed");
+
+	if (wc.buf[0].len != 0)
+		errx(1, "check: burst not drained by lock orl");
+	for (i = 0; i < 3; i++) {
+		memcpy(&v, &fb[4 * i], 4);
+		if (v != 0x11223344)
+			errx(1, "check: pending store %d lost", i);
+	}
+	memcpy(&v, &fb[64], 4);
+	if (v != 1)
+		errx(1, "check: lock orl not delivered");
+}
+
+static void
+fill(struct vie *vie, struct vm_guest_paging *paging, int rep, int combine,
+    uint32_t pixel)
+{
+	uint64_t *regs;
+	uint64_t gpa;
+	int error;
+
+	regs = vm_stub_vcpu(NULL, 0)->regs;
+	regs[VM_REG_GUEST_RAX] = pixel;
+	regs[VM_REG_GUEST_RDI] = FB_BASE;
+	regs[VM_REG_GUEST_RCX] = fb_size / 4;
+
+	for (gpa = FB_BASE; gpa < FB_BASE + fb_size; ) {
+		if (combine) {
+			error = vmm_emulate_instruction_rmw(NULL, 0, gpa, vie,
+			    paging, vie_wc_mread, vie_wc_mwrite, vie_wc_rmw,
+			    &wc);
+		} else {
+			error = vmm_emulate_instruction(NULL, 0, gpa, vie,
+			    paging, fb_mread, fb_mwrite, NULL);
+		}
+		if (error)
+			errx(1, "emulation failed: %d", error);
+
+		/* 'rep stosl' advances %rdi itself, emulate 'add $4,%rdi' */
+		if (!rep)
+			regs[VM_REG_GUEST_RDI] += 4;
+		gpa = regs[VM_REG_GUEST_RDI];
+	}
+
+	/* End of frame, e.g. the port write that flips the display page */
+	if (combine && vie_wc_flush(&wc, 0) != 0)
+		errx(1, "vie_wc_flush failed");
+}
+
+static void
+run(const char *name, int rep, size_t burst, int nframes)
+{
+	static const uint8_t stosl[] = { 0xf3, 0xab };
+	static const uint8_t movl[] = { 0x89, 0x07 };
+	struct vm_guest_paging paging;
+	struct vie vie;
+	uint64_t start, elapsed;
+	size_t i;
+	int frame;
+
+	memset(&paging, 0, sizeof(paging));
+	paging.cpu_mode = CPU_MODE_64BIT;
+	paging.paging_mode = PAGING_MODE_64;
+
+	if (rep)
+		decode(&vie, stosl, sizeof(stosl));
+	else
+		decode(&vie, movl, sizeof(movl));
+
+	vie_wc_init(&wc, NULL, fb_mread, fb_mwrite, NULL, fb_mbwrite, NULL);
+	if (burst != 0 && vie_wc_add_range(&wc, FB_BASE, fb_size, burst) != 0)
+		errx(1, "vie_wc_add_range");
+
+	dev_calls = 0;
+	start = bench_nsec();
+	for (frame = 0; frame < nframes; frame++)
+		fill(&vie, &paging, rep, burst != 0, 0xff000000 | frame);
+	elapsed = bench_nsec() - start;
+
+	for (i = 0; i < fb_size / 4; i++) {
+		if (((uint32_t *)fb)[i] != (0xff000000 | (nframes - 1)))
+			errx(1, "%s: framebuffer mismatch at pixel %zu",
+			    name, i);
+	}
+
+	printf("%-20s %9.1f calls %9.1f stores %8.1f bursts %8.3f ms "
+	    "%8.1f MB/s\n", name, (double)dev_calls / nframes,
+	    (double)wc.buf[0].stores / nframes,
+	    (double)wc.buf[0].bursts / nframes, elapsed / 1e6 / nframes,
+	    (double)fb_size * nframes * 1e3 / elapsed);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: wc_bench [-f frames] [-d device_ns] "
+	    "[-g width,height]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct vm_guest_paging paging;
+	uint64_t devns;
+	int ch, nframes, width, height;
+
+	devns = DEV_NS;
+	nframes = 10;
+	width = 1024;
+	height = 768;
+
+	while ((ch = getopt(argc, argv, "d:f:g:")) != -1) {
+		switch (ch) {
+		case 'd':
+			devns = strtoull(optarg, NULL, 0);
+			break;
+		case 'f':
+			nframes = atoi(optarg);
+			break;
+		case 'g':
+			if (sscanf(optarg, "%d,%d", &width, &height) != 2)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nframes < 1 || width < 1 || height < 1 || width * height < 32)
+		usage();
+
+	fb_size = (size_t)width * height * 4;
+	fb = malloc(fb_size);
+	if (fb == NULL)
+		err(1, "malloc");
+
+	memset(&paging, 0, sizeof(paging));
+	paging.cpu_mode = CPU_MODE_64BIT;
+	paging.paging_mode = PAGING_MODE_64;
+	check_lock(&paging);
+
+	dev_cost = devns * bench_tsc_ghz();
+	printf("%dx%d frame, %ju ns per device model call, per frame:\n",
+	    width, height, (uintmax_t)devns);
+
+	run("rep stosl", 1, 0, nframes);
+	run("rep stosl wc 64", 1, 64, nframes);
+	run("rep stosl wc 4096", 1, 4096, nframes);
+	run("movl loop", 0, 0, nframes);
+	run("movl loop wc 64", 0, 64, nframes);
+	run("movl loop wc 4096", 0, 4096, nframes);
+
+	free(fb);
+	return (0);
+}
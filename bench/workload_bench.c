@@ -0,0 +1,607 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * End-to-end device workload benchmark.
+ *
+ * A stream of MMIO exits shaped like a guest's is decoded and emulated on
+ * one vCPU against stand-ins for the devices behind them:
+ *
+ *	timer	LAPIC timer programming: LVT timer, divide, initial count
+ *	eoi	LAPIC EOI writes
+ *	ioapic	IOAPIC redirection entry updates: select, read, select, write
+ *	hpet	HPET main counter reads
+ *	virtio	virtio-pci notify doorbell writes, over four queues
+ *	fb	framebuffer streaming, rep movsl from a RAM shadow buffer
+ *
+ * The classes are mixed in the ratios given with -r, which are shares of
+ * the exits; a class with several steps runs them back to back. The
+ * stream is drawn up front so that the measured loop only sets up each
+ * exit's registers and calls vmm_decode_instruction() and
+ * vmm_emulate_instruction(). The device stand-ins keep the state the
+ * accesses act on (the APIC registers, the IOAPIC index and redirection
+ * table, the virtio kick counts and the framebuffer) and are found by a
+ * lookup on the GPA, as a VMM's MMIO dispatch would.
+ *
+ * It reports the exits per second of the whole loop and, per class, the
+ * exits, their share of the time and the decode and emulate latency. With
+ * -w the exits are emulated through vie_rec_emulate() and recorded for
+ * replay_bench and cache_sim; the framebuffer's source bytes are guest RAM,
+ * which a recording does not hold, so those exits do not replay.
+ *
+ * With -R the stream is run that many times over, carrying on where it
+ * left off, and with -s the mean decode and emulate time of each class
+ * and of all exits in each repetition is appended to a results file (see
+ * bench.h) for bench_compare. The tables show the last repetition.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "vmm_exitrec.h"
+#include "bench.h"
+
+#define	LAPIC_BASE	0xfee00000UL
+#define	IOAPIC_BASE	0xfec00000UL
+#define	HPET_BASE	0xfed00000UL
+#define	VIRTIO_BASE	0xfe003000UL	/* notify capability of the BAR */
+#define	FB_BASE		0xc0000000UL
+#define	FB_SIZE		(1024 * 768 * 4)
+#define	SHADOW_BASE	0x00100000UL	/* guest RAM the blits come from */
+#define	SHADOW_SIZE	(1024 * 4 * 16)	/* sixteen scanlines */
+#define	SCANLINE	(1024 * 4)
+
+#define	VIRTIO_NQUEUE	4
+#define	IOAPIC_NPIN	24
+
+#define	W_TIMER		0
+#define	W_EOI		1
+#define	W_IOAPIC	2
+#define	W_HPET		3
+#define	W_VIRTIO	4
+#define	W_FB		5
+#define	W_NCLASS	6
+
+#define	W_MAXSTEP	4
+
+/* One exit: the operand is at 'off' from the device base in %rdx */
+struct w_step {
+	uint8_t		inst[VIE_INST_SIZE];
+	int		len;
+	uint64_t	off;
+};
+
+struct w_class {
+	const char	*name;
+	int		ratio;		/* default share of the exits, % */
+	uint64_t	base;
+	int		nstep;
+	struct w_step	steps[W_MAXSTEP];
+};
+
+static const struct w_class classes[W_NCLASS] = {
+	/* movl %eax,disp32(%rdx) to LVT timer, divide, initial count */
+	[W_TIMER] = { "timer", 10, LAPIC_BASE, 3, {
+	    { { 0x89, 0x82, 0x20, 0x03, 0x00, 0x00 }, 6, 0x320 },
+	    { { 0x89, 0x82, 0xe0, 0x03, 0x00, 0x00 }, 6, 0x3e0 },
+	    { { 0x89, 0x82, 0x80, 0x03, 0x00, 0x00 }, 6, 0x380 } } },
+	/* movl %eax,0xb0(%rdx) */
+	[W_EOI] = { "eoi", 30, LAPIC_BASE, 1, {
+	    { { 0x89, 0x82, 0xb0, 0x00, 0x00, 0x00 }, 6, 0xb0 } } },
+	[W_IOAPIC] = { "ioapic", 4, IOAPIC_BASE, 4, {
+	    /* movl %ecx,(%rdx); movl 0x10(%rdx),%eax; again; the store */
+	    { { 0x89, 0x0a }, 2, 0x00 },
+	    { { 0x8b, 0x42, 0x10 }, 3, 0x10 },
+	    { { 0x89, 0x0a }, 2, 0x00 },
+	    { { 0x89, 0x42, 0x10 }, 3, 0x10 } } },
+	/* movq 0xf0(%rdx),%rax */
+	[W_HPET] = { "hpet", 25, HPET_BASE, 1, {
+	    { { 0x48, 0x8b, 0x82, 0xf0, 0x00, 0x00, 0x00 }, 7, 0xf0 } } },
+	[W_VIRTIO] = { "virtio", 25, VIRTIO_BASE, 1, {
+	    { { 0x66, 0x89, 0x02 }, 3, 0x00 } } },	/* movw %ax,(%rdx) */
+	[W_FB] = { "fb", 6, FB_BASE, 1, {
+	    { { 0xf3, 0xa5 }, 2, 0x00 } } },		/* rep movsl */
+};
+
+/* Device stand-ins */
+static struct {
+	uint32_t	regs[0x400 / 4];
+	uint64_t	eoi;
+	uint64_t	armed;
+} lapic;
+
+static struct {
+	uint32_t	index;
+	uint64_t	redir[IOAPIC_NPIN];
+} ioapic;
+
+static struct {
+	uint64_t	start;
+} hpet;
+
+static struct {
+	uint64_t	kicks[VIRTIO_NQUEUE];
+} virtio;
+
+static uint8_t *fb;
+static uint8_t shadow[SHADOW_SIZE] __aligned(CACHE_LINE_SIZE);
+
+static int
+lapic_read(uint64_t off, uint64_t *val, int size)
+{
+
+	*val = lapic.regs[off / 4];
+	return (0);
+}
+
+static int
+lapic_write(uint64_t off, uint64_t val, int size)
+{
+
+	lapic.regs[off / 4] = val;
+	if (off == 0xb0)
+		lapic.eoi++;
+	else if (off == 0x380)
+		lapic.armed++;
+	return (0);
+}
+
+static int
+ioapic_read(uint64_t off, uint64_t *val, int size)
+{
+	uint32_t pin;
+
+	if (off == 0x00) {
+		*val = ioapic.index;
+		return (0);
+	}
+	pin = (ioapic.index - 0x10) / 2;
+	if (ioapic.index < 0x10 || pin >= IOAPIC_NPIN)
+		*val = 0;
+	else
+		*val = ioapic.redir[pin] >> (ioapic.index & 1) * 32 &
+		    0xffffffff;
+	return (0);
+}
+
+static int
+ioapic_write(uint64_t off, uint64_t val, int size)
+{
+	uint64_t mask;
+	uint32_t pin;
+	int shift;
+
+	if (off == 0x00) {
+		ioapic.index = val & 0xff;
+		return (0);
+	}
+	pin = (ioapic.index - 0x10) / 2;
+	if (ioapic.index < 0x10 || pin >= IOAPIC_NPIN)
+		return (0);
+	shift = (ioapic.index & 1) * 32;
+	mask = 0xffffffffUL << shift;
+	ioapic.redir[pin] = (ioapic.redir[pin] & ~mask) |
+	    ((val & 0xffffffff) << shift);
+	return (0);
+}
+
+static int
+hpet_read(uint64_t off, uint64_t *val, int size)
+{
+
+	/* Ticks at roughly the 14.318 MHz of the real thing */
+	*val = (bench_rdtsc() - hpet.start) >> 8;
+	return (0);
+}
+
+static int
+hpet_write(uint64_t off, uint64_t val, int size)
+{
+
+	return (0);
+}
+
+static int
+virtio_read(uint64_t off, uint64_t *val, int size)
+{
+
+	*val = 0;
+	return (0);
+}
+
+static int
+virtio_write(uint64_t off, uint64_t val, int size)
+{
+
+	virtio.kicks[(off / 4) % VIRTIO_NQUEUE]++;
+	return (0);
+}
+
+static int
+fb_read(uint64_t off, uint64_t *val, int size)
+{
+
+	*val = 0;
+	memcpy(val, fb + off, size);
+	return (0);
+}
+
+static int
+fb_write(uint64_t off, uint64_t val, int size)
+{
+
+	memcpy(fb + off, &val, size);
+	return (0);
+}
+
+/* MMIO dispatch, by GPA */
+static const struct w_dev {
+	uint64_t	base;
+	uint64_t	size;
+	int		(*read)(uint64_t off, uint64_t *val, int size);
+	int		(*write)(uint64_t off, uint64_t val, int size);
+} devs[] = {
+	{ FB_BASE, FB_SIZE, fb_read, fb_write },
+	{ VIRTIO_BASE, 4 * VIRTIO_NQUEUE, virtio_read, virtio_write },
+	{ IOAPIC_BASE, 0x20, ioapic_read, ioapic_write },
+	{ HPET_BASE, 0x400, hpet_read, hpet_write },
+	{ LAPIC_BASE, 0x400, lapic_read, lapic_write },
+};
+
+static const struct w_dev *
+dev_lookup(uint64_t gpa, int size)
+{
+	const struct w_dev *d;
+	size_t i;
+
+	for (i = 0; i < nitems(devs); i++) {
+		d = &devs[i];
+		if (gpa - d->base < d->size && gpa + size - d->base <= d->size)
+			return (d);
+	}
+	return (NULL);
+}
+
+static int
+dev_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+	const struct w_dev *d;
+
+	if ((d = dev_lookup(gpa, rsize)) == NULL)
+		return (EFAULT);
+	return (d->read(gpa - d->base, rval, rsize));
+}
+
+static int
+dev_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+	const struct w_dev *d;
+
+	if ((d = dev_lookup(gpa, wsize)) == NULL)
+		return (EFAULT);
+	return (d->write(gpa - d->base, wval, wsize));
+}
+
+static uint64_t
+next_random(uint64_t *state)
+{
+
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return (*state);
+}
+
+/*
+ * Draw the class of 'n' exits. A class is picked with its ratio divided by
+ * its number of steps, then all its steps follow.
+ */
+static void
+draw(uint8_t *stream, size_t n, const int *ratio, uint64_t seed)
+{
+	double w[W_NCLASS], sum, u;
+	uint64_t state;
+	size_t i;
+	int c, s;
+
+	sum = 0;
+	for (c = 0; c < W_NCLASS; c++)
+		sum += w[c] = (double)ratio[c] / classes[c].nstep;
+	state = seed ? seed : 1;
+	for (i = 0; i < n;) {
+		u = (next_random(&state) >> 11) * 0x1p-53 * sum;
+		for (c = 0; c < W_NCLASS - 1 && u >= w[c]; c++)
+			u -= w[c];
+		for (s = 0; s < classes[c].nstep && i < n; s++)
+			stream[i++] = c;
+	}
+}
+
+/*
+ * The registers of the next exit of class 'c', at step 'step' of it. The
+ * framebuffer blit carries its string registers from one exit to the
+ * next in 'fbregs'.
+ */
+static void
+setup(struct vm_stub_vcpu *vc, int c, int step, uint64_t *state,
+    uint64_t *fbregs)
+{
+	uint64_t *regs;
+	uint32_t pin;
+
+	regs = vc->regs;
+	regs[VM_REG_GUEST_RDX] = classes[c].base;
+	switch (c) {
+	case W_TIMER:
+		/* One-shot on vector 0xec, divide by 1, a random count */
+		regs[VM_REG_GUEST_RAX] = step == 0 ? 0xec : step == 1 ? 0xb :
+		    next_random(state) & 0xfffff;
+		break;
+	case W_EOI:
+		regs[VM_REG_GUEST_RAX] = 0;
+		break;
+	case W_IOAPIC:
+		/* Mask or unmask the low half of a random pin's entry */
+		if (step == 0) {
+			pin = next_random(state) % IOAPIC_NPIN;
+			regs[VM_REG_GUEST_RCX] = 0x10 + 2 * pin;
+		} else if (step == 3)
+			regs[VM_REG_GUEST_RAX] ^= 0x10000;
+		break;
+	case W_VIRTIO:
+		regs[VM_REG_GUEST_RAX] = next_random(state) % VIRTIO_NQUEUE;
+		regs[VM_REG_GUEST_RDX] += regs[VM_REG_GUEST_RAX] * 4;
+		break;
+	case W_FB:
+		if (fbregs[2] == 0) {
+			/* Next scanline, from the next shadow scanline */
+			fbregs[0] = SHADOW_BASE + (fbregs[1] - FB_BASE) %
+			    SHADOW_SIZE;
+			fbregs[2] = SCANLINE / 4;
+		}
+		regs[VM_REG_GUEST_RSI] = fbregs[0];
+		regs[VM_REG_GUEST_RDI] = fbregs[1];
+		regs[VM_REG_GUEST_RCX] = fbregs[2];
+		break;
+	}
+}
+
+static uint64_t
+operand_gpa(struct vm_stub_vcpu *vc, int c, int step)
+{
+
+	if (c == W_FB)
+		return (vc->regs[VM_REG_GUEST_RDI]);
+	return (vc->regs[VM_REG_GUEST_RDX] + classes[c].steps[step].off);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: workload_bench [-c cpu] [-l label] [-n exits] "
+	    "[-R repetitions]\n"
+	    "                      [-r class=ratio,...] [-S seed] "
+	    "[-s results] [-w exits.rec]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct vm_guest_paging paging;
+	struct vm_stub_vcpu *vc;
+	struct bench_results br;
+	struct bench_stats st;
+	struct vie_rec rec;
+	struct vie vie;
+	const struct w_step *ws;
+	const char *label, *path, *results;
+	double rep[W_NCLASS + 1][BENCH_RES_MAXREP];
+	uint64_t *samples, *csamples, ccycles[W_NCLASS], cexits[W_NCLASS];
+	uint64_t fbregs[3], gpa, seed, state, t0, t1, total;
+	uint8_t *stream;
+	char *p, *q, *v;
+	size_t i, n, nc;
+	int c, ch, cpu, error, nrep, r, ratio[W_NCLASS], step[W_NCLASS];
+	double ghz, ns;
+
+	n = 1000000;
+	cpu = 0;
+	seed = 1;
+	path = results = NULL;
+	label = "";
+	nrep = 1;
+	for (c = 0; c < W_NCLASS; c++)
+		ratio[c] = classes[c].ratio;
+	while ((ch = getopt(argc, argv, "c:l:n:R:r:S:s:w:")) != -1) {
+		switch (ch) {
+		case 'c':
+			cpu = atoi(optarg);
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		case 'R':
+			nrep = atoi(optarg);
+			break;
+		case 'n':
+			n = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			/* Classes not listed are left out */
+			memset(ratio, 0, sizeof(ratio));
+			for (p = optarg; (q = strsep(&p, ",")) != NULL;) {
+				if ((v = strchr(q, '=')) == NULL)
+					usage();
+				*v++ = '\0';
+				for (c = 0; c < W_NCLASS; c++)
+					if (strcmp(q, classes[c].name) == 0)
+						break;
+				if (c == W_NCLASS || (ratio[c] = atoi(v)) < 0)
+					usage();
+			}
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			results = optarg;
+			break;
+		case 'w':
+			path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	for (c = 0, total = 0; c < W_NCLASS; c++)
+		total += ratio[c];
+	if (n == 0 || total == 0 || nrep < 1 || nrep > BENCH_RES_MAXREP ||
+	    optind != argc)
+		usage();
+
+	if (cpu >= 0 && bench_pin(cpu) != 0)
+		warnx("cannot pin to cpu %d", cpu);
+	ghz = bench_tsc_ghz();
+
+	stream = malloc(n);
+	samples = calloc(n, sizeof(uint64_t));
+	csamples = calloc(n, sizeof(uint64_t));
+	fb = calloc(1, FB_SIZE);
+	if (stream == NULL || samples == NULL || csamples == NULL ||
+	    fb == NULL)
+		err(1, "malloc");
+	draw(stream, n, ratio, seed);
+	for (i = 0; i < sizeof(shadow); i++)
+		shadow[i] = i * 7;
+
+	vc = vm_stub_vcpu(NULL, 0);
+	vm_stub_reset(vc);
+	if (vm_stub_map(vc, SHADOW_BASE, SHADOW_SIZE, shadow) != 0)
+		errx(1, "vm_stub_map");
+	vc->regs[VM_REG_GUEST_RFLAGS] = 0x2;
+	memset(&paging, 0, sizeof(paging));
+	paging.cpu_mode = CPU_MODE_64BIT;
+	paging.paging_mode = PAGING_MODE_64;
+	if (path != NULL && (error = vie_rec_open(&rec, path, dev_mread,
+	    dev_mwrite, NULL)) != 0)
+		errc(1, error, "%s", path);
+
+	memset(step, 0, sizeof(step));
+	fbregs[0] = SHADOW_BASE;
+	fbregs[1] = FB_BASE;
+	fbregs[2] = SCANLINE / 4;
+	state = seed ? seed : 1;
+	hpet.start = bench_rdtsc();
+	for (r = 0; r < nrep; r++) {
+		t0 = bench_nsec();
+		for (i = 0; i < n; i++) {
+			c = stream[i];
+			ws = &classes[c].steps[step[c]];
+			setup(vc, c, step[c], &state, fbregs);
+			gpa = operand_gpa(vc, c, step[c]);
+
+			t1 = bench_rdtsc();
+			memset(&vie, 0, sizeof(vie));
+			vie.base_register = VM_REG_LAST;
+			vie.index_register = VM_REG_LAST;
+			vie.segment_register = VM_REG_LAST;
+			memcpy(vie.inst, ws->inst, ws->len);
+			vie.num_valid = ws->len;
+			error = vmm_decode_instruction(NULL, 0,
+			    VIE_INVALID_GLA, CPU_MODE_64BIT, 0, &vie);
+			/* MMIO is mapped 1:1, so the GLA is the GPA */
+			if (error == 0 && path != NULL)
+				error = vie_rec_emulate(&rec, NULL, 0, gpa, 0,
+				    gpa, &vie, &paging);
+			else if (error == 0)
+				error = vmm_emulate_instruction(NULL, 0, gpa,
+				    &vie, &paging, dev_mread, dev_mwrite, NULL);
+			samples[i] = bench_rdtsc() - t1;
+			if (error != 0)
+				errx(1, "%s, step %d: error %d",
+				    classes[c].name, step[c], error);
+
+			if (c == W_FB) {
+				fbregs[0] = vc->regs[VM_REG_GUEST_RSI];
+				fbregs[1] = vc->regs[VM_REG_GUEST_RDI];
+				fbregs[2] = vc->regs[VM_REG_GUEST_RCX];
+				if (fbregs[1] >= FB_BASE + FB_SIZE)
+					fbregs[1] = FB_BASE;
+			}
+			step[c] = (step[c] + 1) % classes[c].nstep;
+		}
+		t0 = bench_nsec() - t0;
+
+		memset(ccycles, 0, sizeof(ccycles));
+		memset(cexits, 0, sizeof(cexits));
+		for (i = 0, total = 0; i < n; i++) {
+			ccycles[stream[i]] += samples[i];
+			cexits[stream[i]]++;
+			total += samples[i];
+		}
+		for (c = 0; c < W_NCLASS; c++)
+			rep[c][r] = cexits[c] ? ccycles[c] / ghz / cexits[c] :
+			    0;
+		rep[W_NCLASS][r] = total / ghz / n;
+	}
+	if (path != NULL && (error = vie_rec_close(&rec)) != 0)
+		errc(1, error, "%s", path);
+	if (results != NULL) {
+		if ((error = bench_results_open(&br, results,
+		    "workload_bench", label)) != 0)
+			errc(1, error, "%s", results);
+		for (c = 0; c < W_NCLASS; c++)
+			if (cexits[c] != 0)
+				bench_results_add(&br, classes[c].name, "ns",
+				    rep[c], nrep);
+		bench_results_add(&br, "all", "ns", rep[W_NCLASS], nrep);
+		if ((error = bench_results_close(&br)) != 0)
+			errc(1, error, "%s", results);
+	}
+
+	printf("%zu exits in %.1f ms: %.2f M exits/s, %.1f ns/exit, "
+	    "%.1f ns of it decode and emulate\n", n, t0 / 1e6, n * 1e3 / t0,
+	    (double)t0 / n, total / ghz / n);
+	if (path != NULL)
+		printf("recorded to %s, %ju exits dropped\n", path,
+		    (uintmax_t)rec.vcpu[0].dropped);
+	printf("\n%-8s %6s %9s %6s %6s  %s\n", "class", "ratio", "exits",
+	    "exits", "time", "decode+emulate, ns");
+	for (c = 0; c < W_NCLASS; c++) {
+		if (cexits[c] == 0)
+			continue;
+		for (i = 0, nc = 0; i < n; i++)
+			if (stream[i] == c)
+				csamples[nc++] = samples[i];
+		bench_stats(csamples, nc, 1 / ghz, &st);
+		ns = (double)ccycles[c] / ghz;
+		printf("%-8s %5d%% %9ju %5.1f%% %5.1f%%  mean %7.1f  "
+		    "p50 %7.1f  p99 %7.1f  max %9.1f\n", classes[c].name,
+		    ratio[c], (uintmax_t)cexits[c], 100.0 * cexits[c] / n,
+		    100.0 * ccycles[c] / total, ns / cexits[c], st.p50, st.p99,
+		    st.max);
+	}
+	printf("\n%ju EOIs, %ju timers armed, %ju virtio kicks (",
+	    (uintmax_t)lapic.eoi, (uintmax_t)lapic.armed,
+	    (uintmax_t)(virtio.kicks[0] + virtio.kicks[1] + virtio.kicks[2] +
+	    virtio.kicks[3]));
+	for (c = 0; c < VIRTIO_NQUEUE; c++)
+		printf("%s%ju", c ? "/" : "", (uintmax_t)virtio.kicks[c]);
+	printf(")\n");
+
+	free(fb);
+	free(csamples);
+	free(samples);
+	free(stream);
+	return (0);
+}
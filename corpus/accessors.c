@@ -0,0 +1,491 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * MMIO accessor idioms of guest kernels and drivers, for corpus_gen.
+ *
+ * The accessors follow the Linux <asm/io.h> and FreeBSD bus_space(9)
+ * implementations for x86: plain volatile loads and stores, string
+ * instructions for the region and set operations and inline assembly
+ * for the bit operations. The callers use them the way drivers do, with
+ * the register base as an argument so that every memory access that does
+ * not go through the stack is a device access. This file is only
+ * compiled, never linked.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define	__iomem		volatile
+
+/* <asm/io.h> */
+static inline uint8_t
+readb(const __iomem void *addr)
+{
+
+	return (*(const __iomem uint8_t *)addr);
+}
+
+static inline uint16_t
+readw(const __iomem void *addr)
+{
+
+	return (*(const __iomem uint16_t *)addr);
+}
+
+static inline uint32_t
+readl(const __iomem void *addr)
+{
+
+	return (*(const __iomem uint32_t *)addr);
+}
+
+static inline uint64_t
+readq(const __iomem void *addr)
+{
+
+	return (*(const __iomem uint64_t *)addr);
+}
+
+static inline void
+writeb(uint8_t val, __iomem void *addr)
+{
+
+	*(__iomem uint8_t *)addr = val;
+}
+
+static inline void
+writew(uint16_t val, __iomem void *addr)
+{
+
+	*(__iomem uint16_t *)addr = val;
+}
+
+static inline void
+writel(uint32_t val, __iomem void *addr)
+{
+
+	*(__iomem uint32_t *)addr = val;
+}
+
+static inline void
+writeq(uint64_t val, __iomem void *addr)
+{
+
+	*(__iomem uint64_t *)addr = val;
+}
+
+/* x86 memcpy_toio()/memset_io(): rep movsl/stosl and the tail bytewise */
+static inline void
+memcpy_toio(__iomem void *dst, const void *src, size_t n)
+{
+	size_t d0, d1, d2;
+
+	__asm __volatile("rep movsl\n\t"
+	    "movl %k4,%%ecx\n\t"
+	    "andl $3,%%ecx\n\t"
+	    "rep movsb"
+	    : "=&c" (d0), "=&D" (d1), "=&S" (d2)
+	    : "0" (n / 4), "g" (n), "1" (dst), "2" (src)
+	    : "memory");
+}
+
+static inline void
+memcpy_fromio(void *dst, const __iomem void *src, size_t n)
+{
+	size_t d0, d1, d2;
+
+	__asm __volatile("rep movsl\n\t"
+	    "movl %k4,%%ecx\n\t"
+	    "andl $3,%%ecx\n\t"
+	    "rep movsb"
+	    : "=&c" (d0), "=&D" (d1), "=&S" (d2)
+	    : "0" (n / 4), "g" (n), "1" (dst), "2" (src)
+	    : "memory");
+}
+
+static inline void
+memset_io(__iomem void *dst, int c, size_t n)
+{
+	size_t d0, d1;
+
+	__asm __volatile("rep stosb"
+	    : "=&c" (d0), "=&D" (d1)
+	    : "a" (c), "0" (n), "1" (dst)
+	    : "memory");
+}
+
+/* <asm/bitops.h> */
+static inline int
+constant_test_bit(long nr, const __iomem unsigned long *addr)
+{
+
+	return ((addr[nr / (8 * sizeof(long))] &
+	    (1UL << (nr & (8 * sizeof(long) - 1)))) != 0);
+}
+
+static inline int
+variable_test_bit(long nr, const __iomem unsigned long *addr)
+{
+	unsigned char c;
+
+	__asm __volatile("bt%z1 %2,%1\n\tsetc %0"
+	    : "=qm" (c)
+	    : "m" (*addr), "Ir" (nr));
+	return (c);
+}
+
+static inline void
+set_bit(long nr, __iomem unsigned long *addr)
+{
+
+	__asm __volatile("lock bts%z0 %1,%0"
+	    : "+m" (*addr) : "Ir" (nr) : "memory");
+}
+
+static inline void
+clear_bit(long nr, __iomem unsigned long *addr)
+{
+
+	__asm __volatile("lock btr%z0 %1,%0"
+	    : "+m" (*addr) : "Ir" (nr) : "memory");
+}
+
+/* bus_space(9) */
+static inline void
+bus_space_write_region_4(__iomem uint32_t *dst, const uint32_t *src,
+    size_t count)
+{
+
+	while (count--)
+		*dst++ = *src++;
+}
+
+static inline void
+bus_space_read_region_4(const __iomem uint32_t *src, uint32_t *dst,
+    size_t count)
+{
+
+	while (count--)
+		*dst++ = *src++;
+}
+
+static inline void
+bus_space_set_region_4(__iomem uint32_t *dst, uint32_t val, size_t count)
+{
+
+	while (count--)
+		*dst++ = val;
+}
+
+/* Driver code */
+uint8_t
+acc_readb(__iomem uint8_t *base)
+{
+
+	return (readb(base + 0x3));
+}
+
+int
+acc_readb_signed(__iomem uint8_t *base)
+{
+
+	return ((int8_t)readb(base + 0x7));
+}
+
+uint16_t
+acc_readw(__iomem uint8_t *base)
+{
+
+	return (readw(base + 0x12));
+}
+
+int
+acc_readw_signed(__iomem uint8_t *base)
+{
+
+	return ((int16_t)readw(base + 0x12));
+}
+
+uint32_t
+acc_readl(__iomem uint8_t *base)
+{
+
+	return (readl(base + 0x10));
+}
+
+uint32_t
+acc_readl_far(__iomem uint8_t *base)
+{
+
+	return (readl(base + 0x2004));
+}
+
+uint32_t
+acc_readl_index(__iomem uint8_t *base, int i)
+{
+
+	return (readl(base + 0x100 + 4 * i));
+}
+
+uint64_t
+acc_readq(__iomem uint8_t *base)
+{
+
+	return (readq(base + 0x18));
+}
+
+uint64_t
+acc_readq_lo_hi(__iomem uint8_t *base)
+{
+	uint32_t lo, hi;
+
+	lo = readl(base + 0x20);
+	hi = readl(base + 0x24);
+	return ((uint64_t)hi << 32 | lo);
+}
+
+void
+acc_writeb(__iomem uint8_t *base, uint8_t val)
+{
+
+	writeb(val, base + 0x3);
+}
+
+void
+acc_writeb_imm(__iomem uint8_t *base)
+{
+
+	writeb(0x80, base + 0x3);
+}
+
+void
+acc_writew(__iomem uint8_t *base, uint16_t val)
+{
+
+	writew(val, base + 0x12);
+}
+
+void
+acc_writel(__iomem uint8_t *base, uint32_t val)
+{
+
+	writel(val, base + 0x10);
+}
+
+void
+acc_writel_imm(__iomem uint8_t *base)
+{
+
+	writel(0xdeadbeef, base + 0x10);
+}
+
+void
+acc_writel_zero(__iomem uint8_t *base)
+{
+
+	writel(0, base + 0x14);
+}
+
+void
+acc_writel_index(__iomem uint8_t *base, int i, uint32_t val)
+{
+
+	writel(val, base + 0x100 + 4 * i);
+}
+
+void
+acc_writeq(__iomem uint8_t *base, uint64_t val)
+{
+
+	writeq(val, base + 0x18);
+}
+
+void
+acc_writeq_lo_hi(__iomem uint8_t *base, uint64_t val)
+{
+
+	writel(val, base + 0x20);
+	writel(val >> 32, base + 0x24);
+}
+
+/* Read-modify-write of a control register */
+void
+acc_setbits(__iomem uint8_t *base, uint32_t mask)
+{
+
+	writel(readl(base + 0x4) | mask, base + 0x4);
+}
+
+void
+acc_clrbits(__iomem uint8_t *base, uint32_t mask)
+{
+
+	writel(readl(base + 0x4) & ~mask, base + 0x4);
+}
+
+void
+acc_setbits_imm(__iomem uint8_t *base)
+{
+
+	writel(readl(base + 0x4) | 0x1, base + 0x4);
+}
+
+void
+acc_clrbits_imm(__iomem uint8_t *base)
+{
+
+	writel(readl(base + 0x4) & ~0x80000000U, base + 0x4);
+}
+
+void
+acc_orb_direct(__iomem uint8_t *base)
+{
+
+	*(__iomem uint8_t *)(base + 0x8) |= 0x40;
+}
+
+void
+acc_andl_direct(__iomem uint8_t *base)
+{
+
+	*(__iomem uint32_t *)(base + 0xc) &= 0xfffffff0;
+}
+
+uint32_t
+acc_consume(__iomem uint8_t *base, uint32_t n)
+{
+
+	return (readl(base + 0x30) - n);
+}
+
+/* Status checks and polling */
+int
+acc_is_gone(__iomem uint8_t *base)
+{
+
+	return (readl(base + 0x0) == 0xffffffff);
+}
+
+int
+acc_cmp_reg(__iomem uint8_t *base, uint32_t val)
+{
+
+	return (readl(base + 0x28) < val);
+}
+
+int
+acc_cmp_reg_rev(__iomem uint8_t *base, uint32_t val)
+{
+
+	return (val < readl(base + 0x28));
+}
+
+int
+acc_poll_ready(__iomem uint8_t *base, int spins)
+{
+
+	while (spins-- > 0)
+		if (readl(base + 0x4) & 0x1)
+			return (1);
+	return (0);
+}
+
+int
+acc_test_bit_const(__iomem unsigned long *bitmap)
+{
+
+	return (constant_test_bit(35, bitmap));
+}
+
+int
+acc_test_bit_var(__iomem unsigned long *bitmap, long nr)
+{
+
+	return (variable_test_bit(nr, bitmap));
+}
+
+int
+acc_test_bit_imm(__iomem unsigned long *bitmap)
+{
+
+	return (variable_test_bit(3, bitmap));
+}
+
+void
+acc_set_bit(__iomem unsigned long *bitmap, long nr)
+{
+
+	set_bit(nr, bitmap);
+}
+
+void
+acc_clear_bit(__iomem unsigned long *bitmap)
+{
+
+	clear_bit(5, bitmap);
+}
+
+/* Buffers */
+void
+acc_memcpy_toio(__iomem uint8_t *base, const void *buf, size_t n)
+{
+
+	memcpy_toio(base + 0x1000, buf, n);
+}
+
+void
+acc_memcpy_fromio(__iomem uint8_t *base, void *buf, size_t n)
+{
+
+	memcpy_fromio(buf, base + 0x1000, n);
+}
+
+void
+acc_memset_io(__iomem uint8_t *base, size_t n)
+{
+
+	memset_io(base + 0x1000, 0, n);
+}
+
+void
+acc_write_region(__iomem uint8_t *base, const uint32_t *buf, size_t n)
+{
+
+	bus_space_write_region_4((__iomem uint32_t *)(base + 0x1000), buf, n);
+}
+
+void
+acc_read_region(__iomem uint8_t *base, uint32_t *buf, size_t n)
+{
+
+	bus_space_read_region_4((__iomem uint32_t *)(base + 0x1000), buf, n);
+}
+
+void
+acc_set_region(__iomem uint8_t *base, size_t n)
+{
+
+	bus_space_set_region_4((__iomem uint32_t *)(base + 0x1000), 0, n);
+}
+
+/* Descriptor ring doorbell: fill a descriptor, then ring */
+struct acc_desc {
+	uint64_t	addr;
+	uint32_t	len;
+	uint16_t	flags;
+	uint16_t	id;
+};
+
+void
+acc_post(__iomem struct acc_desc *ring, __iomem uint8_t *base,
+    uint64_t addr, uint32_t len, unsigned int tail)
+{
+	__iomem struct acc_desc *d;
+
+	d = &ring[tail & 0xff];
+	d->addr = addr;
+	d->len = len;
+	d->flags = 0x1;
+	d->id = tail;
+	writel(tail + 1, base + 0x40);
+}
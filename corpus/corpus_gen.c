@@ -0,0 +1,552 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Test vector corpus from compiled MMIO accessors.
+ *
+ * corpus_gen compiles a C file of device accessors (accessors.c) with each
+ * of the local compilers, at each optimization level and for 32- and
+ * 64-bit x86, disassembles the objects with objdump and keeps the
+ * instructions that touch memory other than the stack. Each distinct
+ * instruction that vmm_decode_instruction() accepts becomes a test vector:
+ * the registers of its memory operand point at an MMIO cell, a RAM cell
+ * backs the other side of a string or stack instruction and the remaining
+ * register operand gets a value. The vectors go through tvec_record() for
+ * their expectations, so the corpus is what the emulator does today, for
+ * regression tests and for benchmarking with instructions compilers really
+ * emit. Memory accesses the decoder rejects are counted per build and,
+ * with -v, listed.
+ *
+ * Nothing but the compilers and objdump is needed; compilers that are not
+ * installed are skipped.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "tvec.h"
+
+#define	CG_DEV_BASE	0xfeb00000UL	/* MMIO cells, per operand */
+#define	CG_DEV_REGION	0x1000UL	/* destination of string instructions */
+#define	CG_RAM_SRC	0x7000UL	/* source of string instructions */
+#define	CG_RAM_STACK	0x8000UL	/* top of the stack */
+#define	CG_REP_COUNT	4
+#define	CG_RIP64	0xffffffff81000000UL	/* text of the object */
+#define	CG_RIP32	0xc1000000UL
+#define	CG_VAL		0x1122334455667788UL	/* MMIO cells */
+#define	CG_RAMVAL	0x0123456789abcdefUL	/* RAM cells */
+#define	CG_REGVAL	0x8877665544332211UL	/* register operand */
+#define	CG_RFLAGS	0x2
+
+#define	CG_CFLAGS	"-fno-pic -ffreestanding -mno-sse -mno-mmx " \
+			"-mno-80387 -mno-red-zone"
+
+/* ModRM and SIB register numbers */
+static const int cg_gpr[16] = {
+	VM_REG_GUEST_RAX, VM_REG_GUEST_RCX, VM_REG_GUEST_RDX,
+	VM_REG_GUEST_RBX, VM_REG_GUEST_RSP, VM_REG_GUEST_RBP,
+	VM_REG_GUEST_RSI, VM_REG_GUEST_RDI, VM_REG_GUEST_R8,
+	VM_REG_GUEST_R9, VM_REG_GUEST_R10, VM_REG_GUEST_R11,
+	VM_REG_GUEST_R12, VM_REG_GUEST_R13, VM_REG_GUEST_R14,
+	VM_REG_GUEST_R15,
+};
+
+/* A distinct instruction and where it was first seen */
+struct cg_inst {
+	uint8_t		inst[VIE_INST_SIZE];
+	uint8_t		len;
+	uint8_t		bits;
+	uint8_t		decoded;
+	uint64_t	addr;
+	int		nbuild;		/* builds that emitted it */
+	int		lastbuild;
+	char		func[48];
+	char		text[80];
+	char		build[48];
+};
+
+static struct cg_inst *insts;
+static size_t ninst, maxinst;
+
+/* Counts of one build */
+struct cg_count {
+	u_int		inst;
+	u_int		mem;		/* non-stack memory accesses */
+	u_int		decoded;	/* of which the emulator decodes */
+};
+
+static int verbose;
+
+static struct cg_inst *
+cg_lookup(const uint8_t *inst, int len, int bits)
+{
+	struct cg_inst *ci;
+	size_t i;
+
+	for (i = 0; i < ninst; i++) {
+		ci = &insts[i];
+		if (ci->len == len && ci->bits == bits &&
+		    memcmp(ci->inst, inst, len) == 0)
+			return (ci);
+	}
+	if (ninst == maxinst) {
+		maxinst = maxinst ? maxinst * 2 : 256;
+		insts = reallocf(insts, maxinst * sizeof(struct cg_inst));
+		if (insts == NULL)
+			err(1, "reallocf");
+	}
+	ci = &insts[ninst++];
+	memset(ci, 0, sizeof(*ci));
+	memcpy(ci->inst, inst, len);
+	ci->len = len;
+	ci->bits = bits;
+	ci->lastbuild = -1;
+	return (ci);
+}
+
+static int
+cg_decode(struct vie *vie, const uint8_t *inst, int len, int bits)
+{
+
+	memset(vie, 0, sizeof(struct vie));
+	vie->base_register = VM_REG_LAST;
+	vie->index_register = VM_REG_LAST;
+	vie->segment_register = VM_REG_LAST;
+	memcpy(vie->inst, inst, len);
+	vie->num_valid = len;
+	if (vmm_decode_instruction(NULL, 0, VIE_INVALID_GLA,
+	    bits == 64 ? CPU_MODE_64BIT : CPU_MODE_PROTECTED, bits == 32,
+	    vie) != 0)
+		return (-1);
+	return (vie->num_processed == len ? 0 : -1);
+}
+
+/*
+ * MOVS and STOS have no ModRM, so no base, index or displacement; that
+ * tells STOS apart from 0F AB, BTS.
+ */
+static int
+cg_is_string(const struct vie *vie)
+{
+
+	return ((vie->op.op_byte == 0xa4 || vie->op.op_byte == 0xa5 ||
+	    vie->op.op_byte == 0xaa || vie->op.op_byte == 0xab) &&
+	    vie->base_register == VM_REG_LAST &&
+	    vie->index_register == VM_REG_LAST && vie->disp_bytes == 0);
+}
+
+/*
+ * Does the disassembly 'text' access memory other than the stack and the
+ * globals? Used for the instructions the decoder rejects.
+ */
+static int
+cg_touches_mem(const char *text)
+{
+	static const char *const skip[] = {
+		"(%rsp", "(%esp", "(%rbp", "(%ebp", "(%rip",
+	};
+	size_t i;
+
+	if (strchr(text, '(') == NULL || strncmp(text, "lea", 3) == 0 ||
+	    strncmp(text, "nop", 3) == 0 || strstr(text, " nop") != NULL)
+		return (0);
+	for (i = 0; i < nitems(skip); i++)
+		if (strstr(text, skip[i]) != NULL)
+			return (0);
+	return (1);
+}
+
+/*
+ * Is a decoded instruction a device access? Operands based on the stack
+ * or frame pointer or on RIP are locals and globals, and so is an absolute
+ * address: it is a relocation in an object file.
+ */
+static int
+cg_is_device(const struct vie *vie)
+{
+
+	if (cg_is_string(vie))
+		return (1);
+	switch (vie->base_register) {
+	case VM_REG_GUEST_RSP:
+	case VM_REG_GUEST_RBP:
+	case VM_REG_GUEST_RIP:
+		return (0);
+	case VM_REG_LAST:
+		return (vie->index_register != VM_REG_LAST);
+	default:
+		return (1);
+	}
+}
+
+/* Add one instruction of the disassembly of 'build' */
+static void
+cg_add(int build, const char *bname, int bits, const char *func,
+    uint64_t addr, const uint8_t *inst, int len, const char *text,
+    struct cg_count *cnt)
+{
+	struct cg_inst *ci;
+	struct vie vie;
+	int decoded;
+
+	cnt->inst++;
+	decoded = cg_decode(&vie, inst, len, bits) == 0;
+	if (decoded ? !cg_is_device(&vie) : !cg_touches_mem(text))
+		return;
+	cnt->mem++;
+	if (decoded)
+		cnt->decoded++;
+
+	ci = cg_lookup(inst, len, bits);
+	if (ci->lastbuild != build) {
+		ci->lastbuild = build;
+		ci->nbuild++;
+	}
+	if (ci->nbuild > 1)
+		return;
+	ci->decoded = decoded;
+	ci->addr = addr;
+	strlcpy(ci->func, func, sizeof(ci->func));
+	strlcpy(ci->text, text, sizeof(ci->text));
+	strlcpy(ci->build, bname, sizeof(ci->build));
+	if (!decoded && verbose)
+		fprintf(stderr, "%s: %s: not decoded: %s\n", bname, func,
+		    text);
+}
+
+/*
+ * Parse 'objdump -d' output: function labels
+ *
+ *	0000000000000040 <acc_readl>:
+ *
+ * and instructions, the bytes and the text separated by tabs
+ *
+ *	  40:	8b 47 10             	mov    0x10(%rdi),%eax
+ */
+static void
+cg_parse(FILE *fp, int build, const char *bname, int bits,
+    struct cg_count *cnt)
+{
+	uint8_t inst[VIE_INST_SIZE];
+	char line[512], func[48], *p, *q, *end;
+	uint64_t addr;
+	int len;
+
+	strlcpy(func, "?", sizeof(func));
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if ((p = strchr(line, '<')) != NULL &&
+		    (q = strstr(p, ">:")) != NULL && q[2] == '\0') {
+			*q = '\0';
+			strlcpy(func, p + 1, sizeof(func));
+			continue;
+		}
+
+		addr = strtoull(line, &end, 16);
+		if (end == line || *end != ':' || end[1] != '\t')
+			continue;
+		p = end + 2;
+		len = 0;
+		while (len < VIE_INST_SIZE &&
+		    (*p != '\t' && *p != '\0')) {
+			while (*p == ' ')
+				p++;
+			if (*p == '\t' || *p == '\0')
+				break;
+			inst[len++] = strtoul(p, &end, 16);
+			if (end != p + 2)
+				break;
+			p = end;
+		}
+		if (*p != '\t' || len == 0)
+			continue;	/* truncated or continuation line */
+		for (p++; *p == ' ' || *p == '\t'; p++)
+			;
+		/* Squeeze the padding after the mnemonic */
+		if ((q = strchr(p, ' ')) != NULL) {
+			for (end = q; *end == ' '; end++)
+				;
+			memmove(q + 1, end, strlen(end) + 1);
+		}
+		cg_add(build, bname, bits, func, addr, inst, len, p, cnt);
+	}
+}
+
+static int
+cg_have(const char *cc)
+{
+	char cmd[256];
+
+	snprintf(cmd, sizeof(cmd), "command -v '%s' >/dev/null 2>&1", cc);
+	return (system(cmd) == 0);
+}
+
+/* Compile 'src', disassemble it and add its instructions */
+static int
+cg_build(int build, const char *cc, const char *opt, int bits,
+    const char *cflags, const char *src, const char *obj)
+{
+	struct cg_count cnt;
+	char cmd[1024], bname[48];
+	FILE *fp;
+
+	snprintf(bname, sizeof(bname), "%s -O%s -m%d", cc, opt, bits);
+	snprintf(cmd, sizeof(cmd), "'%s' -O%s -m%d %s -c -o '%s' '%s'",
+	    cc, opt, bits, cflags, obj, src);
+	if (system(cmd) != 0) {
+		warnx("%s: compile failed, skipped", bname);
+		return (-1);
+	}
+	snprintf(cmd, sizeof(cmd), "objdump -d --insn-width=%d '%s'",
+	    VIE_INST_SIZE, obj);
+	if ((fp = popen(cmd, "r")) == NULL)
+		err(1, "popen");
+	memset(&cnt, 0, sizeof(cnt));
+	cg_parse(fp, build, bname, bits, &cnt);
+	if (pclose(fp) != 0)
+		errx(1, "%s: objdump failed", bname);
+	fprintf(stderr, "%-24s %5u instructions, %4u device accesses, "
+	    "%4u decoded\n", bname, cnt.inst, cnt.mem, cnt.decoded);
+	return (0);
+}
+
+static void
+cg_reg(FILE *out, int reg, uint64_t val, uint64_t mask)
+{
+
+	fprintf(out, "reg %s %#jx\n", tvec_regname(reg),
+	    (uintmax_t)(val & mask));
+}
+
+/* Write a vector without expectations for a decoded instruction */
+static void
+cg_vector(FILE *out, const struct cg_inst *ci)
+{
+	struct vie vie;
+	uint64_t amask, bv, gpa, mask, xv;
+	int i, reg, size;
+
+	if (cg_decode(&vie, ci->inst, ci->len, ci->bits) != 0)
+		return;
+
+	fprintf(out, "# %s: %s\n# %s", ci->func, ci->text, ci->build);
+	if (ci->nbuild > 1)
+		fprintf(out, ", and %d other build%s", ci->nbuild - 1,
+		    ci->nbuild > 2 ? "s" : "");
+	fprintf(out, "\ninst");
+	for (i = 0; i < ci->len; i++)
+		fprintf(out, " %02x", ci->inst[i]);
+	fprintf(out, "\nmode %s\n", ci->bits == 64 ? "64" : "prot");
+
+	mask = ci->bits == 64 ? ~0UL : 0xffffffffUL;
+	amask = vie.addrsize == 8 ? ~0UL : (1UL << (vie.addrsize * 8)) - 1;
+	size = vie.opsize;
+
+	if (cg_is_string(&vie)) {
+		gpa = CG_DEV_BASE + CG_DEV_REGION;
+		fprintf(out, "gpa %#jx\n", (uintmax_t)gpa);
+		cg_reg(out, VM_REG_GUEST_RIP, (ci->bits == 64 ? CG_RIP64 :
+		    CG_RIP32) + ci->addr, mask);
+		cg_reg(out, VM_REG_GUEST_RFLAGS, CG_RFLAGS, mask);
+		cg_reg(out, VM_REG_GUEST_RDI, gpa, amask);
+		if (vie.repz_present || vie.repnz_present)
+			cg_reg(out, VM_REG_GUEST_RCX, CG_REP_COUNT, amask);
+		if (vie.op.op_byte == 0xa4 || vie.op.op_byte == 0xa5) {
+			/* memcpy_toio(): from RAM to the device */
+			cg_reg(out, VM_REG_GUEST_RSI, CG_RAM_SRC, amask);
+			fprintf(out, "ram %#jx 8 %#jx\n",
+			    (uintmax_t)CG_RAM_SRC, (uintmax_t)CG_RAMVAL);
+		} else
+			cg_reg(out, VM_REG_GUEST_RAX, CG_REGVAL, mask);
+		fprintf(out, "mem %#jx 8 0\nend\n\n", (uintmax_t)gpa);
+		return;
+	}
+
+	/*
+	 * Point the operand at an MMIO cell at the displacement's offset in
+	 * the device page: an index register holds 1 and the base register
+	 * the rest of the address.
+	 */
+	gpa = CG_DEV_BASE + ((uint64_t)vie.displacement & 0xfff);
+	bv = xv = 0;
+	if (vie.index_register == VM_REG_LAST) {
+		bv = gpa - vie.displacement;
+	} else if (vie.base_register == vie.index_register) {
+		bv = xv = (gpa - vie.displacement) / (1 + vie.scale);
+	} else if (vie.base_register == VM_REG_LAST) {
+		xv = (gpa - vie.displacement) / vie.scale;
+	} else {
+		xv = 1;
+		bv = gpa - vie.displacement - vie.scale;
+	}
+	gpa = (bv + xv * vie.scale + vie.displacement) & amask;
+
+	fprintf(out, "gpa %#jx\n", (uintmax_t)gpa);
+	cg_reg(out, VM_REG_GUEST_RIP, (ci->bits == 64 ? CG_RIP64 :
+	    CG_RIP32) + ci->addr, mask);
+	cg_reg(out, VM_REG_GUEST_RFLAGS, CG_RFLAGS, mask);
+	if (vie.base_register != VM_REG_LAST)
+		cg_reg(out, vie.base_register, bv, amask);
+	if (vie.index_register != VM_REG_LAST &&
+	    vie.index_register != vie.base_register)
+		cg_reg(out, vie.index_register, xv, amask);
+
+	/* The register operand, unless it also addresses memory */
+	reg = cg_gpr[vie.reg];
+	if (reg != vie.base_register && reg != vie.index_register &&
+	    reg != VM_REG_GUEST_RSP)
+		cg_reg(out, reg, CG_REGVAL, mask);
+
+	/* PUSH and POP r/m have the other side of the move on the stack */
+	if (vie.op.op_byte == 0xff || vie.op.op_byte == 0x8f) {
+		cg_reg(out, VM_REG_GUEST_RSP, vie.op.op_byte == 0xff ?
+		    CG_RAM_STACK : CG_RAM_STACK - size, mask);
+		fprintf(out, "ram %#jx %d %#jx\n",
+		    (uintmax_t)(CG_RAM_STACK - size), size,
+		    (uintmax_t)(vie.op.op_byte == 0xff ? 0 : CG_RAMVAL &
+		    ((size < 8 ? 1UL << size * 8 : 0) - 1)));
+	}
+	fprintf(out, "mem %#jx 8 %#jx\nend\n\n", (uintmax_t)gpa,
+	    (uintmax_t)CG_VAL);
+}
+
+/* Split a comma separated list in place */
+static int
+cg_list(char *s, char **v, int max)
+{
+	int n;
+
+	for (n = 0; n < max && (v[n] = strsep(&s, ",")) != NULL; n++)
+		if (*v[n] == '\0')
+			return (-1);
+	return (s == NULL ? n : -1);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: corpus_gen [-v] [-c cc,...] [-f cflags] "
+	    "[-m bits,...] [-O levels,...]\n"
+	    "                  [-o output.tv] accessors.c\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	char *ccs[8], *levels[8], *bitv[2], ccdef[] = "gcc,clang";
+	char levdef[] = "0,1,2,3", bitdef[] = "32,64";
+	char dir[] = "/tmp/corpus_gen.XXXXXX", obj[64], cmd[256], ver[128];
+	const char *cflags, *output;
+	struct cg_inst *ci;
+	FILE *out, *tmp, *fp;
+	size_t i, nvec;
+	int b, bits, build, ch, error, j, k, nbits, ncc, nlevel, nok;
+	char *cclist, *levlist, *bitlist;
+
+	cclist = ccdef;
+	levlist = levdef;
+	bitlist = bitdef;
+	cflags = CG_CFLAGS;
+	output = NULL;
+	while ((ch = getopt(argc, argv, "c:f:m:O:o:v")) != -1) {
+		switch (ch) {
+		case 'c':
+			cclist = optarg;
+			break;
+		case 'f':
+			cflags = optarg;
+			break;
+		case 'm':
+			bitlist = optarg;
+			break;
+		case 'O':
+			levlist = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	if ((ncc = cg_list(cclist, ccs, nitems(ccs))) < 0 ||
+	    (nlevel = cg_list(levlist, levels, nitems(levels))) < 0 ||
+	    (nbits = cg_list(bitlist, bitv, nitems(bitv))) < 0)
+		usage();
+	for (b = 0; b < nbits; b++)
+		if (strcmp(bitv[b], "32") != 0 && strcmp(bitv[b], "64") != 0)
+			usage();
+
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	snprintf(obj, sizeof(obj), "%s/accessors.o", dir);
+	if ((tmp = tmpfile()) == NULL)
+		err(1, "tmpfile");
+
+	nok = build = 0;
+	for (j = 0; j < ncc; j++) {
+		if (!cg_have(ccs[j])) {
+			warnx("%s: not found, skipped", ccs[j]);
+			continue;
+		}
+		/* Which compiler made the corpus */
+		snprintf(cmd, sizeof(cmd), "'%s' --version", ccs[j]);
+		if ((fp = popen(cmd, "r")) != NULL) {
+			if (fgets(ver, sizeof(ver), fp) != NULL)
+				fprintf(tmp, "# %s: %s", ccs[j], ver);
+			pclose(fp);
+		}
+		for (k = 0; k < nlevel; k++) {
+			for (b = 0; b < nbits; b++) {
+				bits = atoi(bitv[b]);
+				if (cg_build(build++, ccs[j], levels[k], bits,
+				    cflags, argv[optind], obj) == 0)
+					nok++;
+			}
+		}
+	}
+	unlink(obj);
+	rmdir(dir);
+	if (nok == 0)
+		errx(1, "nothing compiled");
+
+	fprintf(tmp, "# %s built with %s\n\n", argv[optind], cflags);
+	nvec = 0;
+	for (i = 0; i < ninst; i++) {
+		ci = &insts[i];
+		if (!ci->decoded)
+			continue;
+		cg_vector(tmp, ci);
+		nvec++;
+	}
+	fprintf(stderr, "%zu distinct device accesses, %zu decoded\n", ninst,
+	    nvec);
+
+	/* Record what the emulator makes of them */
+	if (output == NULL)
+		out = stdout;
+	else if ((out = fopen(output, "w")) == NULL)
+		err(1, "%s", output);
+	rewind(tmp);
+	error = tvec_record(tmp, "corpus", out, 0);
+	if (error == 0 && fflush(out) != 0)
+		error = errno;
+	if (out != stdout)
+		fclose(out);
+	fclose(tmp);
+	free(insts);
+	return (error != 0);
+}
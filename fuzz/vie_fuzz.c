@@ -0,0 +1,1066 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Differential fuzzer for the instruction emulator.
+ *
+ * Random encodings of the instructions that the emulator supports with a
+ * memory operand are executed natively on the host against a data page and,
+ * from the same initial state, decoded and emulated with that page as MMIO.
+ * MOVS, PUSH and POP move data between MMIO and guest memory as well; their
+ * other operand is in a second page that the emulator reaches through
+ * vm_copy_setup() as RAM. The general purpose registers, the defined status
+ * flags and both pages must end up the same.
+ *
+ * For native execution the instruction is copied into a code page followed
+ * by a jump back into fuzz_native(), which loads the guest registers and
+ * flags from a 'struct fuzz_ctx', jumps to the code page and stores them
+ * back. The guest %rsp is live while the instruction runs, so faults are
+ * taken on an alternate signal stack and unwound with siglongjmp().
+ *
+ * Encodings the emulator rejects are counted per instruction. Differences
+ * are minimized and written out as test vectors that expect the native
+ * results, ready to be added to vectors/.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/mman.h>
+
+#include <err.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <x86/psl.h>
+
+#include "vmm_stubs.h"
+#include "tvec.h"
+
+#define	FUZZ_PAGE		4096
+#define	FUZZ_DATA_ADDR		0x10000000UL	/* preferred data page */
+#define	FUZZ_RAM_ADDR		0x10100000UL	/* preferred RAM page */
+#define	FUZZ_MAXINST		15
+#define	FUZZ_STATUS		\
+	(PSL_C | PSL_PF | PSL_AF | PSL_Z | PSL_N | PSL_V)
+
+/* fuzz_op.imm */
+#define	FUZZ_IMM_NONE		0	/* the default */
+#define	FUZZ_IMM_8		1
+#define	FUZZ_IMM_Z		2	/* 16 bits with 0x66, else 32 */
+
+/* fuzz_op.form, how the memory operands are addressed */
+#define	FUZZ_MODRM		0	/* ModRM operand, the default */
+#define	FUZZ_MOFFS		1	/* absolute address after the opcode */
+#define	FUZZ_MOVS		2	/* (%rsi) to (%rdi), one of them MMIO */
+#define	FUZZ_STOS		3	/* to (%rdi) */
+#define	FUZZ_PUSH		4	/* ModRM operand to (%rsp) in RAM */
+#define	FUZZ_POP		5	/* (%rsp) in RAM to the ModRM operand */
+
+/* fuzz_check() results */
+#define	FUZZ_SAME		0
+#define	FUZZ_DIFF		1
+#define	FUZZ_LENGTH		2	/* decoded length differs */
+#define	FUZZ_UNSUPPORTED	3	/* the emulator rejected it */
+#define	FUZZ_FAULT		4	/* the native instruction faulted */
+
+struct fuzz_op {
+	const char	*name;
+	uint8_t		opcode[2];
+	uint8_t		oplen;
+	int8_t		digit;		/* ModRM.reg opcode extension or -1 */
+	uint8_t		imm;		/* FUZZ_IMM_xyz */
+	uint32_t	undef;		/* status flags left undefined */
+	uint8_t		form;		/* FUZZ_MODRM, ... */
+};
+
+static const struct fuzz_op fuzz_ops[] = {
+	{
+		.name = "or r,r/m",
+		.opcode = { 0x0b },
+		.oplen = 1,
+		.digit = -1,
+		.undef = PSL_AF,
+	},
+	{
+		.name = "and r,r/m",
+		.opcode = { 0x23 },
+		.oplen = 1,
+		.digit = -1,
+		.undef = PSL_AF,
+	},
+	{
+		.name = "sub r,r/m",
+		.opcode = { 0x2b },
+		.oplen = 1,
+		.digit = -1,
+	},
+	{
+		.name = "cmp r/m,r",
+		.opcode = { 0x39 },
+		.oplen = 1,
+		.digit = -1,
+	},
+	{
+		.name = "cmp r,r/m",
+		.opcode = { 0x3b },
+		.oplen = 1,
+		.digit = -1,
+	},
+	{
+		.name = "mov r/m8,r8",
+		.opcode = { 0x88 },
+		.oplen = 1,
+		.digit = -1,
+	},
+	{
+		.name = "mov r/m,r",
+		.opcode = { 0x89 },
+		.oplen = 1,
+		.digit = -1,
+	},
+	{
+		.name = "mov r8,r/m8",
+		.opcode = { 0x8a },
+		.oplen = 1,
+		.digit = -1,
+	},
+	{
+		.name = "mov r,r/m",
+		.opcode = { 0x8b },
+		.oplen = 1,
+		.digit = -1,
+	},
+	{
+		.name = "mov r/m8,imm8",
+		.opcode = { 0xc6 },
+		.oplen = 1,
+		.digit = 0,
+		.imm = FUZZ_IMM_8,
+	},
+	{
+		.name = "mov r/m,imm",
+		.opcode = { 0xc7 },
+		.oplen = 1,
+		.digit = 0,
+		.imm = FUZZ_IMM_Z,
+	},
+	{
+		.name = "or r/m8,imm8",
+		.opcode = { 0x80 },
+		.oplen = 1,
+		.digit = 1,
+		.imm = FUZZ_IMM_8,
+		.undef = PSL_AF,
+	},
+	{
+		.name = "and r/m8,imm8",
+		.opcode = { 0x80 },
+		.oplen = 1,
+		.digit = 4,
+		.imm = FUZZ_IMM_8,
+		.undef = PSL_AF,
+	},
+	{
+		.name = "cmp r/m8,imm8",
+		.opcode = { 0x80 },
+		.oplen = 1,
+		.digit = 7,
+		.imm = FUZZ_IMM_8,
+	},
+	{
+		.name = "or r/m,imm",
+		.opcode = { 0x81 },
+		.oplen = 1,
+		.digit = 1,
+		.imm = FUZZ_IMM_Z,
+		.undef = PSL_AF,
+	},
+	{
+		.name = "and r/m,imm",
+		.opcode = { 0x81 },
+		.oplen = 1,
+		.digit = 4,
+		.imm = FUZZ_IMM_Z,
+		.undef = PSL_AF,
+	},
+	{
+		.name = "cmp r/m,imm",
+		.opcode = { 0x81 },
+		.oplen = 1,
+		.digit = 7,
+		.imm = FUZZ_IMM_Z,
+	},
+	{
+		.name = "or r/m,imm8",
+		.opcode = { 0x83 },
+		.oplen = 1,
+		.digit = 1,
+		.imm = FUZZ_IMM_8,
+		.undef = PSL_AF,
+	},
+	{
+		.name = "and r/m,imm8",
+		.opcode = { 0x83 },
+		.oplen = 1,
+		.digit = 4,
+		.imm = FUZZ_IMM_8,
+		.undef = PSL_AF,
+	},
+	{
+		.name = "cmp r/m,imm8",
+		.opcode = { 0x83 },
+		.oplen = 1,
+		.digit = 7,
+		.imm = FUZZ_IMM_8,
+	},
+	{
+		.name = "movzx r,r/m8",
+		.opcode = { 0x0f, 0xb6 },
+		.oplen = 2,
+		.digit = -1,
+	},
+	{
+		.name = "movzx r,r/m16",
+		.opcode = { 0x0f, 0xb7 },
+		.oplen = 2,
+		.digit = -1,
+	},
+	{
+		.name = "movsx r,r/m8",
+		.opcode = { 0x0f, 0xbe },
+		.oplen = 2,
+		.digit = -1,
+	},
+	{
+		.name = "bt r/m,imm8",
+		.opcode = { 0x0f, 0xba },
+		.oplen = 2,
+		.digit = 4,
+		.imm = FUZZ_IMM_8,
+		.undef = PSL_PF | PSL_AF | PSL_N | PSL_V,
+	},
+	{
+		.name = "bts r/m,imm8",
+		.opcode = { 0x0f, 0xba },
+		.oplen = 2,
+		.digit = 5,
+		.imm = FUZZ_IMM_8,
+		.undef = PSL_PF | PSL_AF | PSL_N | PSL_V,
+	},
+	{
+		.name = "btr r/m,imm8",
+		.opcode = { 0x0f, 0xba },
+		.oplen = 2,
+		.digit = 6,
+		.imm = FUZZ_IMM_8,
+		.undef = PSL_PF | PSL_AF | PSL_N | PSL_V,
+	},
+	{
+		.name = "mov rax,moffs",
+		.opcode = { 0xa1 },
+		.oplen = 1,
+		.digit = -1,
+		.form = FUZZ_MOFFS,
+	},
+	{
+		.name = "mov moffs,rax",
+		.opcode = { 0xa3 },
+		.oplen = 1,
+		.digit = -1,
+		.form = FUZZ_MOFFS,
+	},
+	{
+		.name = "movsb",
+		.opcode = { 0xa4 },
+		.oplen = 1,
+		.digit = -1,
+		.form = FUZZ_MOVS,
+	},
+	{
+		.name = "movs",
+		.opcode = { 0xa5 },
+		.oplen = 1,
+		.digit = -1,
+		.form = FUZZ_MOVS,
+	},
+	{
+		.name = "stosb",
+		.opcode = { 0xaa },
+		.oplen = 1,
+		.digit = -1,
+		.form = FUZZ_STOS,
+	},
+	{
+		.name = "stos",
+		.opcode = { 0xab },
+		.oplen = 1,
+		.digit = -1,
+		.form = FUZZ_STOS,
+	},
+	{
+		.name = "push r/m",
+		.opcode = { 0xff },
+		.oplen = 1,
+		.digit = 6,
+		.form = FUZZ_PUSH,
+	},
+	{
+		.name = "pop r/m",
+		.opcode = { 0x8f },
+		.oplen = 1,
+		.digit = 0,
+		.form = FUZZ_POP,
+	},
+};
+
+/* Registers in instruction encoding order */
+static const int fuzz_gpr[16] = {
+	VM_REG_GUEST_RAX, VM_REG_GUEST_RCX, VM_REG_GUEST_RDX, VM_REG_GUEST_RBX,
+	VM_REG_GUEST_RSP, VM_REG_GUEST_RBP, VM_REG_GUEST_RSI, VM_REG_GUEST_RDI,
+	VM_REG_GUEST_R8, VM_REG_GUEST_R9, VM_REG_GUEST_R10, VM_REG_GUEST_R11,
+	VM_REG_GUEST_R12, VM_REG_GUEST_R13, VM_REG_GUEST_R14, VM_REG_GUEST_R15,
+};
+
+/* Guest state as seen by fuzz_native(), the offsets are used below */
+struct fuzz_ctx {
+	uint64_t	gpr[16];	/* 0: in encoding order */
+	uint64_t	rflags;		/* 128 */
+};
+
+struct fuzz_case {
+	const struct fuzz_op *op;
+	uint8_t		inst[FUZZ_MAXINST];
+	int		len;
+	int		base;		/* register or -1 */
+	int		index;		/* register or -1 */
+	int		scale;
+	int64_t		disp;
+	int		solved;		/* register computed to reach 'ea' */
+	uint32_t	fixed;		/* other registers holding addresses */
+	uint64_t	off;		/* page offset of the MMIO operand */
+	uint64_t	ea;
+	uint64_t	mem;		/* initial 8 bytes at 'ea' */
+	int		nmem;		/* 2 if there is a second operand */
+	int		ram2;		/* it is in the RAM page */
+	uint64_t	off2;		/* page offset of the second operand */
+	uint64_t	ea2;
+	uint64_t	mem2;		/* initial 8 bytes at 'ea2' */
+	struct fuzz_ctx	in;
+};
+
+struct fuzz_out {
+	struct fuzz_ctx	ctx;
+	uint64_t	mem;		/* final 8 bytes at 'ea' */
+	uint64_t	mem2;		/* and at 'ea2' */
+};
+
+/* Used by fuzz_native() */
+void		fuzz_native(struct fuzz_ctx *ctx);
+extern char	fuzz_native_return[];
+uint64_t	fuzz_host_rsp;
+uint64_t	fuzz_scratch;
+struct fuzz_ctx	*fuzz_ctxp;
+void		*fuzz_code;
+
+__asm(
+"	.text\n"
+"	.globl	fuzz_native\n"
+"	.type	fuzz_native,@function\n"
+"fuzz_native:\n"
+"	pushq	%rbx\n"
+"	pushq	%rbp\n"
+"	pushq	%r12\n"
+"	pushq	%r13\n"
+"	pushq	%r14\n"
+"	pushq	%r15\n"
+"	movq	%rsp, fuzz_host_rsp(%rip)\n"
+"	movq	%rdi, fuzz_ctxp(%rip)\n"
+"	pushq	128(%rdi)\n"
+"	popfq\n"
+"	movq	0(%rdi), %rax\n"
+"	movq	8(%rdi), %rcx\n"
+"	movq	16(%rdi), %rdx\n"
+"	movq	24(%rdi), %rbx\n"
+"	movq	32(%rdi), %rsp\n"
+"	movq	40(%rdi), %rbp\n"
+"	movq	48(%rdi), %rsi\n"
+"	movq	64(%rdi), %r8\n"
+"	movq	72(%rdi), %r9\n"
+"	movq	80(%rdi), %r10\n"
+"	movq	88(%rdi), %r11\n"
+"	movq	96(%rdi), %r12\n"
+"	movq	104(%rdi), %r13\n"
+"	movq	112(%rdi), %r14\n"
+"	movq	120(%rdi), %r15\n"
+"	movq	56(%rdi), %rdi\n"
+"	jmp	*fuzz_code(%rip)\n"
+"	.globl	fuzz_native_return\n"
+"fuzz_native_return:\n"
+"	movq	%rdi, fuzz_scratch(%rip)\n"
+"	movq	fuzz_ctxp(%rip), %rdi\n"
+"	movq	%rax, 0(%rdi)\n"
+"	movq	%rcx, 8(%rdi)\n"
+"	movq	%rdx, 16(%rdi)\n"
+"	movq	%rbx, 24(%rdi)\n"
+"	movq	%rsp, 32(%rdi)\n"
+"	movq	%rbp, 40(%rdi)\n"
+"	movq	%rsi, 48(%rdi)\n"
+"	movq	%r8, 64(%rdi)\n"
+"	movq	%r9, 72(%rdi)\n"
+"	movq	%r10, 80(%rdi)\n"
+"	movq	%r11, 88(%rdi)\n"
+"	movq	%r12, 96(%rdi)\n"
+"	movq	%r13, 104(%rdi)\n"
+"	movq	%r14, 112(%rdi)\n"
+"	movq	%r15, 120(%rdi)\n"
+"	movq	fuzz_host_rsp(%rip), %rsp\n"
+"	pushfq\n"
+"	popq	128(%rdi)\n"
+"	cld\n"
+"	movq	fuzz_scratch(%rip), %rax\n"
+"	movq	%rax, 56(%rdi)\n"
+"	popq	%r15\n"
+"	popq	%r14\n"
+"	popq	%r13\n"
+"	popq	%r12\n"
+"	popq	%rbp\n"
+"	popq	%rbx\n"
+"	ret\n"
+"	.size	fuzz_native, . - fuzz_native\n"
+);
+
+static uint8_t	*fuzz_data;		/* native data page */
+static uint8_t	*fuzz_ram;		/* native RAM page */
+static uint8_t	fuzz_shadow[FUZZ_PAGE] __aligned(64);	/* emulated */
+static uint8_t	fuzz_ram_shadow[FUZZ_PAGE] __aligned(64);
+static uint8_t	fuzz_ref[FUZZ_PAGE] __aligned(64);	/* initial */
+
+static sigjmp_buf fuzz_jb;
+static volatile sig_atomic_t fuzz_in_native;
+
+static uint64_t
+fuzz_random(uint64_t *state)
+{
+	uint64_t x;
+
+	/* xorshift64*, as in tvec_generate() */
+	x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return (x * 0x2545f4914f6cdd1dUL);
+}
+
+static uint64_t
+nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void
+fuzz_fault(int sig, siginfo_t *si, void *uc)
+{
+
+	if (!fuzz_in_native) {
+		/* A fault in the fuzzer or the emulator itself */
+		signal(sig, SIG_DFL);
+		return;
+	}
+	siglongjmp(fuzz_jb, sig);
+}
+
+static void
+fuzz_init(void)
+{
+	static const int sigs[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGTRAP };
+	struct sigaction sa;
+	stack_t ss;
+	int i;
+
+	fuzz_data = mmap((void *)FUZZ_DATA_ADDR, FUZZ_PAGE,
+	    PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	fuzz_ram = mmap((void *)FUZZ_RAM_ADDR, FUZZ_PAGE,
+	    PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	fuzz_code = mmap(NULL, FUZZ_PAGE, PROT_READ | PROT_WRITE | PROT_EXEC,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (fuzz_data == MAP_FAILED || fuzz_ram == MAP_FAILED ||
+	    fuzz_code == MAP_FAILED)
+		err(1, "mmap");
+
+	ss.ss_sp = malloc(SIGSTKSZ * 4);
+	ss.ss_size = SIGSTKSZ * 4;
+	ss.ss_flags = 0;
+	if (ss.ss_sp == NULL || sigaltstack(&ss, NULL) != 0)
+		err(1, "sigaltstack");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = fuzz_fault;
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	for (i = 0; i < (int)nitems(sigs); i++) {
+		if (sigaction(sigs[i], &sa, NULL) != 0)
+			err(1, "sigaction");
+	}
+}
+
+/*
+ * Choose the value of 'solved' that makes the operand address 'off'. The
+ * forms without a ModRM operand have nothing to solve for.
+ */
+static void
+fuzz_solve(struct fuzz_case *fc, uint64_t off)
+{
+	uint64_t k, other, r, t;
+
+	if (fc->base < 0 && fc->index < 0) {
+		fc->solved = -1;
+		fc->off = off;
+		fc->ea = (uint64_t)fuzz_data + off;
+		return;
+	}
+
+	other = 0;
+	if (fc->base >= 0) {
+		fc->solved = fc->base;
+		k = 1;
+		if (fc->index == fc->base)
+			k += fc->scale;
+		else if (fc->index >= 0)
+			other = fc->in.gpr[fc->index] * fc->scale;
+	} else {
+		fc->solved = fc->index;
+		k = fc->scale;
+	}
+
+	t = (uint64_t)fuzz_data + off - fc->disp - other;
+	r = t % k;
+	fc->in.gpr[fc->solved] = (t - r) / k;
+	fc->off = off - r;
+	fc->ea = (uint64_t)fuzz_data + fc->off;
+}
+
+/* A random page offset that leaves room for fuzz_solve() to move it down */
+static uint64_t
+fuzz_offset(uint64_t *state)
+{
+	uint64_t off, rnd;
+
+	rnd = fuzz_random(state);
+	off = 16 + rnd % (FUZZ_PAGE - 32);
+	if (rnd & (1UL << 63))
+		off &= ~7UL;
+	return (off);
+}
+
+/*
+ * Point the implicit operands of the moffs, string and stack forms at the
+ * pages: append the address of a moffs form, place the second operand of
+ * MOVS, PUSH and POP and load %rsi, %rdi or %rsp, the latter for a stack
+ * operand of 'size' bytes. A repeated string instruction runs at most once,
+ * the emulator restarts the others.
+ */
+static void
+fuzz_implicit(struct fuzz_case *fc, uint64_t *state, int rep, int size)
+{
+	uint64_t rnd;
+
+	rnd = fuzz_random(state);
+	fc->nmem = 1;
+	fc->ram2 = 0;
+	fc->mem2 = fuzz_random(state);
+	switch (fc->op->form) {
+	case FUZZ_MOFFS:
+		memcpy(fc->inst + fc->len, &fc->ea, 8);
+		fc->len += 8;
+		return;
+	case FUZZ_MOVS:
+		/* RAM to MMIO, MMIO to RAM or MMIO to MMIO */
+		fc->nmem = 2;
+		fc->ram2 = rnd % 3 != 2;
+		do {
+			fc->off2 = fuzz_offset(state);
+		} while (!fc->ram2 && fc->off2 + 8 > fc->off &&
+		    fc->off + 8 > fc->off2);
+		fc->ea2 = (uint64_t)(fc->ram2 ? fuzz_ram : fuzz_data) +
+		    fc->off2;
+		fc->in.gpr[6] = rnd % 3 == 0 ? fc->ea2 : fc->ea;
+		fc->in.gpr[7] = rnd % 3 == 0 ? fc->ea : fc->ea2;
+		fc->fixed = 1 << 6 | 1 << 7;
+		break;
+	case FUZZ_STOS:
+		fc->in.gpr[7] = fc->ea;
+		fc->fixed = 1 << 7;
+		break;
+	case FUZZ_PUSH:
+	case FUZZ_POP:
+		fc->nmem = 2;
+		fc->ram2 = 1;
+		fc->off2 = fuzz_offset(state);
+		fc->ea2 = (uint64_t)fuzz_ram + fc->off2;
+		fc->in.gpr[4] = fc->ea2 +
+		    (fc->op->form == FUZZ_PUSH ? size : 0);
+		fc->fixed = 1 << 4;
+		return;
+	}
+
+	if (rep) {
+		fc->in.gpr[1] = (rnd >> 8) & 1;
+		fc->fixed |= 1 << 1;
+	}
+	if (rnd & (1UL << 16))
+		fc->in.rflags |= PSL_D;
+}
+
+/*
+ * Generate a random instance of a random instruction with a memory operand.
+ * Returns -1 for encodings without a register to solve for (RIP-relative or
+ * absolute) and for stack operands addressed through %rsp, the caller just
+ * tries again.
+ */
+static int
+fuzz_generate(struct fuzz_case *fc, uint64_t *state)
+{
+	const struct fuzz_op *op;
+	uint64_t rnd;
+	uint8_t *p, rex;
+	int i, mod, reg, rm, ss, idx, b, imm, o16, rep;
+
+	rnd = fuzz_random(state);
+	op = &fuzz_ops[rnd % nitems(fuzz_ops)];
+	rnd = fuzz_random(state);
+
+	fc->op = op;
+	p = fc->inst;
+	o16 = rnd & 1;
+	if (o16)
+		*p++ = 0x66;
+	rep = 0;
+	if ((op->form == FUZZ_MOVS || op->form == FUZZ_STOS) &&
+	    ((rnd >> 60) & 3) != 0) {
+		/* The emulator takes repnz for rep, as the cpu does */
+		rep = 1;
+		*p++ = ((rnd >> 60) & 3) == 1 ? 0xf2 : 0xf3;
+	}
+	rex = 0;
+	if (rnd & 2) {
+		rex = 0x40 | ((rnd >> 2) & 0xf);
+		*p++ = rex;
+	}
+	memcpy(p, op->opcode, op->oplen);
+	p += op->oplen;
+
+	fc->base = fc->index = -1;
+	fc->scale = 1;
+	fc->disp = 0;
+	if (op->form == FUZZ_MODRM || op->form == FUZZ_PUSH ||
+	    op->form == FUZZ_POP) {
+		mod = (rnd >> 6) % 3;
+		reg = op->digit >= 0 ? op->digit : (rnd >> 8) & 7;
+		rm = (rnd >> 11) & 7;
+		*p++ = mod << 6 | reg << 3 | rm;
+
+		if (rm == 4) {
+			ss = (rnd >> 14) & 3;
+			idx = (rnd >> 16) & 7;
+			b = (rnd >> 19) & 7;
+			*p++ = ss << 6 | idx << 3 | b;
+			idx |= (rex & 0x2) << 2;
+			if (idx != 4)
+				fc->index = idx;
+			fc->scale = 1 << ss;
+			if (b == 5 && mod == 0) {
+				fc->disp = (int32_t)(rnd >> 22);
+				memcpy(p, &fc->disp, 4);
+				p += 4;
+			} else
+				fc->base = b | (rex & 0x1) << 3;
+		} else if (rm == 5 && mod == 0) {
+			return (-1);
+		} else
+			fc->base = rm | (rex & 0x1) << 3;
+		if (fc->base < 0 && fc->index < 0)
+			return (-1);
+		if (op->form != FUZZ_MODRM &&
+		    (fc->base == 4 || fc->index == 4))
+			return (-1);
+
+		rnd = fuzz_random(state);
+		if (mod == 1) {
+			fc->disp = (int8_t)rnd;
+			*p++ = rnd;
+		} else if (mod == 2) {
+			fc->disp = (int32_t)rnd;
+			memcpy(p, &fc->disp, 4);
+			p += 4;
+		}
+	}
+
+	rnd = fuzz_random(state);
+	imm = 0;
+	if (op->imm == FUZZ_IMM_8)
+		imm = 1;
+	else if (op->imm == FUZZ_IMM_Z)
+		imm = o16 && (rex & 0x8) == 0 ? 2 : 4;	/* REX.W wins */
+	memcpy(p, &rnd, imm);
+	p += imm;
+	fc->len = p - fc->inst;
+
+	/* Half the registers small, to reach the interesting flag cases */
+	for (i = 0; i < 16; i++) {
+		rnd = fuzz_random(state);
+		fc->in.gpr[i] = (rnd & 1) ? rnd : (rnd >> 1) & 0xff;
+	}
+	rnd = fuzz_random(state);
+	fc->in.rflags = PSL_RESERVED_DEFAULT | (rnd & FUZZ_STATUS);
+	fc->mem = fuzz_random(state);
+
+	fc->fixed = 0;
+	fuzz_solve(fc, fuzz_offset(state));
+	if (op->form != FUZZ_MODRM)
+		fuzz_implicit(fc, state, rep,
+		    o16 && (rex & 0x8) == 0 ? 2 : 8);
+	else
+		fc->nmem = 1;
+	return (0);
+}
+
+static int
+fuzz_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+
+	if (gpa - (uint64_t)fuzz_data > FUZZ_PAGE - rsize)
+		return (EFAULT);
+	*rval = 0;
+	memcpy(rval, &fuzz_shadow[gpa - (uint64_t)fuzz_data], rsize);
+	return (0);
+}
+
+static int
+fuzz_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+
+	if (gpa - (uint64_t)fuzz_data > FUZZ_PAGE - wsize)
+		return (EFAULT);
+	memcpy(&fuzz_shadow[gpa - (uint64_t)fuzz_data], &wval, wsize);
+	return (0);
+}
+
+static int
+fuzz_run_native(const struct fuzz_case *fc, struct fuzz_out *out)
+{
+	uint8_t *p;
+	uint64_t ret;
+	int sig;
+
+	/* The instruction followed by 'jmp *0(%rip)' to fuzz_native_return */
+	p = fuzz_code;
+	memcpy(p, fc->inst, fc->len);
+	p += fc->len;
+	memcpy(p, "\xff\x25\x00\x00\x00\x00", 6);
+	ret = (uint64_t)fuzz_native_return;
+	memcpy(p + 6, &ret, 8);
+
+	memcpy(&fuzz_data[fc->off], &fc->mem, 8);
+	if (fc->nmem == 2)
+		memcpy(&(fc->ram2 ? fuzz_ram : fuzz_data)[fc->off2], &fc->mem2,
+		    8);
+	out->ctx = fc->in;
+
+	fuzz_in_native = 1;
+	sig = sigsetjmp(fuzz_jb, 0);
+	if (sig == 0)
+		fuzz_native(&out->ctx);
+	fuzz_in_native = 0;
+
+	memcpy(&out->mem, &fuzz_data[fc->off], 8);
+	if (fc->nmem == 2)
+		memcpy(&out->mem2, &(fc->ram2 ? fuzz_ram : fuzz_data)[fc->off2],
+		    8);
+	return (sig);
+}
+
+static int
+fuzz_emulate(const struct fuzz_case *fc, struct fuzz_out *out)
+{
+	struct vm_guest_paging paging;
+	struct vm_stub_vcpu *vc;
+	struct vie vie;
+	int i;
+
+	vc = vm_stub_vcpu(NULL, 0);
+	vm_stub_reset(vc);
+	for (i = 0; i < 16; i++)
+		vc->regs[fuzz_gpr[i]] = fc->in.gpr[i];
+	vc->regs[VM_REG_GUEST_RFLAGS] = fc->in.rflags;
+	vm_stub_map(vc, (uint64_t)fuzz_ram, FUZZ_PAGE, fuzz_ram_shadow);
+
+	memset(&vie, 0, sizeof(struct vie));
+	vie.base_register = VM_REG_LAST;
+	vie.index_register = VM_REG_LAST;
+	vie.segment_register = VM_REG_LAST;
+	memcpy(vie.inst, fc->inst, fc->len);
+	vie.num_valid = fc->len;
+
+	memset(&paging, 0, sizeof(paging));
+	paging.cpu_mode = CPU_MODE_64BIT;
+	paging.paging_mode = PAGING_MODE_64;
+
+	/* Passing the linear address makes the decoder verify it too */
+	memcpy(&fuzz_shadow[fc->off], &fc->mem, 8);
+	if (fc->nmem == 2)
+		memcpy(&(fc->ram2 ? fuzz_ram_shadow : fuzz_shadow)[fc->off2],
+		    &fc->mem2, 8);
+	if (vmm_decode_instruction(NULL, 0, fc->ea, CPU_MODE_64BIT, 0, &vie))
+		return (FUZZ_UNSUPPORTED);
+	if (vie.num_processed != fc->len)
+		return (FUZZ_LENGTH);
+	if (vmm_emulate_instruction(NULL, 0, fc->ea, &vie, &paging,
+	    fuzz_mread, fuzz_mwrite, NULL) != 0)
+		return (FUZZ_UNSUPPORTED);
+
+	for (i = 0; i < 16; i++)
+		out->ctx.gpr[i] = vc->regs[fuzz_gpr[i]];
+	out->ctx.rflags = vc->regs[VM_REG_GUEST_RFLAGS];
+	memcpy(&out->mem, &fuzz_shadow[fc->off], 8);
+	if (fc->nmem == 2)
+		memcpy(&out->mem2,
+		    &(fc->ram2 ? fuzz_ram_shadow : fuzz_shadow)[fc->off2], 8);
+	return (FUZZ_SAME);
+}
+
+/* Run 'fc' both ways and compare */
+static int
+fuzz_check(const struct fuzz_case *fc, struct fuzz_out *nat,
+    struct fuzz_out *emu)
+{
+	uint64_t defined;
+	int i, result;
+
+	if (fuzz_run_native(fc, nat) != 0)
+		result = FUZZ_FAULT;
+	else
+		result = fuzz_emulate(fc, emu);
+
+	if (result == FUZZ_SAME) {
+		defined = FUZZ_STATUS & ~fc->op->undef;
+		for (i = 0; i < 16; i++) {
+			if (nat->ctx.gpr[i] != emu->ctx.gpr[i])
+				result = FUZZ_DIFF;
+		}
+		if (((nat->ctx.rflags ^ emu->ctx.rflags) & defined) != 0 ||
+		    memcmp(fuzz_data, fuzz_shadow, FUZZ_PAGE) != 0 ||
+		    memcmp(fuzz_ram, fuzz_ram_shadow, FUZZ_PAGE) != 0)
+			result = FUZZ_DIFF;
+	}
+
+	/* Only the operands change unless something went wrong */
+	if (result == FUZZ_SAME) {
+		memcpy(&fuzz_data[fc->off], &fuzz_ref[fc->off], 8);
+		memcpy(&fuzz_shadow[fc->off], &fuzz_ref[fc->off], 8);
+		if (fc->nmem == 2) {
+			memcpy(&(fc->ram2 ? fuzz_ram : fuzz_data)[fc->off2],
+			    &fuzz_ref[fc->off2], 8);
+			memcpy(&(fc->ram2 ? fuzz_ram_shadow :
+			    fuzz_shadow)[fc->off2], &fuzz_ref[fc->off2], 8);
+		}
+	} else {
+		memcpy(fuzz_data, fuzz_ref, FUZZ_PAGE);
+		memcpy(fuzz_shadow, fuzz_ref, FUZZ_PAGE);
+		memcpy(fuzz_ram, fuzz_ref, FUZZ_PAGE);
+		memcpy(fuzz_ram_shadow, fuzz_ref, FUZZ_PAGE);
+	}
+	return (result);
+}
+
+/* Clear as much of the initial state as possible while 'fc' still differs */
+static void
+fuzz_minimize(struct fuzz_case *fc)
+{
+	struct fuzz_out nat, emu;
+	struct fuzz_case save;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		if (i == fc->solved || (fc->fixed & (1 << i)) != 0 ||
+		    fc->in.gpr[i] == 0)
+			continue;
+		save = *fc;
+		fc->in.gpr[i] = 0;
+		fuzz_solve(fc, save.off);
+		if (fuzz_check(fc, &nat, &emu) != FUZZ_DIFF)
+			*fc = save;
+	}
+
+	save = *fc;
+	fc->in.rflags = PSL_RESERVED_DEFAULT;
+	if (fuzz_check(fc, &nat, &emu) != FUZZ_DIFF)
+		*fc = save;
+
+	save = *fc;
+	fc->mem = 0;
+	if (fuzz_check(fc, &nat, &emu) != FUZZ_DIFF)
+		*fc = save;
+
+	save = *fc;
+	fc->mem2 = 0;
+	if (fc->nmem == 2 && fuzz_check(fc, &nat, &emu) != FUZZ_DIFF)
+		*fc = save;
+}
+
+/* Write 'fc' as a test vector expecting the native outcome */
+static void
+fuzz_write(FILE *fp, const struct fuzz_case *fc, const struct fuzz_out *nat,
+    const struct fuzz_out *emu, uint64_t seed, uint64_t n)
+{
+	uint64_t defined, rflags;
+	int i;
+
+	fprintf(fp, "# %s, case %ju of seed %ju\ninst", fc->op->name,
+	    (uintmax_t)n, (uintmax_t)seed);
+	for (i = 0; i < fc->len; i++)
+		fprintf(fp, " %02x", fc->inst[i]);
+	fprintf(fp, "\nmode 64\ngpa %#jx\n", (uintmax_t)fc->ea);
+
+	for (i = 0; i < 16; i++) {
+		if (fc->in.gpr[i] != 0)
+			fprintf(fp, "reg %s %#jx\n", tvec_regname(fuzz_gpr[i]),
+			    (uintmax_t)fc->in.gpr[i]);
+	}
+	fprintf(fp, "reg rflags %#jx\n", (uintmax_t)fc->in.rflags);
+	fprintf(fp, "mem %#jx 8 %#jx\n", (uintmax_t)fc->ea,
+	    (uintmax_t)fc->mem);
+	if (fc->nmem == 2)
+		fprintf(fp, "%s %#jx 8 %#jx\n", fc->ram2 ? "ram" : "mem",
+		    (uintmax_t)fc->ea2, (uintmax_t)fc->mem2);
+
+	for (i = 0; i < 16; i++) {
+		if (fc->in.gpr[i] != 0 || nat->ctx.gpr[i] != 0)
+			fprintf(fp, "expect reg %s %#jx\n",
+			    tvec_regname(fuzz_gpr[i]),
+			    (uintmax_t)nat->ctx.gpr[i]);
+	}
+
+	/* Undefined flags are whatever the emulator produced */
+	defined = FUZZ_STATUS & ~fc->op->undef;
+	rflags = fc->in.rflags & ~defined;
+	if (emu != NULL)
+		rflags = emu->ctx.rflags & ~defined;
+	rflags |= nat->ctx.rflags & defined;
+	fprintf(fp, "expect reg rflags %#jx\n", (uintmax_t)rflags);
+	fprintf(fp, "expect mem %#jx 8 %#jx\n", (uintmax_t)fc->ea,
+	    (uintmax_t)nat->mem);
+	if (fc->nmem == 2)
+		fprintf(fp, "expect mem %#jx 8 %#jx\n", (uintmax_t)fc->ea2,
+		    (uintmax_t)nat->mem2);
+	fprintf(fp, "end\n\n");
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: vie_fuzz [-m max] [-n count] [-o output.tv] "
+	    "[-S seed]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct fuzz_case fc;
+	struct fuzz_out nat, emu;
+	uint64_t count[5], unsupported[nitems(fuzz_ops)];
+	uint64_t i, n, seed, state, elapsed, max, written, v;
+	FILE *out;
+	int ch, j, result;
+
+	n = 1000000;
+	max = 100;
+	seed = 1;
+	out = stdout;
+	while ((ch = getopt(argc, argv, "m:n:o:S:")) != -1) {
+		switch (ch) {
+		case 'm':
+			max = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			n = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			if ((out = fopen(optarg, "w")) == NULL)
+				err(1, "%s", optarg);
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	fuzz_init();
+	state = seed ? seed : 1;
+	for (j = 0; j < FUZZ_PAGE / 8; j++) {
+		v = fuzz_random(&state);
+		memcpy(&fuzz_ref[j * 8], &v, 8);
+	}
+	memcpy(fuzz_data, fuzz_ref, FUZZ_PAGE);
+	memcpy(fuzz_shadow, fuzz_ref, FUZZ_PAGE);
+	memcpy(fuzz_ram, fuzz_ref, FUZZ_PAGE);
+	memcpy(fuzz_ram_shadow, fuzz_ref, FUZZ_PAGE);
+
+	memset(count, 0, sizeof(count));
+	memset(unsupported, 0, sizeof(unsupported));
+	written = 0;
+	elapsed = nsec();
+	for (i = 0; i < n; i++) {
+		while (fuzz_generate(&fc, &state) != 0)
+			;
+		result = fuzz_check(&fc, &nat, &emu);
+		count[result]++;
+		if (result == FUZZ_UNSUPPORTED)
+			unsupported[fc.op - fuzz_ops]++;
+		if ((result != FUZZ_DIFF && result != FUZZ_LENGTH) ||
+		    written == max)
+			continue;
+
+		if (result == FUZZ_DIFF) {
+			fuzz_minimize(&fc);
+			fuzz_check(&fc, &nat, &emu);
+			fuzz_write(out, &fc, &nat, &emu, seed, i);
+		} else {
+			/* The emulator never ran, expect the native outcome */
+			fprintf(out, "# decoded length differs\n");
+			fuzz_write(out, &fc, &nat, NULL, seed, i);
+		}
+		written++;
+	}
+	elapsed = nsec() - elapsed;
+	fflush(out);
+
+	fprintf(stderr, "%ju cases, %ju same, %ju differ, %ju length, "
+	    "%ju unsupported, %ju native faults\n", (uintmax_t)n,
+	    (uintmax_t)count[FUZZ_SAME], (uintmax_t)count[FUZZ_DIFF],
+	    (uintmax_t)count[FUZZ_LENGTH], (uintmax_t)count[FUZZ_UNSUPPORTED],
+	    (uintmax_t)count[FUZZ_FAULT]);
+	fprintf(stderr, "%.3f s, %.0f comparisons/s\n", elapsed / 1e9,
+	    n * 1e9 / elapsed);
+	for (j = 0; j < (int)nitems(fuzz_ops); j++) {
+		if (unsupported[j] != 0)
+			fprintf(stderr, "  unsupported: %-16s %ju\n",
+			    fuzz_ops[j].name, (uintmax_t)unsupported[j]);
+	}
+	return (count[FUZZ_DIFF] + count[FUZZ_LENGTH] != 0);
+}
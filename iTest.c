@@ -1,43 +1,744 @@
-//iTest for Automation of Tests
-// Just a prototype
-#include<stdio.h>
-#include<string.h>
-#include<assert.h>
-#define l printf("passed")
-#define m printf("failed")
-int statussummary(int r)
+/*
+ * iTest: parallel test vector runner for the bhyve instruction emulator
+ *
+ * The vectors of all corpora are split into one contiguous shard per worker
+ * thread. A worker takes chunks from the front of its own shard and, once
+ * that is exhausted, steals the back half of the largest remaining shard.
+ * Worker 'i' emulates as vCPU 'i', so every worker has its own register
+ * file in 'vm_stub_default' and memory cells in 'tvec_cpu[i]'.
+ *
+ * Failures are recorded and reported once all workers are done; failing
+ * vectors are re-run serially to describe the mismatch. The time taken by
+ * every vector is recorded too and summarized at the end.
+ *
+ * With -d the run is a soak instead: every worker goes round the vectors,
+ * from the start of its own shard, and the exits of any recordings given
+ * (see vmm_exitrec.h) until the duration is up. Every interval the main
+ * thread samples the throughput, the latency of one operation in
+ * ITEST_SOAK_SAMPLE and the peak RSS. The median of a few intervals after
+ * warm-up is the baseline; the soak fails if a sample drifts from it by
+ * more than its bound for ITEST_SOAK_STRIKES intervals in a row, or at
+ * the first failing vector or exit.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <machine/atomic.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "vmm_exitrec.h"
+#include "tvec.h"
+
+#define	ITEST_CHUNK	64	/* vectors taken from a shard at a time */
+#define	ITEST_SLOWEST	5	/* slowest vectors reported */
+#define	ITEST_FAILURES	20	/* failures described unless -v */
+
+#define	ITEST_SOAK_SAMPLE	64	/* operations per one timed */
+#define	ITEST_SOAK_WARMUP	1	/* intervals before the baseline */
+#define	ITEST_SOAK_BASE		3	/* intervals the baseline is made of */
+#define	ITEST_SOAK_STRIKES	3	/* intervals out of bounds to fail */
+
+/* Soak metrics and their default bounds */
+#define	SOAK_TPUT	0	/* throughput drop, % */
+#define	SOAK_P99	1	/* p99 latency rise, % */
+#define	SOAK_RSS	2	/* peak RSS growth, MB */
+#define	SOAK_NMETRIC	3
+
+/* Latency histogram: 2^ITEST_HSHIFT buckets per power of 2 cycles */
+#define	ITEST_HSHIFT	3
+#define	ITEST_NBUCKET	((64 - ITEST_HSHIFT + 1) << ITEST_HSHIFT)
+
+/* A shard is the range [lo, hi) of vector indices, packed as hi:lo */
+#define	SHARD(lo, hi)	((uint64_t)(hi) << 32 | (uint32_t)(lo))
+#define	SHARD_LO(s)	((uint32_t)(s))
+#define	SHARD_HI(s)	((uint32_t)((s) >> 32))
+
+struct worker {
+	volatile uint64_t shard;
+	pthread_t	td;
+	int		vcpu;
+	int		repeat;
+	uint64_t	ran;
+	uint64_t	failed;
+	uint64_t	steals;
+	uint64_t	mismatched;		/* exits that did not replay */
+	uint64_t	hist[ITEST_NBUCKET];	/* soak latency samples */
+} __aligned(CACHE_LINE_SIZE);
+
+static const struct tvec **vec;		/* all vectors of all corpora */
+static uint32_t	nvec;
+static uint8_t	*failed;		/* per vector */
+static uint32_t	*cycles;		/* per vector, last run */
+
+static struct worker *workers;
+static int	nworkers;
+static volatile int start_flag;
+static volatile int stop_flag;
+
+static struct tvec_corpus *corpora;
+static char	**names;
+static int	ncorpora;
+
+static struct vie_replay *replays;	/* recordings, soak only */
+static int	nreplay;
+
+static const char *const soak_names[SOAK_NMETRIC] = {
+	"tput", "p99", "rss"
+};
+
+static __inline uint64_t
+rdtsc(void)
 {
-	if(r==1)
-		return 1;
-	else 
-		return 0;
+	uint32_t lo, hi;
+
+	__asm __volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32 | lo);
 }
-void ROFL()
+
+static uint64_t
+nsec(void)
 {
-	printf("Hello world! I work with gitHub!");
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
 }
 
-int main()
+static double
+tsc_ghz(void)
 {
+	struct timespec ts = { 0, 50000000 };
+	uint64_t c0, t0;
 
-	int check;
-	printf("hello world");
-	statussummary(check);
-	printf("Hello world! I work with gitHub!");
+	c0 = rdtsc();
+	t0 = nsec();
+	nanosleep(&ts, NULL);
+	return ((double)(rdtsc() - c0) / (nsec() - t0));
+}
 
-	
-	ROFL();
+/* Take a chunk from the front of our own shard */
+static int
+take(struct worker *w, uint32_t *lo, uint32_t *hi)
+{
+	uint64_t s;
+	uint32_t l, h, n;
 
+	do {
+		s = atomic_load_acq_64(&w->shard);
+		l = SHARD_LO(s);
+		h = SHARD_HI(s);
+		if (l >= h)
+			return (0);
+		n = MIN(h - l, ITEST_CHUNK);
+	} while (!atomic_cmpset_64(&w->shard, s, SHARD(l + n, h)));
 
-	printf("TheEnd!");
-	printf("Goodbye!");
-    return 0;
+	*lo = l;
+	*hi = l + n;
+	return (1);
 }
 
-int jon()
+/* Move the back half of the largest other shard into our own */
+static int
+steal(struct worker *w)
 {
-	printf("Hello! ROFL");
-	return 0;
+	struct worker *victim;
+	uint64_t s;
+	uint32_t l, h, mid, left, best;
+	int i;
+
+	for (;;) {
+		victim = NULL;
+		best = 0;
+		for (i = 0; i < nworkers; i++) {
+			if (&workers[i] == w)
+				continue;
+			s = atomic_load_acq_64(&workers[i].shard);
+			left = SHARD_HI(s) - SHARD_LO(s);
+			if (SHARD_LO(s) < SHARD_HI(s) && left > best) {
+				best = left;
+				victim = &workers[i];
+			}
+		}
+		if (victim == NULL)
+			return (0);
+
+		s = atomic_load_acq_64(&victim->shard);
+		l = SHARD_LO(s);
+		h = SHARD_HI(s);
+		if (l >= h)
+			continue;
+		mid = l + (h - l) / 2;
+		if (atomic_cmpset_64(&victim->shard, s, SHARD(l, mid))) {
+			/* Our own shard is empty, nobody else writes it now */
+			atomic_store_rel_64(&w->shard, SHARD(mid, h));
+			w->steals++;
+			return (1);
+		}
+	}
 }
 
+static void *
+worker_thread(void *arg)
+{
+	struct worker *w;
+	uint64_t t0;
+	uint32_t i, lo, hi;
+	int n;
 
+	w = arg;
+	while (!start_flag)
+		__asm __volatile("pause");
+
+	for (;;) {
+		while (take(w, &lo, &hi)) {
+			for (i = lo; i < hi; i++) {
+				t0 = rdtsc();
+				for (n = 0; n < w->repeat; n++) {
+					if (__predict_false(tvec_run(w->vcpu,
+					    vec[i]) != 0)) {
+						failed[i] = 1;
+						w->failed++;
+						break;
+					}
+				}
+				cycles[i] = (rdtsc() - t0) / w->repeat;
+				w->ran += w->repeat;
+			}
+		}
+		if (!steal(w))
+			break;
+	}
+	return (NULL);
+}
+
+static __inline int
+hist_bucket(uint64_t v)
+{
+	int e;
+
+	if (v < 1 << ITEST_HSHIFT)
+		return (v);
+	e = flsll(v) - 1;
+	return ((e - ITEST_HSHIFT + 1) << ITEST_HSHIFT |
+	    (v >> (e - ITEST_HSHIFT) & ((1 << ITEST_HSHIFT) - 1)));
+}
+
+/* The lowest value in bucket 'b' */
+static uint64_t
+hist_value(int b)
+{
+	int e;
+
+	if (b < 1 << ITEST_HSHIFT)
+		return (b);
+	e = (b >> ITEST_HSHIFT) + ITEST_HSHIFT - 1;
+	return ((uint64_t)(1 << ITEST_HSHIFT | (b & ((1 << ITEST_HSHIFT) - 1)))
+	    << (e - ITEST_HSHIFT));
+}
+
+static uint64_t
+hist_pct(const uint64_t *hist, double pct)
+{
+	uint64_t n, sum;
+	int b;
+
+	for (n = 0, b = 0; b < ITEST_NBUCKET; b++)
+		n += hist[b];
+	for (sum = 0, b = 0; b < ITEST_NBUCKET - 1; b++) {
+		sum += hist[b];
+		if (sum >= n * pct)
+			break;
+	}
+	return (n != 0 ? hist_value(b) : 0);
+}
+
+/*
+ * Soak worker: a chunk of vectors, then a chunk of exits of each recording,
+ * round and round until told to stop. The vCPU is reset before the exits
+ * so that a vector's RAM does not hide a recorded MMIO address.
+ */
+static void *
+soak_thread(void *arg)
+{
+	struct vie_replay_cursor *c;
+	const struct vie_rec_exit *ex;
+	struct worker *w;
+	uint64_t n, t0;
+	uint32_t i;
+	int b, k, r, sample, vcpuid;
+
+	w = arg;
+	c = NULL;
+	if (nreplay > 0 && (c = calloc(nreplay, sizeof(*c))) == NULL)
+		err(1, "calloc");
+	for (k = 0; k < nreplay; k++)
+		vie_replay_rewind(&replays[k], &c[k], -1);
+	i = SHARD_LO(w->shard);
+	while (!start_flag)
+		__asm __volatile("pause");
+
+	t0 = 0;
+	for (n = 0; !stop_flag;) {
+		for (b = 0; b < ITEST_CHUNK && nvec > 0; b++, n++) {
+			if ((sample = (n & (ITEST_SOAK_SAMPLE - 1)) == 0))
+				t0 = rdtsc();
+			r = tvec_run(w->vcpu, vec[i]);
+			if (sample)
+				w->hist[hist_bucket(rdtsc() - t0)]++;
+			if (__predict_false(r != 0)) {
+				failed[i] = 1;
+				atomic_store_rel_64(&w->failed, w->failed + 1);
+			}
+			if (++i == nvec)
+				i = 0;
+		}
+		if (nreplay > 0)
+			vm_stub_reset(vm_stub_vcpu(NULL, w->vcpu));
+		for (k = 0; k < nreplay; k++) {
+			for (b = 0; b < ITEST_CHUNK; b++, n++) {
+				ex = vie_replay_next(&replays[k], &c[k],
+				    &vcpuid);
+				if (ex == NULL) {
+					/* Checked to have exits by main() */
+					vie_replay_rewind(&replays[k], &c[k],
+					    -1);
+					ex = vie_replay_next(&replays[k],
+					    &c[k], &vcpuid);
+				}
+				if ((sample = (n & (ITEST_SOAK_SAMPLE - 1)) ==
+				    0))
+					t0 = rdtsc();
+				r = vie_replay_exit(NULL, w->vcpu, ex);
+				if (sample)
+					w->hist[hist_bucket(rdtsc() - t0)]++;
+				if (__predict_false(r != 0))
+					atomic_store_rel_64(&w->mismatched,
+					    w->mismatched + 1);
+			}
+		}
+		atomic_store_rel_64(&w->ran, n);
+	}
+	free(c);
+	return (NULL);
+}
+
+static const char *
+vec_name(const struct tvec *tv)
+{
+	const char *p;
+	int i;
+
+	p = (const char *)tv;
+	for (i = 0; i < ncorpora; i++) {
+		if (p >= (const char *)corpora[i].hdr &&
+		    p < (const char *)corpora[i].hdr + corpora[i].len)
+			return (names[i]);
+	}
+	return ("?");
+}
+
+static int
+cmp_cycles(const void *a, const void *b)
+{
+	uint32_t x, y;
+
+	x = cycles[*(const uint32_t *)a];
+	y = cycles[*(const uint32_t *)b];
+	return (x < y ? -1 : x > y);
+}
+
+static void
+report_timing(double ghz)
+{
+	uint32_t *order, i;
+	const struct tvec *tv;
+	int j;
+
+	order = malloc(nvec * sizeof(uint32_t));
+	if (order == NULL)
+		err(1, "malloc");
+	for (i = 0; i < nvec; i++)
+		order[i] = i;
+	qsort(order, nvec, sizeof(uint32_t), cmp_cycles);
+
+	printf("per vector: p50 %.0f ns, p99 %.0f ns, p99.9 %.0f ns, "
+	    "max %.0f ns\n", cycles[order[nvec / 2]] / ghz,
+	    cycles[order[(uint64_t)nvec * 99 / 100]] / ghz,
+	    cycles[order[(uint64_t)nvec * 999 / 1000]] / ghz,
+	    cycles[order[nvec - 1]] / ghz);
+
+	printf("slowest:\n");
+	for (i = nvec; i > 0 && nvec - i < ITEST_SLOWEST; i--) {
+		tv = vec[order[i - 1]];
+		printf("  %8.0f ns  %s:%u  inst", cycles[order[i - 1]] / ghz,
+		    vec_name(tv), tv->line);
+		for (j = 0; j < tv->inst_len; j++)
+			printf(" %02x", tv->inst[j]);
+		printf("\n");
+	}
+	free(order);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x, y;
+
+	x = *(const double *)a;
+	y = *(const double *)b;
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * Sample the workers every 'interval' ns until 'duration' is up, a sample
+ * stays out of 'bounds' or an operation fails. Returns 1 on a drift.
+ */
+static int
+soak(uint64_t duration, uint64_t interval, const double *bounds, double ghz)
+{
+	static uint64_t cur[ITEST_NBUCKET], prev[ITEST_NBUCKET];
+	static uint64_t delta[ITEST_NBUCKET];
+	double base[SOAK_NMETRIC], drift[SOAK_NMETRIC], val[SOAK_NMETRIC];
+	double win[SOAK_NMETRIC][ITEST_SOAK_BASE], worst[SOAK_NMETRIC];
+	struct timespec ts;
+	struct rusage ru;
+	uint64_t fails, next, now, ops, t0, tlast, olast;
+	int b, k, m, nbase, drifted, strikes[SOAK_NMETRIC];
+	char mark[32];
+
+	memset(strikes, 0, sizeof(strikes));
+	memset(worst, 0, sizeof(worst));
+	drifted = nbase = 0;
+	olast = 0;
+	printf("%8s %12s %9s %9s %9s %9s %8s\n", "time", "ops", "Mops/s",
+	    "p50 ns", "p99 ns", "p99.9 ns", "rss MB");
+	t0 = tlast = nsec();
+	start_flag = 1;
+	for (k = 1;; k++) {
+		next = t0 + MIN(k * interval, duration);
+		while ((now = nsec()) < next) {
+			ts.tv_sec = (next - now) / 1000000000;
+			ts.tv_nsec = (next - now) % 1000000000;
+			nanosleep(&ts, NULL);
+		}
+
+		ops = fails = 0;
+		memset(cur, 0, sizeof(cur));
+		for (m = 0; m < nworkers; m++) {
+			ops += atomic_load_acq_64(&workers[m].ran);
+			fails += atomic_load_acq_64(&workers[m].failed) +
+			    atomic_load_acq_64(&workers[m].mismatched);
+			for (b = 0; b < ITEST_NBUCKET; b++)
+				cur[b] += workers[m].hist[b];
+		}
+		for (b = 0; b < ITEST_NBUCKET; b++) {
+			delta[b] = cur[b] - prev[b];
+			prev[b] = cur[b];
+		}
+		getrusage(RUSAGE_SELF, &ru);
+		val[SOAK_TPUT] = (ops - olast) * 1e3 / (now - tlast);
+		val[SOAK_P99] = hist_pct(delta, .99) / ghz;
+		val[SOAK_RSS] = ru.ru_maxrss / 1024.0;	/* KB to MB */
+		olast = ops;
+		tlast = now;
+
+		/* The median of the samples after warm-up is the baseline */
+		mark[0] = '\0';
+		if (k > ITEST_SOAK_WARMUP && nbase < ITEST_SOAK_BASE) {
+			for (m = 0; m < SOAK_NMETRIC; m++)
+				win[m][nbase] = val[m];
+			if (++nbase == ITEST_SOAK_BASE) {
+				for (m = 0; m < SOAK_NMETRIC; m++) {
+					qsort(win[m], nbase, sizeof(double),
+					    cmp_double);
+					base[m] = win[m][nbase / 2];
+				}
+			}
+			strcpy(mark, "  baseline");
+		} else if (nbase == ITEST_SOAK_BASE) {
+			drift[SOAK_TPUT] = 100 * (base[SOAK_TPUT] -
+			    val[SOAK_TPUT]) / base[SOAK_TPUT];
+			drift[SOAK_P99] = 100 * (val[SOAK_P99] -
+			    base[SOAK_P99]) / base[SOAK_P99];
+			drift[SOAK_RSS] = val[SOAK_RSS] - base[SOAK_RSS];
+			for (m = 0; m < SOAK_NMETRIC; m++) {
+				worst[m] = MAX(worst[m], drift[m]);
+				if (drift[m] <= bounds[m]) {
+					strikes[m] = 0;
+					continue;
+				}
+				snprintf(mark + strlen(mark), sizeof(mark) -
+				    strlen(mark), "  %s!", soak_names[m]);
+				if (++strikes[m] == ITEST_SOAK_STRIKES)
+					drifted = 1;
+			}
+		}
+		printf("%7.1fs %12ju %9.2f %9.0f %9.0f %9.0f %8.1f%s\n",
+		    (now - t0) / 1e9, (uintmax_t)ops, val[SOAK_TPUT],
+		    hist_pct(delta, .5) / ghz, val[SOAK_P99],
+		    hist_pct(delta, .999) / ghz, val[SOAK_RSS], mark);
+		fflush(stdout);
+
+		if (drifted || fails != 0 || now - t0 >= duration)
+			break;
+	}
+	stop_flag = 1;
+
+	if (fails != 0)
+		printf("soak stopped at the first failure\n");
+	if (nbase < ITEST_SOAK_BASE) {
+		if (fails == 0)
+			printf("soak too short for a baseline, drift not "
+			    "checked\n");
+		return (0);
+	}
+	printf("baseline %.2f Mops/s, p99 %.0f ns, rss %.1f MB; worst drift "
+	    "tput -%.1f%%, p99 +%.1f%%, rss +%.1f MB\n", base[SOAK_TPUT],
+	    base[SOAK_P99], base[SOAK_RSS], worst[SOAK_TPUT], worst[SOAK_P99],
+	    worst[SOAK_RSS]);
+	for (m = 0; m < SOAK_NMETRIC; m++)
+		if (strikes[m] >= ITEST_SOAK_STRIKES)
+			printf("%s drifted beyond %g%s for %d intervals\n",
+			    soak_names[m], bounds[m], m == SOAK_RSS ? " MB" :
+			    "%", ITEST_SOAK_STRIKES);
+	return (drifted);
+}
+
+/* Seconds, or minutes or hours with an 'm' or 'h' suffix, in ns */
+static uint64_t
+parse_time(const char *s)
+{
+	char *end;
+	double v;
+
+	v = strtod(s, &end);
+	if (*end == 'm')
+		v *= 60;
+	else if (*end == 'h')
+		v *= 3600;
+	else if (*end != '\0' && *end != 's')
+		return (0);
+	if (*end != '\0' && end[1] != '\0')
+		return (0);
+	return (v > 0 ? v * 1e9 : 0);
+}
+
+/* 'metric=bound,...' */
+static int
+parse_bounds(char *s, double *bounds)
+{
+	char *p, *v;
+	int m;
+
+	while ((p = strsep(&s, ",")) != NULL) {
+		if ((v = strchr(p, '=')) == NULL)
+			return (-1);
+		*v++ = '\0';
+		for (m = 0; m < SOAK_NMETRIC; m++)
+			if (strcmp(p, soak_names[m]) == 0)
+				break;
+		if (m == SOAK_NMETRIC || (bounds[m] = atof(v)) <= 0)
+			return (-1);
+	}
+	return (0);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: itest [-qtv] [-j workers] [-n repeat] "
+	    "corpus ...\n"
+	    "       itest -d duration [-qv] [-b metric=bound,...] "
+	    "[-i interval] [-j workers]\n"
+	    "             corpus | recording ...\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct vie_replay_cursor c;
+	const struct tvec *tv;
+	uint64_t ran, nfailed, nmismatched, steals, elapsed, duration, interval;
+	uint64_t nexit;
+	uint32_t i, j, per, nvfailed;
+	double bounds[SOAK_NMETRIC], ghz;
+	int ch, drifted, error, k, quiet, repeat, timing, verbose, reported;
+	int vcpuid;
+
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	quiet = timing = verbose = 0;
+	repeat = 1;
+	duration = 0;
+	interval = 10000000000UL;
+	bounds[SOAK_TPUT] = 20;
+	bounds[SOAK_P99] = 50;
+	bounds[SOAK_RSS] = 64;
+	while ((ch = getopt(argc, argv, "b:d:i:j:n:qtv")) != -1) {
+		switch (ch) {
+		case 'b':
+			if (parse_bounds(optarg, bounds) != 0)
+				usage();
+			break;
+		case 'd':
+			if ((duration = parse_time(optarg)) == 0)
+				usage();
+			break;
+		case 'i':
+			if ((interval = parse_time(optarg)) == 0)
+				usage();
+			break;
+		case 'j':
+			nworkers = atoi(optarg);
+			break;
+		case 'n':
+			repeat = atoi(optarg);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 't':
+			timing = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0 || repeat < 1 || nworkers < 1)
+		usage();
+	if (nworkers > TVEC_MAXCPU)
+		nworkers = TVEC_MAXCPU;
+
+	/* Load the corpora and recordings and index the vectors */
+	names = calloc(argc, sizeof(char *));
+	corpora = calloc(argc, sizeof(struct tvec_corpus));
+	replays = calloc(argc, sizeof(struct vie_replay));
+	if (names == NULL || corpora == NULL || replays == NULL)
+		err(1, "calloc");
+	nvec = 0;
+	nexit = 0;
+	for (k = 0; k < argc; k++) {
+		error = vie_replay_open(&replays[nreplay], argv[k]);
+		if (error == 0) {
+			if (duration == 0)
+				errx(1, "%s: recordings are replayed with -d "
+				    "only", argv[k]);
+			vie_replay_rewind(&replays[nreplay], &c, -1);
+			for (j = 0; vie_replay_next(&replays[nreplay], &c,
+			    &vcpuid) != NULL; j++)
+				continue;
+			if (c.left != 0)
+				errx(1, "%s: malformed recording", argv[k]);
+			if (j == 0)
+				errx(1, "%s: no exits", argv[k]);
+			nexit += j;
+			nreplay++;
+			continue;
+		}
+		if (error != EFTYPE)
+			errc(1, error, "%s", argv[k]);
+		names[ncorpora] = argv[k];
+		if ((error = tvec_load(argv[k], &corpora[ncorpora])) != 0)
+			errc(1, error, "%s", argv[k]);
+		if (nvec + corpora[ncorpora].hdr->count > UINT32_MAX)
+			errx(1, "too many vectors");
+		nvec += corpora[ncorpora++].hdr->count;
+	}
+	if (nvec == 0 && nreplay == 0)
+		errx(1, "no vectors");
+
+	vec = malloc(MAX(nvec, 1) * sizeof(struct tvec *));
+	failed = calloc(MAX(nvec, 1), sizeof(uint8_t));
+	cycles = calloc(MAX(nvec, 1), sizeof(uint32_t));
+	workers = calloc(nworkers, sizeof(struct worker));
+	if (vec == NULL || failed == NULL || cycles == NULL || workers == NULL)
+		err(1, "malloc");
+	for (i = 0, k = 0; k < ncorpora; k++) {
+		tv = tvec_first(&corpora[k]);
+		for (j = 0; j < corpora[k].hdr->count; j++, tv = tvec_next(tv))
+			vec[i++] = tv;
+	}
+
+	/* One contiguous shard per worker */
+	per = nvec / nworkers;
+	for (k = 0; k < nworkers; k++) {
+		workers[k].vcpu = k;
+		workers[k].repeat = repeat;
+		workers[k].shard = SHARD(k * per,
+		    k == nworkers - 1 ? nvec : (k + 1) * per);
+		if (pthread_create(&workers[k].td, NULL, duration != 0 ?
+		    soak_thread : worker_thread, &workers[k]) != 0)
+			errx(1, "pthread_create");
+	}
+
+	drifted = 0;
+	elapsed = nsec();
+	if (duration != 0) {
+		printf("soak: %u vectors and %ju exits of %d recordings on %d "
+		    "workers, bounds tput %g%%, p99 %g%%, rss %g MB\n", nvec,
+		    (uintmax_t)nexit, nreplay, nworkers, bounds[SOAK_TPUT],
+		    bounds[SOAK_P99], bounds[SOAK_RSS]);
+		drifted = soak(duration, interval, bounds, tsc_ghz());
+	} else
+		start_flag = 1;
+	ran = nfailed = nmismatched = steals = 0;
+	for (k = 0; k < nworkers; k++) {
+		pthread_join(workers[k].td, NULL);
+		ran += workers[k].ran;
+		nfailed += workers[k].failed;
+		nmismatched += workers[k].mismatched;
+		steals += workers[k].steals;
+	}
+	elapsed = nsec() - elapsed;
+	for (i = 0, nvfailed = 0; i < nvec; i++)
+		nvfailed += failed[i];
+
+	/* Describe the failures, re-running each one on vCPU 0 */
+	reported = 0;
+	for (i = 0; i < nvec && !quiet; i++) {
+		if (!failed[i])
+			continue;
+		if (!verbose && reported++ == ITEST_FAILURES) {
+			fprintf(stderr, "...\n");
+			break;
+		}
+		tvec_run(0, vec[i]);
+		tvec_report(stderr, vec_name(vec[i]), 0, vec[i]);
+	}
+
+	printf("%u vectors, %u passed, %u failed, %d workers, %ju steals\n",
+	    nvec, nvec - nvfailed, nvfailed, nworkers, (uintmax_t)steals);
+	if (nreplay > 0)
+		printf("%ju exits did not replay as recorded\n",
+		    (uintmax_t)nmismatched);
+	printf("%ju runs in %.3f s, %.0f vectors/s\n", (uintmax_t)ran,
+	    elapsed / 1e9, ran * 1e9 / elapsed);
+
+	if (timing && duration == 0) {
+		ghz = tsc_ghz();
+		report_timing(ghz);
+	}
+
+	for (k = 0; k < ncorpora; k++)
+		tvec_free(&corpora[k]);
+	for (k = 0; k < nreplay; k++)
+		vie_replay_close(&replays[k]);
+	return (nfailed != 0 || nmismatched != 0 || drifted ? 1 : 0);
+}
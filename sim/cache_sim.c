@@ -0,0 +1,547 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Trace-driven cache simulator.
+ *
+ * Reads an exit recording (see vmm_exitrec.h), merging the vCPUs in TSC
+ * order, and runs every exit through simulated caches of each size given:
+ *
+ *	decode	decoded instructions by CR3, RIP and cpu mode. A hit on other
+ *		instruction bytes is stale: the code changed under the entry.
+ *	tlb	guest translations of each vCPU by page, for the instruction
+ *		fetch at RIP and for the exit's GLA, flushed when the vCPU
+ *		switches CR3 unless tagged with it (-p). A hit on another GPA
+ *		is stale.
+ *	mmio	device register reads by GPA and size, updated by writes. A hit
+ *		on another value than the device returned is stale.
+ *
+ * For each size it prints the hit rate, the stale hits and the time the
+ * hits would save per exit: the cost of the stages each cache skips (the
+ * decode stages, the fetch and gla2gpa stages, the mmio_read stage) for
+ * the opcode of the exit. The costs are measured by replaying the exits
+ * through the emulator, built with VIE_STAGES, or given with -C. Replay
+ * does not fetch and its device model is the recording, so the fetch and
+ * mmio_read costs of a real VMM have to be given with -C.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "vmm_exitrec.h"
+#include "bench.h"
+
+#define	CS_DECODE	0
+#define	CS_TLB		1
+#define	CS_MMIO		2
+#define	CS_NKIND	3
+
+#define	CS_LRU		0
+#define	CS_CLOCK	1
+#define	CS_RANDOM	2
+
+#define	CS_MAXSIZE	32
+
+#define	CS_MISS		0
+#define	CS_HIT		1
+#define	CS_STALE	2
+
+static const char *const cs_kinds[CS_NKIND] = { "decode", "tlb", "mmio" };
+static const char *const cs_policies[] = { "lru", "clock", "random" };
+
+/* One set associative cache; keys are hashes and never 0 */
+struct cs_cache {
+	int		nset;
+	int		assoc;
+	uint64_t	*tag;
+	uint64_t	*val;
+	uint64_t	*use;		/* LRU: last use, CLOCK: referenced */
+	int		*hand;		/* CLOCK: next way to look at */
+};
+
+/* A cache kind at one size */
+struct cs_sim {
+	int		kind;
+	int		size;
+	struct cs_cache	*cache[VIE_REC_MAXCPU];	/* per vCPU for the tlb */
+	uint64_t	cr3[VIE_REC_MAXCPU];
+	uint64_t	lookups;
+	uint64_t	hits;
+	uint64_t	stale;
+	/* Stage runs saved by hits, by opcode and stage */
+	double		saved[VIE_STAGES_NKEYS][VIE_STAGE_LAST];
+};
+
+static int policy;
+static int assoc;
+static bool tagged;
+static uint64_t rng = 0x9e3779b97f4a7c15UL;
+static uint64_t now;
+
+static __inline uint64_t
+cs_hash(uint64_t a, uint64_t b)
+{
+	uint64_t x;
+
+	x = a * 0x9e3779b97f4a7c15UL ^ b;
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9UL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebUL;
+	x ^= x >> 31;
+	return (x | 1);
+}
+
+static struct cs_cache *
+cs_cache_alloc(int size)
+{
+	struct cs_cache *c;
+	int a;
+
+	a = assoc == 0 ? size : assoc;
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		err(1, "calloc");
+	c->assoc = a;
+	c->nset = size / a;
+	c->tag = calloc(size, sizeof(uint64_t));
+	c->val = calloc(size, sizeof(uint64_t));
+	c->use = calloc(size, sizeof(uint64_t));
+	c->hand = calloc(c->nset, sizeof(int));
+	if (c->tag == NULL || c->val == NULL || c->use == NULL ||
+	    c->hand == NULL)
+		err(1, "calloc");
+	return (c);
+}
+
+static void
+cs_cache_flush(struct cs_cache *c)
+{
+
+	memset(c->tag, 0, c->nset * c->assoc * sizeof(uint64_t));
+}
+
+/* The way to replace in the set starting at 'base' */
+static int
+cs_victim(struct cs_cache *c, int set, int base)
+{
+	int w, v;
+
+	for (w = 0; w < c->assoc; w++) {
+		if (c->tag[base + w] == 0)
+			return (w);
+	}
+	switch (policy) {
+	case CS_LRU:
+		for (v = 0, w = 1; w < c->assoc; w++) {
+			if (c->use[base + w] < c->use[base + v])
+				v = w;
+		}
+		return (v);
+	case CS_CLOCK:
+		for (;;) {
+			w = c->hand[set];
+			c->hand[set] = (w + 1) % c->assoc;
+			if (c->use[base + w] == 0)
+				return (w);
+			c->use[base + w] = 0;
+		}
+	default:
+		rng ^= rng << 13;
+		rng ^= rng >> 7;
+		rng ^= rng << 17;
+		return (rng % c->assoc);
+	}
+}
+
+/*
+ * Look 'key' up, expecting 'val', and leave 'key' cached with 'val'.
+ * Returns CS_HIT, CS_STALE if it was cached with another value, or
+ * CS_MISS.
+ */
+static int
+cs_lookup(struct cs_cache *c, uint64_t key, uint64_t val)
+{
+	int base, result, set, w;
+
+	set = key >> 1 & (c->nset - 1);
+	base = set * c->assoc;
+	for (w = 0; w < c->assoc; w++) {
+		if (c->tag[base + w] == key)
+			break;
+	}
+	if (w < c->assoc) {
+		result = c->val[base + w] == val ? CS_HIT : CS_STALE;
+	} else {
+		w = cs_victim(c, set, base);
+		c->tag[base + w] = key;
+		result = CS_MISS;
+	}
+	c->val[base + w] = val;
+	c->use[base + w] = policy == CS_LRU ? ++now : 1;
+	return (result);
+}
+
+/* The key vie_stages uses for the opcode of 'ex' */
+static int
+cs_opkey(const struct vie_rec_exit *ex)
+{
+	int i;
+
+	for (i = 0; i < ex->inst_len; i++) {
+		switch (ex->inst[i]) {
+		case 0x26: case 0x2e: case 0x36: case 0x3e:
+		case 0x64: case 0x65: case 0x66: case 0x67:
+		case 0xf0: case 0xf2: case 0xf3:
+			continue;
+		}
+		if (ex->cpu_mode == CPU_MODE_64BIT &&
+		    (ex->inst[i] & 0xf0) == 0x40)
+			continue;
+		break;
+	}
+	if (i >= ex->inst_len)
+		return (VIE_STAGES_UNKNOWN);
+	if (ex->inst[i] != 0x0f)
+		return (ex->inst[i]);
+	return (i + 1 < ex->inst_len ? 256 + ex->inst[i + 1] :
+	    VIE_STAGES_UNKNOWN);
+}
+
+/* Register 'reg' of 'ex' before emulation */
+static uint64_t
+cs_reg(const struct vie_rec_exit *ex, int reg)
+{
+	const uint64_t *val;
+
+	if ((ex->inmask & 1U << reg) == 0)
+		return (0);
+	val = (const uint64_t *)(ex + 1);
+	return (val[__builtin_popcount(ex->inmask & ((1U << reg) - 1))]);
+}
+
+static void
+cs_sim_exit(struct cs_sim *s, int vcpuid, const struct vie_rec_exit *ex,
+    int key)
+{
+	const struct vie_rec_access *a;
+	struct cs_cache *c;
+	uint64_t inst[2], rip;
+	int i, nread, r, stage;
+
+	rip = cs_reg(ex, VM_REG_GUEST_RIP);
+	switch (s->kind) {
+	case CS_DECODE:
+		memset(inst, 0, sizeof(inst));
+		memcpy(inst, ex->inst, ex->inst_len);
+		r = cs_lookup(s->cache[0], cs_hash(ex->cr3, rip) ^
+		    (ex->cpu_mode << 1 | ex->cs_d) << 1,
+		    cs_hash(inst[0] ^ ex->inst_len, inst[1]));
+		s->lookups++;
+		if (r == CS_STALE)
+			s->stale++;
+		if (r != CS_HIT)
+			break;
+		s->hits++;
+		for (stage = VIE_STAGE_PREFIXES; stage <= VIE_STAGE_VERIFY_GLA;
+		    stage++)
+			s->saved[key][stage]++;
+		break;
+	case CS_TLB:
+		if ((c = s->cache[vcpuid]) == NULL)
+			c = s->cache[vcpuid] = cs_cache_alloc(s->size);
+		if (!tagged && ex->cr3 != s->cr3[vcpuid])
+			cs_cache_flush(c);
+		s->cr3[vcpuid] = ex->cr3;
+		/* The recording has no GPA for RIP, assume it never moves */
+		r = cs_lookup(c, cs_hash(tagged ? ex->cr3 : 0, rip >> 12), 0);
+		s->lookups++;
+		if (r == CS_HIT) {
+			s->hits++;
+			s->saved[key][VIE_STAGE_FETCH]++;
+		}
+		if (ex->gla == VIE_INVALID_GLA)
+			break;
+		r = cs_lookup(c, cs_hash(tagged ? ex->cr3 : 0, ex->gla >> 12),
+		    ex->gpa >> 12);
+		s->lookups++;
+		if (r == CS_STALE)
+			s->stale++;
+		if (r == CS_HIT) {
+			s->hits++;
+			s->saved[key][VIE_STAGE_GLA2GPA]++;
+		}
+		break;
+	case CS_MMIO:
+		a = (const struct vie_rec_access *)((const uint64_t *)(ex + 1) +
+		    __builtin_popcount(ex->inmask) +
+		    __builtin_popcount(ex->outmask));
+		for (nread = 0, i = 0; i < ex->naccess; i++)
+			nread += !a[i].write;
+		for (i = 0; i < ex->naccess; i++, a++) {
+			if (a->error != 0)
+				continue;
+			r = cs_lookup(s->cache[0], cs_hash(a->gpa, a->size),
+			    a->val);
+			if (a->write)
+				continue;
+			s->lookups++;
+			if (r == CS_STALE)
+				s->stale++;
+			if (r == CS_HIT) {
+				s->hits++;
+				s->saved[key][VIE_STAGE_MMIO_READ] +=
+				    1.0 / nread;
+			}
+		}
+		break;
+	}
+}
+
+static void
+cs_sim_flush(struct cs_sim *s)
+{
+	int v;
+
+	for (v = 0; v < VIE_REC_MAXCPU; v++) {
+		if (s->cache[v] != NULL)
+			cs_cache_flush(s->cache[v]);
+	}
+}
+
+/* Stage named 'name', with or without its "decode;" or "emulate;" */
+static int
+cs_stage(const char *name, size_t len)
+{
+	const char *sn, *p;
+	int stage;
+
+	for (stage = VIE_STAGE_NONE + 1; stage < VIE_STAGE_LAST; stage++) {
+		sn = vie_stages_name(stage);
+		if ((p = strchr(sn, ';')) != NULL && strlen(p + 1) == len &&
+		    strncmp(p + 1, name, len) == 0)
+			return (stage);
+		if (strlen(sn) == len && strncmp(sn, name, len) == 0)
+			return (stage);
+	}
+	return (-1);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: cache_sim [-mp] [-a assoc] [-c kind[,kind]] "
+	    "[-C stage=ns[,...]] [-i interval]\n"
+	    "                 [-r lru|clock|random] [-s size[,size]] "
+	    "recording\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct vie_stages st;
+	static struct vie_replay_cursor cursor[VIE_REC_MAXCPU];
+	const struct vie_rec_exit *head[VIE_REC_MAXCPU], *ex;
+	struct vie_replay rp;
+	struct cs_sim *sims[CS_NKIND * CS_MAXSIZE], *s;
+	double cost[VIE_STAGES_NKEYS][VIE_STAGE_LAST], given[VIE_STAGE_LAST];
+	double ghz, ns;
+	uint64_t exits, interval, mismatched;
+	const char *p;
+	char *end, *q;
+	int sizes[CS_MAXSIZE], kinds, nsim, nsize;
+	int ch, error, i, k, key, measure, min, stage, v, vcpuid;
+
+	assoc = 8;
+	policy = CS_LRU;
+	kinds = (1 << CS_NKIND) - 1;
+	interval = 0;
+	measure = 1;
+	for (nsize = 0; nsize < 10; nsize++)
+		sizes[nsize] = 16 << nsize;
+	for (stage = 0; stage < VIE_STAGE_LAST; stage++)
+		given[stage] = -1;
+	while ((ch = getopt(argc, argv, "a:c:C:i:mpr:s:")) != -1) {
+		switch (ch) {
+		case 'a':
+			assoc = atoi(optarg);
+			break;
+		case 'c':
+			kinds = 0;
+			for (p = optarg; *p != '\0'; p += *p == ',') {
+				for (k = 0; k < CS_NKIND; k++) {
+					i = strlen(cs_kinds[k]);
+					if (strncmp(p, cs_kinds[k], i) == 0 &&
+					    (p[i] == ',' || p[i] == '\0'))
+						break;
+				}
+				if (k == CS_NKIND)
+					usage();
+				kinds |= 1 << k;
+				p += strlen(cs_kinds[k]);
+			}
+			break;
+		case 'C':
+			for (p = optarg; *p != '\0'; p = end + (*end == ',')) {
+				if ((q = strchr(p, '=')) == NULL ||
+				    (stage = cs_stage(p, q - p)) < 0)
+					usage();
+				given[stage] = strtod(q + 1, &end);
+				if (end == q + 1 ||
+				    (*end != ',' && *end != '\0'))
+					usage();
+			}
+			break;
+		case 'i':
+			interval = strtoull(optarg, NULL, 0);
+			break;
+		case 'm':
+			measure = 0;
+			break;
+		case 'p':
+			tagged = true;
+			break;
+		case 'r':
+			for (policy = 0; policy < (int)nitems(cs_policies);
+			    policy++) {
+				if (strcmp(optarg, cs_policies[policy]) == 0)
+					break;
+			}
+			if (policy == (int)nitems(cs_policies))
+				usage();
+			break;
+		case 's':
+			nsize = 0;
+			for (p = optarg; *p != '\0' && nsize < CS_MAXSIZE;
+			    p = end + (*end == ',')) {
+				sizes[nsize++] = strtol(p, &end, 0);
+				if (end == p)
+					usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || assoc < 0 || nsize == 0)
+		usage();
+	for (i = 0; i < nsize; i++) {
+		if (sizes[i] < 1 || (assoc != 0 && (sizes[i] % assoc != 0 ||
+		    !powerof2(sizes[i] / assoc))))
+			errx(1, "%d entries: not a power of 2 sets of %d",
+			    sizes[i], assoc);
+	}
+
+	if ((error = vie_replay_open(&rp, argv[0])) != 0)
+		errc(1, error, "%s", argv[0]);
+
+	nsim = 0;
+	for (k = 0; k < CS_NKIND; k++) {
+		if ((kinds & 1 << k) == 0)
+			continue;
+		for (i = 0; i < nsize; i++) {
+			if ((s = calloc(1, sizeof(*s))) == NULL)
+				err(1, "calloc");
+			s->kind = k;
+			s->size = sizes[i];
+			if (k != CS_TLB)
+				s->cache[0] = cs_cache_alloc(s->size);
+			sims[nsim++] = s;
+		}
+	}
+
+	/* Merge the vCPUs by TSC, each of them decoded in order */
+	for (v = 0; v < VIE_REC_MAXCPU; v++) {
+		vie_replay_rewind(&rp, &cursor[v], v);
+		head[v] = vie_replay_next(&rp, &cursor[v], &vcpuid);
+	}
+	vie_stages_reset();
+	exits = mismatched = 0;
+	for (;;) {
+		for (min = -1, v = 0; v < VIE_REC_MAXCPU; v++) {
+			if (head[v] != NULL && (min < 0 ||
+			    head[v]->tsc < head[min]->tsc))
+				min = v;
+		}
+		if (min < 0)
+			break;
+		ex = head[min];
+		key = cs_opkey(ex);
+		if (interval != 0 && exits != 0 && exits % interval == 0) {
+			for (i = 0; i < nsim; i++)
+				cs_sim_flush(sims[i]);
+		}
+		for (i = 0; i < nsim; i++)
+			cs_sim_exit(sims[i], min, ex, key);
+		if (measure && vie_replay_exit(NULL, min, ex) != 0)
+			mismatched++;
+		exits++;
+		head[min] = vie_replay_next(&rp, &cursor[min], &vcpuid);
+	}
+	for (v = 0; v < VIE_REC_MAXCPU; v++) {
+		if (cursor[v].left != 0)
+			warnx("%s: vcpu %d: malformed chunk", argv[0], v);
+	}
+	if (mismatched != 0)
+		warnx("%ju exits did not replay as recorded",
+		    (uintmax_t)mismatched);
+
+	/* Mean cost of each stage per exit of each opcode, in ns */
+	ghz = bench_tsc_ghz();
+	if (measure)
+		vie_stages_snapshot(-1, &st);
+	for (key = 0; key < VIE_STAGES_NKEYS; key++) {
+		for (stage = 0; stage < VIE_STAGE_LAST; stage++) {
+			if (given[stage] >= 0)
+				cost[key][stage] = given[stage];
+			else if (st.count[key] != 0)
+				cost[key][stage] = st.cycles[key][stage] / ghz /
+				    st.count[key];
+			else
+				cost[key][stage] = 0;
+		}
+	}
+
+	printf("# %ju exits, %s, ", (uintmax_t)exits, argv[0]);
+	if (assoc == 0)
+		printf("fully associative");
+	else
+		printf("%d-way", assoc);
+	printf(", %s%s", cs_policies[policy],
+	    tagged ? ", tlb tagged by cr3" : "");
+	if (interval != 0)
+		printf(", flushed every %ju exits", (uintmax_t)interval);
+	printf("\n# stage costs %s", measure ? "measured by replay" :
+	    "not measured");
+	for (stage = 0; stage < VIE_STAGE_LAST; stage++) {
+		if (given[stage] >= 0)
+			printf(", %s=%g", vie_stages_name(stage),
+			    given[stage]);
+	}
+	printf("\n%-8s %8s %12s %7s %7s %10s\n", "cache", "entries",
+	    "lookups", "hit%", "stale%", "ns/exit");
+	for (i = 0; i < nsim; i++) {
+		s = sims[i];
+		ns = 0;
+		for (key = 0; key < VIE_STAGES_NKEYS; key++)
+			for (stage = 0; stage < VIE_STAGE_LAST; stage++)
+				ns += s->saved[key][stage] * cost[key][stage];
+		printf("%-8s %8d %12ju %7.2f %7.2f %10.1f\n",
+		    cs_kinds[s->kind], s->size, (uintmax_t)s->lookups,
+		    s->lookups ? 100.0 * s->hits / s->lookups : 0,
+		    s->lookups ? 100.0 * s->stale / s->lookups : 0,
+		    exits ? ns / exits : 0);
+	}
+	vie_replay_close(&rp);
+	return (0);
+}
@@ -1,1446 +1,320 @@
 /*
  * Test harness for bhyve instruction emulator
+ *
+ * Runs corpora of test vectors (see tvec.h) through the decoder and the
+ * emulator and reports the failures and the rate at which vectors were
+ * executed. With -s the emulator's statistics are printed too, if it was
+ * built with VIE_STATS, and with -T its tracepoints are recorded into a
+ * trace file for trace/vie_trace, if it was built with VIE_TRACE. With -F
+ * the cycles spent in each stage of each opcode are written out as folded
+ * stacks for flamegraph.pl, if it was built with VIE_STAGES.
  */
 
 #include <sys/types.h>
 #include <sys/errno.h>
 
-#include <assert.h>
+#include <err.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "vmm_stubs.h"
+#include "tvec.h"
+#ifdef VIE_TRACE
+#include "vmm_trace.h"
 
-static uint64_t vm_regs[VM_REG_LAST];
+#define	TRACE_NREC	(1 << 16)
+#endif
 
-struct mem_cell {
-	uint64_t   addr;
-	uint64_t   val;
-};
-
-int
-vm_get_register(void *ctx, int vcpu, int reg, uint64_t *retval)
+static uint64_t
+nsec(void)
 {
+	struct timespec ts;
 
-	if (reg >= VM_REG_GUEST_RAX &&
-	    reg < VM_REG_LAST) {
-		*retval = vm_regs[reg];
-		return (0);
-	}
-		
-	return (EINVAL);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
 }
 
-int
-vm_set_register(void *ctx, int vcpu, int reg, uint64_t val)
+/* Run every vector of 'c' 'repeat' times and return the number of failures */
+static uint64_t
+run(const char *name, struct tvec_corpus *c, int repeat, int quiet)
 {
-
-	if (reg >= VM_REG_GUEST_RAX &&
-	    reg < VM_REG_LAST) {
-		vm_regs[reg] = reg;
-		return (0);
+	const struct tvec *tv;
+	uint64_t failed, i;
+	int n;
+
+	failed = 0;
+	for (n = 0; n < repeat; n++) {
+		tv = tvec_first(c);
+		for (i = 0; i < c->hdr->count; i++, tv = tvec_next(tv)) {
+			if (__predict_true(tvec_run(0, tv) == 0))
+				continue;
+			failed++;
+			if (!quiet && n == 0)
+				tvec_report(stderr, name, 0, tv);
+		}
 	}
-
-	return (EINVAL);
+	return (failed);
 }
 
-/*
- * Memory r/w callback functions
- */
-int
-test_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
-    void *arg)
+#ifdef VIE_STATS
+/* Upper bound in cycles of the 'pct' percentile of a latency histogram */
+static uint64_t
+hist_pct(const uint64_t *hist, double pct)
 {
-	struct mem_cell *mc;
-
-	mc = arg;
-
-	if (mc->addr == gpa) {
-		*rval = mc->val;
-		return (0);
+	uint64_t n, sum;
+	int i;
+
+	for (n = 0, i = 0; i < VIE_STATS_NBUCKETS; i++)
+		n += hist[i];
+	for (sum = 0, i = 0; i < VIE_STATS_NBUCKETS - 1; i++) {
+		sum += hist[i];
+		if (sum >= n * pct)
+			break;
 	}
-
-	return (EINVAL);
+	return (1UL << i);
 }
 
-int
-test_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval,
-    int wsize, void *arg)
+static void
+print_stats(void)
 {
-	struct mem_cell *mc;
-
-	mc = arg;
-
-	if (mc->addr == gpa) {
-		mc->val = wval;
-		return (0);
+	struct vie_stats st;
+	uint64_t n;
+	int i, op;
+
+	vie_stats_snapshot(-1, &st);
+	printf("decode: %ju ok, p50 <%ju p99 <%ju cycles\n",
+	    (uintmax_t)st.decoded, (uintmax_t)hist_pct(st.decode_hist, .5),
+	    (uintmax_t)hist_pct(st.decode_hist, .99));
+	for (i = 0; i < VIE_STATS_NDECODE; i++) {
+		if (st.decode_errors[i] != 0)
+			printf("  %-12s %ju failed\n",
+			    vie_stats_decode_error(i),
+			    (uintmax_t)st.decode_errors[i]);
+	}
+	for (op = 0; op < VIE_STATS_NOPS; op++) {
+		for (n = 0, i = 0; i < VIE_STATS_NSIZES; i++)
+			n += st.emulated[op][i];
+		if (n == 0)
+			continue;
+		printf("%-8s", vie_stats_opname(op));
+		for (i = 0; i < VIE_STATS_NSIZES; i++)
+			printf(" %d:%-8ju", 1 << i,
+			    (uintmax_t)st.emulated[op][i]);
+		printf(" errors %-6ju p50 <%ju p99 <%ju cycles\n",
+		    (uintmax_t)st.emulate_errors[op],
+		    (uintmax_t)hist_pct(st.emulate_hist[op], .5),
+		    (uintmax_t)hist_pct(st.emulate_hist[op], .99));
 	}
-	
-	return (EINVAL);
 }
+#endif
 
-void
-panic(char *str, ...)
+#ifdef VIE_STAGES
+/* One "opcode;stage cycles" line per stage of each opcode seen */
+static void
+print_folded(FILE *fp)
 {
-
-	printf("panic: %s\n", str);
+	static struct vie_stages st;
+	char name[32];
+	int key, stage;
+
+	vie_stages_snapshot(-1, &st);
+	for (key = 0; key < VIE_STAGES_NKEYS; key++) {
+		if (st.count[key] == 0)
+			continue;
+		vie_stages_opname(key, name, sizeof(name));
+		for (stage = VIE_STAGE_NONE + 1; stage < VIE_STAGE_LAST;
+		    stage++) {
+			if (st.cycles[key][stage] != 0)
+				fprintf(fp, "%s;%s %ju\n", name,
+				    vie_stages_name(stage),
+				    (uintmax_t)st.cycles[key][stage]);
+		}
+	}
 }
+#endif
 
-
-main()
+/*
+ * Return a stream on the original stdout and point stdout at stderr, so that
+ * diagnostics the emulator prints, such as verify_gla mismatches, cannot end
+ * up in recorded vectors.
+ */
+static FILE *
+record_stream(void)
 {
-	struct mem_cell mc;
-	struct vie vie;
-	uint64_t gla, gpa;
-	int err;
-
-	/*
-	 * ICLASS: AND         CATEGORY: LOGICAL               EXTENSION: BASE              IFORM: AND_GPRv_MEMv           ISA_SET: I86
-     
-     * SHORT: and eax, dword ptr [ecx+0xf0]                  AND r16/32, r/m16/32
-	 * (rcx = lapic address, 0xff000000)
-	 * and    0xf0(%rcx),%eax                         
-	 * 0x23 0x81 0xf0 0x00 0x00 0x00
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0x0000aabb;
-	vm_regs[VM_REG_GUEST_RCX] = 0xff000000;
-	vie.inst[0] = 0x23;
-	vie.inst[1] = 0x81;
-	vie.inst[2] = 0xf0;
-	vie.inst[3] = 0x00;
-	vie.inst[4] = 0x00;
-	vie.inst[5] = 0x00;
-	vie.num_valid = 6;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000f0;
-	mc.val  = 0x0000aa00;
-	gpa = 0xff0000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-
-
-	/*
-	 * ICLASS: AND         CATEGORY: LOGICAL              EXTENSION: BASE            IFORM: AND_MEMv_IMMz              ISA_SET: I86
-
-     * SHORT: and dword ptr [eax+0xf0], 0xfffffeff        AND r/m32, imm32
-     * (rax = lapic address, 0xff000000)
-     * andl   $0xfffffeff,0xf0(%rax)
-     * 0x81 0xa0 0xf0 0x00 0x00 0x00 0xff 0xfe 0xff 0xff
-     */
-
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0xff000000;
-	vie.inst[0] = 0x81;
-	vie.inst[1] = 0xa0;
-	vie.inst[2] = 0xf0;
-	vie.inst[3] = 0x00;
-	vie.inst[4] = 0x00;
-	vie.inst[5] = 0x00;
-	vie.inst[6] = 0xff;
-	vie.inst[7] = 0xfe;
-	vie.inst[8] = 0xff;
-	vie.inst[9] = 0xff;
-	vie.num_valid = 10;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000f0;
-	mc.val  = 0x0000a1aa;
-	gpa = 0xff0000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xa0aa);
-
-	/*
-	 * SHORT: and dword ptr [eax+0xf0], 0xffef0000             AND r/m16, imm16
-     * (rax = lapic address, 0xff000000)
-     * andl   $0x0000feff,0xf0(%rax)
-     * 0x81 0xa0 0xf0 0x00 0x00 0x00 0xff 0xfe 0x00 0x00
-     */
-
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0xff000000;
-	vie.inst[0] = 0x81;
-	vie.inst[1] = 0xa0;
-	vie.inst[2] = 0xf0;
-	vie.inst[3] = 0x00;
-	vie.inst[4] = 0x00;
-	vie.inst[5] = 0x00;
-	vie.inst[6] = 0xff;
-	vie.inst[7] = 0xfe;
-	vie.inst[8] = 0x00;
-	vie.inst[9] = 0x00;
-	vie.num_valid = 10;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000f0;
-	mc.val  = 0x0000a1aa;
-	gpa = 0xff0000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xa0aa);
-
-    /*
-     * ICLASS: AND          CATEGORY: LOGICAL           EXTENSION: BASE         IFORM: AND_MEMb_IMMb_80r4               ISA_SET: I86
-     
-     * SHORT: and byte ptr [eax+0xf0], 0xff                AND r/m8, imm8
-     * (rax = lapic address, 0xff000000)
-     * andl   $0xff,0xf0(%rax)
-     * 0x80 0xa0 0xf0 0x00 0x00 0x00 0xff 
-     */
-
-
-     memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0xff000000;
-	vie.inst[0] = 0x80;
-	vie.inst[1] = 0xa0;
-	vie.inst[2] = 0xf0;
-	vie.inst[3] = 0x00;
-	vie.inst[4] = 0x00;
-	vie.inst[5] = 0x00;
-	vie.inst[6] = 0xff;
-	vie.num_valid = 7;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000f0;
-	mc.val  = 0x0000a1aa;
-	gpa = 0xff0000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xa0aa);
-
-    /*
-	 * SHORT: and byte ptr [eax+0xf0], 0xff                AND r/m16/32, imm8
-     * (rax = lapic address, 0xff000000)
-     * andl   $0xff,0xf0(%rax)
-     * 0x83 0xa0 0xf0 0x00 0x00 0x00 0xff 
-     */
-
-
-     memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0xff000000;
-	vie.inst[0] = 0x83;
-	vie.inst[1] = 0xa0;
-	vie.inst[2] = 0xf0;
-	vie.inst[3] = 0x00;
-	vie.inst[4] = 0x00;
-	vie.inst[5] = 0x00;
-	vie.inst[6] = 0xff;
-	vie.num_valid = 7;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000f0;
-	mc.val  = 0x0000a1aa;
-	gpa = 0xff0000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xa0aa);
-
-
-	/*
-	 * ICLASS: MOV             CATEGORY: DATAXFER            EXTENSION: BASE           IFORM: MOV_MEMb_GPR8             ISA_SET: I86
-
-     * SHORT: mov byte ptr [ecx+0x58ecdc05], cl               MOV r/m8, r8
-     * mov    %r8d,5827804(%rip)
-	 * 88 89 05 dc ec 58 00
-	 * rip -> 0xffffffff8046539d
-	 * var -> 0xffffffff809f4080
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 7;	
-	vm_regs[VM_REG_GUEST_R8] = 0xa5a5a5a5deadbeefULL;
-	vie.inst[0] = 0x88;
-	vie.inst[1] = 0x89;
-	vie.inst[2] = 0x05;
-	vie.inst[3] = 0xdc;
-	vie.inst[4] = 0xec;
-	vie.inst[5] = 0x58;
-	vie.inst[6] = 0x00;
-	vie.num_valid = 7;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff000080;
-	mc.val  = 0;
-	gpa = 0xff000080;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-
-    /* 
-     *ICLASS: MOV              CATEGORY: DATAXFER              EXTENSION: BASE             IFORM: MOV_MEMv_GPRv      ISA_SET: I86
-
-     * SHORT: mov dword ptr [eax+0x58ecdc05], ecx               MOV r/m16/32, r16/32
-     * mov    %r8d,5827804(%rip)
-	 * 89 88 05 dc ec 58 00
-	 * rip -> 0xffffffff8046539d
-	 * var -> 0xffffffff809f4080
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 7;	
-	vm_regs[VM_REG_GUEST_R8] = 0xa5a5a5a5deadbeefULL;
-	vie.inst[0] = 0x89;
-	vie.inst[1] = 0x88;
-	vie.inst[2] = 0x05;
-	vie.inst[3] = 0xdc;
-	vie.inst[4] = 0xec;
-	vie.inst[5] = 0x58;
-	vie.inst[6] = 0x00;
-	vie.num_valid = 7;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff000080;
-	mc.val  = 0;
-	gpa = 0xff000080;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
- 
-	/*
-	 * ICLASS: MOV          CATEGORY: DATAXFER             EXTENSION: BASE             IFORM: MOV_GPR8_MEMb                ISA_SET: I86
-
-     * SHORT: mov cl, byte ptr [ecx+0x58ecdc05]                 MOV r8, r/m8
-     * mov    %r8d,5827804(%rip)
-	 * 8a 89 05 dc ec 58 00
-	 * rip -> 0xffffffff8046539d
-	 * var -> 0xffffffff809f4080
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 7;	
-	vm_regs[VM_REG_GUEST_R8] = 0xa5a5a5a5deadbeefULL;
-	vie.inst[0] = 0x8a;
-	vie.inst[1] = 0x89;
-	vie.inst[2] = 0x05;
-	vie.inst[3] = 0xdc;
-	vie.inst[4] = 0xec;
-	vie.inst[5] = 0x58;
-	vie.inst[6] = 0x00;
-	vie.num_valid = 7;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff000080;
-	mc.val  = 0;
-	gpa = 0xff000080;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	/* 
-	 * ICLASS: MOV             CATEGORY: DATAXFER               EXTENSION: BASE            IFORM: MOV_GPRv_MEMv           ISA_SET: I86
-     * SHORT: mov ecx, dword ptr [eax+0x58ecdc05]               MOV r16/32, r/m16/32
-     * mov    %r8d,5827804(%rip)
-	 * 8b 88 05 dc ec 58 00
-	 * rip -> 0xffffffff8046539d
-	 * var -> 0xffffffff809f4080
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 7;	
-	vm_regs[VM_REG_GUEST_R8] = 0xa5a5a5a5deadbeefULL;
-	vie.inst[0] = 0x8b;
-	vie.inst[1] = 0x88;
-	vie.inst[2] = 0x05;
-	vie.inst[3] = 0xdc;
-	vie.inst[4] = 0xec;
-	vie.inst[5] = 0x58;
-	vie.inst[6] = 0x00;
-	vie.num_valid = 7;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff000080;
-	mc.val  = 0;
-	gpa = 0xff000080;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	/* 
-	 *ICLASS: MOV          CATEGORY: DATAXFER              EXTENSION: BASE              IFORM: MOV_OrAX_MEMv         ISA_SET: I86
-     * SHORT: mov eax, dword ptr [0x0]                      MOV eax, moffs 16/32
-     * mov    %r8d,5827804(%rip)  
-	 * a1 00 00 00 00 
-	 * rip -> 0xffffffff8046539d
-	 * var -> 0xffffffff809f4080
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 5;	
-	vm_regs[VM_REG_GUEST_R8] = 0xa5a5a5a5deadbeefULL;
-	vie.inst[0] = 0xa1;
-	vie.inst[1] = 0x00;
-	vie.inst[2] = 0x00;
-	vie.inst[3] = 0x00;
-	vie.inst[4] = 0x00;
-	vie.num_valid = 5;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff000080;
-	mc.val  = 0;
-	gpa = 0xff000080;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-
-    /* 
-     *ICLASS: MOV             CATEGORY: DATAXFER             EXTENSION: BASE               IFORM: MOV_MEMv_OrAX          ISA_SET: I86
-     * SHORT: mov dword ptr [0x0], eax                        MOV moffs16/32, eax
-     * mov    %r8d,5827804(%rip)  
-	 * a3 00 00 00 00 
-	 * rip -> 0xffffffff8046539d
-	 * var -> 0xffffffff809f4080
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 5;	
-	vm_regs[VM_REG_GUEST_R8] = 0xa5a5a5a5deadbeefULL;
-	vie.inst[0] = 0xa3;
-	vie.inst[1] = 0x00;
-	vie.inst[2] = 0x00;
-	vie.inst[3] = 0x00;
-	vie.inst[4] = 0x00;
-	vie.num_valid = 5;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff000080;
-	mc.val  = 0;
-	gpa = 0xff000080;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-
-
-
-	/*
-	 * ICLASS: MOV             CATEGORY: DATAXFER            EXTENSION: BASE           IFORM: MOV_MEMv_IMMz             ISA_SET: I86
-     * SHORT: mov dword ptr [eax+0x58ecdc05], 0xffff                         MOV r/m 16, imm16
-	 * movl   $0x1ef,5872021(%rip)
-	 * c7 05 95 99 59 00 ef
-	 * c7 80 05 dc ec 58 ff ff 00 00
-	 * rip -> ffffffff813d2751
-	 * val -> ffffffff8196c0f0
-	 * pa -> 0xfee000f0
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 9;	
-	vie.inst[0] = 0xc7;
-	vie.inst[1] = 0x80;
-	vie.inst[2] = 0x05;
-	vie.inst[3] = 0xdc;
-	vie.inst[4] = 0xec;
-	vie.inst[5] = 0x58;
-	vie.inst[6] = 0xff;
-	vie.inst[7] = 0xff;
-	vie.inst[7] = 0x00;
-	vie.inst[8] = 0x00;
-	vie.num_valid = 9;
-
-    gla = 0;
-    err = vmm_decode_instruction(NULL, 0, gla, &vie);
-    assert(err == 0);
-
-    mc.addr = 0xfee000f0;
-	mc.val  = 0;
-	gpa = 0xfee000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	/*
-	 * ICLASS: MOV             CATEGORY: DATAXFER            EXTENSION: BASE           IFORM: MOV_MEMv_IMMz             ISA_SET: I86
-     * SHORT: mov dword ptr [eax+0x58ecdc05], 0xffffffff                        MOV r/m 32, imm32
-	 * movl   $0x1ef,5872021(%rip)
-	 * c7 05 95 99 59 00 ef
-	 * c7 80 05 dc ec 58 ff ff ff ff
-	 * rip -> ffffffff813d2751
-	 * val -> ffffffff8196c0f0
-	 * pa -> 0xfee000f0
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 9;	
-	vie.inst[0] = 0xc7;
-	vie.inst[1] = 0x80;
-	vie.inst[2] = 0x05;
-	vie.inst[3] = 0xdc;
-	vie.inst[4] = 0xec;
-	vie.inst[5] = 0x58;
-	vie.inst[6] = 0xff;
-	vie.inst[7] = 0xff;
-	vie.inst[7] = 0xff;
-	vie.inst[8] = 0xff;
-	vie.num_valid = 9;
-
-    gla = 0;
-    err = vmm_decode_instruction(NULL, 0, gla, &vie);
-    assert(err == 0);
-
-    mc.addr = 0xfee000f0;
-	mc.val  = 0;
-	gpa = 0xfee000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	/*
-	 * ICLASS: MOV             CATEGORY: DATAXFER              EXTENSION: BASE              IFORM: MOV_MEMb_IMMb            ISA_SET: I86
-     * SHORT: mov byte ptr [ecx+0x58ecdc05], 0xff              MOV r/m8. imm8
-	 * c6 81 05 dc ec 58 ff
-	 * rip -> ffffffff813d2751
-	 * val -> ffffffff8196c0f0
-	 * pa -> 0xfee000f0
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 7;	
-	vie.inst[0] = 0xc6;
-	vie.inst[1] = 0x81;
-	vie.inst[2] = 0x05;
-	vie.inst[3] = 0xdc;
-	vie.inst[4] = 0xec;
-	vie.inst[5] = 0x58;
-	vie.inst[6] = 0xff;
-	vie.num_valid = 7;
-
-    gla = 0;
-    err = vmm_decode_instruction(NULL, 0, gla, &vie);
-    assert(err == 0);
-
-    mc.addr = 0xfee000f0;
-	mc.val  = 0;
-	gpa = 0xfee000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	/* 
-	 * ICLASS: MOVZX            CATEGORY: DATAXFER            EXTENSION: BASE          IFORM: MOVZX_GPRv_MEMb           ISA_SET: I386
-     * SHORT: movzx ax, byte ptr [ecx+0x58ecdc05]            MoVZX r16, r/m8 (Mov with Zero-extend)
-     * 66 0f b6 81 05 dc ec 58
-	 * rip -> ffffffff813d2751
-	 * val -> ffffffff8196c0f0
-	 * pa -> 0xfee000f0
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 8;	
-	vie.inst[0] = 0x66;
-	vie.inst[1] = 0x0f;
-	vie.inst[2] = 0xb6;
-	vie.inst[3] = 0x81;
-	vie.inst[4] = 0x05;
-	vie.inst[5] = 0xdc;
-	vie.inst[6] = 0xec;
-	vie.inst[7] = 0x58;
-	vie.num_valid = 8;
-
-    gla = 0;
-    err = vmm_decode_instruction(NULL, 0, gla, &vie);
-    assert(err == 0);
-
-    mc.addr = 0xfee000f0;
-	mc.val  = 0;
-	gpa = 0xfee000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	/* 
-	 * ICLASS: MOVZX            CATEGORY: DATAXFER            EXTENSION: BASE          IFORM: MOVZX_GPRv_MEMb           ISA_SET: I386
-     * SHORT: movzx eax, byte ptr [ecx+0x58ecdc05]            MoVZX r32, r/m8 (Mov with Zero-extend)
-     * 0f b6 81 05 dc ec 58
-	 * rip -> ffffffff813d2751
-	 * val -> ffffffff8196c0f0
-	 * pa -> 0xfee000f0
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 7;	
-	vie.inst[0] = 0x0f;
-	vie.inst[1] = 0xb6;
-	vie.inst[2] = 0x81;
-	vie.inst[3] = 0x05;
-	vie.inst[4] = 0xdc;
-	vie.inst[5] = 0xec;
-	vie.inst[6] = 0x58;
-	vie.num_valid = 7;
-
-    gla = 0;
-    err = vmm_decode_instruction(NULL, 0, gla, &vie);
-    assert(err == 0);
-
-    mc.addr = 0xfee000f0;
-	mc.val  = 0;
-	gpa = 0xfee000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
- 
-    /*  
-	 * ICLASS: MOVZX            CATEGORY: DATAXFER           EXTENSION: BASE           IFORM: MOVZX_GPRv_MEMw         ISA_SET: I386
-     * SHORT: movzx eax, word ptr [ecx+0x58ecdc05]          MOV r16/32, r/m16
-     * 0f b7 81 05 dc ec 58
-	 * rip -> ffffffff813d2751
-	 * val -> ffffffff8196c0f0
-	 * pa -> 0xfee000f0
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 7;	
-	vie.inst[0] = 0x0f;
-	vie.inst[1] = 0xb7;
-	vie.inst[2] = 0x81;
-	vie.inst[3] = 0x05;
-	vie.inst[4] = 0xdc;	
-	vie.inst[5] = 0xec;
-	vie.inst[6] = 0x58;
-	vie.num_valid = 7;
-
-    gla = 0;
-    err = vmm_decode_instruction(NULL, 0, gla, &vie);
-    assert(err == 0);
-
-    mc.addr = 0xfee000f0;
-	mc.val  = 0;
-	gpa = 0xfee000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	/*
-	 * ICLASS: MOVSX             CATEGORY: DATAXFER             EXTENSION: BASE            IFORM: MOVSX_GPRv_MEMb         ISA_SET: I386
-     * SHORT: movsx ax, byte ptr [ecx+0x58ecdc05]               MOVSX r16, r/m8
-     * 66 0f be 81 05 dc ec 58
-	 * rip -> ffffffff813d2751
-	 * val -> ffffffff8196c0f0
-	 * pa -> 0xfee000f0
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 8;	
-	vie.inst[0] = 0x66;
-	vie.inst[1] = 0x0f;
-	vie.inst[2] = 0xbe;
-	vie.inst[3] = 0x81;
-	vie.inst[4] = 0x05;
-	vie.inst[5] = 0xdc;
-	vie.inst[6] = 0xec;
-	vie.inst[7] = 0x58;
-	vie.num_valid = 8;
-
-    gla = 0;
-    err = vmm_decode_instruction(NULL, 0, gla, &vie);
-    assert(err == 0);
-
-    mc.addr = 0xfee000f0;
-	mc.val  = 0;
-	gpa = 0xfee000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	/* 
-	 * ICLASS: MOVSX               CATEGORY: DATAXFER            EXTENSION: BASE           IFORM: MOVSX_GPRv_MEMb        ISA_SET: I386
-     * SHORT: movsx eax, byte ptr [ecx+0x58ecdc05]               MOVSX r32, r/m8
-     * 0f be 81 05 dc ec 58
-	 * rip -> ffffffff813d2751
-	 * val -> ffffffff8196c0f0
-	 * pa -> 0xfee000f0
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 7;	
-	vie.inst[0] = 0x0f;
-	vie.inst[1] = 0xbe;
-	vie.inst[2] = 0x81;
-	vie.inst[3] = 0x05;
-	vie.inst[4] = 0xdc;
-	vie.inst[5] = 0xec;
-	vie.inst[6] = 0x58;
-	vie.num_valid = 7;
-
-    gla = 0;
-    err = vmm_decode_instruction(NULL, 0, gla, &vie);
-    assert(err == 0);
-
-    mc.addr = 0xfee000f0;
-	mc.val  = 0;
-	gpa = 0xfee000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-    /*
-	 * ICLASS: MOVSB              CATEGORY: STRINGOP                EXTENSION: BASE               IFORM: MOVSB             ISA_SET: I86
-     * SHORT: movsb byte ptr [di], byte ptr [si]                      MOVSB m8, m8
-     * 67 a4                                                    move data from string to string
-	 * rip -> ffffffff813d2751
-	 * val -> ffffffff8196c0f0
-	 * pa -> 0xfee000f0
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 2;	
-	vie.inst[0] = 0x67;
-	vie.inst[1] = 0xa4;
-	vie.num_valid = 2;
-
-    gla = 0;
-    err = vmm_decode_instruction(NULL, 0, gla, &vie);
-    assert(err == 0);
-
-    mc.addr = 0xfee000f0;
-	mc.val  = 0;
-	gpa = 0xfee000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	 /*
-	 * ICLASS: MOVSW             CATEGORY: STRINGOP             EXTENSION: BASE                 IFORM: MOVSW            ISA_SET: I86
-     * SHORT: movsw word ptr [edi], word ptr [esi]                 MOVSW m16/32, m16/32
-     * 66 a5                                                move data from string to string
-	 * rip -> ffffffff813d2751
-	 * val -> ffffffff8196c0f0
-	 * pa -> 0xfee000f0
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 2;	
-	vie.inst[0] = 0x66;
-	vie.inst[1] = 0xa5;
-	vie.num_valid = 2;
-
-    gla = 0;
-    err = vmm_decode_instruction(NULL, 0, gla, &vie);
-    assert(err == 0);
-
-    mc.addr = 0xfee000f0;
-	mc.val  = 0;
-	gpa = 0xfee000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-    /*
-	 * ICLASS: MOVSD              CATEGORY: STRINGOP              EXTENSION: BASE             IFORM: MOVSD               ISA_SET: I386
-     * SHORT: movsd dword ptr [edi], dword ptr [esi]                     MOVSW m32, m32
-     * A5                                                    move data from string to string
-	 * rip -> ffffffff813d2751
-	 * val -> ffffffff8196c0f0
-	 * pa -> 0xfee000f0
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	/* RIP-relative is from next instruction */
-	vm_regs[VM_REG_GUEST_RIP] = 0xffffffff8046539d + 1;	
-	vie.inst[0] = 0xa5;
-	vie.num_valid = 1;
-
-    gla = 0;
-    err = vmm_decode_instruction(NULL, 0, gla, &vie);
-    assert(err == 0);
-
-    mc.addr = 0xfee000f0;
-	mc.val  = 0;
-	gpa = 0xfee000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-    /* 
-	 * ICLASS: OR             CATEGORY: LOGICAL           EXTENSION: BASE               IFORM: OR_GPRv_MEMv             ISA_SET: I86
-     * SHORT: or ax, word ptr [ecx+0x5dcec58]
-     * (rcx = lapic address, 0xff000000)                 OR reg16, r/m16/32
-	 * 66 0b 81 05 dc ec 58
-	 */
-
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0x0000aabb;
-	vm_regs[VM_REG_GUEST_RCX] = 0xff000000;
-	vie.inst[0] = 0x66;
-	vie.inst[1] = 0x0b;
-	vie.inst[2] = 0x81;
-	vie.inst[3] = 0x05;
-	vie.inst[4] = 0xdc;
-	vie.inst[5] = 0xec;
-	vie.inst[6] = 0x58;
-	vie.num_valid = 7;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000ff;
-	mc.val  = 0x0000aa00;
-	gpa = 0xff0000ff;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	/* 
-	 * ICLASS: OR             CATEGORY: LOGICAL           EXTENSION: BASE               IFORM: OR_GPRv_MEMv             ISA_SET: I86
-     * SHORT: or eax, word ptr [ecx+0x5dcec58]
-     * (rcx = lapic address, 0xff000000)                  OR reg32, r/m16/32
-	 * 0b 81 05 dc ec 58
-	 */
-
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0x0000aabb;
-	vm_regs[VM_REG_GUEST_RCX] = 0xff000000;
-	vie.inst[0] = 0x0b;
-	vie.inst[1] = 0x81;
-	vie.inst[2] = 0x05;
-	vie.inst[3] = 0xdc;
-	vie.inst[4] = 0xec;
-	vie.inst[5] = 0x58;
-	vie.num_valid = 6;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000ff;
-	mc.val  = 0x0000aa00;
-	gpa = 0xff0000ff;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	   
-	 /*
-	 * ICLASS: CMP             CATEGORY: BINARY               EXTENSION: BASE                 IFORM: CMP_MEMv_GPRv           ISA_SET: I86
-     * SHORT: cmp word ptr [ecx+0x58ecdc05], ax               CMP r/m16/32, reg16   
-	 * (rcx = lapic address, 0xff000000)  
-	 * 66 39 81 05 dc ec 58
-	 */
-
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0x0000aabb;
-	vm_regs[VM_REG_GUEST_RCX] = 0xff000000;
-	vm_regs[VM_REG_GUEST_RFLAGS]=0xff000000;
-	vie.inst[0] = 0x66;
-	vie.inst[1] = 0x39;
-	vie.inst[2] = 0x81;
-	vie.inst[3] = 0x05;
-	vie.inst[4] = 0xdc;
-	vie.inst[5] = 0xec;
-	vie.inst[6] = 0x58;
-	vie.num_valid = 7;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000f0;
-	mc.val  = 0x0000aa00;
-	gpa = 0xff0000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-    /*
-	 * ICLASS: CMP             CATEGORY: BINARY               EXTENSION: BASE                 IFORM: CMP_MEMv_GPRv           ISA_SET: I86
-     * SHORT: cmp dword ptr [ecx+0x58ecdc05], eax             CMP r/m16/32, reg32   
-	 * (rcx = lapic address, 0xff000000)  
-	 * 39 81 05 dc ec 58
-	 */
-	
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0x0000aabb;
-	vm_regs[VM_REG_GUEST_RCX] = 0xff000000;
-	vm_regs[VM_REG_GUEST_RFLAGS]=0xff000000;
-	vie.inst[0] = 0x39;
-	vie.inst[1] = 0x80;
-	vie.inst[2] = 0x05;
-	vie.inst[3] = 0xdc;
-	vie.inst[4] = 0xec;
-	vie.inst[5] = 0x58;
-	vie.num_valid = 6;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000f0;
-	mc.val  = 0x0000aa00;
-	gpa = 0xff0000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-    
-	/*
-	 * ICLASS: CMP                CATEGORY: BINARY                 EXTENSION: BASE               IFORM: CMP_GPRv_MEMv       ISA_SET: I86
-     * SHORT: cmp ax, word ptr [ecx+0x58ecdc05]                     CMP r16, r/m16/32
-     * (rcx = lapic address, 0xff000000)  
-	 * 66 3b 81 05 dc ec 58
-	 */
-	
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0x0000aabb;
-	vm_regs[VM_REG_GUEST_RCX] = 0xff000000;
-	vm_regs[VM_REG_GUEST_RFLAGS]=0xff000000;
-	vie.inst[0] = 0x66;
-	vie.inst[1] = 0x3b;
-	vie.inst[2] = 0x81;
-	vie.inst[3] = 0x05;
-	vie.inst[4] = 0xdc;
-	vie.inst[5] = 0xec;
-	vie.inst[6] = 0x58;
-	vie.num_valid = 7;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000f0;
-	mc.val  = 0x0000aa00;
-	gpa = 0xff0000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	/*
-	 * ICLASS: CMP                CATEGORY: BINARY                 EXTENSION: BASE               IFORM: CMP_GPRv_MEMv       ISA_SET: I86
-     * SHORT: cmp eax, dword ptr [ecx+0x58ecdc05]                  CMP r32, r/m16/32
-     * (rcx = lapic address, 0xff000000)  
-	 * 3b 81 05 dc ec 58
-	 */
-	
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0x0000aabb;
-	vm_regs[VM_REG_GUEST_RCX] = 0xff000000;
-	vm_regs[VM_REG_GUEST_RFLAGS]=0xff000000;
-	vie.inst[0] = 0x3b;
-	vie.inst[1] = 0x81;
-	vie.inst[2] = 0x05;
-	vie.inst[3] = 0xdc;
-	vie.inst[4] = 0xec;
-	vie.inst[5] = 0x58;
-	vie.num_valid = 6;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000f0;
-	mc.val  = 0x0000aa00;
-	gpa = 0xff0000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-
-	/*
-	 * ICLASS: BT              CATEGORY: BITBYTE                   EXTENSION: BASE              IFORM: BT_MEMv_IMMb       ISA_SET: I386
-     * SHORT: bt word ptr [ecx+0x58ecdc05], 0xff                    BT r/m16, imm8  
-     * 0x66, 0x0F, 0xBA, 0xA1, 0x05, 0xDC, 0xEC, 0x58, 0xFF
-     */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0xff000000;
-	vm_regs[VM_REG_GUEST_RFLAGS]=0xff000000;
-	vie.inst[0] = 0x66;
-	vie.inst[1] = 0x0f;
-	vie.inst[2] = 0xba;
-	vie.inst[3] = 0xa1;
-	vie.inst[4] = 0x05;
-	vie.inst[5] = 0xdc;
-	vie.inst[6] = 0xec;
-	vie.inst[7] = 0x58;
-	vie.inst[8] = 0xff;
-	vie.num_valid = 9;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000f0;
-	mc.val  = 0x0000a1aa;
-	gpa = 0xff0000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);s
-	assert(err == 0);
-	assert(mc.val == 0xa0aa);
-    
-
-    /*
-	 * ICLASS: BT              CATEGORY: BITBYTE                 EXTENSION: BASE             IFORM: BT_MEMv_IMMb          ISA_SET: I386
-     * SHORT: bt dword ptr [ecx+0x58ecdc05], 0xff                 BT r/m32, imm8
-     * 0x0F, 0xBA, 0xA1, 0x05, 0xDC, 0xEC, 0x58, 0xFF
-     */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0xff000000;
-	vm_regs[VM_REG_GUEST_RFLAGS]=0xff000000;
-	vie.inst[0] = 0x0f;
-	vie.inst[1] = 0xba;
-	vie.inst[2] = 0xa1;
-	vie.inst[3] = 0x05;
-	vie.inst[4] = 0xdc;
-	vie.inst[5] = 0xec;
-	vie.inst[6] = 0x58;
-	vie.inst[7] = 0xff;
-	vie.num_valid = 8;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000f0;
-	mc.val  = 0x0000a1aa;
-	gpa = 0xff0000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);s
-	assert(err == 0);
-	assert(mc.val == 0xa0aa);
-    
-
-	
-	/*
-	 * (rax = lapic address, 0xff000000)
-     * mov   $ff,0xf0(%rax)             || mov r/m8, imm8  ( XXX Group 11 extended opcode - not just MOV )
-     * 0xc6 0xf0 0x00 0x00 0x00 0xff
-     */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0xff000000;
-	vm_regs[VM_REG_GUEST_RFLAGS]=0xff000000;
-	vie.inst[0] = 0xc6;
-	vie.inst[1] = 0xf0;
-	vie.inst[2] = 0x00;
-	vie.inst[3] = 0x00;
-	vie.inst[4] = 0x00;
-	vie.inst[5] = 0xff;
-	vie.num_valid = 6;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000f0;
-	mc.val  = 0x0000a1aa;
-	gpa = 0xff0000f0;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xa0aa);
-
-	/*
-	 * ICLASS: SUB                 CATEGORY: BINARY               EXTENSION: BASE            IFORM: SUB_GPRv_MEMv        ISA_SET: I86
-     * SHORT: sub ax, word ptr [ecx+0x5ecdc05]                     SUB r16, r/m16
-	 * 0x66 0x2b 0x81 0x05 0xdc 0xec 0x05 
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0x0000aabb;
-	vm_regs[VM_REG_GUEST_RCX] = 0xff000000;
-	vie.inst[0] = 0x66;
-	vie.inst[1] = 0x2b;
-	vie.inst[2] = 0x81;
-	vie.inst[3] = 0x05;
-	vie.inst[4] = 0xdc;
-	vie.inst[5] = 0xec;
-	vie.inst[6] = 0x05;
-	vie.num_valid = 7;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000ff;
-	mc.val  = 0x0000aa00;
-	gpa = 0xff0000ff;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-
-	/*
-	 * ICLASS: SUB                 CATEGORY: BINARY               EXTENSION: BASE            IFORM: SUB_GPRv_MEMv        ISA_SET: I86
-     * SHORT: sub eax, dword ptr [ecx+0x5ecdc05]                   SUB r32, r/m32
-	 * 0x2b 0x81 0x05 0xdc 0xec 0x05 
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0x0000aabb;
-	vm_regs[VM_REG_GUEST_RCX] = 0xff000000;
-	vie.inst[0] = 0x2b;
-	vie.inst[1] = 0x81;
-	vie.inst[2] = 0x05;
-	vie.inst[3] = 0xdc;
-	vie.inst[4] = 0xec;
-	vie.inst[5] = 0x05;
-	vie.num_valid = 6;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000ff;
-	mc.val  = 0x0000aa00;
-	gpa = 0xff0000ff;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	/*
-	 * ICLASS: STOSB                 CATEGORY: STRINGOP                 EXTENSION: BASE             IFORM: STOSB           ISA_SET: I86
-     *  SHORT: stosb byte ptr [edi]                                       STOS m8, r8
-	 * 0xAA; 
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0x0000aabb;
-	vm_regs[VM_REG_GUEST_RCX] = 0xff000000;
-	vie.inst[0] = 0xaa;
-	vie.num_valid = 1;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000ff;
-	mc.val  = 0x0000aa00;
-	gpa = 0xff0000ff;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	/*
-	 * ICLASS: STOSW                   CATEGORY: STRINGOP               EXTENSION: BASE            IFORM: STOSW            ISA_SET: I86
-     * SHORT: stosw word ptr [edi]                                       STOS m16, r16
-	 * 0x66 0xAB
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0x0000aabb;
-	vm_regs[VM_REG_GUEST_RCX] = 0xff000000;
-	vie.inst[0] = 0x66;
-	vie.inst[1] = 0xab;
-	vie.num_valid = 2;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000ff;
-	mc.val  = 0x0000aa00;
-	gpa = 0xff0000ff;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	/*
-	 * ICLASS: STOSD              CATEGORY: STRINGOP                 EXTENSION: BASE               IFORM: STOSD           ISA_SET: I386
-     * SHORT: stosd dword ptr [edi]                                   STOS m32, r32
-	 * 0xAB; 
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0x0000aabb;
-	vm_regs[VM_REG_GUEST_RCX] = 0xff000000;
-	vie.inst[0] = 0xab;
-	vie.num_valid = 1;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000ff;
-	mc.val  = 0x0000aa00;
-	gpa = 0xff0000ff;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-    /* 
-	 * ICLASS: PUSH              CATEGORY: PUSH                EXTENSION: BASE               IFORM: PUSH_M              ISA_SET: I86
-     * SHORT: push dword ptr [ecx+0x5ecdc05]                   PUSH r/m 16/32
-     * 0xff 0xb1 0x05 0xdc 0xec 0x05
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0x0000aabb;
-	vm_regs[VM_REG_GUEST_RCX] = 0xff000000;
-	vie.inst[0] = 0xff;
-	vie.inst[1] = 0xb1;
-	vie.inst[2] = 0x05;
-	vie.inst[3] = 0xdc;
-	vie.isnt[4] = 0xec;
-	vie.inst[5] = 0x05;
-	vie.num_valid = 6;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000ff;
-	mc.val  = 0x0000aa00;
-	gpa = 0xff0000ff;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-	/* 
-	 * ICLASS: POP               CATEGORY: POP                    EXTENSION: BASE           IFORM: POP_MEMv          ISA_SET: I86
-     * SHORT: pop dword ptr [ecx+0x5ecdc05]                       POP r/m 16/32
-     * 0x8f 0x81 0x05 0xdc 0xec 0x05
-	 */
-	memset(&vie, 0, sizeof(struct vie));
-	vie.base_register = VM_REG_LAST;
-	vie.index_register = VM_REG_LAST;
-
-	vm_regs[VM_REG_GUEST_RAX] = 0x0000aabb;
-	vm_regs[VM_REG_GUEST_RCX] = 0xff000000;
-	vie.inst[0] = 0x8f;
-	vie.inst[1] = 0x81;
-	vie.inst[2] = 0x05;
-	vie.inst[3] = 0xdc;
-	vie.isnt[4] = 0xec;
-	vie.inst[5] = 0x05;
-	vie.num_valid = 6;
-
-	gla = 0;
-	err = vmm_decode_instruction(NULL, 0, gla, &vie);
-	assert(err == 0);
-
-	mc.addr = 0xff0000ff;
-	mc.val  = 0x0000aa00;
-	gpa = 0xff0000ff;
-	err = vmm_emulate_instruction(NULL, 0, gpa, &vie,
-				      test_mread, test_mwrite,
-				      &mc);
-	assert(err == 0);
-	assert(mc.val == 0xdeadbeef);
-
-
-
-
-
-   
-
-
-   
-
-   
-
-
+	FILE *out;
+	int fd;
+
+	fflush(stdout);
+	if ((fd = dup(STDOUT_FILENO)) < 0 || (out = fdopen(fd, "w")) == NULL)
+		err(1, "stdout");
+	if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+		err(1, "dup2");
+	return (out);
+}
 
+static void
+usage(void)
+{
 
+	fprintf(stderr,
+	    "usage: harness [-qs] [-F folded] [-n repeat] [-T trace] "
+	    "corpus ...\n"
+	    "       harness -o output.tvb corpus.tv\n"
+	    "       harness -r corpus.tv > recorded.tv\n"
+	    "       harness -g count [-S seed] corpus > generated.tv\n");
+	exit(1);
+}
 
+int
+main(int argc, char **argv)
+{
+	struct tvec_corpus c;
+#ifdef VIE_TRACE
+	struct vie_trace tr;
+#endif
+	uint64_t failed, total, start, elapsed, ngen, seed;
+	const char *folded, *output, *trace;
+	FILE *fp, *out;
+	int ch, error, i, quiet, record, repeat, stats;
+
+	output = trace = folded = NULL;
+	quiet = record = stats = 0;
+	repeat = 1;
+	ngen = 0;
+	seed = 1;
+	while ((ch = getopt(argc, argv, "F:g:n:o:qrsS:T:")) != -1) {
+		switch (ch) {
+		case 'F':
+#ifndef VIE_STAGES
+			errx(1, "-F: built without VIE_STAGES");
+#endif
+			folded = optarg;
+			break;
+		case 'g':
+			ngen = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			repeat = atoi(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'r':
+			record = 1;
+			break;
+		case 's':
+#ifndef VIE_STATS
+			errx(1, "-s: built without VIE_STATS");
+#endif
+			stats = 1;
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'T':
+#ifndef VIE_TRACE
+			errx(1, "-T: built without VIE_TRACE");
+#endif
+			trace = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0 || repeat < 1)
+		usage();
+
+	if (record) {
+		if (argc != 1 || output != NULL)
+			usage();
+		if ((fp = fopen(argv[0], "r")) == NULL)
+			err(1, "%s", argv[0]);
+		out = record_stream();
+		error = tvec_record(fp, argv[0], out, 0);
+		fclose(fp);
+		if (fclose(out) != 0)
+			err(1, "stdout");
+		return (error ? 1 : 0);
+	}
 
+	if (ngen != 0) {
+		if (argc != 1 || output != NULL)
+			usage();
+		if ((error = tvec_load(argv[0], &c)) != 0)
+			errc(1, error, "%s", argv[0]);
+		if ((fp = tmpfile()) == NULL)
+			err(1, "tmpfile");
+		if ((error = tvec_generate(&c, argv[0], ngen, seed, fp)) != 0)
+			errc(1, error, "%s", argv[0]);
+		tvec_free(&c);
+		rewind(fp);
+		out = record_stream();
+		error = tvec_record(fp, "generated", out, 0);
+		fclose(fp);
+		if (fclose(out) != 0)
+			err(1, "stdout");
+		return (error ? 1 : 0);
+	}
 
-	
+	if (output != NULL) {
+		if (argc != 1)
+			usage();
+		if ((error = tvec_load(argv[0], &c)) != 0)
+			errc(1, error, "%s", argv[0]);
+		if ((error = tvec_save(&c, output)) != 0)
+			errc(1, error, "%s", output);
+		printf("%s: %ju vectors, %zu bytes\n", output,
+		    (uintmax_t)c.hdr->count, c.len);
+		tvec_free(&c);
+		return (0);
+	}
 
+#ifdef VIE_TRACE
+	if (trace != NULL) {
+		if ((error = vie_trace_create(&tr, trace, 1, TRACE_NREC)) != 0)
+			errc(1, error, "%s", trace);
+		vie_trace_start(&tr);
+	}
+#endif
+
+	failed = total = elapsed = 0;
+	for (i = 0; i < argc; i++) {
+		if ((error = tvec_load(argv[i], &c)) != 0)
+			errc(1, error, "%s", argv[i]);
+		start = nsec();
+		failed += run(argv[i], &c, repeat, quiet);
+		elapsed += nsec() - start;
+		total += c.hdr->count * repeat;
+		tvec_free(&c);
+	}
 
+	printf("%ju vectors, %ju failed, %.0f vectors/s\n", (uintmax_t)total,
+	    (uintmax_t)failed, elapsed ? total * 1e9 / elapsed : 0);
+#ifdef VIE_STATS
+	if (stats)
+		print_stats();
+#endif
+#ifdef VIE_STAGES
+	if (folded != NULL) {
+		if ((fp = fopen(folded, "w")) == NULL)
+			err(1, "%s", folded);
+		print_folded(fp);
+		fclose(fp);
+	}
+#endif
+#ifdef VIE_TRACE
+	if (trace != NULL) {
+		vie_trace_stop();
+		vie_trace_close(&tr);
+	}
+#endif
+	return (failed ? 1 : 0);
 }
@@ -0,0 +1,193 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Tracepoint overhead benchmark.
+ *
+ * Decodes and emulates a mix of MMIO instructions on vCPU 0 in a loop and
+ * reports the time per instruction with the tracepoints disabled, enabled
+ * and enabled while another thread drains the ring as fast as it can, the
+ * way vie_trace -f does. The disabled figure is what a VIE_TRACE build
+ * costs when nobody traces; compare it with vie_bench, built without
+ * VIE_TRACE, for the cost of the tracepoints being compiled in at all.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "vmm_trace.h"
+#include "bench.h"
+
+#define	MMIO_BASE	0xfee00000UL
+#define	NPASS		3
+
+static const struct tb_inst {
+	const char	*name;
+	uint8_t		inst[VIE_INST_SIZE];
+	int		len;
+} insts[] = {
+	{ "movl %eax,0xb0(%rcx)", { 0x89, 0x81, 0xb0, 0, 0, 0 }, 6 },
+	{ "movl 0x10(%rcx),%edx", { 0x8b, 0x51, 0x10 }, 3 },
+	{ "andl $0xff,0x20(%rcx)", { 0x81, 0x61, 0x20, 0xff, 0, 0, 0 }, 7 },
+	{ "movzbl 0x30(%rcx),%eax", { 0x0f, 0xb6, 0x41, 0x30 }, 4 },
+};
+
+static struct vie_trace tr;
+static volatile int reader_stop;
+static uint64_t reader_drained, reader_lost;
+
+static int
+dev_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+
+	*rval = gpa;
+	return (0);
+}
+
+static int
+dev_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+
+	return (0);
+}
+
+static void *
+reader(void *arg)
+{
+	static struct vie_trace_rec buf[1024];
+	uint64_t tail;
+
+	if (arg != NULL)
+		bench_pin(*(int *)arg);
+	tail = 0;
+	while (!reader_stop)
+		reader_drained += vie_trace_drain(&tr, 0, &tail, buf,
+		    nitems(buf), &reader_lost);
+	return (NULL);
+}
+
+/* Nanoseconds per decoded and emulated instruction */
+static double
+run(struct vm_guest_paging *paging, size_t niter, double ghz)
+{
+	struct vie vie;
+	const struct tb_inst *ti;
+	uint64_t t0, best;
+	size_t i;
+	int pass;
+
+	best = UINT64_MAX;
+	for (pass = 0; pass < NPASS; pass++) {
+		t0 = bench_rdtsc();
+		for (i = 0; i < niter; i++) {
+			ti = &insts[i % nitems(insts)];
+			memset(&vie, 0, sizeof(vie));
+			vie.base_register = VM_REG_LAST;
+			vie.index_register = VM_REG_LAST;
+			vie.segment_register = VM_REG_LAST;
+			memcpy(vie.inst, ti->inst, ti->len);
+			vie.num_valid = ti->len;
+			vm_set_register(NULL, 0, VM_REG_GUEST_RCX, MMIO_BASE);
+			if (vmm_decode_instruction(NULL, 0, VIE_INVALID_GLA,
+			    CPU_MODE_64BIT, 0, &vie) != 0)
+				errx(1, "%s: cannot decode", ti->name);
+			if (vmm_emulate_instruction(NULL, 0, MMIO_BASE, &vie,
+			    paging, dev_mread, dev_mwrite, NULL) != 0)
+				errx(1, "%s: cannot emulate", ti->name);
+		}
+		best = MIN(best, bench_rdtsc() - t0);
+	}
+	return (best / ghz / niter);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: trace_bench [-c vcpu_cpu] [-n iterations] "
+	    "[-r reader_cpu] [-s ring_records]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct vm_guest_paging paging;
+	pthread_t td;
+	uint64_t head0, records;
+	size_t niter;
+	uint32_t nrec;
+	double ghz, off, on, drained;
+	int ch, error, reader_cpu, vcpu_cpu;
+
+	niter = 1000000;
+	nrec = 1 << 16;
+	reader_cpu = vcpu_cpu = -1;
+	while ((ch = getopt(argc, argv, "c:n:r:s:")) != -1) {
+		switch (ch) {
+		case 'c':
+			vcpu_cpu = atoi(optarg);
+			break;
+		case 'n':
+			niter = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			reader_cpu = atoi(optarg);
+			break;
+		case 's':
+			nrec = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || niter == 0)
+		usage();
+
+	if ((error = vie_trace_create(&tr, NULL, 1, nrec)) != 0)
+		errc(1, error, "vie_trace_create");
+	if (vcpu_cpu >= 0)
+		bench_pin(vcpu_cpu);
+	ghz = bench_tsc_ghz();
+	memset(&paging, 0, sizeof(paging));
+	paging.cpu_mode = CPU_MODE_64BIT;
+	paging.paging_mode = PAGING_MODE_64;
+
+	vie_trace_stop();
+	off = run(&paging, niter, ghz);
+	printf("%-24s %7.1f ns/inst\n", "tracepoints disabled", off);
+
+	vie_trace_start(&tr);
+	head0 = vie_trace_written(&tr, 0);
+	on = run(&paging, niter, ghz);
+	records = vie_trace_written(&tr, 0) - head0;
+	printf("%-24s %7.1f ns/inst  +%.1f ns, %.1f records/inst, "
+	    "%.1f ns/record\n", "tracepoints enabled", on, on - off,
+	    (double)records / (NPASS * niter),
+	    records ? (on - off) * NPASS * niter / records : 0);
+
+	reader_stop = 0;
+	if (pthread_create(&td, NULL, reader,
+	    reader_cpu >= 0 ? &reader_cpu : NULL) != 0)
+		errx(1, "pthread_create");
+	on = run(&paging, niter, ghz);
+	reader_stop = 1;
+	pthread_join(td, NULL);
+	vie_trace_stop();
+	drained = reader_drained + reader_lost;
+	printf("%-24s %7.1f ns/inst  +%.1f ns, %.1f%% of records lost\n",
+	    "enabled, with reader", on, on - off,
+	    drained ? 100 * reader_lost / drained : 0);
+
+	vie_trace_close(&tr);
+	return (0);
+}
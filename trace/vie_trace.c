@@ -0,0 +1,132 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Emulation event ring reader.
+ *
+ * Maps the rings written by an emulator built with VIE_TRACE (see
+ * vmm_trace.h) read-only and prints their records, one per line:
+ *
+ *	vcpu tsc event arg a0 a1
+ *
+ * With -f it keeps draining them every 'interval' ms, like tail -f, for
+ * as long as it runs. Records overwritten before they could be read are
+ * counted and reported on stderr.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <err.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "vmm_trace.h"
+
+#define	TRACE_BATCH	1024
+
+static volatile sig_atomic_t done;
+
+static void
+onsig(int sig)
+{
+
+	done = 1;
+}
+
+static void
+print_rec(const struct vie_trace_rec *rec)
+{
+	const char *name;
+
+	name = vie_trace_event_name(rec->event);
+	printf("%u %ju ", rec->vcpuid, (uintmax_t)rec->tsc);
+	if (name != NULL)
+		printf("%s", name);
+	else
+		printf("event%u", rec->event);
+	printf(" %#x %#jx %#jx\n", rec->arg, (uintmax_t)rec->a0,
+	    (uintmax_t)rec->a1);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: vie_trace [-f] [-c vcpu] [-i interval] "
+	    "trace\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct vie_trace_rec buf[TRACE_BATCH];
+	struct vie_trace tr;
+	uint64_t tail[VIE_TRACE_MAXCPU], lost[VIE_TRACE_MAXCPU];
+	size_t i, n;
+	int ch, error, follow, interval, more, v, vcpu;
+
+	follow = 0;
+	interval = 100;
+	vcpu = -1;
+	while ((ch = getopt(argc, argv, "c:fi:")) != -1) {
+		switch (ch) {
+		case 'c':
+			vcpu = atoi(optarg);
+			break;
+		case 'f':
+			follow = 1;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || interval < 1)
+		usage();
+
+	if ((error = vie_trace_attach(&tr, argv[0])) != 0)
+		errc(1, error, "%s", argv[0]);
+	if (vcpu >= (int)tr.hdr->nvcpu)
+		errx(1, "%s: %u vcpus", argv[0], tr.hdr->nvcpu);
+
+	signal(SIGINT, onsig);
+	signal(SIGTERM, onsig);
+
+	for (v = 0; v < VIE_TRACE_MAXCPU; v++)
+		tail[v] = lost[v] = 0;
+	do {
+		/* Drain every ring in turn until all of them are empty */
+		do {
+			more = 0;
+			for (v = 0; v < (int)tr.hdr->nvcpu; v++) {
+				if (vcpu >= 0 && v != vcpu)
+					continue;
+				n = vie_trace_drain(&tr, v, &tail[v], buf,
+				    nitems(buf), &lost[v]);
+				for (i = 0; i < n; i++)
+					print_rec(&buf[i]);
+				if (n != 0)
+					more = 1;
+			}
+		} while (more && !done);
+		fflush(stdout);
+		if (follow && !done)
+			usleep(interval * 1000);
+	} while (follow && !done);
+
+	for (v = 0; v < (int)tr.hdr->nvcpu; v++) {
+		if (lost[v] != 0)
+			warnx("vcpu %d: %ju records lost", v,
+			    (uintmax_t)lost[v]);
+	}
+	vie_trace_close(&tr);
+	return (0);
+}
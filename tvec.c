@@ -0,0 +1,991 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Test vector compiler, loader and runner.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <x86/psl.h>
+
+#include "vmm_stubs.h"
+#include "tvec.h"
+
+#define	TVEC_MAXSIZE	(sizeof(struct tvec) +				\
+			 2 * TVEC_MAXREG * sizeof(struct tvec_reg) +	\
+			 2 * TVEC_MAXMEM * sizeof(struct tvec_mem))
+
+#define	TVEC_MAXLINE	256
+#define	TVEC_MAXARGS	(VIE_INST_SIZE + 1)
+
+#define	TVEC_RFLAGS_STATUS	\
+	(PSL_C | PSL_PF | PSL_AF | PSL_Z | PSL_N | PSL_V)
+
+struct tvec_cpu	tvec_cpu[TVEC_MAXCPU];
+
+/* A vector while it is being parsed */
+struct tvec_build {
+	struct tvec	tv;
+	struct tvec_reg	reg_in[TVEC_MAXREG];
+	struct tvec_mem	mem_in[TVEC_MAXMEM];
+	struct tvec_reg	reg_out[TVEC_MAXREG];
+	struct tvec_mem	mem_out[TVEC_MAXMEM];
+	int		csd_set;	/* 'csd' was given explicitly */
+};
+
+static const char *tvec_regnames[VM_REG_LAST] = {
+	[VM_REG_GUEST_RAX] = "rax",
+	[VM_REG_GUEST_RBX] = "rbx",
+	[VM_REG_GUEST_RCX] = "rcx",
+	[VM_REG_GUEST_RDX] = "rdx",
+	[VM_REG_GUEST_RSI] = "rsi",
+	[VM_REG_GUEST_RDI] = "rdi",
+	[VM_REG_GUEST_RBP] = "rbp",
+	[VM_REG_GUEST_R8] = "r8",
+	[VM_REG_GUEST_R9] = "r9",
+	[VM_REG_GUEST_R10] = "r10",
+	[VM_REG_GUEST_R11] = "r11",
+	[VM_REG_GUEST_R12] = "r12",
+	[VM_REG_GUEST_R13] = "r13",
+	[VM_REG_GUEST_R14] = "r14",
+	[VM_REG_GUEST_R15] = "r15",
+	[VM_REG_GUEST_CR0] = "cr0",
+	[VM_REG_GUEST_CR3] = "cr3",
+	[VM_REG_GUEST_CR4] = "cr4",
+	[VM_REG_GUEST_DR7] = "dr7",
+	[VM_REG_GUEST_RSP] = "rsp",
+	[VM_REG_GUEST_RIP] = "rip",
+	[VM_REG_GUEST_RFLAGS] = "rflags",
+	[VM_REG_GUEST_ES] = "es",
+	[VM_REG_GUEST_CS] = "cs",
+	[VM_REG_GUEST_SS] = "ss",
+	[VM_REG_GUEST_DS] = "ds",
+	[VM_REG_GUEST_FS] = "fs",
+	[VM_REG_GUEST_GS] = "gs",
+	[VM_REG_GUEST_LDTR] = "ldtr",
+	[VM_REG_GUEST_TR] = "tr",
+	[VM_REG_GUEST_IDTR] = "idtr",
+	[VM_REG_GUEST_GDTR] = "gdtr",
+	[VM_REG_GUEST_EFER] = "efer",
+};
+
+static const char *tvec_modenames[] = {
+	[CPU_MODE_REAL] = "real",
+	[CPU_MODE_PROTECTED] = "prot",
+	[CPU_MODE_COMPATIBILITY] = "compat",
+	[CPU_MODE_64BIT] = "64",
+};
+
+static const struct {
+	int		error;
+	const char	*name;
+} tvec_errnames[] = {
+	{ EINVAL, "EINVAL" },
+	{ EFAULT, "EFAULT" },
+	{ ENOENT, "ENOENT" },
+	{ EOPNOTSUPP, "EOPNOTSUPP" },
+};
+
+static const struct {
+	int		vector;
+	const char	*name;
+} tvec_excnames[] = {
+	{ TVEC_EXC_SS, "ss" },
+	{ TVEC_EXC_GP, "gp" },
+	{ TVEC_EXC_PF, "pf" },
+	{ TVEC_EXC_AC, "ac" },
+};
+
+static int
+tvec_lookup(const char *const *names, int n, const char *name)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (names[i] != NULL && strcmp(names[i], name) == 0)
+			return (i);
+	}
+	return (-1);
+}
+
+static int
+tvec_parse_uint(const char *s, uint64_t *val)
+{
+	char *end;
+
+	if (s == NULL || *s == '\0')
+		return (-1);
+	*val = strtoull(s, &end, 0);
+	return (*end == '\0' ? 0 : -1);
+}
+
+static int
+tvec_parse_mem(char **argv, int argc, struct tvec_mem *m, int flags)
+{
+	uint64_t size;
+
+	if (argc != 3 || tvec_parse_uint(argv[0], &m->gpa) != 0 ||
+	    tvec_parse_uint(argv[1], &size) != 0 ||
+	    tvec_parse_uint(argv[2], &m->val) != 0)
+		return (-1);
+	if (size == 0 || !powerof2(size) || size > 8)
+		return (-1);
+	m->size = size;
+	m->flags = flags;
+	if (size < 8)
+		m->val &= (1UL << (size * 8)) - 1;
+	return (0);
+}
+
+static int
+tvec_parse_reg(char **argv, int argc, struct tvec_reg *r)
+{
+	int reg;
+
+	if (argc != 2)
+		return (-1);
+	reg = tvec_lookup(tvec_regnames, VM_REG_LAST, argv[0]);
+	if (reg < 0 || tvec_parse_uint(argv[1], &r->val) != 0)
+		return (-1);
+	r->reg = reg;
+	return (0);
+}
+
+static int
+tvec_parse_expect(struct tvec_build *b, char **argv, int argc)
+{
+	struct tvec *tv;
+	uint64_t val;
+	int i;
+
+	tv = &b->tv;
+	if (strcmp(argv[0], "reg") == 0) {
+		if (tv->nreg_out >= TVEC_MAXREG)
+			return (-1);
+		return (tvec_parse_reg(argv + 1, argc - 1,
+		    &b->reg_out[tv->nreg_out++]));
+	} else if (strcmp(argv[0], "mem") == 0) {
+		if (tv->nmem_out >= TVEC_MAXMEM)
+			return (-1);
+		return (tvec_parse_mem(argv + 1, argc - 1,
+		    &b->mem_out[tv->nmem_out++], 0));
+	} else if (strcmp(argv[0], "decode-error") == 0 && argc == 1) {
+		tv->result = TVEC_DECODE_ERROR;
+		return (0);
+	} else if (strcmp(argv[0], "error") == 0 && argc == 2) {
+		tv->result = TVEC_EMULATE_ERROR;
+		for (i = 0; i < (int)nitems(tvec_errnames); i++) {
+			if (strcmp(argv[1], tvec_errnames[i].name) == 0) {
+				tv->error = tvec_errnames[i].error;
+				return (0);
+			}
+		}
+		if (tvec_parse_uint(argv[1], &val) != 0 || val == 0 ||
+		    val > 255)
+			return (-1);
+		tv->error = val;
+		return (0);
+	} else if (strcmp(argv[0], "exception") == 0 && argc == 2) {
+		for (i = 0; i < (int)nitems(tvec_excnames); i++) {
+			if (strcmp(argv[1], tvec_excnames[i].name) == 0) {
+				tv->exception = tvec_excnames[i].vector;
+				return (0);
+			}
+		}
+		return (-1);
+	}
+	return (-1);
+}
+
+/*
+ * Parse one line into 'b'. Returns 1 when the line ends a vector, 0 if more
+ * lines are needed and -1 on a syntax error.
+ */
+static int
+tvec_parse_line(struct tvec_build *b, char *line)
+{
+	struct tvec *tv;
+	char *argv[TVEC_MAXARGS], *p;
+	uint64_t val;
+	int argc, i, mode;
+
+	if ((p = strchr(line, '#')) != NULL)
+		*p = '\0';
+
+	argc = 0;
+	for (p = strtok(line, " \t\r\n"); p != NULL;
+	    p = strtok(NULL, " \t\r\n")) {
+		if (argc == TVEC_MAXARGS)
+			return (-1);
+		argv[argc++] = p;
+	}
+	if (argc == 0)
+		return (0);
+
+	tv = &b->tv;
+	if (strcmp(argv[0], "end") == 0 && argc == 1) {
+		if (tv->inst_len == 0)
+			return (-1);
+		if (!b->csd_set && tv->cpu_mode != CPU_MODE_64BIT &&
+		    tv->cpu_mode != CPU_MODE_REAL)
+			tv->flags |= TVEC_F_CSD;
+		return (1);
+	} else if (strcmp(argv[0], "inst") == 0) {
+		if (argc - 1 > VIE_INST_SIZE || argc == 1)
+			return (-1);
+		for (i = 1; i < argc; i++) {
+			if (!isxdigit(argv[i][0]) || strlen(argv[i]) != 2)
+				return (-1);
+			tv->inst[i - 1] = strtoul(argv[i], NULL, 16);
+		}
+		tv->inst_len = argc - 1;
+		return (0);
+	} else if (strcmp(argv[0], "mode") == 0 && argc == 2) {
+		mode = tvec_lookup(tvec_modenames, nitems(tvec_modenames),
+		    argv[1]);
+		if (mode < 0)
+			return (-1);
+		tv->cpu_mode = mode;
+		return (0);
+	} else if (strcmp(argv[0], "csd") == 0 && argc == 2) {
+		if (tvec_parse_uint(argv[1], &val) != 0 || val > 1)
+			return (-1);
+		tv->flags = (tv->flags & ~TVEC_F_CSD) | (val ? TVEC_F_CSD : 0);
+		b->csd_set = 1;
+		return (0);
+	} else if (strcmp(argv[0], "gpa") == 0 && argc == 2) {
+		return (tvec_parse_uint(argv[1], &tv->gpa));
+	} else if (strcmp(argv[0], "gla") == 0 && argc == 2) {
+		return (tvec_parse_uint(argv[1], &tv->gla));
+	} else if (strcmp(argv[0], "np") == 0 && argc == 3) {
+		if (tvec_parse_uint(argv[1], &tv->np_gla) != 0 ||
+		    tvec_parse_uint(argv[2], &tv->np_len) != 0 ||
+		    tv->np_len == 0)
+			return (-1);
+		return (0);
+	} else if (strcmp(argv[0], "reg") == 0) {
+		if (tv->nreg_in >= TVEC_MAXREG)
+			return (-1);
+		return (tvec_parse_reg(argv + 1, argc - 1,
+		    &b->reg_in[tv->nreg_in++]));
+	} else if (strcmp(argv[0], "mem") == 0 ||
+	    strcmp(argv[0], "ram") == 0) {
+		if (tv->nmem_in >= TVEC_MAXMEM)
+			return (-1);
+		return (tvec_parse_mem(argv + 1, argc - 1,
+		    &b->mem_in[tv->nmem_in++],
+		    argv[0][0] == 'r' ? TVEC_MEM_RAM : 0));
+	} else if (strcmp(argv[0], "expect") == 0 && argc > 1) {
+		return (tvec_parse_expect(b, argv + 1, argc - 1));
+	}
+	return (-1);
+}
+
+static void
+tvec_build_init(struct tvec_build *b)
+{
+
+	memset(&b->tv, 0, sizeof(struct tvec));
+	b->tv.cpu_mode = CPU_MODE_64BIT;
+	b->tv.gla = VIE_INVALID_GLA;
+	b->csd_set = 0;
+}
+
+/* Lay out 'b' as a contiguous record at 'dst' and return its size */
+static size_t
+tvec_pack(struct tvec_build *b, void *dst)
+{
+	struct tvec *tv;
+	char *p;
+
+	tv = &b->tv;
+	p = (char *)dst + sizeof(struct tvec);
+	memcpy(p, b->reg_in, tv->nreg_in * sizeof(struct tvec_reg));
+	p += tv->nreg_in * sizeof(struct tvec_reg);
+	memcpy(p, b->mem_in, tv->nmem_in * sizeof(struct tvec_mem));
+	p += tv->nmem_in * sizeof(struct tvec_mem);
+	memcpy(p, b->reg_out, tv->nreg_out * sizeof(struct tvec_reg));
+	p += tv->nreg_out * sizeof(struct tvec_reg);
+	memcpy(p, b->mem_out, tv->nmem_out * sizeof(struct tvec_mem));
+	p += tv->nmem_out * sizeof(struct tvec_mem);
+
+	tv->size = p - (char *)dst;
+	memcpy(dst, tv, sizeof(struct tvec));
+	return (tv->size);
+}
+
+int
+tvec_compile(FILE *fp, const char *name, struct tvec_corpus *c)
+{
+	struct tvec_build b;
+	struct tvec_hdr *hdr;
+	char line[TVEC_MAXLINE];
+	size_t cap, len;
+	void *p;
+	int error, lineno, r;
+
+	cap = 64 * 1024;
+	hdr = malloc(cap);
+	if (hdr == NULL)
+		return (ENOMEM);
+	memset(hdr, 0, sizeof(struct tvec_hdr));
+	len = sizeof(struct tvec_hdr);
+
+	error = 0;
+	lineno = 0;
+	tvec_build_init(&b);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		r = tvec_parse_line(&b, line);
+		if (r < 0) {
+			fprintf(stderr, "%s:%d: syntax error\n", name, lineno);
+			error = EINVAL;
+			continue;
+		}
+		if (r == 0)
+			continue;
+
+		if (cap - len < TVEC_MAXSIZE) {
+			cap *= 2;
+			if ((p = realloc(hdr, cap)) == NULL) {
+				free(hdr);
+				return (ENOMEM);
+			}
+			hdr = p;
+		}
+		b.tv.line = lineno;
+		len += tvec_pack(&b, (char *)hdr + len);
+		hdr->count++;
+		tvec_build_init(&b);
+	}
+	if (b.tv.inst_len != 0) {
+		fprintf(stderr, "%s:%d: missing 'end'\n", name, lineno);
+		error = EINVAL;
+	}
+	if (error) {
+		free(hdr);
+		return (error);
+	}
+
+	hdr->magic = TVEC_MAGIC;
+	hdr->version = TVEC_VERSION;
+	hdr->size = len;
+	c->hdr = hdr;
+	c->len = len;
+	c->mapped = 0;
+	return (0);
+}
+
+static int
+tvec_check_regs(const struct tvec_reg *r, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (r[i].reg >= VM_REG_LAST)
+			return (EFTYPE);
+	return (0);
+}
+
+static int
+tvec_check_mems(const struct tvec_mem *m, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (m[i].size == 0 || !powerof2(m[i].size) || m[i].size > 8 ||
+		    (m[i].flags & ~TVEC_MEM_RAM) != 0)
+			return (EFTYPE);
+	return (0);
+}
+
+/*
+ * Make sure every record of a mapped corpus lies within the file and holds
+ * nothing the runner would use as an out of range index or size.
+ */
+static int
+tvec_check(const struct tvec_corpus *c)
+{
+	const struct tvec *tv;
+	const char *end;
+	uint64_t i;
+	size_t min;
+	int j;
+
+	if (c->len < sizeof(struct tvec_hdr) || c->hdr->magic != TVEC_MAGIC ||
+	    c->hdr->version != TVEC_VERSION || c->hdr->size != c->len)
+		return (EFTYPE);
+
+	end = (const char *)c->hdr + c->len;
+	tv = tvec_first(c);
+	for (i = 0; i < c->hdr->count; i++) {
+		if ((const char *)tv + sizeof(struct tvec) > end)
+			return (EFTYPE);
+		min = sizeof(struct tvec) +
+		    (tv->nreg_in + tv->nreg_out) * sizeof(struct tvec_reg) +
+		    (tv->nmem_in + tv->nmem_out) * sizeof(struct tvec_mem);
+		if (tv->size != min || (const char *)tv + tv->size > end ||
+		    tv->nreg_in > TVEC_MAXREG || tv->nreg_out > TVEC_MAXREG ||
+		    tv->nmem_in > TVEC_MAXMEM || tv->nmem_out > TVEC_MAXMEM ||
+		    tv->inst_len == 0 || tv->inst_len > VIE_INST_SIZE ||
+		    tv->cpu_mode > CPU_MODE_64BIT ||
+		    tv->result > TVEC_EMULATE_ERROR)
+			return (EFTYPE);
+		if (tv->exception != TVEC_EXC_NONE) {
+			for (j = 0; j < (int)nitems(tvec_excnames); j++)
+				if (tvec_excnames[j].vector == tv->exception)
+					break;
+			if (j == (int)nitems(tvec_excnames))
+				return (EFTYPE);
+		}
+		if (tvec_check_regs(tvec_reg_in(tv), tv->nreg_in) != 0 ||
+		    tvec_check_regs(tvec_reg_out(tv), tv->nreg_out) != 0 ||
+		    tvec_check_mems(tvec_mem_in(tv), tv->nmem_in) != 0 ||
+		    tvec_check_mems(tvec_mem_out(tv), tv->nmem_out) != 0)
+			return (EFTYPE);
+		tv = tvec_next(tv);
+	}
+	return (0);
+}
+
+int
+tvec_load(const char *path, struct tvec_corpus *c)
+{
+	struct stat sb;
+	uint32_t magic;
+	FILE *fp;
+	void *p;
+	int error, fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return (errno);
+
+	if (read(fd, &magic, sizeof(magic)) != sizeof(magic) ||
+	    magic != TVEC_MAGIC) {
+		/* Not a compiled corpus, treat it as text */
+		if ((fp = fdopen(fd, "r")) == NULL) {
+			error = errno;
+			close(fd);
+			return (error);
+		}
+		rewind(fp);
+		error = tvec_compile(fp, path, c);
+		fclose(fp);
+		return (error);
+	}
+
+	if (fstat(fd, &sb) != 0) {
+		error = errno;
+		close(fd);
+		return (error);
+	}
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	error = errno;
+	close(fd);
+	if (p == MAP_FAILED)
+		return (error);
+
+	c->hdr = p;
+	c->len = sb.st_size;
+	c->mapped = 1;
+	if ((error = tvec_check(c)) != 0) {
+		tvec_free(c);
+		return (error);
+	}
+	return (0);
+}
+
+int
+tvec_save(const struct tvec_corpus *c, const char *path)
+{
+	FILE *fp;
+	int error;
+
+	if ((fp = fopen(path, "w")) == NULL)
+		return (errno);
+
+	error = 0;
+	if (fwrite(c->hdr, c->len, 1, fp) != 1)
+		error = errno;
+	if (fclose(fp) != 0 && error == 0)
+		error = errno;
+	return (error);
+}
+
+void
+tvec_free(struct tvec_corpus *c)
+{
+
+	if (c->mapped)
+		munmap(c->hdr, c->len);
+	else
+		free(c->hdr);
+	c->hdr = NULL;
+	c->len = 0;
+}
+
+static void
+tvec_setup(struct vm_stub_vcpu *vc, struct tvec_cpu *cpu,
+    const struct tvec *tv, struct vm_guest_paging *paging)
+{
+	const struct tvec_reg *r;
+	struct tvec_mem *m;
+	struct vie *vie;
+	int i;
+
+	vm_stub_reset(vc);
+	vc->np_gla = tv->np_gla;
+	vc->np_len = tv->np_len;
+	r = tvec_reg_in(tv);
+	for (i = 0; i < tv->nreg_in; i++)
+		vc->regs[r[i].reg] = r[i].val;
+
+	memcpy(cpu->mem, tvec_mem_in(tv),
+	    tv->nmem_in * sizeof(struct tvec_mem));
+	cpu->nmem = tv->nmem_in;
+	for (i = 0; i < cpu->nmem; i++) {
+		m = &cpu->mem[i];
+		if ((m->flags & TVEC_MEM_RAM) != 0)
+			vm_stub_map(vc, m->gpa, m->size, &m->val);
+	}
+	cpu->result = TVEC_OK;
+	cpu->error = 0;
+
+	vie = &cpu->vie;
+	memset(vie, 0, sizeof(struct vie));
+	vie->base_register = VM_REG_LAST;
+	vie->index_register = VM_REG_LAST;
+	vie->segment_register = VM_REG_LAST;
+	memcpy(vie->inst, tv->inst, tv->inst_len);
+	vie->num_valid = tv->inst_len;
+
+	paging->cr3 = vc->regs[VM_REG_GUEST_CR3];
+	paging->cpl = 0;
+	paging->cpu_mode = tv->cpu_mode;
+	if (tv->cpu_mode == CPU_MODE_64BIT ||
+	    tv->cpu_mode == CPU_MODE_COMPATIBILITY)
+		paging->paging_mode = PAGING_MODE_64;
+	else
+		paging->paging_mode = PAGING_MODE_FLAT;
+}
+
+static void
+tvec_exec(int vcpu, struct tvec_cpu *cpu, const struct tvec *tv)
+{
+	struct vm_guest_paging paging;
+	int error;
+
+	tvec_setup(vm_stub_vcpu(NULL, vcpu), cpu, tv, &paging);
+
+	if (vmm_decode_instruction(NULL, vcpu, tv->gla, tv->cpu_mode,
+	    (tv->flags & TVEC_F_CSD) != 0, &cpu->vie) != 0) {
+		cpu->result = TVEC_DECODE_ERROR;
+		return;
+	}
+
+	error = vmm_emulate_instruction(NULL, vcpu, tv->gpa, &cpu->vie,
+	    &paging, tvec_mread, tvec_mwrite, NULL);
+	if (error) {
+		cpu->result = TVEC_EMULATE_ERROR;
+		cpu->error = error;
+	}
+}
+
+static const struct tvec_mem *
+tvec_cell(const struct tvec_cpu *cpu, uint64_t gpa)
+{
+	int i;
+
+	for (i = 0; i < cpu->nmem; i++) {
+		if (cpu->mem[i].gpa == gpa)
+			return (&cpu->mem[i]);
+	}
+	return (NULL);
+}
+
+static uint64_t
+tvec_cell_val(const struct tvec_mem *m)
+{
+
+	if (m->size < 8)
+		return (m->val & ((1UL << (m->size * 8)) - 1));
+	return (m->val);
+}
+
+int
+tvec_run(int vcpu, const struct tvec *tv)
+{
+	const struct tvec_reg *r;
+	const struct tvec_mem *m, *cell;
+	struct vm_stub_vcpu *vc;
+	struct tvec_cpu *cpu;
+	int i;
+
+	KASSERT(vcpu >= 0 && vcpu < TVEC_MAXCPU,
+	    ("%s: invalid vcpu %d", __func__, vcpu));
+
+	vc = vm_stub_vcpu(NULL, vcpu);
+	cpu = &tvec_cpu[vcpu];
+	tvec_exec(vcpu, cpu, tv);
+
+	if (cpu->result != tv->result || vc->exception != tv->exception ||
+	    (tv->result == TVEC_EMULATE_ERROR && cpu->error != tv->error))
+		return (-1);
+
+	r = tvec_reg_out(tv);
+	for (i = 0; i < tv->nreg_out; i++) {
+		if (vc->regs[r[i].reg] != r[i].val)
+			return (-1);
+	}
+
+	m = tvec_mem_out(tv);
+	for (i = 0; i < tv->nmem_out; i++) {
+		cell = tvec_cell(cpu, m[i].gpa);
+		if (cell == NULL || tvec_cell_val(cell) != m[i].val)
+			return (-1);
+	}
+	return (0);
+}
+
+const char *
+tvec_regname(int reg)
+{
+
+	if (reg < 0 || reg >= VM_REG_LAST)
+		return (NULL);
+	return (tvec_regnames[reg]);
+}
+
+static const char *
+tvec_errname(int error)
+{
+	static char buf[16];
+	int i;
+
+	for (i = 0; i < (int)nitems(tvec_errnames); i++) {
+		if (tvec_errnames[i].error == error)
+			return (tvec_errnames[i].name);
+	}
+	snprintf(buf, sizeof(buf), "%d", error);
+	return (buf);
+}
+
+static const char *
+tvec_excname(int vector)
+{
+	int i;
+
+	for (i = 0; i < (int)nitems(tvec_excnames); i++) {
+		if (tvec_excnames[i].vector == vector)
+			return (tvec_excnames[i].name);
+	}
+	return ("none");
+}
+
+static const char *
+tvec_resultname(int result, int error)
+{
+	static char buf[32];
+
+	switch (result) {
+	case TVEC_OK:
+		return ("success");
+	case TVEC_DECODE_ERROR:
+		return ("decode error");
+	default:
+		snprintf(buf, sizeof(buf), "error %s", tvec_errname(error));
+		return (buf);
+	}
+}
+
+void
+tvec_report(FILE *fp, const char *name, int vcpu, const struct tvec *tv)
+{
+	const struct tvec_reg *r;
+	const struct tvec_mem *m, *cell;
+	struct vm_stub_vcpu *vc;
+	struct tvec_cpu *cpu;
+	int i;
+
+	vc = vm_stub_vcpu(NULL, vcpu);
+	cpu = &tvec_cpu[vcpu];
+	fprintf(fp, "%s:%u: inst", name, tv->line);
+	for (i = 0; i < tv->inst_len; i++)
+		fprintf(fp, " %02x", tv->inst[i]);
+	fprintf(fp, "\n");
+
+	if (cpu->result != tv->result ||
+	    (tv->result == TVEC_EMULATE_ERROR && cpu->error != tv->error)) {
+		fprintf(fp, "\texpected %s,", tvec_resultname(tv->result,
+		    tv->error));
+		fprintf(fp, " got %s\n", tvec_resultname(cpu->result,
+		    cpu->error));
+	}
+	if (vc->exception != tv->exception)
+		fprintf(fp, "\texpected exception %s, got %s\n",
+		    tvec_excname(tv->exception), tvec_excname(vc->exception));
+
+	r = tvec_reg_out(tv);
+	for (i = 0; i < tv->nreg_out; i++) {
+		if (vc->regs[r[i].reg] != r[i].val)
+			fprintf(fp, "\t%s: expected %#jx, got %#jx\n",
+			    tvec_regnames[r[i].reg], (uintmax_t)r[i].val,
+			    (uintmax_t)vc->regs[r[i].reg]);
+	}
+
+	m = tvec_mem_out(tv);
+	for (i = 0; i < tv->nmem_out; i++) {
+		cell = tvec_cell(cpu, m[i].gpa);
+		if (cell == NULL)
+			fprintf(fp, "\tmem %#jx: no such cell\n",
+			    (uintmax_t)m[i].gpa);
+		else if (tvec_cell_val(cell) != m[i].val)
+			fprintf(fp, "\tmem %#jx: expected %#jx, got %#jx\n",
+			    (uintmax_t)m[i].gpa, (uintmax_t)m[i].val,
+			    (uintmax_t)tvec_cell_val(cell));
+	}
+}
+
+static void
+tvec_emit_expect(FILE *out, const struct tvec *tv,
+    const struct vm_stub_vcpu *vc, const struct tvec_cpu *cpu)
+{
+	const struct tvec_reg *r;
+	uint64_t listed;
+	int i;
+
+	if (cpu->result == TVEC_DECODE_ERROR) {
+		fprintf(out, "expect decode-error\n");
+		return;
+	}
+	if (cpu->result == TVEC_EMULATE_ERROR)
+		fprintf(out, "expect error %s\n", tvec_errname(cpu->error));
+	if (vc->exception != TVEC_EXC_NONE)
+		fprintf(out, "expect exception %s\n",
+		    tvec_excname(vc->exception));
+
+	/* Registers that were initialized or that the instruction changed */
+	listed = 0;
+	r = tvec_reg_in(tv);
+	for (i = 0; i < tv->nreg_in; i++)
+		listed |= 1UL << r[i].reg;
+	for (i = 0; i < VM_REG_LAST; i++) {
+		if ((listed & (1UL << i)) != 0 || vc->regs[i] != 0)
+			fprintf(out, "expect reg %s %#jx\n", tvec_regnames[i],
+			    (uintmax_t)vc->regs[i]);
+	}
+
+	for (i = 0; i < cpu->nmem; i++)
+		fprintf(out, "expect mem %#jx %d %#jx\n",
+		    (uintmax_t)cpu->mem[i].gpa, cpu->mem[i].size,
+		    (uintmax_t)tvec_cell_val(&cpu->mem[i]));
+}
+
+int
+tvec_record(FILE *in, const char *name, FILE *out, int vcpu)
+{
+	struct tvec_build b;
+	uint64_t rec[TVEC_MAXSIZE / sizeof(uint64_t)];
+	char line[TVEC_MAXLINE], copy[TVEC_MAXLINE], *p;
+	int error, lineno, r;
+
+	error = 0;
+	lineno = 0;
+	tvec_build_init(&b);
+	while (fgets(line, sizeof(line), in) != NULL) {
+		lineno++;
+		strlcpy(copy, line, sizeof(copy));
+		r = tvec_parse_line(&b, copy);
+		if (r < 0) {
+			fprintf(stderr, "%s:%d: syntax error\n", name, lineno);
+			error = EINVAL;
+			fputs(line, out);
+			continue;
+		}
+
+		/* Drop the old expectations, they are rewritten at 'end' */
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		if (strncmp(p, "expect", 6) == 0 && isspace(p[6]))
+			continue;
+
+		if (r == 1) {
+			b.tv.nreg_out = b.tv.nmem_out = 0;
+			b.tv.line = lineno;
+			tvec_pack(&b, rec);
+			tvec_exec(vcpu, &tvec_cpu[vcpu],
+			    (const struct tvec *)rec);
+			tvec_emit_expect(out, (const struct tvec *)rec,
+			    vm_stub_vcpu(NULL, vcpu), &tvec_cpu[vcpu]);
+			tvec_build_init(&b);
+		}
+		fputs(line, out);
+	}
+	return (error);
+}
+
+static uint64_t
+tvec_random(uint64_t *state)
+{
+	uint64_t x;
+
+	/* xorshift64*, the same sequence on every host */
+	x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return (x * 0x2545f4914f6cdd1dUL);
+}
+
+int
+tvec_generate(const struct tvec_corpus *c, const char *name, uint64_t n,
+    uint64_t seed, FILE *out)
+{
+	const struct tvec **vec;
+	const struct tvec *tv;
+	const struct tvec_reg *r;
+	const struct tvec_mem *m;
+	uint64_t i, rnd, state, val;
+	int j;
+
+	if (c->hdr->count == 0)
+		return (EINVAL);
+
+	vec = malloc(c->hdr->count * sizeof(struct tvec *));
+	if (vec == NULL)
+		return (ENOMEM);
+	tv = tvec_first(c);
+	for (i = 0; i < c->hdr->count; i++, tv = tvec_next(tv))
+		vec[i] = tv;
+
+	state = seed ? seed : 1;
+	for (i = 0; i < n; i++) {
+		tv = vec[tvec_random(&state) % c->hdr->count];
+		fprintf(out, "# %s:%u\ninst", name, tv->line);
+		for (j = 0; j < tv->inst_len; j++)
+			fprintf(out, " %02x", tv->inst[j]);
+		fprintf(out, "\nmode %s\ncsd %d\ngpa %#jx\n",
+		    tvec_modenames[tv->cpu_mode], (tv->flags & TVEC_F_CSD) != 0,
+		    (uintmax_t)tv->gpa);
+		if (tv->gla != VIE_INVALID_GLA)
+			fprintf(out, "gla %#jx\n", (uintmax_t)tv->gla);
+		if (tv->np_len != 0)
+			fprintf(out, "np %#jx %#jx\n", (uintmax_t)tv->np_gla,
+			    (uintmax_t)tv->np_len);
+
+		/*
+		 * Registers that address memory or control the emulation are
+		 * kept, data registers get random values and RFLAGS random
+		 * status bits.
+		 */
+		r = tvec_reg_in(tv);
+		for (j = 0; j < tv->nreg_in; j++) {
+			val = r[j].val;
+			rnd = tvec_random(&state);
+			switch (r[j].reg) {
+			case VM_REG_GUEST_RSP:
+			case VM_REG_GUEST_RSI:
+			case VM_REG_GUEST_RDI:
+			case VM_REG_GUEST_RIP:
+			case VM_REG_GUEST_CR0:
+				break;
+			case VM_REG_GUEST_RCX:
+				/* Base register or 'rep' count */
+				if (val < 0x10000)
+					val = 1 + rnd % 16;
+				break;
+			case VM_REG_GUEST_RFLAGS:
+				val = (val & ~TVEC_RFLAGS_STATUS) |
+				    (rnd & TVEC_RFLAGS_STATUS);
+				break;
+			default:
+				val = rnd;
+				break;
+			}
+			fprintf(out, "reg %s %#jx\n", tvec_regnames[r[j].reg],
+			    (uintmax_t)val);
+		}
+
+		m = tvec_mem_in(tv);
+		for (j = 0; j < tv->nmem_in; j++) {
+			val = tvec_random(&state);
+			if (m[j].size < 8)
+				val &= (1UL << (m[j].size * 8)) - 1;
+			fprintf(out, "%s %#jx %d %#jx\n",
+			    (m[j].flags & TVEC_MEM_RAM) ? "ram" : "mem",
+			    (uintmax_t)m[j].gpa, m[j].size, (uintmax_t)val);
+		}
+		fprintf(out, "end\n\n");
+	}
+
+	free(vec);
+	return (0);
+}
+
+/*
+ * Memory region callbacks. An access must fall within a single MMIO cell;
+ * anything else is an unexpected access and fails the vector.
+ */
+static struct tvec_mem *
+tvec_access(int vcpu, uint64_t gpa, int size)
+{
+	struct tvec_cpu *cpu;
+	struct tvec_mem *m;
+	int i;
+
+	KASSERT(vcpu >= 0 && vcpu < TVEC_MAXCPU,
+	    ("%s: invalid vcpu %d", __func__, vcpu));
+
+	cpu = &tvec_cpu[vcpu];
+	for (i = 0; i < cpu->nmem; i++) {
+		m = &cpu->mem[i];
+		if ((m->flags & TVEC_MEM_RAM) == 0 &&
+		    gpa - m->gpa < m->size && gpa + size - m->gpa <= m->size)
+			return (m);
+	}
+	return (NULL);
+}
+
+int
+tvec_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+	struct tvec_mem *m;
+
+	m = tvec_access(cpuid, gpa, rsize);
+	if (m == NULL)
+		return (EINVAL);
+
+	*rval = 0;
+	memcpy(rval, (uint8_t *)&m->val + (gpa - m->gpa), rsize);
+	return (0);
+}
+
+int
+tvec_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+	struct tvec_mem *m;
+
+	m = tvec_access(cpuid, gpa, wsize);
+	if (m == NULL)
+		return (EINVAL);
+
+	memcpy((uint8_t *)&m->val + (gpa - m->gpa), &wval, wsize);
+	return (0);
+}
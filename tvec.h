@@ -0,0 +1,216 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Test vectors for the instruction emulator.
+ *
+ * A test vector holds the instruction bytes, the cpu mode, the initial
+ * register and memory state and the expected state after the instruction
+ * has been decoded and emulated once. Vectors are written in a line based
+ * text format:
+ *
+ *	# and 0xf0(%rcx),%eax
+ *	inst 23 81 f0 00 00 00
+ *	mode 64				real, prot, compat or 64 (default)
+ *	csd 1				CS.D, defaults to 1 outside 64-bit mode
+ *	gpa 0xff0000f0			faulting guest physical address
+ *	gla 0xff0000f0			guest linear address, if the exit
+ *					reports one, checked by the decoder
+ *	reg rax 0xaabb			initial registers, others are zero
+ *	reg rcx 0xff000000
+ *	mem 0xff0000f0 4 0xaa00		MMIO cell: gpa, size (1/2/4/8), value
+ *	ram 0x7000 8 0			guest RAM cell, reached via vm_copy_*
+ *	np 0x7000 0x1000		linear range whose accesses raise #PF
+ *	expect reg rax 0xaa00
+ *	expect mem 0xff0000f0 4 0xaa00
+ *	expect decode-error		decoding must fail
+ *	expect error EFAULT		emulation must fail with this errno
+ *	expect exception gp		gp, ss, pf or ac must be injected
+ *	end
+ *
+ * and compiled into a binary corpus of variable length records which the
+ * runner maps and walks without copying. The record mode of the harness
+ * copies a text corpus and replaces the 'expect' lines of every vector with
+ * the state the emulator actually produced.
+ */
+
+#ifndef	_TVEC_H_
+#define	_TVEC_H_
+
+#define	TVEC_MAGIC		0x43455654	/* "TVEC" */
+#define	TVEC_VERSION		3
+
+#define	TVEC_MAXREG		16
+#define	TVEC_MAXMEM		8
+#define	TVEC_MAXCPU		VM_STUB_MAXCPU
+
+/* tvec.result */
+#define	TVEC_OK			0
+#define	TVEC_DECODE_ERROR	1
+#define	TVEC_EMULATE_ERROR	2
+
+/* tvec.flags */
+#define	TVEC_F_CSD		(1 << 0)	/* CS.D is set */
+
+/* tvec_mem.flags */
+#define	TVEC_MEM_RAM		(1 << 0)	/* guest RAM rather than MMIO */
+
+/* Exception vectors */
+#define	TVEC_EXC_NONE		0
+#define	TVEC_EXC_SS		VM_STUB_EXC_SS
+#define	TVEC_EXC_GP		VM_STUB_EXC_GP
+#define	TVEC_EXC_PF		VM_STUB_EXC_PF
+#define	TVEC_EXC_AC		VM_STUB_EXC_AC
+
+struct tvec_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	count;		/* number of vectors */
+	uint64_t	size;		/* bytes including the header */
+	uint64_t	pad[5];
+};
+
+struct tvec_reg {
+	uint64_t	val;
+	uint32_t	reg;		/* VM_REG_GUEST_xyz */
+	uint32_t	pad;
+};
+
+struct tvec_mem {
+	uint64_t	gpa;
+	uint64_t	val;
+	uint8_t		size;
+	uint8_t		flags;
+	uint8_t		pad[6];
+};
+
+/*
+ * A vector is followed by 'nreg_in' tvec_reg, 'nmem_in' tvec_mem, 'nreg_out'
+ * tvec_reg and 'nmem_out' tvec_mem entries. 'size' covers all of them and is
+ * a multiple of 8.
+ */
+struct tvec {
+	uint16_t	size;
+	uint8_t		inst_len;
+	uint8_t		cpu_mode;	/* enum vm_cpu_mode */
+	uint8_t		nreg_in;
+	uint8_t		nmem_in;
+	uint8_t		nreg_out;
+	uint8_t		nmem_out;
+	uint8_t		result;		/* expected TVEC_xyz result */
+	uint8_t		error;		/* errno for TVEC_EMULATE_ERROR */
+	uint8_t		exception;	/* expected exception vector */
+	uint8_t		flags;
+	uint32_t	line;		/* line of 'end' in the text source */
+	uint64_t	gpa;
+	uint64_t	gla;		/* VIE_INVALID_GLA if not given */
+	uint64_t	np_gla;		/* not present range, see 'np' */
+	uint64_t	np_len;
+	uint8_t		inst[16];
+};
+
+static __inline const struct tvec_reg *
+tvec_reg_in(const struct tvec *tv)
+{
+
+	return ((const struct tvec_reg *)(tv + 1));
+}
+
+static __inline const struct tvec_mem *
+tvec_mem_in(const struct tvec *tv)
+{
+
+	return ((const struct tvec_mem *)(tvec_reg_in(tv) + tv->nreg_in));
+}
+
+static __inline const struct tvec_reg *
+tvec_reg_out(const struct tvec *tv)
+{
+
+	return ((const struct tvec_reg *)(tvec_mem_in(tv) + tv->nmem_in));
+}
+
+static __inline const struct tvec_mem *
+tvec_mem_out(const struct tvec *tv)
+{
+
+	return ((const struct tvec_mem *)(tvec_reg_out(tv) + tv->nreg_out));
+}
+
+struct tvec_corpus {
+	struct tvec_hdr	*hdr;
+	size_t		len;
+	int		mapped;		/* 'hdr' is mmap'ed, not malloc'ed */
+};
+
+static __inline const struct tvec *
+tvec_first(const struct tvec_corpus *c)
+{
+
+	return ((const struct tvec *)(c->hdr + 1));
+}
+
+static __inline const struct tvec *
+tvec_next(const struct tvec *tv)
+{
+
+	return ((const struct tvec *)((const char *)tv + tv->size));
+}
+
+/*
+ * Memory cells and outcome of the vector running on a vCPU. Registers,
+ * segments and exceptions live in the vCPU of 'vm_stub_default'; the RAM
+ * cells are mapped into its memory view.
+ */
+struct tvec_cpu {
+	struct tvec_mem	mem[TVEC_MAXMEM];
+	int		nmem;
+	int		result;		/* TVEC_xyz */
+	int		error;		/* emulation error */
+	struct vie	vie;
+} __aligned(CACHE_LINE_SIZE);
+
+extern struct tvec_cpu tvec_cpu[TVEC_MAXCPU];
+
+/*
+ * Load a corpus: binary files are mapped, text files are compiled into
+ * memory. Returns 0 or an errno; parse errors are reported on stderr.
+ */
+int	tvec_load(const char *path, struct tvec_corpus *c);
+int	tvec_compile(FILE *fp, const char *name, struct tvec_corpus *c);
+int	tvec_save(const struct tvec_corpus *c, const char *path);
+void	tvec_free(struct tvec_corpus *c);
+
+/*
+ * Copy the text corpus 'in' to 'out' with the 'expect' lines of every vector
+ * replaced by the state the emulator produced on 'vcpu'.
+ */
+int	tvec_record(FILE *in, const char *name, FILE *out, int vcpu);
+
+/*
+ * Write 'n' vectors in text form without expectations to 'out'. Each is a
+ * random vector of 'c' with new values for its data registers, status flags
+ * and memory cells; run the result through tvec_record() to complete it.
+ */
+int	tvec_generate(const struct tvec_corpus *c, const char *name,
+	    uint64_t n, uint64_t seed, FILE *out);
+
+/*
+ * Set up 'vcpu', decode and emulate 'tv'. Returns 0 if the outcome
+ * matches the expectations of the vector and -1 otherwise.
+ */
+int	tvec_run(int vcpu, const struct tvec *tv);
+
+/* Describe how the state of 'vcpu' differs from 'tv' */
+void	tvec_report(FILE *fp, const char *name, int vcpu,
+	    const struct tvec *tv);
+
+/* Name of a register in the text format */
+const char *tvec_regname(int reg);
+
+/* Memory region callbacks backed by the MMIO cells of 'tvec_cpu[cpuid]' */
+int	tvec_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval,
+	    int rsize, void *arg);
+int	tvec_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval,
+	    int wsize, void *arg);
+
+#endif	/* _TVEC_H_ */
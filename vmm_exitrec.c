@@ -0,0 +1,985 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Exit recording and replay.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <machine/cpufunc.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "vmm_exitrec.h"
+
+_Static_assert(sizeof(struct vie_rec_exit) % 8 == 0, "vie_rec_exit");
+_Static_assert(sizeof(struct vie_rec_access) % 8 == 0, "vie_rec_access");
+_Static_assert(sizeof(struct vie_rec_chunk) % 8 == 0, "vie_rec_chunk");
+_Static_assert(sizeof(struct vie_rec_index) % 8 == 0, "vie_rec_index");
+_Static_assert(VIE_REC_NREG <= 32, "VIE_REC_REGS");
+_Static_assert(VIE_REC_MAXLEN % 8 == 0, "VIE_REC_MAXLEN");
+
+/*
+ * An encoded record, every delta against the chunk's struct vie_rec_state
+ * and signed values zigzag encoded:
+ *
+ *	byte	inst_len | naccess << 4 | VIE_REC_E_SAMEINST
+ *	byte	cpu_mode | paging_mode << 2 | cpl << 4 | cs_d << 6
+ *	byte	flags
+ *	varint	tsc delta, error, gla, gpa and cr3 deltas
+ *		the instruction bytes, unless VIE_REC_E_SAMEINST
+ *	varint	mask of the registers that differ from the state, then the
+ *		delta of each
+ *	varint	outmask, then the change emulation made to each register
+ *		per access: byte size | write << 4 | VIE_REC_E_ERROR,
+ *		varint gpa delta from the exit's, value, error if any
+ *	byte	with VIE_REC_F_SEGS, mask of the segments that differ from
+ *		the state, then varint base delta, limit and access of each
+ *
+ * The state is the registers an exit left behind, so an exit on a vCPU
+ * that did nothing else in between costs a few bytes for RIP.
+ */
+#define	VIE_REC_E_SAMEINST	0x80
+#define	VIE_REC_E_WRITE		0x10
+#define	VIE_REC_E_ERROR		0x20
+
+static __inline uint64_t
+vie_rec_zz(int64_t v)
+{
+
+	return ((uint64_t)v << 1 ^ (uint64_t)(v >> 63));
+}
+
+static __inline int64_t
+vie_rec_unzz(uint64_t v)
+{
+
+	return ((int64_t)(v >> 1) ^ -(int64_t)(v & 1));
+}
+
+static __inline uint8_t *
+vie_rec_put(uint8_t *p, uint64_t v)
+{
+
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return (p);
+}
+
+static __inline int
+vie_rec_get(const uint8_t **pp, const uint8_t *end, uint64_t *vp)
+{
+	const uint8_t *p;
+	uint64_t v;
+	int shift;
+
+	for (p = *pp, v = 0, shift = 0; p < end && shift < 64; shift += 7) {
+		v |= (uint64_t)(*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0) {
+			*pp = p;
+			*vp = v;
+			return (0);
+		}
+	}
+	return (EFTYPE);
+}
+
+static int
+vie_rec_write(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		n = writev(fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return (errno);
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return (0);
+}
+
+/* Add the chunk just written to the index */
+static int
+vie_rec_add_index(struct vie_rec *rec, const struct vie_rec_chunk *chunk)
+{
+	struct vie_rec_index *ix;
+	size_t n;
+
+	if (rec->nindex == rec->maxindex) {
+		n = MAX(rec->maxindex * 2, 1024);
+		ix = realloc(rec->index, n * sizeof(struct vie_rec_index));
+		if (ix == NULL)
+			return (ENOMEM);
+		rec->index = ix;
+		rec->maxindex = n;
+	}
+	ix = &rec->index[rec->nindex++];
+	memset(ix, 0, sizeof(*ix));
+	ix->offset = rec->off;
+	ix->tsc = chunk->tsc;
+	ix->tsc_last = chunk->tsc_last;
+	ix->nexit = chunk->nexit;
+	ix->vcpuid = chunk->vcpuid;
+	rec->off += sizeof(*chunk) + chunk->len;
+	return (0);
+}
+
+static void *
+vie_rec_writer(void *arg)
+{
+	struct vie_rec *rec;
+	struct vie_rec_buf *b;
+	struct vie_rec_chunk chunk;
+	struct iovec iov[2];
+	int error;
+
+	rec = arg;
+	pthread_mutex_lock(&rec->mtx);
+	for (;;) {
+		while (rec->full == NULL && !rec->stop)
+			pthread_cond_wait(&rec->cv, &rec->mtx);
+		if ((b = rec->full) == NULL)
+			break;
+		if ((rec->full = b->next) == NULL)
+			rec->fullp = &rec->full;
+		pthread_mutex_unlock(&rec->mtx);
+
+		/* Chunks stay 8-byte aligned, the reader stops at 'nexit' */
+		memset(&chunk, 0, sizeof(chunk));
+		chunk.len = roundup2(b->len, 8);
+		chunk.nexit = b->nexit;
+		chunk.vcpuid = b->vcpuid;
+		chunk.tsc = b->tsc;
+		chunk.tsc_last = b->tsc_last;
+		memset(b->data + b->len, 0, chunk.len - b->len);
+		iov[0].iov_base = &chunk;
+		iov[0].iov_len = sizeof(chunk);
+		iov[1].iov_base = b->data;
+		iov[1].iov_len = chunk.len;
+		error = rec->error == 0 ? vie_rec_write(rec->fd, iov, 2) : 0;
+		if (error == 0 && rec->error == 0)
+			error = vie_rec_add_index(rec, &chunk);
+
+		pthread_mutex_lock(&rec->mtx);
+		if (error != 0 && rec->error == 0)
+			rec->error = error;
+		b->next = rec->free;
+		rec->free = b;
+	}
+	pthread_mutex_unlock(&rec->mtx);
+	return (NULL);
+}
+
+/* Queue 'b' for the writer, or free it if it holds no exits */
+static void
+vie_rec_queue(struct vie_rec *rec, struct vie_rec_buf *b)
+{
+
+	if (b->nexit != 0) {
+		b->next = NULL;
+		*rec->fullp = b;
+		rec->fullp = &b->next;
+		pthread_cond_signal(&rec->cv);
+	} else {
+		b->next = rec->free;
+		rec->free = b;
+	}
+}
+
+/*
+ * Queue 'full' and take a free buffer for 'vcpuid'. Returns NULL rather
+ * than waiting for the writer when there is none.
+ */
+static struct vie_rec_buf *
+vie_rec_swap(struct vie_rec *rec, struct vie_rec_buf *full, int vcpuid)
+{
+	struct vie_rec_buf *b;
+
+	pthread_mutex_lock(&rec->mtx);
+	if (full != NULL)
+		vie_rec_queue(rec, full);
+	if ((b = rec->free) != NULL)
+		rec->free = b->next;
+	pthread_mutex_unlock(&rec->mtx);
+
+	if (b != NULL) {
+		b->vcpuid = vcpuid;
+		b->len = 0;
+		b->nexit = 0;
+	}
+	return (b);
+}
+
+int
+vie_rec_open(struct vie_rec *rec, const char *path, mem_region_read_t mrr,
+    mem_region_write_t mrw, void *arg)
+{
+	struct vie_rec_hdr hdr;
+	struct iovec iov;
+	int error, i;
+
+	memset(rec, 0, sizeof(struct vie_rec));
+	rec->mrr = mrr;
+	rec->mrw = mrw;
+	rec->arg = arg;
+
+	rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (rec->fd < 0)
+		return (errno);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = VIE_REC_MAGIC;
+	hdr.version = VIE_REC_VERSION;
+	iov.iov_base = &hdr;
+	iov.iov_len = sizeof(hdr);
+	if ((error = vie_rec_write(rec->fd, &iov, 1)) != 0)
+		goto fail;
+	rec->off = sizeof(hdr);
+
+	rec->bufs = calloc(VIE_REC_NBUF, sizeof(struct vie_rec_buf));
+	if (rec->bufs == NULL) {
+		error = ENOMEM;
+		goto fail;
+	}
+	for (i = 0; i < VIE_REC_NBUF; i++) {
+		rec->bufs[i].next = rec->free;
+		rec->free = &rec->bufs[i];
+	}
+	rec->fullp = &rec->full;
+
+	pthread_mutex_init(&rec->mtx, NULL);
+	pthread_cond_init(&rec->cv, NULL);
+	if ((error = pthread_create(&rec->writer, NULL, vie_rec_writer,
+	    rec)) != 0) {
+		pthread_cond_destroy(&rec->cv);
+		pthread_mutex_destroy(&rec->mtx);
+		free(rec->bufs);
+		goto fail;
+	}
+	return (0);
+
+fail:
+	close(rec->fd);
+	unlink(path);
+	return (error);
+}
+
+int
+vie_rec_close(struct vie_rec *rec)
+{
+	struct vie_rec_hdr hdr;
+	struct iovec iov;
+	int error, i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = VIE_REC_MAGIC;
+	hdr.version = VIE_REC_VERSION;
+	pthread_mutex_lock(&rec->mtx);
+	for (i = 0; i < VIE_REC_MAXCPU; i++) {
+		if (rec->vcpu[i].buf != NULL) {
+			vie_rec_queue(rec, rec->vcpu[i].buf);
+			rec->vcpu[i].buf = NULL;
+		}
+		hdr.exits += rec->vcpu[i].exits;
+		hdr.dropped += rec->vcpu[i].dropped;
+	}
+	rec->stop = true;
+	pthread_cond_signal(&rec->cv);
+	pthread_mutex_unlock(&rec->mtx);
+	pthread_join(rec->writer, NULL);
+
+	/* The writer left the file offset at the end of the last chunk */
+	error = rec->error;
+	if (error == 0) {
+		iov.iov_base = rec->index;
+		iov.iov_len = rec->nindex * sizeof(struct vie_rec_index);
+		error = vie_rec_write(rec->fd, &iov, 1);
+		hdr.index = rec->off;
+		hdr.nchunk = rec->nindex;
+	}
+	if (error == 0 && pwrite(rec->fd, &hdr, sizeof(hdr), 0) !=
+	    (ssize_t)sizeof(hdr))
+		error = errno;
+	if (close(rec->fd) != 0 && error == 0)
+		error = errno;
+	pthread_cond_destroy(&rec->cv);
+	pthread_mutex_destroy(&rec->mtx);
+	free(rec->bufs);
+	free(rec->index);
+	rec->bufs = NULL;
+	rec->index = NULL;
+	return (error);
+}
+
+static void
+vie_rec_access(struct vie_rec *rec, int cpuid, uint64_t gpa, uint64_t val,
+    int size, int write, int error)
+{
+	struct vie_rec_vcpu *vc;
+	struct vie_rec_access *a;
+
+	vc = &rec->vcpu[cpuid];
+	if (vc->naccess++ >= VIE_REC_MAXACCESS)
+		return;
+	a = &vc->access[vc->naccess - 1];
+	a->gpa = gpa;
+	a->val = val;
+	a->error = error;
+	a->size = size;
+	a->write = write;
+}
+
+int
+vie_rec_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+	struct vie_rec *rec;
+	int error;
+
+	rec = arg;
+	error = (*rec->mrr)(vm, cpuid, gpa, rval, rsize, rec->arg);
+	vie_rec_access(rec, cpuid, gpa, *rval, rsize, 0, error);
+	return (error);
+}
+
+int
+vie_rec_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+	struct vie_rec *rec;
+	int error;
+
+	rec = arg;
+	error = (*rec->mrw)(vm, cpuid, gpa, wval, wsize, rec->arg);
+	vie_rec_access(rec, cpuid, gpa, wval, wsize, 1, error);
+	return (error);
+}
+
+/*
+ * Only the registers and segments in 'used' were read, the others are
+ * taken to be those of the state.
+ */
+static uint8_t *
+vie_rec_encode(uint8_t *p, struct vie_rec_state *st,
+    const struct vie_rec_exit *ex, uint64_t used, const uint64_t *before,
+    const uint64_t *after, const struct vie_rec_access *access,
+    const struct seg_desc *segs)
+{
+	const struct vie_rec_access *a;
+	uint32_t m, mask;
+	int i, r;
+
+	i = ex->inst_len == st->inst_len &&
+	    memcmp(ex->inst, st->inst, ex->inst_len) == 0;
+	*p++ = ex->inst_len | ex->naccess << 4 | (i ? VIE_REC_E_SAMEINST : 0);
+	*p++ = ex->cpu_mode | ex->paging_mode << 2 | ex->cpl << 4 |
+	    ex->cs_d << 6;
+	*p++ = ex->flags;
+	p = vie_rec_put(p, vie_rec_zz(ex->tsc - st->tsc));
+	p = vie_rec_put(p, vie_rec_zz(ex->error));
+	p = vie_rec_put(p, vie_rec_zz(ex->gla - st->gla));
+	p = vie_rec_put(p, vie_rec_zz(ex->gpa - st->gpa));
+	p = vie_rec_put(p, vie_rec_zz(ex->cr3 - st->cr3));
+	if (!i) {
+		memcpy(p, ex->inst, ex->inst_len);
+		p += ex->inst_len;
+		memcpy(st->inst, ex->inst, ex->inst_len);
+		st->inst_len = ex->inst_len;
+	}
+	st->tsc = ex->tsc;
+	st->gla = ex->gla;
+	st->gpa = ex->gpa;
+	st->cr3 = ex->cr3;
+
+	for (mask = 0, m = used & VIE_REC_REGS; m != 0; m &= m - 1) {
+		r = ffs(m) - 1;
+		if (before[r] != st->regs[r])
+			mask |= 1U << r;
+	}
+	p = vie_rec_put(p, mask);
+	for (m = mask; m != 0; m &= m - 1) {
+		r = ffs(m) - 1;
+		p = vie_rec_put(p, vie_rec_zz(before[r] - st->regs[r]));
+	}
+	p = vie_rec_put(p, ex->outmask);
+	for (m = ex->outmask; m != 0; m &= m - 1) {
+		r = ffs(m) - 1;
+		p = vie_rec_put(p, vie_rec_zz(after[r] - before[r]));
+	}
+	for (m = used & VIE_REC_REGS; m != 0; m &= m - 1) {
+		r = ffs(m) - 1;
+		st->regs[r] = after[r];
+	}
+
+	for (i = 0; i < ex->naccess; i++) {
+		a = &access[i];
+		*p++ = a->size | (a->write ? VIE_REC_E_WRITE : 0) |
+		    (a->error ? VIE_REC_E_ERROR : 0);
+		p = vie_rec_put(p, vie_rec_zz(a->gpa - ex->gpa));
+		p = vie_rec_put(p, a->val);
+		if (a->error)
+			p = vie_rec_put(p, vie_rec_zz(a->error));
+	}
+
+	if (ex->flags & VIE_REC_F_SEGS) {
+		for (mask = 0, i = 0; i < VIE_REC_NSEG; i++) {
+			if ((used & 1UL << (VM_REG_GUEST_ES + i)) != 0 &&
+			    memcmp(&segs[i], &st->segs[i], sizeof(segs[i])))
+				mask |= 1U << i;
+		}
+		*p++ = mask;
+		for (i = 0; i < VIE_REC_NSEG; i++) {
+			if ((mask & 1U << i) == 0)
+				continue;
+			p = vie_rec_put(p,
+			    vie_rec_zz(segs[i].base - st->segs[i].base));
+			p = vie_rec_put(p, segs[i].limit);
+			p = vie_rec_put(p, segs[i].access);
+			st->segs[i] = segs[i];
+		}
+	}
+	return (p);
+}
+
+int
+vie_rec_emulate(struct vie_rec *rec, void *vm, int vcpuid, uint64_t gla,
+    int cs_d, uint64_t gpa, struct vie *vie, struct vm_guest_paging *paging)
+{
+	struct vie_rec_vcpu *vc;
+	struct vie_rec_buf *b;
+	struct vie_rec_exit ex;
+	struct seg_desc segs[VIE_REC_NSEG];
+	uint64_t before[VIE_REC_NREG], after[VIE_REC_NREG], used;
+	uint32_t m, regs;
+	uint8_t *p;
+	int error, i, r;
+
+	KASSERT(vcpuid >= 0 && vcpuid < VIE_REC_MAXCPU,
+	    ("%s: invalid vcpuid %d", __func__, vcpuid));
+
+	vc = &rec->vcpu[vcpuid];
+	memset(&ex, 0, sizeof(ex));
+	ex.tsc = rdtsc();
+
+	/* RIP, which identifies the exit, and what the instruction uses */
+	used = vie_regs_used(vie) | 1UL << VM_REG_GUEST_RIP;
+	regs = used & VIE_REC_REGS;
+	for (m = regs; m != 0; m &= m - 1) {
+		r = ffs(m) - 1;
+		if (vm_get_register(vm, vcpuid, r, &before[r]) != 0)
+			before[r] = 0;
+	}
+	if ((used & VIE_REC_SEGS) != 0) {
+		ex.flags |= VIE_REC_F_SEGS;
+		for (i = 0; i < VIE_REC_NSEG; i++) {
+			if ((used & 1UL << (VM_REG_GUEST_ES + i)) == 0)
+				continue;
+			if (vm_get_seg_desc(vm, vcpuid, VM_REG_GUEST_ES + i,
+			    &segs[i]) != 0)
+				memset(&segs[i], 0, sizeof(segs[i]));
+		}
+	}
+
+	vc->naccess = 0;
+	error = vmm_emulate_instruction(vm, vcpuid, gpa, vie, paging,
+	    vie_rec_mread, vie_rec_mwrite, rec);
+
+	for (m = regs; m != 0; m &= m - 1) {
+		r = ffs(m) - 1;
+		if (vm_get_register(vm, vcpuid, r, &after[r]) != 0)
+			after[r] = before[r];
+		if (after[r] != before[r])
+			ex.outmask |= 1U << r;
+	}
+
+	/* Each buffer starts a chunk that decodes on its own */
+	if ((b = vc->buf) == NULL ||
+	    b->len + VIE_REC_MAXENC > VIE_REC_BUFSIZE) {
+		b = vc->buf = vie_rec_swap(rec, b, vcpuid);
+		memset(&vc->st, 0, sizeof(vc->st));
+	}
+	if (b == NULL) {
+		vc->dropped++;
+		return (error);
+	}
+
+	ex.inst_len = vie->num_valid;
+	ex.naccess = MIN(vc->naccess, VIE_REC_MAXACCESS);
+	ex.cpu_mode = paging->cpu_mode;
+	ex.paging_mode = paging->paging_mode;
+	ex.cpl = paging->cpl;
+	ex.cs_d = cs_d;
+	if (vc->naccess > VIE_REC_MAXACCESS)
+		ex.flags |= VIE_REC_F_TRUNCATED;
+	ex.error = error;
+	ex.gla = gla;
+	ex.gpa = gpa;
+	ex.cr3 = paging->cr3;
+	memcpy(ex.inst, vie->inst, vie->num_valid);
+
+	p = vie_rec_encode(b->data + b->len, &vc->st, &ex, used, before,
+	    after, vc->access, segs);
+	b->len = p - b->data;
+	if (b->nexit++ == 0)
+		b->tsc = ex.tsc;
+	b->tsc_last = ex.tsc;
+	vc->exits++;
+	return (error);
+}
+
+/* Rebuild the index of a recording that was not closed */
+static int
+vie_replay_scan(struct vie_replay *rp)
+{
+	const struct vie_rec_chunk *chunk;
+	struct vie_rec_index *ix;
+	size_t max, n, off;
+
+	ix = NULL;
+	for (n = max = 0, off = sizeof(struct vie_rec_hdr);
+	    rp->len - off >= sizeof(*chunk); off += sizeof(*chunk) +
+	    chunk->len) {
+		chunk = (const struct vie_rec_chunk *)
+		    ((const char *)rp->hdr + off);
+		if (chunk->len > rp->len - off - sizeof(*chunk) ||
+		    chunk->len % 8 != 0 || chunk->nexit == 0)
+			break;
+		if (n == max) {
+			max = MAX(max * 2, 1024);
+			ix = reallocf(ix, max * sizeof(*ix));
+			if (ix == NULL)
+				return (ENOMEM);
+		}
+		memset(&ix[n], 0, sizeof(ix[n]));
+		ix[n].offset = off;
+		ix[n].tsc = chunk->tsc;
+		ix[n].tsc_last = chunk->tsc_last;
+		ix[n].nexit = chunk->nexit;
+		ix[n].vcpuid = chunk->vcpuid;
+		n++;
+	}
+	rp->index = rp->built = ix;
+	rp->nchunk = n;
+	return (0);
+}
+
+int
+vie_replay_open(struct vie_replay *rp, const char *path)
+{
+	const struct vie_rec_hdr *hdr;
+	struct stat sb;
+	void *p;
+	int error, fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (errno);
+	if (fstat(fd, &sb) != 0) {
+		error = errno;
+		close(fd);
+		return (error);
+	}
+	if (sb.st_size < (off_t)sizeof(struct vie_rec_hdr)) {
+		close(fd);
+		return (EFTYPE);
+	}
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return (errno);
+
+	hdr = p;
+	if (hdr->magic != VIE_REC_MAGIC || hdr->version != VIE_REC_VERSION) {
+		munmap(p, sb.st_size);
+		return (EFTYPE);
+	}
+	memset(rp, 0, sizeof(struct vie_replay));
+	rp->hdr = hdr;
+	rp->len = sb.st_size;
+	if (hdr->index >= sizeof(struct vie_rec_hdr) && hdr->index % 8 == 0 &&
+	    hdr->index <= rp->len && hdr->nchunk <= (rp->len - hdr->index) /
+	    sizeof(struct vie_rec_index)) {
+		rp->index = (const struct vie_rec_index *)
+		    ((const char *)p + hdr->index);
+		rp->nchunk = hdr->nchunk;
+	} else if ((error = vie_replay_scan(rp)) != 0) {
+		munmap(p, sb.st_size);
+		return (error);
+	}
+	return (0);
+}
+
+void
+vie_replay_close(struct vie_replay *rp)
+{
+
+	munmap((void *)rp->hdr, rp->len);
+	free(rp->built);
+	rp->hdr = NULL;
+	rp->index = rp->built = NULL;
+}
+
+void
+vie_replay_rewind(struct vie_replay *rp, struct vie_replay_cursor *c,
+    int vcpuid)
+{
+
+	c->chunk = 0;
+	c->filter = vcpuid;
+	c->vcpuid = -1;
+	c->p = c->end = NULL;
+	c->left = 0;
+	c->pending = false;
+}
+
+void
+vie_replay_seek(struct vie_replay *rp, struct vie_replay_cursor *c,
+    int vcpuid, uint64_t tsc)
+{
+	const struct vie_rec_exit *ex;
+	int v;
+
+	vie_replay_rewind(rp, c, vcpuid);
+	while (c->chunk < rp->nchunk && (rp->index[c->chunk].tsc_last < tsc ||
+	    (vcpuid >= 0 && rp->index[c->chunk].vcpuid != vcpuid)))
+		c->chunk++;
+	while ((ex = vie_replay_next(rp, c, &v)) != NULL) {
+		if (ex->tsc >= tsc) {
+			c->pending = true;
+			break;
+		}
+	}
+}
+
+/* Start decoding chunk 'c->chunk' */
+static int
+vie_replay_enter(struct vie_replay *rp, struct vie_replay_cursor *c)
+{
+	const struct vie_rec_index *ix;
+	const struct vie_rec_chunk *chunk;
+
+	ix = &rp->index[c->chunk++];
+	c->left = ix->nexit;
+	c->p = c->end = NULL;
+	if (ix->offset < sizeof(struct vie_rec_hdr) || ix->offset % 8 != 0 ||
+	    rp->len - ix->offset < sizeof(*chunk))
+		return (EFTYPE);
+	chunk = (const struct vie_rec_chunk *)((const char *)rp->hdr +
+	    ix->offset);
+	if (chunk->len > rp->len - ix->offset - sizeof(*chunk) ||
+	    chunk->nexit != ix->nexit || chunk->vcpuid != ix->vcpuid ||
+	    chunk->vcpuid >= VIE_REC_MAXCPU)
+		return (EFTYPE);
+	c->vcpuid = chunk->vcpuid;
+	c->p = (const uint8_t *)(chunk + 1);
+	c->end = c->p + chunk->len;
+	memset(&c->st, 0, sizeof(c->st));
+	return (0);
+}
+
+/* Decode the record at 'c->p' into 'c->rec' */
+static int
+vie_replay_decode(struct vie_replay_cursor *c)
+{
+	struct vie_rec_state *st;
+	struct vie_rec_exit *ex;
+	struct vie_rec_access *a;
+	struct seg_desc *segs;
+	const uint8_t *p;
+	uint64_t mask, v, *val;
+	bool e;
+	int i, r;
+
+	p = c->p;
+	st = &c->st;
+	ex = (struct vie_rec_exit *)c->rec;
+	memset(ex, 0, sizeof(*ex));
+	if (c->end - p < 3)
+		return (EFTYPE);
+	ex->inst_len = p[0] & 0xf;
+	ex->naccess = p[0] >> 4 & 0x7;
+	ex->cpu_mode = p[1] & 0x3;
+	ex->paging_mode = p[1] >> 2 & 0x3;
+	ex->cpl = p[1] >> 4 & 0x3;
+	ex->cs_d = p[1] >> 6 & 0x1;
+	ex->flags = p[2];
+	i = p[0] & VIE_REC_E_SAMEINST;
+	p += 3;
+	if (ex->inst_len > VIE_INST_SIZE || ex->naccess > VIE_REC_MAXACCESS)
+		return (EFTYPE);
+
+#define	GET(x)	do {							\
+	if (vie_rec_get(&p, c->end, &(x)) != 0)				\
+		return (EFTYPE);					\
+} while (0)
+	GET(v);
+	ex->tsc = st->tsc += vie_rec_unzz(v);
+	GET(v);
+	ex->error = vie_rec_unzz(v);
+	GET(v);
+	ex->gla = st->gla += vie_rec_unzz(v);
+	GET(v);
+	ex->gpa = st->gpa += vie_rec_unzz(v);
+	GET(v);
+	ex->cr3 = st->cr3 += vie_rec_unzz(v);
+	if (!i) {
+		if (c->end - p < ex->inst_len)
+			return (EFTYPE);
+		memcpy(st->inst, p, ex->inst_len);
+		st->inst_len = ex->inst_len;
+		p += ex->inst_len;
+	} else if (st->inst_len != ex->inst_len)
+		return (EFTYPE);
+	memcpy(ex->inst, st->inst, ex->inst_len);
+
+	GET(mask);
+	if ((mask & ~(uint64_t)VIE_REC_REGS) != 0)
+		return (EFTYPE);
+	val = (uint64_t *)(ex + 1);
+	for (r = 0; r < VIE_REC_NREG; r++) {
+		if (mask & 1U << r) {
+			GET(v);
+			st->regs[r] += vie_rec_unzz(v);
+		}
+		if (st->regs[r] != 0) {
+			ex->inmask |= 1U << r;
+			*val++ = st->regs[r];
+		}
+	}
+	GET(mask);
+	if ((mask & ~(uint64_t)VIE_REC_REGS) != 0)
+		return (EFTYPE);
+	ex->outmask = mask;
+	for (r = 0; r < VIE_REC_NREG; r++) {
+		if (mask & 1U << r) {
+			GET(v);
+			st->regs[r] += vie_rec_unzz(v);
+			*val++ = st->regs[r];
+		}
+	}
+
+	a = (struct vie_rec_access *)val;
+	for (i = 0; i < ex->naccess; i++, a++) {
+		memset(a, 0, sizeof(*a));
+		if (p == c->end)
+			return (EFTYPE);
+		a->size = *p & 0xf;
+		a->write = (*p & VIE_REC_E_WRITE) != 0;
+		e = *p++ & VIE_REC_E_ERROR;
+		GET(v);
+		a->gpa = ex->gpa + vie_rec_unzz(v);
+		GET(a->val);
+		if (e) {
+			GET(v);
+			a->error = vie_rec_unzz(v);
+		}
+	}
+
+	segs = (struct seg_desc *)a;
+	if (ex->flags & VIE_REC_F_SEGS) {
+		if (p == c->end || (*p & ~0x3f) != 0)
+			return (EFTYPE);
+		mask = *p++;
+		for (i = 0; i < VIE_REC_NSEG; i++) {
+			if (mask & 1U << i) {
+				GET(v);
+				st->segs[i].base += vie_rec_unzz(v);
+				GET(v);
+				st->segs[i].limit = v;
+				GET(v);
+				st->segs[i].access = v;
+			}
+			segs[i] = st->segs[i];
+		}
+		segs += VIE_REC_NSEG;
+	}
+#undef	GET
+
+	ex->len = (uint8_t *)segs - (uint8_t *)ex;
+	c->p = p;
+	return (0);
+}
+
+const struct vie_rec_exit *
+vie_replay_next(struct vie_replay *rp, struct vie_replay_cursor *c,
+    int *vcpuid)
+{
+
+	if (c->pending) {
+		c->pending = false;
+		*vcpuid = c->vcpuid;
+		return ((const struct vie_rec_exit *)c->rec);
+	}
+	while (c->left == 0) {
+		while (c->chunk < rp->nchunk && c->filter >= 0 &&
+		    rp->index[c->chunk].vcpuid != c->filter)
+			c->chunk++;
+		if (c->chunk >= rp->nchunk)
+			return (NULL);
+		if (vie_replay_enter(rp, c) != 0)
+			return (NULL);
+	}
+	if (vie_replay_decode(c) != 0)
+		return (NULL);
+	c->left--;
+	*vcpuid = c->vcpuid;
+	return ((const struct vie_rec_exit *)c->rec);
+}
+
+/* Device model serving the accesses of a record */
+struct vie_replay_dev {
+	const struct vie_rec_access *access;
+	int		naccess;
+	int		next;
+	bool		truncated;
+	bool		mismatch;
+};
+
+static const struct vie_rec_access *
+vie_replay_access(struct vie_replay_dev *dev, uint64_t gpa, int size,
+    int write)
+{
+	const struct vie_rec_access *a;
+
+	if (dev->next >= dev->naccess) {
+		if (!dev->truncated)
+			dev->mismatch = true;
+		dev->next++;
+		return (NULL);
+	}
+	a = &dev->access[dev->next++];
+	if (a->gpa != gpa || a->size != size || a->write != write)
+		dev->mismatch = true;
+	return (a);
+}
+
+static int
+vie_replay_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval,
+    int rsize, void *arg)
+{
+	const struct vie_rec_access *a;
+
+	if ((a = vie_replay_access(arg, gpa, rsize, 0)) == NULL) {
+		*rval = 0;
+		return (0);
+	}
+	*rval = a->val;
+	return (a->error);
+}
+
+static int
+vie_replay_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval,
+    int wsize, void *arg)
+{
+	struct vie_replay_dev *dev;
+	const struct vie_rec_access *a;
+
+	dev = arg;
+	if ((a = vie_replay_access(dev, gpa, wsize, 1)) == NULL)
+		return (0);
+	if (a->val != wval)
+		dev->mismatch = true;
+	return (a->error);
+}
+
+int
+vie_replay_exit(void *vm, int vcpuid, const struct vie_rec_exit *ex)
+{
+	struct vie_replay_dev dev;
+	struct vm_guest_paging paging;
+	struct seg_desc seg;
+	struct vie vie;
+	const uint64_t *in, *out;
+	const struct seg_desc *segs;
+	uint64_t before[VIE_REC_NREG], val, want;
+	size_t len;
+	int error, i, r, result;
+
+	len = sizeof(struct vie_rec_exit) +
+	    (__builtin_popcount(ex->inmask) + __builtin_popcount(ex->outmask)) *
+	    sizeof(uint64_t) + ex->naccess * sizeof(struct vie_rec_access) +
+	    (ex->flags & VIE_REC_F_SEGS ? VIE_REC_NSEG * sizeof(seg) : 0);
+	if (len != ex->len || ex->inst_len > VIE_INST_SIZE ||
+	    ((ex->inmask | ex->outmask) & ~VIE_REC_REGS) != 0)
+		return (VIE_REPLAY_BAD);
+
+	in = (const uint64_t *)(ex + 1);
+	for (r = 0; r < VIE_REC_NREG; r++) {
+		if ((VIE_REC_REGS & 1U << r) == 0)
+			continue;
+		before[r] = ex->inmask & 1U << r ? *in++ : 0;
+		vm_set_register(vm, vcpuid, r, before[r]);
+	}
+	out = in;
+	dev.access = (const struct vie_rec_access *)(out +
+	    __builtin_popcount(ex->outmask));
+	dev.naccess = ex->naccess;
+	dev.next = 0;
+	dev.truncated = (ex->flags & VIE_REC_F_TRUNCATED) != 0;
+	dev.mismatch = false;
+	if (ex->flags & VIE_REC_F_SEGS) {
+		segs = (const struct seg_desc *)(dev.access + ex->naccess);
+		for (i = 0; i < VIE_REC_NSEG; i++) {
+			seg = segs[i];
+			vm_set_seg_desc(vm, vcpuid, VM_REG_GUEST_ES + i, &seg);
+		}
+	}
+
+	paging.cr3 = ex->cr3;
+	paging.cpl = ex->cpl;
+	paging.cpu_mode = ex->cpu_mode;
+	paging.paging_mode = ex->paging_mode;
+
+	memset(&vie, 0, sizeof(vie));
+	vie.base_register = VM_REG_LAST;
+	vie.index_register = VM_REG_LAST;
+	vie.segment_register = VM_REG_LAST;
+	memcpy(vie.inst, ex->inst, ex->inst_len);
+	vie.num_valid = ex->inst_len;
+	if (vmm_decode_instruction(vm, vcpuid, ex->gla, ex->cpu_mode, ex->cs_d,
+	    &vie) != 0)
+		return (VIE_REPLAY_DECODE);
+
+	error = vmm_emulate_instruction(vm, vcpuid, ex->gpa, &vie, &paging,
+	    vie_replay_mread, vie_replay_mwrite, &dev);
+
+	result = 0;
+	if (error != ex->error)
+		result |= VIE_REPLAY_ERROR;
+	if (dev.mismatch || (dev.next != dev.naccess && !dev.truncated))
+		result |= VIE_REPLAY_ACCESS;
+	for (r = 0; r < VIE_REC_NREG; r++) {
+		if ((VIE_REC_REGS & 1U << r) == 0)
+			continue;
+		want = ex->outmask & 1U << r ? *out++ : before[r];
+		if (vm_get_register(vm, vcpuid, r, &val) != 0 || val != want)
+			result |= VIE_REPLAY_REGS;
+	}
+	return (result);
+}
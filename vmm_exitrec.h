@@ -0,0 +1,280 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Exit recording and replay.
+ *
+ * vie_rec_emulate() is vmm_emulate_instruction() that also logs the exit:
+ * the instruction bytes, cpu mode and paging state, RIP and the registers
+ * the instruction uses (see vie_regs_used()) before emulation, the segment
+ * descriptors for the string and stack instructions, every device model
+ * access with the value read or written, the registers the emulation
+ * changed and its result. The registers and segments the instruction does
+ * not use are not read: a record carries over their values from the
+ * previous record of the chunk. The device model is called through 'struct
+ * vie_rec' like vie_prof_mread() does.
+ *
+ * A vCPU appends its exits to its own buffer and hands full buffers to a
+ * writer thread, which writes them out as chunks, followed on close by an
+ * index of the chunks:
+ *
+ *	struct vie_rec_hdr
+ *	struct vie_rec_chunk, then 'len' bytes of records of one vCPU
+ *	...
+ *	struct vie_rec_index[nchunk]
+ *
+ * A vCPU never waits for the writer: when no buffer is free its exits are
+ * counted as dropped instead.
+ *
+ * Records are encoded against the previous record of the same chunk, so
+ * any chunk decodes on its own: the TSC, addresses and CR3 as deltas, the
+ * registers as the deltas of the ones that differ from the state the
+ * previous exit left, the instruction bytes only when they change, all as
+ * varints (see vmm_exitrec.c). Decoded, a record is struct vie_rec_exit
+ * followed by the values of the registers in 'inmask' and 'outmask' in
+ * register order, 'naccess' struct vie_rec_access and, with
+ * VIE_REC_F_SEGS, VIE_REC_NSEG struct seg_desc. Registers that were zero
+ * before emulation are not in 'inmask'.
+ *
+ * The file is mapped for replay. The index, rebuilt from the chunk
+ * headers if the recorder did not get to write it, lets a replayer start
+ * at any chunk: one thread per group of vCPUs keeps each vCPU's exits in
+ * order, and vie_replay_seek() finds a point in time without decoding the
+ * chunks before it.
+ *
+ * vie_replay_exit() feeds a record back through vmm_decode_instruction()
+ * and vmm_emulate_instruction() with device model callbacks that serve
+ * the recorded reads, and checks that the emulation makes the recorded
+ * accesses and register changes. Guest memory is not recorded: string and
+ * stack instructions that accessed guest RAM rather than MMIO do not
+ * replay the same way.
+ */
+
+#ifndef	_VMM_EXITREC_H_
+#define	_VMM_EXITREC_H_
+
+#include <pthread.h>
+
+#define	VIE_REC_MAGIC		0x43455256	/* "VREC" */
+#define	VIE_REC_VERSION		2
+#define	VIE_REC_MAXCPU		16
+#define	VIE_REC_MAXACCESS	4	/* device model calls per exit */
+#define	VIE_REC_BUFSIZE		(64 * 1024)
+#define	VIE_REC_NBUF		64
+#define	VIE_REC_NSEG		6	/* VM_REG_GUEST_ES to VM_REG_GUEST_GS */
+
+/* The registers recorded, as (1 << enum vm_reg_name) */
+#define	VIE_REC_REGS	(0x7fffU | 1U << VM_REG_GUEST_CR0 |		\
+			 1U << VM_REG_GUEST_RSP |			\
+			 1U << VM_REG_GUEST_RIP |			\
+			 1U << VM_REG_GUEST_RFLAGS)
+#define	VIE_REC_NREG	(VM_REG_GUEST_RFLAGS + 1)
+
+/* The segment descriptors recorded, likewise */
+#define	VIE_REC_SEGS	(0x3fUL << VM_REG_GUEST_ES)
+
+/* Largest encoded record, with room to spare, and decoded record */
+#define	VIE_REC_MAXENC		1024
+#define	VIE_REC_MAXLEN		(sizeof(struct vie_rec_exit) +		\
+	2 * VIE_REC_NREG * sizeof(uint64_t) +				\
+	VIE_REC_MAXACCESS * sizeof(struct vie_rec_access) +		\
+	VIE_REC_NSEG * sizeof(struct seg_desc))
+
+#ifndef	CACHE_LINE_SIZE
+#define	CACHE_LINE_SIZE		64
+#endif
+
+struct vie_rec_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	exits;		/* written, filled in on close */
+	uint64_t	dropped;
+	uint64_t	index;		/* offset of the index, 0 if none */
+	uint64_t	nchunk;
+};
+
+struct vie_rec_chunk {
+	uint32_t	len;		/* bytes of records that follow */
+	uint32_t	nexit;
+	uint16_t	vcpuid;
+	uint16_t	pad[3];
+	uint64_t	tsc;		/* of the first and last records */
+	uint64_t	tsc_last;
+};
+
+struct vie_rec_index {
+	uint64_t	offset;		/* of the struct vie_rec_chunk */
+	uint64_t	tsc;
+	uint64_t	tsc_last;
+	uint32_t	nexit;
+	uint16_t	vcpuid;
+	uint16_t	pad;
+};
+
+/* vie_rec_exit.flags */
+#define	VIE_REC_F_SEGS		0x01	/* segment descriptors follow */
+#define	VIE_REC_F_TRUNCATED	0x02	/* more than VIE_REC_MAXACCESS */
+
+struct vie_rec_exit {
+	uint16_t	len;		/* of the record, a multiple of 8 */
+	uint8_t		inst_len;
+	uint8_t		naccess;
+	uint8_t		cpu_mode;
+	uint8_t		paging_mode;
+	uint8_t		cpl;
+	uint8_t		cs_d;
+	uint8_t		flags;
+	uint8_t		pad[3];
+	int32_t		error;		/* of vmm_emulate_instruction() */
+	uint32_t	inmask;		/* registers before emulation */
+	uint32_t	outmask;	/* registers changed by emulation */
+	uint64_t	tsc;
+	uint64_t	gla;
+	uint64_t	gpa;
+	uint64_t	cr3;
+	uint8_t		inst[16];
+};
+
+struct vie_rec_access {
+	uint64_t	gpa;
+	uint64_t	val;		/* read or written */
+	int32_t		error;
+	uint8_t		size;
+	uint8_t		write;
+	uint8_t		pad[2];
+};
+
+/* What the next record of a chunk is encoded against */
+struct vie_rec_state {
+	uint64_t	tsc;
+	uint64_t	gla;
+	uint64_t	gpa;
+	uint64_t	cr3;
+	uint64_t	regs[VIE_REC_NREG];
+	struct seg_desc	segs[VIE_REC_NSEG];
+	uint8_t		inst[16];
+	uint8_t		inst_len;
+};
+
+struct vie_rec_buf {
+	struct vie_rec_buf *next;
+	uint16_t	vcpuid;
+	uint32_t	len;
+	uint32_t	nexit;
+	uint64_t	tsc;
+	uint64_t	tsc_last;
+	uint8_t		data[VIE_REC_BUFSIZE];
+};
+
+struct vie_rec_vcpu {
+	struct vie_rec_buf *buf;
+	struct vie_rec_state st;
+	uint64_t	exits;
+	uint64_t	dropped;
+	/* The exit being emulated */
+	int		naccess;
+	struct vie_rec_access access[VIE_REC_MAXACCESS];
+} __aligned(CACHE_LINE_SIZE);
+
+struct vie_rec {
+	mem_region_read_t	mrr;		/* device model callbacks */
+	mem_region_write_t	mrw;
+	void			*arg;
+
+	int			fd;
+	int			error;		/* first write error */
+	pthread_t		writer;
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cv;
+	bool			stop;
+	struct vie_rec_buf	*free;		/* buffers to fill */
+	struct vie_rec_buf	*full;		/* buffers to write, FIFO */
+	struct vie_rec_buf	**fullp;
+	struct vie_rec_buf	*bufs;
+	uint64_t		off;		/* file offset, of the writer */
+	struct vie_rec_index	*index;
+	size_t			nindex;
+	size_t			maxindex;
+
+	struct vie_rec_vcpu	vcpu[VIE_REC_MAXCPU];
+};
+
+/*
+ * Start recording to 'path' the exits emulated through 'rec' with the
+ * device model callbacks 'mrr' and 'mrw'.
+ */
+int	vie_rec_open(struct vie_rec *rec, const char *path,
+	    mem_region_read_t mrr, mem_region_write_t mrw, void *arg);
+
+/*
+ * Write out what is left and close the file, once no vCPU emulates
+ * through 'rec' any more. Returns the first error writing the file.
+ */
+int	vie_rec_close(struct vie_rec *rec);
+
+/* vmm_emulate_instruction() of an exit decoded with 'gla' and 'cs_d' */
+int	vie_rec_emulate(struct vie_rec *rec, void *vm, int vcpuid,
+	    uint64_t gla, int cs_d, uint64_t gpa, struct vie *vie,
+	    struct vm_guest_paging *paging);
+
+int	vie_rec_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval,
+	    int rsize, void *arg);
+int	vie_rec_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval,
+	    int wsize, void *arg);
+
+/* A recording mapped for replay */
+struct vie_replay {
+	const struct vie_rec_hdr *hdr;
+	size_t		len;
+	const struct vie_rec_index *index;
+	size_t		nchunk;
+	struct vie_rec_index *built;	/* index rebuilt from the chunks */
+};
+
+/* Decodes the records of a recording, or of one of its vCPUs */
+struct vie_replay_cursor {
+	size_t		chunk;		/* index entry of the next chunk */
+	int		filter;		/* vCPU, or -1 for all of them */
+	int		vcpuid;		/* of the current chunk */
+	const uint8_t	*p;		/* next record of the current chunk */
+	const uint8_t	*end;
+	uint32_t	left;		/* records left in the chunk */
+	bool		pending;	/* 'rec' is the next record */
+	struct vie_rec_state st;
+	uint64_t	rec[VIE_REC_MAXLEN / sizeof(uint64_t)];
+};
+
+/* vie_replay_exit() results, 0 if the replay matched the recording */
+#define	VIE_REPLAY_ERROR	0x01	/* different emulation result */
+#define	VIE_REPLAY_ACCESS	0x02	/* different device model accesses */
+#define	VIE_REPLAY_REGS		0x04	/* different register changes */
+#define	VIE_REPLAY_DECODE	0x08	/* the instruction did not decode */
+#define	VIE_REPLAY_BAD		0x10	/* malformed record */
+
+/* Map 'path', EFTYPE if it is not a recording */
+int	vie_replay_open(struct vie_replay *rp, const char *path);
+void	vie_replay_close(struct vie_replay *rp);
+
+/* Start at the first record of 'vcpuid', or of the recording if -1 */
+void	vie_replay_rewind(struct vie_replay *rp, struct vie_replay_cursor *c,
+	    int vcpuid);
+
+/*
+ * Start at the first record of 'vcpuid' (or any vCPU if -1) taken at or
+ * after 'tsc'. Skips whole chunks by their index entries and decodes only
+ * the chunk that holds the record.
+ */
+void	vie_replay_seek(struct vie_replay *rp, struct vie_replay_cursor *c,
+	    int vcpuid, uint64_t tsc);
+
+/*
+ * Decode the next record and return it and its vCPU. The record stays
+ * valid until the next call. NULL at the end of the recording or at a
+ * malformed chunk, where 'c->left' is not 0.
+ */
+const struct vie_rec_exit *vie_replay_next(struct vie_replay *rp,
+	    struct vie_replay_cursor *c, int *vcpuid);
+
+/* Replay 'ex' on 'vcpuid' of 'vm' and compare, see VIE_REPLAY_* */
+int	vie_replay_exit(void *vm, int vcpuid, const struct vie_rec_exit *ex);
+
+#endif	/* _VMM_EXITREC_H_ */
@@ -0,0 +1,311 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Hottest emulation sites.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <machine/atomic.h>
+#include <machine/cpu.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vmm_stubs.h"
+#include "vmm_hotsites.h"
+
+#define	VIE_HOT_HMASK	(VIE_HOT_NHASH - 1)
+
+_Static_assert(powerof2(VIE_HOT_NHASH) && VIE_HOT_NHASH > VIE_HOT_NSITES &&
+    VIE_HOT_NHASH <= UINT16_MAX, "VIE_HOT_NHASH");
+
+/* A site of the merged sketches and the vCPU it came from */
+struct vie_hot_merge {
+	struct vie_hot_site site;
+	uint64_t	est;		/* sum of the counts that were held */
+	int		vcpu;
+};
+
+void
+vie_hot_init(struct vie_hot *hot)
+{
+	struct vie_hot_vcpu *vc;
+	int i, v;
+
+	/* All counters are in one run of zero counts */
+	memset(hot, 0, sizeof(struct vie_hot));
+	for (v = 0; v < VIE_HOT_MAXCPU; v++) {
+		vc = &hot->vcpu[v];
+		for (i = 0; i < VIE_HOT_NSITES; i++) {
+			vc->order[i].site = i;
+			vc->order[i].run = 0;
+			vc->ref[i].pos = i;
+			if (i != 0)
+				vc->free[vc->nfree++] = i;
+		}
+		vc->last[0] = VIE_HOT_NSITES - 1;
+	}
+}
+
+/* A 16-bit tag of the site, the low bits of which are its home slot */
+static __inline u_int
+vie_hot_hash(uint64_t rip, uint64_t gpa, int op_type)
+{
+	uint64_t h;
+
+	h = (rip ^ (gpa * 0x9e3779b97f4a7c15UL) ^ op_type) *
+	    0xff51afd7ed558ccdUL;
+	return (h >> 48);
+}
+
+#define	VIE_HOT_HOME(tag)	((tag) & VIE_HOT_HMASK)
+#define	VIE_HOT_TAG(e)		((e) >> 16)
+#define	VIE_HOT_SITE(e)		(((e) & 0xffff) - 1)
+
+static __inline bool
+vie_hot_match(const struct vie_hot_site *s, uint64_t rip, uint64_t gpa,
+    int op_type)
+{
+
+	return (s->rip == rip && s->gpa == gpa && s->op_type == op_type);
+}
+
+/*
+ * Increment the count of site 'i': swap it with the last counter of its run
+ * and move it over to the next run, or to a run of its own.
+ */
+static __inline void
+vie_hot_increment(struct vie_hot_vcpu *vc, int i)
+{
+	uint64_t count;
+	u_int j, p, q, r;
+
+	p = vc->ref[i].pos;
+	r = vc->order[p].run;
+	q = vc->last[r];
+	if (p != q) {
+		j = vc->order[q].site;
+		vc->order[p].site = j;
+		vc->ref[j].pos = p;
+		vc->order[q].site = i;
+		vc->ref[i].pos = q;
+	}
+
+	if (q == 0 || vc->order[q - 1].run != r)
+		vc->free[vc->nfree++] = r;
+	else
+		vc->last[r] = q - 1;
+
+	count = ++vc->site[i].count;
+	if (q + 1 < VIE_HOT_NSITES &&
+	    vc->runcount[vc->order[q + 1].run] == count) {
+		vc->order[q].run = vc->order[q + 1].run;
+	} else {
+		r = vc->free[--vc->nfree];
+		vc->last[r] = q;
+		vc->runcount[r] = count;
+		vc->order[q].run = r;
+	}
+}
+
+/* Free hash slot 'i', moving back the entries of its probe sequence */
+static void
+vie_hot_unhash(struct vie_hot_vcpu *vc, u_int i)
+{
+	u_int home, j;
+
+	for (j = i;;) {
+		vc->hash[i] = 0;
+		for (;;) {
+			j = (j + 1) & VIE_HOT_HMASK;
+			if (vc->hash[j] == 0)
+				return;
+			home = VIE_HOT_HOME(VIE_HOT_TAG(vc->hash[j]));
+			/* Can the entry at 'j' move back to 'i'? */
+			if (((j - home) & VIE_HOT_HMASK) >=
+			    ((j - i) & VIE_HOT_HMASK))
+				break;
+		}
+		vc->hash[i] = vc->hash[j];
+		vc->ref[VIE_HOT_SITE(vc->hash[i])].slot = i;
+		i = j;
+	}
+}
+
+void
+vie_hot_record(struct vie_hot *hot, int vcpuid, uint64_t rip, uint64_t gpa,
+    int op_type)
+{
+	struct vie_hot_vcpu *vc;
+	struct vie_hot_site *s;
+	uint32_t e;
+	u_int h, home, tag;
+	int i;
+
+	if (vcpuid < 0 || vcpuid >= VIE_HOT_MAXCPU)
+		return;
+	vc = &hot->vcpu[vcpuid];
+	atomic_store_rel_32(&vc->seq, vc->seq + 1);
+	atomic_thread_fence_rel();
+
+	vc->updates++;
+	tag = vie_hot_hash(rip, gpa, op_type);
+	home = VIE_HOT_HOME(tag);
+	for (h = home; (e = vc->hash[h]) != 0; h = (h + 1) & VIE_HOT_HMASK) {
+		i = VIE_HOT_SITE(e);
+		if (VIE_HOT_TAG(e) == tag &&
+		    vie_hot_match(&vc->site[i], rip, gpa, op_type))
+			goto found;
+	}
+
+	/*
+	 * Take over the least counter, which may be unused. Freeing its slot
+	 * may open up one before 'h' on this site's probe sequence.
+	 */
+	i = vc->order[0].site;
+	s = &vc->site[i];
+	if (s->count != 0) {
+		vie_hot_unhash(vc, vc->ref[i].slot);
+		if (((vc->ref[i].slot - home) & VIE_HOT_HMASK) <
+		    ((h - home) & VIE_HOT_HMASK)) {
+			for (h = home; vc->hash[h] != 0;
+			    h = (h + 1) & VIE_HOT_HMASK)
+				;
+		}
+	}
+	s->rip = rip;
+	s->gpa = gpa;
+	s->op_type = op_type;
+	s->error = s->count;
+	vc->ref[i].slot = h;
+	vc->hash[h] = tag << 16 | (i + 1);
+found:
+	vie_hot_increment(vc, i);
+	atomic_store_rel_32(&vc->seq, vc->seq + 1);
+}
+
+int
+vie_hot_emulate(struct vie_hot *hot, void *vm, int vcpuid, uint64_t gpa,
+    struct vie *vie, struct vm_guest_paging *paging, mem_region_read_t mrr,
+    mem_region_write_t mrw, void *mrarg)
+{
+	uint64_t rip;
+
+	if (vm_get_register(vm, vcpuid, VM_REG_GUEST_RIP, &rip) == 0)
+		vie_hot_record(hot, vcpuid, rip, gpa, vie->op.op_type);
+	return (vmm_emulate_instruction(vm, vcpuid, gpa, vie, paging, mrr,
+	    mrw, mrarg));
+}
+
+/*
+ * Copy a consistent snapshot of the used counters of 'vc' and return their
+ * number; '*min' is set to the least count, 0 unless all are used.
+ */
+static int
+vie_hot_snapshot(struct vie_hot_vcpu *vc, struct vie_hot_site *site,
+    uint64_t *min)
+{
+	uint32_t seq;
+	int i, n;
+
+	for (;;) {
+		seq = atomic_load_acq_32(&vc->seq);
+		if (seq & 1) {
+			cpu_spinwait();
+			continue;
+		}
+		for (i = 0, n = 0; i < VIE_HOT_NSITES; i++) {
+			if (vc->site[i].count != 0)
+				site[n++] = vc->site[i];
+		}
+		*min = vc->site[vc->order[0].site % VIE_HOT_NSITES].count;
+		atomic_thread_fence_acq();
+		if (vc->seq == seq)
+			return (n);
+	}
+}
+
+static int
+vie_hot_cmp_site(const void *a, const void *b)
+{
+	const struct vie_hot_site *x, *y;
+
+	x = &((const struct vie_hot_merge *)a)->site;
+	y = &((const struct vie_hot_merge *)b)->site;
+	if (x->rip != y->rip)
+		return (x->rip < y->rip ? -1 : 1);
+	if (x->gpa != y->gpa)
+		return (x->gpa < y->gpa ? -1 : 1);
+	return (x->op_type - y->op_type);
+}
+
+static int
+vie_hot_cmp_est(const void *a, const void *b)
+{
+	const struct vie_hot_merge *x, *y;
+
+	x = a;
+	y = b;
+	if (x->est != y->est)
+		return (x->est > y->est ? -1 : 1);
+	if (x->site.error != y->site.error)
+		return (x->site.error < y->site.error ? -1 : 1);
+	return (0);
+}
+
+int
+vie_hot_top(struct vie_hot *hot, struct vie_hot_site *top, int *n)
+{
+	struct vie_hot_site site[VIE_HOT_NSITES];
+	struct vie_hot_merge *m, *p;
+	uint64_t min[VIE_HOT_MAXCPU], summin, present;
+	int i, j, k, nm, v;
+
+	if (*n < 0)
+		return (EINVAL);
+	m = malloc(VIE_HOT_MAXCPU * VIE_HOT_NSITES * sizeof(*m));
+	if (m == NULL)
+		return (ENOMEM);
+
+	/* A full sketch may have missed up to its least count of any site */
+	nm = 0;
+	summin = 0;
+	for (v = 0; v < VIE_HOT_MAXCPU; v++) {
+		k = vie_hot_snapshot(&hot->vcpu[v], site, &min[v]);
+		summin += min[v];
+		for (i = 0; i < k; i++, nm++) {
+			m[nm].site = site[i];
+			m[nm].vcpu = v;
+		}
+	}
+
+	/* Sum the counters of each site */
+	qsort(m, nm, sizeof(*m), vie_hot_cmp_site);
+	for (i = 0, k = 0; i < nm; i = j, k++) {
+		p = &m[k];
+		p->site = m[i].site;
+		p->est = m[i].site.count;
+		present = min[m[i].vcpu];
+		for (j = i + 1; j < nm && vie_hot_cmp_site(&m[i], &m[j]) == 0;
+		    j++) {
+			p->site.count += m[j].site.count;
+			p->site.error += m[j].site.error;
+			p->est += m[j].site.count;
+			present += min[m[j].vcpu];
+		}
+		p->site.count += summin - present;
+		p->site.error += summin - present;
+	}
+
+	qsort(m, k, sizeof(*m), vie_hot_cmp_est);
+	*n = MIN(*n, k);
+	for (i = 0; i < *n; i++)
+		top[i] = m[i].site;
+	free(m);
+	return (0);
+}
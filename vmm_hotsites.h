@@ -0,0 +1,103 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Hottest emulation sites.
+ *
+ * Every vCPU feeds the (RIP, gpa, op_type) of the instructions it emulates
+ * into its own Space-Saving sketch (Metwally, Agrawal and El Abbadi, 2005)
+ * of VIE_HOT_NSITES counters. A site that is not in the sketch takes over
+ * the counter with the lowest count and inherits that count as its error,
+ * so memory is constant whatever the number of distinct sites:
+ *
+ * - the true count of a site in the sketch is within [count - error, count];
+ * - a site seen more than N / VIE_HOT_NSITES times out of N is in it.
+ *
+ * A hash table finds the counter of a site. The counters are kept sorted by
+ * count in runs of equal counts, the paper's Stream-Summary, so the least
+ * one is always first and an increment moves a counter to the end of its
+ * run: an update is a hash probe and a swap, whether or not it hits. The
+ * table holds a tag of each site's hash, so probes and the deletion of the
+ * site that a miss replaces only read the table.
+ *
+ * That is still a chain of a dozen dependent loads: an update costs about
+ * 28 ns when all of them hit and about 55 ns on a stream where four in ten
+ * miss (bench/hot_bench), not the few ns of a counter increment. A caller
+ * that cannot afford that on every exit should record a sample of them.
+ *
+ * Only the thread emulating on a vCPU updates its sketch; vie_hot_top() may
+ * be called concurrently from any thread.
+ */
+
+#ifndef	_VMM_HOTSITES_H_
+#define	_VMM_HOTSITES_H_
+
+#define	VIE_HOT_MAXCPU		16
+#define	VIE_HOT_NSITES		256	/* counters per vCPU */
+#define	VIE_HOT_NHASH		512	/* power of 2, > VIE_HOT_NSITES */
+
+#ifndef	CACHE_LINE_SIZE
+#define	CACHE_LINE_SIZE		64
+#endif
+
+struct vie_hot_site {
+	uint64_t	rip;
+	uint64_t	gpa;
+	uint64_t	count;		/* upper bound of the true count */
+	uint64_t	error;		/* 'count - error' is a lower bound */
+	int		op_type;	/* struct vie_op.op_type */
+};
+
+/* A place in the count order: the site there and the run it is in */
+struct vie_hot_ord {
+	uint16_t	site;
+	uint16_t	run;
+};
+
+/* Where a site is: its 'order' index and its 'hash' slot */
+struct vie_hot_ref {
+	uint16_t	pos;
+	uint16_t	slot;
+};
+
+/* Counters with a zero count are unused */
+struct vie_hot_vcpu {
+	volatile uint32_t seq;		/* odd while an update is in progress */
+	int		nfree;
+	uint64_t	updates;
+	struct vie_hot_site site[VIE_HOT_NSITES];
+	struct vie_hot_ord order[VIE_HOT_NSITES]; /* by increasing count */
+	struct vie_hot_ref ref[VIE_HOT_NSITES];
+	uint64_t	runcount[VIE_HOT_NSITES]; /* count of each run */
+	uint16_t	last[VIE_HOT_NSITES];	/* last index of each run */
+	uint16_t	free[VIE_HOT_NSITES];	/* unused runs */
+	uint32_t	hash[VIE_HOT_NHASH];	/* tag << 16 | site + 1 */
+} __aligned(CACHE_LINE_SIZE);
+
+struct vie_hot {
+	struct vie_hot_vcpu vcpu[VIE_HOT_MAXCPU];
+};
+
+void	vie_hot_init(struct vie_hot *hot);
+
+/* Count one emulation of the instruction at 'rip' that accessed 'gpa' */
+void	vie_hot_record(struct vie_hot *hot, int vcpuid, uint64_t rip,
+	    uint64_t gpa, int op_type);
+
+/*
+ * vmm_emulate_instruction() that records the site of 'vie' first. The RIP
+ * is read with vm_get_register().
+ */
+int	vie_hot_emulate(struct vie_hot *hot, void *vm, int vcpuid,
+	    uint64_t gpa, struct vie *vie, struct vm_guest_paging *paging,
+	    mem_region_read_t mrr, mem_region_write_t mrw, void *mrarg);
+
+/*
+ * Merge the sketches of all vCPUs and copy the '*n' hottest sites to 'top',
+ * ranked by the sum of their counts in the sketches that hold them. '*n' is
+ * set to the number copied. The bounds stay valid after merging: a vCPU
+ * whose sketch does not hold a site adds its lowest count to both the
+ * site's count and error.
+ */
+int	vie_hot_top(struct vie_hot *hot, struct vie_hot_site *top, int *n);
+
+#endif	/* _VMM_HOTSITES_H_ */
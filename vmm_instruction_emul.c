@@ -37,6 +37,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/pcpu.h>
 #include <sys/systm.h>
 #include <sys/proc.h>
+#include <sys/time.h>
 
 #include <vm/vm.h>
 #include <vm/pmap.h>
@@ -47,6 +48,8 @@ __FBSDID("$FreeBSD$");
 #include <sys/types.h>
 #include <sys/errno.h>
 #include <sys/_iovec.h>
+#include <machine/atomic.h>
+#include <time.h>
 #ifdef _VERIFICATION
 #include "vmm_stubs.h"
 #else   /* !_VERIFICATION */
@@ -63,6 +66,9 @@ __FBSDID("$FreeBSD$");
 #include <machine/vmm_instruction_emul.h>
 #include <x86/psl.h>
 #include <x86/specialreg.h>
+#if defined(VIE_STATS) || defined(VIE_TRACE) || defined(VIE_STAGES)
+#include <machine/cpufunc.h>
+#endif
 
 /* struct vie_op.op_type */
 enum {
@@ -84,6 +90,54 @@ enum {
 	VIE_OP_TYPE_LAST
 };
 
+#ifdef VIE_TRACE
+#define	VIE_TP(vcpuid, event, arg, a0, a1) do {				\
+	if (__predict_false(vie_trace_enabled))				\
+		vie_trace_record((vcpuid), (event), (arg), (a0), (a1));	\
+} while (0)
+#else
+#define	VIE_TP(vcpuid, event, arg, a0, a1)
+#endif
+
+#ifdef VIE_STAGES
+static void vie_stage_begin(int vcpuid, int stage);
+static void vie_stage_switch(int vcpuid, int stage);
+static void vie_stage_push(int vcpuid, int stage);
+static void vie_stage_pop(int vcpuid);
+static void vie_stage_decoded(int vcpuid, struct vie *vie, int error);
+static void vie_stage_done(int vcpuid, struct vie *vie);
+
+#define	VIE_STAGE_BEGIN(vcpuid, stage)	vie_stage_begin(vcpuid, stage)
+#define	VIE_STAGE(vcpuid, stage)	vie_stage_switch(vcpuid, stage)
+#define	VIE_STAGE_PUSH(vcpuid, stage)	vie_stage_push(vcpuid, stage)
+#define	VIE_STAGE_POP(vcpuid)		vie_stage_pop(vcpuid)
+#define	VIE_STAGE_DECODED(vcpuid, vie, error)				\
+	vie_stage_decoded(vcpuid, vie, error)
+#define	VIE_STAGE_DONE(vcpuid, vie)	vie_stage_done(vcpuid, vie)
+#else
+#define	VIE_STAGE_BEGIN(vcpuid, stage)
+#define	VIE_STAGE(vcpuid, stage)
+#define	VIE_STAGE_PUSH(vcpuid, stage)
+#define	VIE_STAGE_POP(vcpuid)
+#define	VIE_STAGE_DECODED(vcpuid, vie, error)
+#define	VIE_STAGE_DONE(vcpuid, vie)
+#endif
+
+/* Why vmm_decode_instruction() failed */
+enum {
+	VIE_DECODE_OK = 0,
+	VIE_DECODE_PREFIX,
+	VIE_DECODE_OPCODE,
+	VIE_DECODE_MODRM,
+	VIE_DECODE_SIB,
+	VIE_DECODE_DISPLACEMENT,
+	VIE_DECODE_IMMEDIATE,
+	VIE_DECODE_MOFFSET,
+	VIE_DECODE_LOCK,
+	VIE_DECODE_GLA,
+	VIE_DECODE_LAST
+};
+
 /* struct vie_op.op_flags */
 #define	VIE_OP_F_IMM		(1 << 0)  /* 16/32-bit immediate operand */
 #define	VIE_OP_F_IMM8		(1 << 1)  /* 8-bit immediate operand */
@@ -92,6 +146,17 @@ enum {
 #define	VIE_OP_F_NO_GLA_VERIFICATION (1 << 4)
 
 static const struct vie_op two_byte_opcodes[256] = {
+	[0xAB] = {
+		/* The bit offset register can move the operand */
+		.op_byte = 0xAB,
+		.op_type = VIE_OP_TYPE_BITTEST,
+		.op_flags = VIE_OP_F_NO_GLA_VERIFICATION,
+	},
+	[0xB3] = {
+		.op_byte = 0xB3,
+		.op_type = VIE_OP_TYPE_BITTEST,
+		.op_flags = VIE_OP_F_NO_GLA_VERIFICATION,
+	},
 	[0xB6] = {
 		.op_byte = 0xB6,
 		.op_type = VIE_OP_TYPE_MOVZX,
@@ -271,6 +336,148 @@ vie_read_register(void *vm, int vcpuid, enum vm_reg_name reg, uint64_t *rval)
 	return (error);
 }
 
+/*
+ * The memory region callbacks of the instruction being emulated. Devices
+ * that provide typed handlers in 'ops' are called at the exact width of
+ * the access, the others through the generic 'read' and 'write' callbacks.
+ */
+struct vie_mmio {
+	const struct vie_mmio_ops *ops;
+	mem_region_read_t	read;
+	mem_region_write_t	write;
+	mem_region_rmw_t	rmw;		/* optional */
+	void			*arg;
+};
+
+static int
+vie_mmio_do_read(void *vm, int vcpuid, struct vie_mmio *mmio, uint64_t gpa,
+    uint64_t *rval, int size)
+{
+	const struct vie_mmio_ops *ops;
+	uint8_t val8;
+	uint16_t val16;
+	uint32_t val32;
+	int error;
+
+	ops = mmio->ops;
+	if (ops == NULL)
+		return ((*mmio->read)(vm, vcpuid, gpa, rval, size, mmio->arg));
+
+	error = EINVAL;
+	switch (size) {
+	case 1:
+		if (ops->read8 != NULL) {
+			error = (*ops->read8)(vm, vcpuid, gpa, &val8,
+			    mmio->arg);
+			*rval = val8;
+		}
+		break;
+	case 2:
+		if (ops->read16 != NULL) {
+			error = (*ops->read16)(vm, vcpuid, gpa, &val16,
+			    mmio->arg);
+			*rval = val16;
+		}
+		break;
+	case 4:
+		if (ops->read32 != NULL) {
+			error = (*ops->read32)(vm, vcpuid, gpa, &val32,
+			    mmio->arg);
+			*rval = val32;
+		}
+		break;
+	case 8:
+		if (ops->read64 != NULL)
+			error = (*ops->read64)(vm, vcpuid, gpa, rval,
+			    mmio->arg);
+		break;
+	}
+	return (error);
+}
+
+static int
+vie_mmio_do_write(void *vm, int vcpuid, struct vie_mmio *mmio, uint64_t gpa,
+    uint64_t wval, int size)
+{
+	const struct vie_mmio_ops *ops;
+	int error;
+
+	ops = mmio->ops;
+	if (ops == NULL)
+		return ((*mmio->write)(vm, vcpuid, gpa, wval, size, mmio->arg));
+
+	error = EINVAL;
+	switch (size) {
+	case 1:
+		if (ops->write8 != NULL)
+			error = (*ops->write8)(vm, vcpuid, gpa, wval,
+			    mmio->arg);
+		break;
+	case 2:
+		if (ops->write16 != NULL)
+			error = (*ops->write16)(vm, vcpuid, gpa, wval,
+			    mmio->arg);
+		break;
+	case 4:
+		if (ops->write32 != NULL)
+			error = (*ops->write32)(vm, vcpuid, gpa, wval,
+			    mmio->arg);
+		break;
+	case 8:
+		if (ops->write64 != NULL)
+			error = (*ops->write64)(vm, vcpuid, gpa, wval,
+			    mmio->arg);
+		break;
+	}
+	return (error);
+}
+
+static int
+vie_mmio_read(void *vm, int vcpuid, struct vie_mmio *mmio, uint64_t gpa,
+    uint64_t *rval, int size)
+{
+	int error;
+
+	VIE_TP(vcpuid, VIE_TRACE_MMIO_READ, size, gpa, 0);
+	VIE_STAGE_PUSH(vcpuid, VIE_STAGE_MMIO_READ);
+	error = vie_mmio_do_read(vm, vcpuid, mmio, gpa, rval, size);
+	VIE_STAGE_POP(vcpuid);
+	VIE_TP(vcpuid, VIE_TRACE_MMIO_DONE, error, gpa, error ? 0 : *rval);
+	return (error);
+}
+
+static int
+vie_mmio_write(void *vm, int vcpuid, struct vie_mmio *mmio, uint64_t gpa,
+    uint64_t wval, int size)
+{
+	int error;
+
+	VIE_TP(vcpuid, VIE_TRACE_MMIO_WRITE, size, gpa, wval);
+	VIE_STAGE_PUSH(vcpuid, VIE_STAGE_MMIO_WRITE);
+	error = vie_mmio_do_write(vm, vcpuid, mmio, gpa, wval, size);
+	VIE_STAGE_POP(vcpuid);
+	VIE_TP(vcpuid, VIE_TRACE_MMIO_DONE, error, gpa, wval);
+	return (error);
+}
+
+static int
+vie_mmio_rmw(void *vm, int vcpuid, struct vie_mmio *mmio, uint64_t gpa,
+    enum vie_rmw_op op, uint64_t operand, uint64_t *oldval, int size,
+    int locked)
+{
+	int error;
+
+	VIE_TP(vcpuid, VIE_TRACE_MMIO_RMW, size | op << 8 | locked << 16, gpa,
+	    operand);
+	VIE_STAGE_PUSH(vcpuid, VIE_STAGE_MMIO_RMW);
+	error = (*mmio->rmw)(vm, vcpuid, gpa, op, operand, oldval, size,
+	    locked, mmio->arg);
+	VIE_STAGE_POP(vcpuid);
+	VIE_TP(vcpuid, VIE_TRACE_MMIO_DONE, error, gpa,
+	    error ? 0 : *oldval);
+	return (error);
+}
+
 static void
 vie_calc_bytereg(struct vie *vie, enum vm_reg_name *reg, int *lhbr)
 {
@@ -412,7 +619,7 @@ getcc(int opsize, uint64_t x, uint64_t y)
 
 static int
 emulate_mov(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
-	    mem_region_read_t memread, mem_region_write_t memwrite, void *arg)
+	    struct vie_mmio *mmio)
 {
 	int error, size;
 	enum vm_reg_name reg;
@@ -432,7 +639,8 @@ emulate_mov(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		size = 1;	/* override for byte operation */
 		error = vie_read_bytereg(vm, vcpuid, vie, &byte);
 		if (error == 0)
-			error = memwrite(vm, vcpuid, gpa, byte, size, arg);
+			error = vie_mmio_write(vm, vcpuid, mmio, gpa, byte,
+			    size);
 		break;
 	case 0x89:
 		/*
@@ -445,7 +653,8 @@ emulate_mov(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		error = vie_read_register(vm, vcpuid, reg, &val);
 		if (error == 0) {
 			val &= size2mask[size];
-			error = memwrite(vm, vcpuid, gpa, val, size, arg);
+			error = vie_mmio_write(vm, vcpuid, mmio, gpa, val,
+			    size);
 		}
 		break;
 	case 0x8A:
@@ -455,7 +664,7 @@ emulate_mov(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		 * REX + 8A/r:	mov r8, r/m8
 		 */
 		size = 1;	/* override for byte operation */
-		error = memread(vm, vcpuid, gpa, &val, size, arg);
+		error = vie_mmio_read(vm, vcpuid, mmio, gpa, &val, size);
 		if (error == 0)
 			error = vie_write_bytereg(vm, vcpuid, vie, val);
 		break;
@@ -466,7 +675,7 @@ emulate_mov(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		 * 8B/r:	mov r32, r/m32
 		 * REX.W 8B/r:	mov r64, r/m64
 		 */
-		error = memread(vm, vcpuid, gpa, &val, size, arg);
+		error = vie_mmio_read(vm, vcpuid, mmio, gpa, &val, size);
 		if (error == 0) {
 			reg = gpr_map[vie->reg];
 			error = vie_update_register(vm, vcpuid, reg, val, size);
@@ -479,7 +688,7 @@ emulate_mov(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		 * A1:		mov EAX, moffs32
 		 * REX.W + A1:	mov RAX, moffs64
 		 */
-		error = memread(vm, vcpuid, gpa, &val, size, arg);
+		error = vie_mmio_read(vm, vcpuid, mmio, gpa, &val, size);
 		if (error == 0) {
 			reg = VM_REG_GUEST_RAX;
 			error = vie_update_register(vm, vcpuid, reg, val, size);
@@ -495,7 +704,8 @@ emulate_mov(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		error = vie_read_register(vm, vcpuid, VM_REG_GUEST_RAX, &val);
 		if (error == 0) {
 			val &= size2mask[size];
-			error = memwrite(vm, vcpuid, gpa, val, size, arg);
+			error = vie_mmio_write(vm, vcpuid, mmio, gpa, val,
+			    size);
 		}
 		break;
 	case 0xC6:
@@ -505,7 +715,8 @@ emulate_mov(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		 * REX + C6/0	mov r/m8, imm8
 		 */
 		size = 1;	/* override for byte operation */
-		error = memwrite(vm, vcpuid, gpa, vie->immediate, size, arg);
+		error = vie_mmio_write(vm, vcpuid, mmio, gpa, vie->immediate,
+		    size);
 		break;
 	case 0xC7:
 		/*
@@ -515,19 +726,152 @@ emulate_mov(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		 * REX.W + C7/0	mov r/m64, imm32 (sign-extended to 64-bits)
 		 */
 		val = vie->immediate & size2mask[size];
-		error = memwrite(vm, vcpuid, gpa, val, size, arg);
+		error = vie_mmio_write(vm, vcpuid, mmio, gpa, val, size);
+		break;
+	default:
+		break;
+	}
+
+	return (error);
+}
+
+/*
+ * If 'vie' is a MOV that stores a register or an immediate to memory return
+ * the value and the size of the store without performing it. This lets the
+ * caller short-circuit stores that only serve as a doorbell.
+ */
+int
+vie_mov_store(void *vm, int vcpuid, struct vie *vie, uint64_t *val,
+    int *size)
+{
+	uint8_t byte;
+	int error;
+
+	if (!vie->decoded || vie->op.op_type != VIE_OP_TYPE_MOV)
+		return (EINVAL);
+
+	switch (vie->op.op_byte) {
+	case 0x88:
+		error = vie_read_bytereg(vm, vcpuid, vie, &byte);
+		*val = byte;
+		*size = 1;
+		break;
+	case 0x89:
+		error = vie_read_register(vm, vcpuid, gpr_map[vie->reg], val);
+		*val &= size2mask[vie->opsize];
+		*size = vie->opsize;
+		break;
+	case 0xA3:
+		error = vie_read_register(vm, vcpuid, VM_REG_GUEST_RAX, val);
+		*val &= size2mask[vie->opsize];
+		*size = vie->opsize;
+		break;
+	case 0xC6:
+		error = 0;
+		*val = vie->immediate & 0xff;
+		*size = 1;
+		break;
+	case 0xC7:
+		error = 0;
+		*val = vie->immediate & size2mask[vie->opsize];
+		*size = vie->opsize;
 		break;
 	default:
+		error = EINVAL;
 		break;
 	}
 
 	return (error);
 }
 
+#define	VIE_REG(r)	(1UL << (r))
+
+/*
+ * The registers, as VIE_REG(enum vm_reg_name), that emulating the decoded
+ * 'vie' may read or write, including the segment registers whose
+ * descriptors it reads. This lets a caller that saves guest state around
+ * the emulation, such as the exit recorder, skip the registers that the
+ * instruction cannot touch.
+ */
+uint64_t
+vie_regs_used(struct vie *vie)
+{
+	enum vm_reg_name reg;
+	uint64_t mask;
+	int lhbr;
+
+	if (!vie->decoded)
+		return (0);
+
+	mask = 0;
+	if (vie->base_register != VM_REG_LAST)
+		mask |= VIE_REG(vie->base_register);
+	if (vie->index_register != VM_REG_LAST)
+		mask |= VIE_REG(vie->index_register);
+	if (vie->repz_present || vie->repnz_present)
+		mask |= VIE_REG(VM_REG_GUEST_RCX);
+
+	switch (vie->op.op_type) {
+	case VIE_OP_TYPE_MOV:
+		switch (vie->op.op_byte) {
+		case 0x88:
+		case 0x8A:
+			vie_calc_bytereg(vie, &reg, &lhbr);
+			mask |= VIE_REG(reg);
+			break;
+		case 0x89:
+		case 0x8B:
+			mask |= VIE_REG(gpr_map[vie->reg]);
+			break;
+		case 0xA1:
+		case 0xA3:
+			mask |= VIE_REG(VM_REG_GUEST_RAX);
+			break;
+		}
+		break;
+	case VIE_OP_TYPE_MOVSX:
+	case VIE_OP_TYPE_MOVZX:
+		mask |= VIE_REG(gpr_map[vie->reg]);
+		break;
+	case VIE_OP_TYPE_AND:
+	case VIE_OP_TYPE_OR:
+	case VIE_OP_TYPE_SUB:
+	case VIE_OP_TYPE_CMP:
+		mask |= VIE_REG(gpr_map[vie->reg]) |
+		    VIE_REG(VM_REG_GUEST_RFLAGS);
+		break;
+	case VIE_OP_TYPE_GROUP1:
+		mask |= VIE_REG(VM_REG_GUEST_RFLAGS);
+		break;
+	case VIE_OP_TYPE_BITTEST:
+		if (vie->op.op_byte != 0xBA)
+			mask |= VIE_REG(gpr_map[vie->reg]);
+		mask |= VIE_REG(VM_REG_GUEST_RFLAGS);
+		break;
+	case VIE_OP_TYPE_MOVS:
+		mask |= VIE_REG(VM_REG_GUEST_RSI) | VIE_REG(VM_REG_GUEST_RDI) |
+		    VIE_REG(VM_REG_GUEST_CR0) | VIE_REG(VM_REG_GUEST_RFLAGS) |
+		    VIE_REG(VM_REG_GUEST_ES) | VIE_REG(vie->segment_override ?
+		    vie->segment_register : VM_REG_GUEST_DS);
+		break;
+	case VIE_OP_TYPE_STOS:
+		mask |= VIE_REG(VM_REG_GUEST_RAX) | VIE_REG(VM_REG_GUEST_RDI) |
+		    VIE_REG(VM_REG_GUEST_RFLAGS);
+		break;
+	case VIE_OP_TYPE_PUSH:
+	case VIE_OP_TYPE_POP:
+		mask |= VIE_REG(VM_REG_GUEST_RSP) | VIE_REG(VM_REG_GUEST_CR0) |
+		    VIE_REG(VM_REG_GUEST_RFLAGS) | VIE_REG(VM_REG_GUEST_SS);
+		break;
+	default:
+		break;
+	}
+	return (mask);
+}
+
 static int
 emulate_movx(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
-	     mem_region_read_t memread, mem_region_write_t memwrite,
-	     void *arg)
+	     struct vie_mmio *mmio)
 {
 	int error, size;
 	enum vm_reg_name reg;
@@ -548,7 +892,7 @@ emulate_movx(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		 */
 
 		/* get the first operand */
-		error = memread(vm, vcpuid, gpa, &val, 1, arg);
+		error = vie_mmio_read(vm, vcpuid, mmio, gpa, &val, 1);
 		if (error)
 			break;
 
@@ -569,7 +913,7 @@ emulate_movx(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		 * 0F B7/r		movzx r32, r/m16
 		 * REX.W + 0F B7/r	movzx r64, r/m16
 		 */
-		error = memread(vm, vcpuid, gpa, &val, 2, arg);
+		error = vie_mmio_read(vm, vcpuid, mmio, gpa, &val, 2);
 		if (error)
 			return (error);
 
@@ -591,7 +935,7 @@ emulate_movx(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		 */
 
 		/* get the first operand */
-		error = memread(vm, vcpuid, gpa, &val, 1, arg);
+		error = vie_mmio_read(vm, vcpuid, mmio, gpa, &val, 1);
 		if (error)
 			break;
 
@@ -668,8 +1012,7 @@ guest_fault:
 
 static int
 emulate_movs(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
-    struct vm_guest_paging *paging, mem_region_read_t memread,
-    mem_region_write_t memwrite, void *arg)
+    struct vm_guest_paging *paging, struct vie_mmio *mmio)
 {
 #ifdef _KERNEL
 	struct vm_copyinfo copyinfo[2];
@@ -724,13 +1067,17 @@ emulate_movs(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 	 */
 
 	seg = vie->segment_override ? vie->segment_register : VM_REG_GUEST_DS;
+	VIE_STAGE_PUSH(vcpuid, VIE_STAGE_GLA);
 	error = get_gla(vm, vcpuid, vie, paging, opsize, vie->addrsize,
 	    PROT_READ, seg, VM_REG_GUEST_RSI, &srcaddr, &fault);
+	VIE_STAGE_POP(vcpuid);
 	if (error || fault)
 		goto done;
 
+	VIE_STAGE_PUSH(vcpuid, VIE_STAGE_GLA2GPA);
 	error = vm_copy_setup(vm, vcpuid, paging, srcaddr, opsize, PROT_READ,
 	    copyinfo, nitems(copyinfo), &fault);
+	VIE_STAGE_POP(vcpuid);
 	if (error == 0) {
 		if (fault)
 			goto done;	/* Resume guest to handle fault */
@@ -740,7 +1087,7 @@ emulate_movs(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		 */
 		vm_copyin(vm, vcpuid, copyinfo, &val, opsize);
 		vm_copy_teardown(vm, vcpuid, copyinfo, nitems(copyinfo));
-		error = memwrite(vm, vcpuid, gpa, val, opsize, arg);
+		error = vie_mmio_write(vm, vcpuid, mmio, gpa, val, opsize);
 		if (error)
 			goto done;
 	} else {
@@ -749,14 +1096,18 @@ emulate_movs(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		 * if 'srcaddr' is in the mmio space.
 		 */
 
+		VIE_STAGE_PUSH(vcpuid, VIE_STAGE_GLA);
 		error = get_gla(vm, vcpuid, vie, paging, opsize, vie->addrsize,
 		    PROT_WRITE, VM_REG_GUEST_ES, VM_REG_GUEST_RDI, &dstaddr,
 		    &fault);
+		VIE_STAGE_POP(vcpuid);
 		if (error || fault)
 			goto done;
 
+		VIE_STAGE_PUSH(vcpuid, VIE_STAGE_GLA2GPA);
 		error = vm_copy_setup(vm, vcpuid, paging, dstaddr, opsize,
 		    PROT_WRITE, copyinfo, nitems(copyinfo), &fault);
+		VIE_STAGE_POP(vcpuid);
 		if (error == 0) {
 			if (fault)
 				goto done;    /* Resume guest to handle fault */
@@ -770,7 +1121,8 @@ emulate_movs(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 			 * injected into the guest then it will happen
 			 * before the MMIO read is attempted.
 			 */
-			error = memread(vm, vcpuid, gpa, &val, opsize, arg);
+			error = vie_mmio_read(vm, vcpuid, mmio, gpa, &val,
+			    opsize);
 			if (error)
 				goto done;
 
@@ -785,21 +1137,23 @@ emulate_movs(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 			 * instruction is not going to be restarted due
 			 * to address translation faults.
 			 */
+			VIE_STAGE_PUSH(vcpuid, VIE_STAGE_GLA2GPA);
 			error = vm_gla2gpa(vm, vcpuid, paging, srcaddr,
 			    PROT_READ, &srcgpa, &fault);
+			if (error == 0 && fault == 0)
+				error = vm_gla2gpa(vm, vcpuid, paging, dstaddr,
+				   PROT_WRITE, &dstgpa, &fault);
+			VIE_STAGE_POP(vcpuid);
 			if (error || fault)
 				goto done;
 
-			error = vm_gla2gpa(vm, vcpuid, paging, dstaddr,
-			   PROT_WRITE, &dstgpa, &fault);
-			if (error || fault)
-				goto done;
-
-			error = memread(vm, vcpuid, srcgpa, &val, opsize, arg);
+			error = vie_mmio_read(vm, vcpuid, mmio, srcgpa, &val,
+			    opsize);
 			if (error)
 				goto done;
 
-			error = memwrite(vm, vcpuid, dstgpa, val, opsize, arg);
+			error = vie_mmio_write(vm, vcpuid, mmio, dstgpa, val,
+			    opsize);
 			if (error)
 				goto done;
 		}
@@ -850,8 +1204,7 @@ done:
 
 static int
 emulate_stos(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
-    struct vm_guest_paging *paging, mem_region_read_t memread,
-    mem_region_write_t memwrite, void *arg)
+    struct vm_guest_paging *paging, struct vie_mmio *mmio)
 {
 	int error, opsize, repeat;
 	uint64_t val;
@@ -875,7 +1228,7 @@ emulate_stos(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 	error = vie_read_register(vm, vcpuid, VM_REG_GUEST_RAX, &val);
 	KASSERT(!error, ("%s: error %d getting rax", __func__, error));
 
-	error = memwrite(vm, vcpuid, gpa, val, opsize, arg);
+	error = vie_mmio_write(vm, vcpuid, mmio, gpa, val, opsize);
 	if (error)
 		return (error);
 
@@ -912,7 +1265,7 @@ emulate_stos(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 
 static int
 emulate_and(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
-	    mem_region_read_t memread, mem_region_write_t memwrite, void *arg)
+	    struct vie_mmio *mmio)
 {
 	int error, size;
 	enum vm_reg_name reg;
@@ -939,7 +1292,7 @@ emulate_and(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 			break;
 
 		/* get the second operand */
-		error = memread(vm, vcpuid, gpa, &val2, size, arg);
+		error = vie_mmio_read(vm, vcpuid, mmio, gpa, &val2, size);
 		if (error)
 			break;
 
@@ -961,9 +1314,22 @@ emulate_and(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		 * 83 /4		and r/m32, imm8 sign-extended to 32
 		 * REX.W + 83/4		and r/m64, imm8 sign-extended to 64
 		 */
+		if (mmio->rmw != NULL) {
+			/*
+			 * Let the device model update the register
+			 * atomically and hand back the original value.
+			 */
+			error = vie_mmio_rmw(vm, vcpuid, mmio, gpa, VIE_RMW_AND,
+			    vie->immediate & size2mask[size], &val1, size,
+			    vie->lock_present);
+			if (error)
+				break;
+			result = val1 & vie->immediate;
+			break;
+		}
 
 		/* get the first operand */
-                error = memread(vm, vcpuid, gpa, &val1, size, arg);
+                error = vie_mmio_read(vm, vcpuid, mmio, gpa, &val1, size);
                 if (error)
 			break;
 
@@ -972,7 +1338,7 @@ emulate_and(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		 * operand and write the result
 		 */
                 result = val1 & vie->immediate;
-                error = memwrite(vm, vcpuid, gpa, result, size, arg);
+                error = vie_mmio_write(vm, vcpuid, mmio, gpa, result, size);
 		break;
 	default:
 		break;
@@ -1000,7 +1366,7 @@ emulate_and(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 
 static int
 emulate_or(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
-	    mem_region_read_t memread, mem_region_write_t memwrite, void *arg)
+	    struct vie_mmio *mmio)
 {
 	int error, size;
 	enum vm_reg_name reg;
@@ -1027,7 +1393,7 @@ emulate_or(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 			break;
 		
 		/* get the second operand */
-		error = memread(vm, vcpuid, gpa, &val2, size, arg);
+		error = vie_mmio_read(vm, vcpuid, mmio, gpa, &val2, size);
 		if (error)
 			break;
 
@@ -1049,9 +1415,18 @@ emulate_or(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		 * 83 /1		or r/m32, imm8 sign-extended to 32
 		 * REX.W + 83/1		or r/m64, imm8 sign-extended to 64
 		 */
+		if (mmio->rmw != NULL) {
+			error = vie_mmio_rmw(vm, vcpuid, mmio, gpa, VIE_RMW_OR,
+			    vie->immediate & size2mask[size], &val1, size,
+			    vie->lock_present);
+			if (error)
+				break;
+			result = val1 | vie->immediate;
+			break;
+		}
 
 		/* get the first operand */
-                error = memread(vm, vcpuid, gpa, &val1, size, arg);
+                error = vie_mmio_read(vm, vcpuid, mmio, gpa, &val1, size);
                 if (error)
 			break;
 
@@ -1060,7 +1435,7 @@ emulate_or(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 		 * operand and write the result
 		 */
                 result = val1 | vie->immediate;
-                error = memwrite(vm, vcpuid, gpa, result, size, arg);
+                error = vie_mmio_write(vm, vcpuid, mmio, gpa, result, size);
 		break;
 	default:
 		break;
@@ -1088,7 +1463,7 @@ emulate_or(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 
 static int
 emulate_cmp(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
-	    mem_region_read_t memread, mem_region_write_t memwrite, void *arg)
+	    struct vie_mmio *mmio)
 {
 	int error, size;
 	uint64_t regop, memop, op1, op2, rflags, rflags2;
@@ -1120,7 +1495,7 @@ emulate_cmp(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 			return (error);
 
 		/* Get the memory operand */
-		error = memread(vm, vcpuid, gpa, &memop, size, arg);
+		error = vie_mmio_read(vm, vcpuid, mmio, gpa, &memop, size);
 		if (error)
 			return (error);
 
@@ -1159,7 +1534,7 @@ emulate_cmp(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 			size = 1;
 
 		/* get the first operand */
-                error = memread(vm, vcpuid, gpa, &op1, size, arg);
+                error = vie_mmio_read(vm, vcpuid, mmio, gpa, &op1, size);
 		if (error)
 			return (error);
 
@@ -1180,7 +1555,7 @@ emulate_cmp(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 
 static int
 emulate_sub(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
-	    mem_region_read_t memread, mem_region_write_t memwrite, void *arg)
+	    struct vie_mmio *mmio)
 {
 	int error, size;
 	uint64_t nval, rflags, rflags2, val1, val2;
@@ -1206,7 +1581,7 @@ emulate_sub(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 			break;
 
 		/* get the second operand */
-		error = memread(vm, vcpuid, gpa, &val2, size, arg);
+		error = vie_mmio_read(vm, vcpuid, mmio, gpa, &val2, size);
 		if (error)
 			break;
 
@@ -1236,8 +1611,7 @@ emulate_sub(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 
 static int
 emulate_stack_op(void *vm, int vcpuid, uint64_t mmio_gpa, struct vie *vie,
-    struct vm_guest_paging *paging, mem_region_read_t memread,
-    mem_region_write_t memwrite, void *arg)
+    struct vm_guest_paging *paging, struct vie_mmio *mmio)
 {
 #ifdef _KERNEL
 	struct vm_copyinfo copyinfo[2];
@@ -1263,10 +1637,10 @@ emulate_stack_op(void *vm, int vcpuid, uint64_t mmio_gpa, struct vie *vie,
 		 * - Stack pointer size is always 64-bits.
 		 * - PUSH/POP of 32-bit values is not possible in 64-bit mode.
 		 * - 16-bit PUSH/POP is supported by using the operand size
-		 *   override prefix (66H).
+		 *   override prefix (66H), unless REX.W is also present.
 		 */
 		stackaddrsize = 8;
-		size = vie->opsize_override ? 2 : 8;
+		size = vie->opsize_override && !vie->rex_w ? 2 : 8;
 	} else {
 		/*
 		 * In protected or compatibility mode the 'B' flag in the
@@ -1294,6 +1668,8 @@ emulate_stack_op(void *vm, int vcpuid, uint64_t mmio_gpa, struct vie *vie,
 		rsp -= size;
 	}
 
+	/* Faults leave the rest charged to VIE_STAGE_GLA */
+	VIE_STAGE_PUSH(vcpuid, VIE_STAGE_GLA);
 	if (vie_calculate_gla(paging->cpu_mode, VM_REG_GUEST_SS, &ss_desc,
 	    rsp, size, stackaddrsize, pushop ? PROT_WRITE : PROT_READ,
 	    &stack_gla)) {
@@ -1311,19 +1687,23 @@ emulate_stack_op(void *vm, int vcpuid, uint64_t mmio_gpa, struct vie *vie,
 		return (0);
 	}
 
+	VIE_STAGE_POP(vcpuid);
+
+	VIE_STAGE_PUSH(vcpuid, VIE_STAGE_GLA2GPA);
 	error = vm_copy_setup(vm, vcpuid, paging, stack_gla, size,
 	    pushop ? PROT_WRITE : PROT_READ, copyinfo, nitems(copyinfo),
 	    &fault);
+	VIE_STAGE_POP(vcpuid);
 	if (error || fault)
 		return (error);
 
 	if (pushop) {
-		error = memread(vm, vcpuid, mmio_gpa, &val, size, arg);
+		error = vie_mmio_read(vm, vcpuid, mmio, mmio_gpa, &val, size);
 		if (error == 0)
 			vm_copyout(vm, vcpuid, &val, copyinfo, size);
 	} else {
 		vm_copyin(vm, vcpuid, copyinfo, &val, size);
-		error = memwrite(vm, vcpuid, mmio_gpa, val, size, arg);
+		error = vie_mmio_write(vm, vcpuid, mmio, mmio_gpa, val, size);
 		rsp += size;
 	}
 	vm_copy_teardown(vm, vcpuid, copyinfo, nitems(copyinfo));
@@ -1338,8 +1718,7 @@ emulate_stack_op(void *vm, int vcpuid, uint64_t mmio_gpa, struct vie *vie,
 
 static int
 emulate_push(void *vm, int vcpuid, uint64_t mmio_gpa, struct vie *vie,
-    struct vm_guest_paging *paging, mem_region_read_t memread,
-    mem_region_write_t memwrite, void *arg)
+    struct vm_guest_paging *paging, struct vie_mmio *mmio)
 {
 	int error;
 
@@ -1352,15 +1731,13 @@ emulate_push(void *vm, int vcpuid, uint64_t mmio_gpa, struct vie *vie,
 	if ((vie->reg & 7) != 6)
 		return (EINVAL);
 
-	error = emulate_stack_op(vm, vcpuid, mmio_gpa, vie, paging, memread,
-	    memwrite, arg);
+	error = emulate_stack_op(vm, vcpuid, mmio_gpa, vie, paging, mmio);
 	return (error);
 }
 
 static int
 emulate_pop(void *vm, int vcpuid, uint64_t mmio_gpa, struct vie *vie,
-    struct vm_guest_paging *paging, mem_region_read_t memread,
-    mem_region_write_t memwrite, void *arg)
+    struct vm_guest_paging *paging, struct vie_mmio *mmio)
 {
 	int error;
 
@@ -1373,30 +1750,25 @@ emulate_pop(void *vm, int vcpuid, uint64_t mmio_gpa, struct vie *vie,
 	if ((vie->reg & 7) != 0)
 		return (EINVAL);
 
-	error = emulate_stack_op(vm, vcpuid, mmio_gpa, vie, paging, memread,
-	    memwrite, arg);
+	error = emulate_stack_op(vm, vcpuid, mmio_gpa, vie, paging, mmio);
 	return (error);
 }
 
 static int
 emulate_group1(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
-    struct vm_guest_paging *paging, mem_region_read_t memread,
-    mem_region_write_t memwrite, void *memarg)
+    struct vm_guest_paging *paging, struct vie_mmio *mmio)
 {
 	int error;
 
 	switch (vie->reg & 7) {
 	case 0x1:	/* OR */
-		error = emulate_or(vm, vcpuid, gpa, vie,
-		    memread, memwrite, memarg);
+		error = emulate_or(vm, vcpuid, gpa, vie, mmio);
 		break;
 	case 0x4:	/* AND */
-		error = emulate_and(vm, vcpuid, gpa, vie,
-		    memread, memwrite, memarg);
+		error = emulate_and(vm, vcpuid, gpa, vie, mmio);
 		break;
 	case 0x7:	/* CMP */
-		error = emulate_cmp(vm, vcpuid, gpa, vie,
-		    memread, memwrite, memarg);
+		error = emulate_cmp(vm, vcpuid, gpa, vie, mmio);
 		break;
 	default:
 		error = EINVAL;
@@ -1408,33 +1780,73 @@ emulate_group1(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 
 static int
 emulate_bittest(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
-    mem_region_read_t memread, mem_region_write_t memwrite, void *memarg)
+    struct vie_mmio *mmio)
 {
-	uint64_t val, rflags;
-	int error, bitmask, bitoff;
+	enum vie_rmw_op op;
+	uint64_t off, val, rflags;
+	int error, bitmask, bitoff, modify, size;
 
 	/*
-	 * 0F BA is a Group 8 extended opcode.
+	 * 0F BA is a Group 8 extended opcode. We emulate 'Bit Test' (BT),
+	 * 'Bit Test and Set' (BTS) and 'Bit Test and Reset' (BTR), which are
+	 * identified by a ModR/M:reg encoding of 100b, 101b and 110b.
 	 *
-	 * Currently we only emulate the 'Bit Test' instruction which is
-	 * identified by a ModR/M:reg encoding of 100b.
+	 * 0F AB and 0F B3 are BTS and BTR with the bit offset in ModR/M:reg.
+	 * A register offset may address a bit outside of the operand, but
+	 * the processor then accesses the word that holds the bit and 'gpa'
+	 * already points there.
 	 */
-	if ((vie->reg & 7) != 4)
-		return (EINVAL);
+	size = vie->opsize;
+	modify = 1;
+	switch (vie->op.op_byte) {
+	case 0xAB:
+	case 0xB3:
+		op = vie->op.op_byte == 0xAB ? VIE_RMW_BTS : VIE_RMW_BTR;
+		error = vie_read_register(vm, vcpuid, gpr_map[vie->reg], &off);
+		if (error)
+			return (error);
+		break;
+	default:
+		switch (vie->reg & 7) {
+		case 4:
+			op = VIE_RMW_BTS;
+			modify = 0;
+			break;
+		case 5:
+			op = VIE_RMW_BTS;
+			break;
+		case 6:
+			op = VIE_RMW_BTR;
+			break;
+		default:
+			return (EINVAL);
+		}
+		off = vie->immediate;
+		break;
+	}
 
 	error = vie_read_register(vm, vcpuid, VM_REG_GUEST_RFLAGS, &rflags);
 	KASSERT(error == 0, ("%s: error %d getting rflags", __func__, error));
 
-	error = memread(vm, vcpuid, gpa, &val, vie->opsize, memarg);
-	if (error)
-		return (error);
-
 	/*
 	 * Intel SDM, Vol 2, Table 3-2:
 	 * "Range of Bit Positions Specified by Bit Offset Operands"
 	 */
-	bitmask = vie->opsize * 8 - 1;
-	bitoff = vie->immediate & bitmask;
+	bitmask = size * 8 - 1;
+	bitoff = off & bitmask;
+
+	if (modify && mmio->rmw != NULL) {
+		error = vie_mmio_rmw(vm, vcpuid, mmio, gpa, op, bitoff, &val,
+		    size, vie->lock_present);
+	} else {
+		error = vie_mmio_read(vm, vcpuid, mmio, gpa, &val, size);
+		if (error == 0 && modify)
+			error = vie_mmio_write(vm, vcpuid, mmio, gpa,
+			    op == VIE_RMW_BTS ? val | (1UL << bitoff) :
+			    val & ~(1UL << bitoff), size);
+	}
+	if (error)
+		return (error);
 
 	/* Copy the bit into the Carry flag in %rflags */
 	if (val & (1UL << bitoff))
@@ -1448,10 +1860,452 @@ emulate_bittest(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 	return (0);
 }
 
+#if defined(VIE_STATS) || defined(VIE_STAGES)
+static const char *const vie_opnames[VIE_OP_TYPE_LAST] = {
+	[VIE_OP_TYPE_NONE] = "none",
+	[VIE_OP_TYPE_MOV] = "mov",
+	[VIE_OP_TYPE_MOVSX] = "movsx",
+	[VIE_OP_TYPE_MOVZX] = "movzx",
+	[VIE_OP_TYPE_AND] = "and",
+	[VIE_OP_TYPE_OR] = "or",
+	[VIE_OP_TYPE_SUB] = "sub",
+	[VIE_OP_TYPE_TWO_BYTE] = "two-byte",
+	[VIE_OP_TYPE_PUSH] = "push",
+	[VIE_OP_TYPE_CMP] = "cmp",
+	[VIE_OP_TYPE_POP] = "pop",
+	[VIE_OP_TYPE_MOVS] = "movs",
+	[VIE_OP_TYPE_GROUP1] = "group1",
+	[VIE_OP_TYPE_STOS] = "stos",
+	[VIE_OP_TYPE_BITTEST] = "bt",
+};
+#endif
+
+#ifdef VIE_STATS
+#ifdef _VERIFICATION
+#define	VIE_STATS_MAXCPU	VM_STUB_MAXCPU
+#else
+#define	VIE_STATS_MAXCPU	VM_MAXCPU
+#endif
+
+_Static_assert(VIE_OP_TYPE_LAST <= VIE_STATS_NOPS, "VIE_STATS_NOPS");
+_Static_assert(VIE_DECODE_LAST <= VIE_STATS_NDECODE, "VIE_STATS_NDECODE");
+
+/* Only the thread running a vCPU writes its statistics */
+static struct vie_stats_vcpu {
+	struct vie_stats st;
+} __aligned(CACHE_LINE_SIZE) vie_stats_vcpu[VIE_STATS_MAXCPU];
+
+static const char *const vie_stats_decode_errors[VIE_DECODE_LAST] = {
+	[VIE_DECODE_OK] = "ok",
+	[VIE_DECODE_PREFIX] = "prefix",
+	[VIE_DECODE_OPCODE] = "opcode",
+	[VIE_DECODE_MODRM] = "modrm",
+	[VIE_DECODE_SIB] = "sib",
+	[VIE_DECODE_DISPLACEMENT] = "displacement",
+	[VIE_DECODE_IMMEDIATE] = "immediate",
+	[VIE_DECODE_MOFFSET] = "moffset",
+	[VIE_DECODE_LOCK] = "lock",
+	[VIE_DECODE_GLA] = "gla",
+};
+
+static __inline struct vie_stats *
+vie_stats_get(int vcpuid)
+{
+
+	if (vcpuid < 0 || vcpuid >= VIE_STATS_MAXCPU)
+		return (NULL);
+	return (&vie_stats_vcpu[vcpuid].st);
+}
+
+static __inline int
+vie_stats_bucket(uint64_t cycles)
+{
+
+	return (MIN(flsll(cycles), VIE_STATS_NBUCKETS - 1));
+}
+
+/* The byte forms of an instruction do not change 'opsize' */
+static __inline int
+vie_stats_opsize(struct vie *vie)
+{
+
+	switch (vie->op.op_byte) {
+	case 0x80:
+	case 0x88:
+	case 0x8A:
+	case 0xA4:
+	case 0xAA:
+	case 0xC6:
+		return (1);
+	default:
+		return (vie->opsize);
+	}
+}
+
+static void
+vie_stats_emulate(int vcpuid, struct vie *vie, int error, uint64_t cycles)
+{
+	struct vie_stats *st;
+	int op, size;
+
+	if ((st = vie_stats_get(vcpuid)) == NULL)
+		return;
+	op = vie->op.op_type;
+	size = ffs(vie_stats_opsize(vie));
+	size = size != 0 ? size - 1 : 0;
+	st->emulated[op][MIN(size, VIE_STATS_NSIZES - 1)]++;
+	if (error != 0)
+		st->emulate_errors[op]++;
+	st->emulate_hist[op][vie_stats_bucket(cycles)]++;
+}
+
 int
-vmm_emulate_instruction(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
-    struct vm_guest_paging *paging, mem_region_read_t memread,
-    mem_region_write_t memwrite, void *memarg)
+vie_stats_snapshot(int vcpuid, struct vie_stats *st)
+{
+	const uint64_t *src;
+	uint64_t *dst;
+	size_t i;
+	int first, last, v;
+
+	if (vcpuid == -1) {
+		first = 0;
+		last = VIE_STATS_MAXCPU - 1;
+	} else if (vcpuid >= 0 && vcpuid < VIE_STATS_MAXCPU)
+		first = last = vcpuid;
+	else
+		return (EINVAL);
+
+	/* 'struct vie_stats' is nothing but 64-bit counters */
+	memset(st, 0, sizeof(struct vie_stats));
+	dst = (uint64_t *)st;
+	for (v = first; v <= last; v++) {
+		src = (const uint64_t *)&vie_stats_vcpu[v].st;
+		for (i = 0; i < sizeof(struct vie_stats) / sizeof(uint64_t);
+		    i++)
+			dst[i] += src[i];
+	}
+	return (0);
+}
+
+void
+vie_stats_reset(void)
+{
+
+	memset(vie_stats_vcpu, 0, sizeof(vie_stats_vcpu));
+}
+
+const char *
+vie_stats_opname(int op_type)
+{
+
+	if (op_type < 0 || op_type >= VIE_OP_TYPE_LAST)
+		return (NULL);
+	return (vie_opnames[op_type]);
+}
+
+const char *
+vie_stats_decode_error(int error)
+{
+
+	if (error < 0 || error >= VIE_DECODE_LAST)
+		return (NULL);
+	return (vie_stats_decode_errors[error]);
+}
+#endif	/* VIE_STATS */
+
+#ifdef VIE_STAGES
+#ifdef _VERIFICATION
+#define	VIE_STAGES_MAXCPU	VM_STUB_MAXCPU
+#else
+#define	VIE_STAGES_MAXCPU	VM_MAXCPU
+#endif
+#define	VIE_STAGES_NROWS	32	/* opcodes seen by one vCPU */
+#define	VIE_STAGES_DEPTH	4
+
+/*
+ * Only the thread running a vCPU writes its counters. Rows are handed out
+ * to opcodes as they are first seen; the last one is kept for
+ * VIE_STAGES_UNKNOWN, which also takes any opcode that finds them all
+ * taken.
+ */
+static struct vie_stages_vcpu {
+	uint64_t	tsc;		/* of the last stage boundary */
+	uint64_t	overhead;	/* cycles of a boundary itself */
+	int		stage;		/* being timed */
+	int		depth;
+	int		stack[VIE_STAGES_DEPTH];
+	bool		decoded;	/* and not emulated yet */
+	int		key;		/* of the decoded instruction */
+	uint64_t	cost[VIE_STAGE_LAST];	/* of the current instruction */
+	int		nrows;
+	uint8_t		row[VIE_STAGES_NKEYS];	/* row + 1, 0 if none yet */
+	uint16_t	rowkey[VIE_STAGES_NROWS];
+	uint64_t	count[VIE_STAGES_NROWS];
+	uint64_t	cycles[VIE_STAGES_NROWS][VIE_STAGE_LAST];
+} __aligned(CACHE_LINE_SIZE) vie_stages_vcpu[VIE_STAGES_MAXCPU];
+
+static const char *const vie_stage_names[VIE_STAGE_LAST] = {
+	[VIE_STAGE_FETCH] = "fetch",
+	[VIE_STAGE_PREFIXES] = "decode;prefixes",
+	[VIE_STAGE_OPCODE] = "decode;opcode",
+	[VIE_STAGE_MODRM] = "decode;modrm",
+	[VIE_STAGE_SIB] = "decode;sib",
+	[VIE_STAGE_DISPLACEMENT] = "decode;displacement",
+	[VIE_STAGE_IMMEDIATE] = "decode;immediate",
+	[VIE_STAGE_MOFFSET] = "decode;moffset",
+	[VIE_STAGE_LOCK] = "decode;lock",
+	[VIE_STAGE_VERIFY_GLA] = "decode;verify_gla",
+	[VIE_STAGE_EMULATE] = "emulate",
+	[VIE_STAGE_GLA] = "emulate;gla",
+	[VIE_STAGE_GLA2GPA] = "emulate;gla2gpa",
+	[VIE_STAGE_MMIO_READ] = "emulate;mmio_read",
+	[VIE_STAGE_MMIO_WRITE] = "emulate;mmio_write",
+	[VIE_STAGE_MMIO_RMW] = "emulate;mmio_rmw",
+};
+
+static __inline struct vie_stages_vcpu *
+vie_stages_get(int vcpuid)
+{
+
+	if (vcpuid < 0 || vcpuid >= VIE_STAGES_MAXCPU)
+		return (NULL);
+	return (&vie_stages_vcpu[vcpuid]);
+}
+
+/* Keep the TSC read from moving across the code it is timing */
+static __inline uint64_t
+vie_stage_tsc(void)
+{
+	uint64_t tsc;
+
+	lfence();
+	tsc = rdtsc();
+	lfence();
+	return (tsc);
+}
+
+/*
+ * The opcode of 'vie'. A decoded two-byte opcode is the only one whose
+ * op_type differs from that of its last byte in 'one_byte_opcodes'.
+ */
+static int
+vie_stages_key(struct vie *vie)
+{
+	int op;
+
+	if (vie == NULL || vie->op.op_type == VIE_OP_TYPE_NONE ||
+	    vie->op.op_type == VIE_OP_TYPE_TWO_BYTE)
+		return (VIE_STAGES_UNKNOWN);
+	op = vie->op.op_byte;
+	if (one_byte_opcodes[op].op_type != vie->op.op_type)
+		op += 256;
+	return (op);
+}
+
+/* Least cycles between two back-to-back boundaries */
+static uint64_t
+vie_stage_calibrate(void)
+{
+	uint64_t best, t0, t1;
+	int i;
+
+	best = UINT64_MAX;
+	for (i = 0; i < 64; i++) {
+		t0 = vie_stage_tsc();
+		t1 = vie_stage_tsc();
+		best = MIN(best, t1 - t0);
+	}
+	return (best);
+}
+
+static __inline void
+vie_stage_charge(struct vie_stages_vcpu *vs, int stage)
+{
+	uint64_t delta, now;
+
+	now = vie_stage_tsc();
+	delta = now - vs->tsc;
+	vs->cost[vs->stage] += delta > vs->overhead ? delta - vs->overhead : 0;
+	vs->stage = stage;
+	vs->tsc = now;
+}
+
+/* Add the instruction in flight to the row of 'key' */
+static void
+vie_stage_flush(struct vie_stages_vcpu *vs, int key)
+{
+	int i, r;
+
+	if ((r = vs->row[key]) == 0) {
+		if (key != VIE_STAGES_UNKNOWN &&
+		    vs->nrows == VIE_STAGES_NROWS - 1)
+			key = VIE_STAGES_UNKNOWN;
+		if ((r = vs->row[key]) == 0) {
+			r = ++vs->nrows;
+			vs->row[key] = r;
+			vs->rowkey[r - 1] = key;
+		}
+	}
+	r--;
+	vs->count[r]++;
+	for (i = VIE_STAGE_NONE + 1; i < VIE_STAGE_LAST; i++)
+		vs->cycles[r][i] += vs->cost[i];
+	memset(vs->cost, 0, sizeof(vs->cost));
+	vs->depth = 0;
+	vs->decoded = false;
+}
+
+static void
+vie_stage_switch(int vcpuid, int stage)
+{
+	struct vie_stages_vcpu *vs;
+
+	if ((vs = vie_stages_get(vcpuid)) != NULL)
+		vie_stage_charge(vs, stage);
+}
+
+/* Start fetching or decoding an instruction */
+static void
+vie_stage_begin(int vcpuid, int stage)
+{
+	struct vie_stages_vcpu *vs;
+
+	if ((vs = vie_stages_get(vcpuid)) == NULL)
+		return;
+	if (vs->overhead == 0)
+		vs->overhead = vie_stage_calibrate();
+	if (vs->decoded)
+		vie_stage_flush(vs, vs->key);
+	vie_stage_charge(vs, stage);
+}
+
+static void
+vie_stage_push(int vcpuid, int stage)
+{
+	struct vie_stages_vcpu *vs;
+
+	if ((vs = vie_stages_get(vcpuid)) == NULL)
+		return;
+	if (vs->depth < VIE_STAGES_DEPTH)
+		vs->stack[vs->depth++] = vs->stage;
+	vie_stage_charge(vs, stage);
+}
+
+static void
+vie_stage_pop(int vcpuid)
+{
+	struct vie_stages_vcpu *vs;
+
+	if ((vs = vie_stages_get(vcpuid)) == NULL)
+		return;
+	vie_stage_charge(vs, vs->depth > 0 ? vs->stack[--vs->depth] :
+	    VIE_STAGE_NONE);
+}
+
+/*
+ * An instruction that failed to decode is done. One that did not is
+ * charged once emulated, or when the next one is fetched or decoded.
+ */
+static void
+vie_stage_decoded(int vcpuid, struct vie *vie, int error)
+{
+	struct vie_stages_vcpu *vs;
+
+	if ((vs = vie_stages_get(vcpuid)) == NULL)
+		return;
+	vie_stage_charge(vs, VIE_STAGE_NONE);
+	if (error != VIE_DECODE_OK) {
+		vie_stage_flush(vs, vie_stages_key(vie));
+		return;
+	}
+	vs->decoded = true;
+	vs->key = vie_stages_key(vie);
+}
+
+/* Stages left early, e.g. by a fault, end here as well */
+static void
+vie_stage_done(int vcpuid, struct vie *vie)
+{
+	struct vie_stages_vcpu *vs;
+
+	if ((vs = vie_stages_get(vcpuid)) == NULL)
+		return;
+	vie_stage_charge(vs, VIE_STAGE_NONE);
+	vie_stage_flush(vs, vie_stages_key(vie));
+}
+
+int
+vie_stages_snapshot(int vcpuid, struct vie_stages *st)
+{
+	struct vie_stages_vcpu *vs;
+	int first, i, key, last, r, v;
+
+	if (vcpuid == -1) {
+		first = 0;
+		last = VIE_STAGES_MAXCPU - 1;
+	} else if (vcpuid >= 0 && vcpuid < VIE_STAGES_MAXCPU)
+		first = last = vcpuid;
+	else
+		return (EINVAL);
+
+	memset(st, 0, sizeof(struct vie_stages));
+	for (v = first; v <= last; v++) {
+		vs = &vie_stages_vcpu[v];
+		for (r = 0; r < vs->nrows; r++) {
+			key = vs->rowkey[r];
+			st->count[key] += vs->count[r];
+			for (i = 0; i < VIE_STAGE_LAST; i++)
+				st->cycles[key][i] += vs->cycles[r][i];
+		}
+	}
+	return (0);
+}
+
+void
+vie_stages_reset(void)
+{
+	uint64_t overhead;
+	int v;
+
+	for (v = 0; v < VIE_STAGES_MAXCPU; v++) {
+		overhead = vie_stages_vcpu[v].overhead;
+		memset(&vie_stages_vcpu[v], 0, sizeof(vie_stages_vcpu[v]));
+		vie_stages_vcpu[v].overhead = overhead;
+	}
+}
+
+const char *
+vie_stages_name(int stage)
+{
+
+	if (stage <= VIE_STAGE_NONE || stage >= VIE_STAGE_LAST)
+		return (NULL);
+	return (vie_stage_names[stage]);
+}
+
+int
+vie_stages_opname(int key, char *buf, size_t len)
+{
+	const struct vie_op *op;
+
+	if (key == VIE_STAGES_UNKNOWN) {
+		snprintf(buf, len, "unknown");
+		return (0);
+	}
+	if (key < 0 || key >= VIE_STAGES_UNKNOWN)
+		return (EINVAL);
+
+	op = key < 256 ? &one_byte_opcodes[key] : &two_byte_opcodes[key - 256];
+	snprintf(buf, len, key < 256 ? "%s_%02x" : "%s_0f%02x",
+	    op->op_type < VIE_OP_TYPE_LAST ? vie_opnames[op->op_type] : "op",
+	    key & 0xff);
+	return (0);
+}
+#endif	/* VIE_STAGES */
+
+static int
+vie_emulate_op(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
+    struct vm_guest_paging *paging, struct vie_mmio *mmio)
 {
 	int error;
 
@@ -1460,53 +2314,41 @@ vmm_emulate_instruction(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 
 	switch (vie->op.op_type) {
 	case VIE_OP_TYPE_GROUP1:
-		error = emulate_group1(vm, vcpuid, gpa, vie, paging, memread,
-		    memwrite, memarg);
+		error = emulate_group1(vm, vcpuid, gpa, vie, paging, mmio);
 		break;
 	case VIE_OP_TYPE_POP:
-		error = emulate_pop(vm, vcpuid, gpa, vie, paging, memread,
-		    memwrite, memarg);
+		error = emulate_pop(vm, vcpuid, gpa, vie, paging, mmio);
 		break;
 	case VIE_OP_TYPE_PUSH:
-		error = emulate_push(vm, vcpuid, gpa, vie, paging, memread,
-		    memwrite, memarg);
+		error = emulate_push(vm, vcpuid, gpa, vie, paging, mmio);
 		break;
 	case VIE_OP_TYPE_CMP:
-		error = emulate_cmp(vm, vcpuid, gpa, vie,
-				    memread, memwrite, memarg);
+		error = emulate_cmp(vm, vcpuid, gpa, vie, mmio);
 		break;
 	case VIE_OP_TYPE_MOV:
-		error = emulate_mov(vm, vcpuid, gpa, vie,
-				    memread, memwrite, memarg);
+		error = emulate_mov(vm, vcpuid, gpa, vie, mmio);
 		break;
 	case VIE_OP_TYPE_MOVSX:
 	case VIE_OP_TYPE_MOVZX:
-		error = emulate_movx(vm, vcpuid, gpa, vie,
-				     memread, memwrite, memarg);
+		error = emulate_movx(vm, vcpuid, gpa, vie, mmio);
 		break;
 	case VIE_OP_TYPE_MOVS:
-		error = emulate_movs(vm, vcpuid, gpa, vie, paging, memread,
-		    memwrite, memarg);
+		error = emulate_movs(vm, vcpuid, gpa, vie, paging, mmio);
 		break;
 	case VIE_OP_TYPE_STOS:
-		error = emulate_stos(vm, vcpuid, gpa, vie, paging, memread,
-		    memwrite, memarg);
+		error = emulate_stos(vm, vcpuid, gpa, vie, paging, mmio);
 		break;
 	case VIE_OP_TYPE_AND:
-		error = emulate_and(vm, vcpuid, gpa, vie,
-				    memread, memwrite, memarg);
+		error = emulate_and(vm, vcpuid, gpa, vie, mmio);
 		break;
 	case VIE_OP_TYPE_OR:
-		error = emulate_or(vm, vcpuid, gpa, vie,
-				    memread, memwrite, memarg);
+		error = emulate_or(vm, vcpuid, gpa, vie, mmio);
 		break;
 	case VIE_OP_TYPE_SUB:
-		error = emulate_sub(vm, vcpuid, gpa, vie,
-				    memread, memwrite, memarg);
+		error = emulate_sub(vm, vcpuid, gpa, vie, mmio);
 		break;
 	case VIE_OP_TYPE_BITTEST:
-		error = emulate_bittest(vm, vcpuid, gpa, vie,
-		    memread, memwrite, memarg);
+		error = emulate_bittest(vm, vcpuid, gpa, vie, mmio);
 		break;
 	default:
 		error = EINVAL;
@@ -1516,6 +2358,121 @@ vmm_emulate_instruction(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
 	return (error);
 }
 
+static int
+vie_emulate(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
+    struct vm_guest_paging *paging, struct vie_mmio *mmio)
+{
+	int error;
+#ifdef VIE_STATS
+	uint64_t tsc;
+
+	tsc = rdtsc();
+#endif
+	VIE_TP(vcpuid, VIE_TRACE_EMULATE, vie->op.op_type |
+	    vie->op.op_byte << 8 | vie->opsize << 16 | vie->addrsize << 24, gpa,
+	    vie->num_valid);
+	VIE_STAGE(vcpuid, VIE_STAGE_EMULATE);
+	error = vie_emulate_op(vm, vcpuid, gpa, vie, paging, mmio);
+	VIE_STAGE_DONE(vcpuid, vie);
+	VIE_TP(vcpuid, VIE_TRACE_EMULATE_DONE, error, gpa, 0);
+#ifdef VIE_STATS
+	vie_stats_emulate(vcpuid, vie, error, rdtsc() - tsc);
+#endif
+	return (error);
+}
+
+int
+vmm_emulate_instruction(void *vm, int vcpuid, uint64_t gpa, struct vie *vie,
+    struct vm_guest_paging *paging, mem_region_read_t memread,
+    mem_region_write_t memwrite, void *memarg)
+{
+	struct vie_mmio mmio;
+
+	mmio.ops = NULL;
+	mmio.read = memread;
+	mmio.write = memwrite;
+	mmio.rmw = NULL;
+	mmio.arg = memarg;
+	return (vie_emulate(vm, vcpuid, gpa, vie, paging, &mmio));
+}
+
+int
+vmm_emulate_instruction_rmw(void *vm, int vcpuid, uint64_t gpa,
+    struct vie *vie, struct vm_guest_paging *paging, mem_region_read_t memread,
+    mem_region_write_t memwrite, mem_region_rmw_t memrmw, void *memarg)
+{
+	struct vie_mmio mmio;
+
+	mmio.ops = NULL;
+	mmio.read = memread;
+	mmio.write = memwrite;
+	mmio.rmw = memrmw;
+	mmio.arg = memarg;
+	return (vie_emulate(vm, vcpuid, gpa, vie, paging, &mmio));
+}
+
+int
+vmm_emulate_instruction_ops(void *vm, int vcpuid, uint64_t gpa,
+    struct vie *vie, struct vm_guest_paging *paging,
+    const struct vie_mmio_ops *ops, void *arg)
+{
+	struct vie_mmio mmio;
+
+	mmio.ops = ops;
+	mmio.read = NULL;
+	mmio.write = NULL;
+	mmio.rmw = ops->rmw;
+	mmio.arg = arg;
+	return (vie_emulate(vm, vcpuid, gpa, vie, paging, &mmio));
+}
+
+/*
+ * Typed handlers that forward each access to the generic callbacks in a
+ * 'struct vie_mmio_legacy'.
+ */
+#define	VIE_MMIO_LEGACY(sz)						\
+static int								\
+vie_mmio_legacy_read##sz(void *vm, int vcpuid, uint64_t gpa,		\
+    uint##sz##_t *rval, void *arg)					\
+{									\
+	struct vie_mmio_legacy *legacy;					\
+	uint64_t val;							\
+	int error;							\
+									\
+	legacy = arg;							\
+	error = (*legacy->read)(vm, vcpuid, gpa, &val, sz / 8,		\
+	    legacy->arg);						\
+	*rval = val;							\
+	return (error);							\
+}									\
+									\
+static int								\
+vie_mmio_legacy_write##sz(void *vm, int vcpuid, uint64_t gpa,		\
+    uint##sz##_t wval, void *arg)					\
+{									\
+	struct vie_mmio_legacy *legacy;					\
+									\
+	legacy = arg;							\
+	return ((*legacy->write)(vm, vcpuid, gpa, wval, sz / 8,		\
+	    legacy->arg));						\
+} struct __hack
+
+VIE_MMIO_LEGACY(8);
+VIE_MMIO_LEGACY(16);
+VIE_MMIO_LEGACY(32);
+VIE_MMIO_LEGACY(64);
+
+const struct vie_mmio_ops vie_mmio_legacy_ops = {
+	.read8 = vie_mmio_legacy_read8,
+	.read16 = vie_mmio_legacy_read16,
+	.read32 = vie_mmio_legacy_read32,
+	.read64 = vie_mmio_legacy_read64,
+	.write8 = vie_mmio_legacy_write8,
+	.write16 = vie_mmio_legacy_write16,
+	.write32 = vie_mmio_legacy_write32,
+	.write64 = vie_mmio_legacy_write64,
+};
+
 int
 vie_alignment_check(int cpl, int size, uint64_t cr0, uint64_t rf, uint64_t gla)
 {
@@ -1948,15 +2905,22 @@ vmm_fetch_instruction(struct vm *vm, int vcpuid, struct vm_guest_paging *paging,
 	if (inst_length > VIE_INST_SIZE)
 		panic("vmm_fetch_instruction: invalid length %d", inst_length);
 
+	VIE_TP(vcpuid, VIE_TRACE_FETCH, inst_length, rip, paging->cr3);
+	VIE_STAGE_BEGIN(vcpuid, VIE_STAGE_FETCH);
 	prot = PROT_READ | PROT_EXEC;
 	error = vm_copy_setup(vm, vcpuid, paging, rip, inst_length, prot,
 	    copyinfo, nitems(copyinfo), faultptr);
-	if (error || *faultptr)
+	if (error || *faultptr) {
+		VIE_STAGE_DONE(vcpuid, NULL);
+		VIE_TP(vcpuid, VIE_TRACE_FETCH_DONE, error, rip, *faultptr);
 		return (error);
+	}
 
 	vm_copyin(vm, vcpuid, copyinfo, vie->inst, inst_length);
 	vm_copy_teardown(vm, vcpuid, copyinfo, nitems(copyinfo));
 	vie->num_valid = inst_length;
+	VIE_STAGE(vcpuid, VIE_STAGE_NONE);
+	VIE_TP(vcpuid, VIE_TRACE_FETCH_DONE, 0, rip, 0);
 	return (0);
 }
 #endif /* _KERNEL */
@@ -2027,6 +2991,8 @@ decode_prefixes(struct vie *vie, enum vm_cpu_mode cpu_mode, int cs_d)
 			vie->repz_present = 1;
 		else if (x == 0xF2)
 			vie->repnz_present = 1;
+		else if (x == 0xF0)
+			vie->lock_present = 1;
 		else if (segment_override(x, &vie->segment_register))
 			vie->segment_override = 1;
 		else
@@ -2384,6 +3350,64 @@ decode_moffset(struct vie *vie)
 	return (0);
 }
 
+/*
+ * From the description of the LOCK prefix in Intel SDM, Vol 2:
+ * the prefix can only be used with the read-modify-write forms of a handful
+ * of instructions whose destination is a memory operand, otherwise #UD is
+ * raised. Of the instructions we emulate that is OR and AND with an
+ * immediate (81/83 /1 and /4), BTS and BTR.
+ */
+static int
+decode_lock(struct vie *vie)
+{
+
+	if (!vie->lock_present)
+		return (0);
+
+	if (vie->mod == VIE_MOD_DIRECT)
+		return (-1);
+
+	switch (vie->op.op_type) {
+	case VIE_OP_TYPE_GROUP1:
+		if ((vie->op.op_byte == 0x81 || vie->op.op_byte == 0x83) &&
+		    ((vie->reg & 7) == 1 || (vie->reg & 7) == 4))
+			return (0);
+		break;
+	case VIE_OP_TYPE_BITTEST:
+		if (vie->op.op_byte != 0xBA || (vie->reg & 7) == 5 ||
+		    (vie->reg & 7) == 6)
+			return (0);
+		break;
+	default:
+		break;
+	}
+
+	return (-1);
+}
+
+/*
+ * A guest can make every exit fail the 'gla' verification, so the mismatch
+ * is reported at most once a second.
+ */
+static bool
+verify_gla_ratecheck(void)
+{
+#ifdef _KERNEL
+	static struct timeval lasterr;
+	static int curpps;
+
+	return (ppsratecheck(&lasterr, &curpps, 1));
+#else
+	/* Every vCPU thread may get here at once; one of them reports */
+	static volatile uint64_t lasterr;
+	uint64_t last, now;
+
+	now = time(NULL);
+	last = atomic_load_acq_64(&lasterr);
+	return (now != last && atomic_cmpset_64(&lasterr, last, now));
+#endif
+}
+
 /*
  * Verify that the 'guest linear address' provided as collateral of the nested
  * page table fault matches with our instruction decoding.
@@ -2465,50 +3489,140 @@ verify_gla(struct vm *vm, int cpuid, uint64_t gla, struct vie *vie,
 	gla2 = segbase + base + vie->scale * idx + vie->displacement;
 	gla2 &= size2mask[vie->addrsize];
 	if (gla != gla2) {
-		printf("verify_gla mismatch: segbase(0x%0lx)"
-		       "base(0x%0lx), scale(%d), index(0x%0lx), "
-		       "disp(0x%0lx), gla(0x%0lx), gla2(0x%0lx)\n",
-		       segbase, base, vie->scale, idx, vie->displacement,
-		       gla, gla2);
+		if (verify_gla_ratecheck())
+			printf("verify_gla mismatch: segbase(0x%0lx)"
+			    "base(0x%0lx), scale(%d), index(0x%0lx), "
+			    "disp(0x%0lx), gla(0x%0lx), gla2(0x%0lx)\n",
+			    segbase, base, vie->scale, idx, vie->displacement,
+			    gla, gla2);
 		return (-1);
 	}
 
 	return (0);
 }
 
-int
-vmm_decode_instruction(struct vm *vm, int cpuid, uint64_t gla,
-		       enum vm_cpu_mode cpu_mode, int cs_d, struct vie *vie)
+/*
+ * The tracepoint after each stage records the number of bytes consumed so
+ * far and what the stage decoded.
+ */
+static int
+vie_decode(struct vm *vm, int cpuid, uint64_t gla, enum vm_cpu_mode cpu_mode,
+    int cs_d, struct vie *vie)
 {
 
+	VIE_STAGE_BEGIN(cpuid, VIE_STAGE_PREFIXES);
 	if (decode_prefixes(vie, cpu_mode, cs_d))
-		return (-1);
-
+		return (VIE_DECODE_PREFIX);
+	VIE_TP(cpuid, VIE_TRACE_PREFIXES, vie->num_processed,
+	    vie->opsize | vie->addrsize << 4 | vie->rex_present << 8 |
+	    vie->rex_w << 9 | vie->repz_present << 10 |
+	    vie->repnz_present << 11 | vie->lock_present << 12,
+	    vie->segment_override ? vie->segment_register : VM_REG_LAST);
+
+	VIE_STAGE(cpuid, VIE_STAGE_OPCODE);
 	if (decode_opcode(vie))
-		return (-1);
+		return (VIE_DECODE_OPCODE);
+	VIE_TP(cpuid, VIE_TRACE_OPCODE, vie->num_processed, vie->op.op_byte,
+	    vie->op.op_type);
 
+	VIE_STAGE(cpuid, VIE_STAGE_MODRM);
 	if (decode_modrm(vie, cpu_mode))
-		return (-1);
+		return (VIE_DECODE_MODRM);
+	VIE_TP(cpuid, VIE_TRACE_MODRM, vie->num_processed,
+	    vie->mod << 8 | vie->reg << 4 | vie->rm, vie->base_register);
 
+	VIE_STAGE(cpuid, VIE_STAGE_SIB);
 	if (decode_sib(vie))
-		return (-1);
+		return (VIE_DECODE_SIB);
+	VIE_TP(cpuid, VIE_TRACE_SIB, vie->num_processed,
+	    vie->ss << 8 | vie->index << 4 | vie->base, vie->index_register);
 
+	VIE_STAGE(cpuid, VIE_STAGE_DISPLACEMENT);
 	if (decode_displacement(vie))
-		return (-1);
+		return (VIE_DECODE_DISPLACEMENT);
+	VIE_TP(cpuid, VIE_TRACE_DISPLACEMENT, vie->num_processed,
+	    vie->disp_bytes, vie->displacement);
 
+	VIE_STAGE(cpuid, VIE_STAGE_IMMEDIATE);
 	if (decode_immediate(vie))
-		return (-1);
+		return (VIE_DECODE_IMMEDIATE);
+	VIE_TP(cpuid, VIE_TRACE_IMMEDIATE, vie->num_processed,
+	    vie->imm_bytes, vie->immediate);
 
+	VIE_STAGE(cpuid, VIE_STAGE_MOFFSET);
 	if (decode_moffset(vie))
-		return (-1);
+		return (VIE_DECODE_MOFFSET);
+	VIE_TP(cpuid, VIE_TRACE_MOFFSET, vie->num_processed,
+	    vie->disp_bytes, vie->displacement);
+
+	VIE_STAGE(cpuid, VIE_STAGE_LOCK);
+	if (decode_lock(vie))
+		return (VIE_DECODE_LOCK);
 
 	if ((vie->op.op_flags & VIE_OP_F_NO_GLA_VERIFICATION) == 0) {
+		VIE_STAGE(cpuid, VIE_STAGE_VERIFY_GLA);
 		if (verify_gla(vm, cpuid, gla, vie, cpu_mode))
-			return (-1);
+			return (VIE_DECODE_GLA);
+		VIE_TP(cpuid, VIE_TRACE_VERIFY_GLA, vie->num_processed, gla,
+		    0);
 	}
 
 	vie->decoded = 1;	/* success */
 
-	return (0);
+	return (VIE_DECODE_OK);
+}
+
+#ifdef VIE_STATS
+static void
+vie_stats_decode(int vcpuid, int error, uint64_t cycles)
+{
+	struct vie_stats *st;
+
+	if ((st = vie_stats_get(vcpuid)) == NULL)
+		return;
+	if (error == VIE_DECODE_OK)
+		st->decoded++;
+	else
+		st->decode_errors[error]++;
+	st->decode_hist[vie_stats_bucket(cycles)]++;
+}
+#endif
+
+#ifdef VIE_TRACE
+/* Record the first 16 instruction bytes as the decode starts */
+static void
+vie_trace_decode(int cpuid, enum vm_cpu_mode cpu_mode, int cs_d,
+    struct vie *vie)
+{
+	uint64_t inst[2];
+
+	memset(inst, 0, sizeof(inst));
+	memcpy(inst, vie->inst, MIN(vie->num_valid, sizeof(inst)));
+	vie_trace_record(cpuid, VIE_TRACE_DECODE,
+	    vie->num_valid | cpu_mode << 8 | cs_d << 16, inst[0], inst[1]);
+}
+#endif
+
+int
+vmm_decode_instruction(struct vm *vm, int cpuid, uint64_t gla,
+		       enum vm_cpu_mode cpu_mode, int cs_d, struct vie *vie)
+{
+	int error;
+#ifdef VIE_STATS
+	uint64_t tsc;
+
+	tsc = rdtsc();
+#endif
+#ifdef VIE_TRACE
+	if (__predict_false(vie_trace_enabled))
+		vie_trace_decode(cpuid, cpu_mode, cs_d, vie);
+#endif
+	error = vie_decode(vm, cpuid, gla, cpu_mode, cs_d, vie);
+	VIE_STAGE_DECODED(cpuid, vie, error);
+	VIE_TP(cpuid, VIE_TRACE_DECODE_DONE, error, vie->num_processed, gla);
+#ifdef VIE_STATS
+	vie_stats_decode(cpuid, error, rdtsc() - tsc);
+#endif
+	return (error == VIE_DECODE_OK ? 0 : -1);
 }
 #endif	/* _KERNEL || _VERIFICATION */
\ No newline at end of file
@@ -46,11 +46,18 @@ struct vie {
 	uint8_t		num_valid;		/* size of the instruction */
 	uint8_t		num_processed;
 
+	uint8_t		addrsize:4, opsize:4;	/* address and operand sizes */
 	uint8_t		rex_w:1,		/* REX prefix */
 			rex_r:1,
 			rex_x:1,
 			rex_b:1,
-			rex_present:1;
+			rex_present:1,
+			repz_present:1,		/* REP/REPE/REPZ prefix */
+			repnz_present:1,	/* REPNE/REPNZ prefix */
+			opsize_override:1,	/* Operand size override */
+			addrsize_override:1,	/* Address size override */
+			segment_override:1,	/* Segment override */
+			lock_present:1;		/* LOCK prefix */
 
 	uint8_t		mod:2,			/* ModRM byte */
 			reg:4,
@@ -66,6 +73,7 @@ struct vie {
 	uint8_t		scale;
 	int		base_register;		/* VM_REG_GUEST_xyz */
 	int		index_register;		/* VM_REG_GUEST_xyz */
+	int		segment_register;	/* VM_REG_GUEST_xyz */
 
 	int64_t		displacement;		/* optional addr displacement */
 	int64_t		immediate;		/* optional immediate operand */
@@ -84,6 +92,70 @@ typedef int (*mem_region_read_t)(void *vm, int cpuid, uint64_t gpa,
 typedef int (*mem_region_write_t)(void *vm, int cpuid, uint64_t gpa,
 				  uint64_t wval, int wsize, void *arg);
 
+/*
+ * Optional callback to atomically read-modify-write a memory region.
+ *
+ * The callback applies 'op' with 'operand' to the 'size' byte location at
+ * 'gpa' and returns the original contents in 'oldval'. For VIE_RMW_BTS and
+ * VIE_RMW_BTR 'operand' is the bit offset. 'locked' is set when the guest
+ * used the LOCK prefix, i.e. the update must be atomic with respect to
+ * other vCPUs and device threads. It is called for AND and OR with an
+ * immediate (81/83 /4 and /1) and for BTS and BTR.
+ */
+enum vie_rmw_op {
+	VIE_RMW_AND,
+	VIE_RMW_OR,
+	VIE_RMW_BTS,
+	VIE_RMW_BTR,
+};
+
+typedef int (*mem_region_rmw_t)(void *vm, int cpuid, uint64_t gpa,
+				enum vie_rmw_op op, uint64_t operand,
+				uint64_t *oldval, int size, int locked,
+				void *arg);
+
+/*
+ * Typed memory region handlers.
+ *
+ * Instead of a pair of generic callbacks a device may supply a handler per
+ * access width, so the device does not have to dispatch on the size or mask
+ * the value. The emulator still switches on the access size to pick the
+ * handler; the saving is the device's own switch, a few percent of an
+ * emulated access. A NULL handler fails accesses of that width with EINVAL.
+ * 'rmw' is optional, see mem_region_rmw_t.
+ */
+struct vie_mmio_ops {
+	int	(*read8)(void *vm, int cpuid, uint64_t gpa, uint8_t *rval,
+		    void *arg);
+	int	(*read16)(void *vm, int cpuid, uint64_t gpa, uint16_t *rval,
+		    void *arg);
+	int	(*read32)(void *vm, int cpuid, uint64_t gpa, uint32_t *rval,
+		    void *arg);
+	int	(*read64)(void *vm, int cpuid, uint64_t gpa, uint64_t *rval,
+		    void *arg);
+	int	(*write8)(void *vm, int cpuid, uint64_t gpa, uint8_t wval,
+		    void *arg);
+	int	(*write16)(void *vm, int cpuid, uint64_t gpa, uint16_t wval,
+		    void *arg);
+	int	(*write32)(void *vm, int cpuid, uint64_t gpa, uint32_t wval,
+		    void *arg);
+	int	(*write64)(void *vm, int cpuid, uint64_t gpa, uint64_t wval,
+		    void *arg);
+	mem_region_rmw_t rmw;
+};
+
+/*
+ * Adapter for devices that only provide generic callbacks: pass
+ * 'vie_mmio_legacy_ops' with a 'struct vie_mmio_legacy' as the argument.
+ */
+struct vie_mmio_legacy {
+	mem_region_read_t	read;
+	mem_region_write_t	write;
+	void			*arg;
+};
+
+extern const struct vie_mmio_ops vie_mmio_legacy_ops;
+
 /*
  * Emulate the decoded 'vie' instruction.
  *
@@ -93,25 +165,263 @@ typedef int (*mem_region_write_t)(void *vm, int cpuid, uint64_t gpa,
  *
  * 'void *vm' should be 'struct vm *' when called from kernel context and
  * 'struct vmctx *' when called from user context.
- * s
  */
 int vmm_emulate_instruction(void *vm, int cpuid, uint64_t gpa, struct vie *vie,
-			    mem_region_read_t mrr, mem_region_write_t mrw,
-			    void *mrarg);
+    struct vm_guest_paging *paging, mem_region_read_t mrr,
+    mem_region_write_t mrw, void *mrarg);
+
+/*
+ * Same as vmm_emulate_instruction() but read-modify-write instructions are
+ * emulated with a single call to 'mrmw' instead of a read followed by a
+ * write, when 'mrmw' is not NULL.
+ */
+int vmm_emulate_instruction_rmw(void *vm, int cpuid, uint64_t gpa,
+    struct vie *vie, struct vm_guest_paging *paging, mem_region_read_t mrr,
+    mem_region_write_t mrw, mem_region_rmw_t mrmw, void *mrarg);
+
+/*
+ * Same as vmm_emulate_instruction() but memory accesses are dispatched to
+ * the typed handlers in 'ops'; 'arg' is passed to each handler.
+ */
+int vmm_emulate_instruction_ops(void *vm, int cpuid, uint64_t gpa,
+    struct vie *vie, struct vm_guest_paging *paging,
+    const struct vie_mmio_ops *ops, void *arg);
+
+int vie_update_register(void *vm, int vcpuid, enum vm_reg_name reg,
+    uint64_t val, int size);
+
+/*
+ * Returns 0 and the value and size of the store if the decoded 'vie' is a
+ * MOV of a register or immediate to memory, and EINVAL otherwise.
+ */
+int vie_mov_store(void *vm, int vcpuid, struct vie *vie, uint64_t *val,
+    int *size);
+
+/*
+ * Returns the registers that emulating the decoded 'vie' may read or write,
+ * as (1UL << enum vm_reg_name), segment registers included.
+ */
+uint64_t vie_regs_used(struct vie *vie);
+
+/*
+ * Returns 1 if an alignment check exception should be injected and 0 otherwise.
+ */
+int vie_alignment_check(int cpl, int operand_size, uint64_t cr0,
+    uint64_t rflags, uint64_t gla);
+
+/* Returns 1 if the 'gla' is not canonical and 0 otherwise. */
+int vie_canonical_check(enum vm_cpu_mode cpu_mode, uint64_t gla);
+
+uint64_t vie_size2mask(int size);
+
+int vie_calculate_gla(enum vm_cpu_mode cpu_mode, enum vm_reg_name seg,
+    struct seg_desc *desc, uint64_t off, int length, int addrsize, int prot,
+    uint64_t *gla);
+
+#ifdef VIE_STATS
+/*
+ * Decode and emulation statistics, compiled in with 'options VIE_STATS'.
+ *
+ * Each vCPU counts into its own cache line aligned 'struct vie_stats'
+ * without locks or atomics, and the counters of all vCPUs are summed when
+ * read. 'emulated' is indexed by op_type and log2 of the operand size and
+ * counts failed emulations too. Latencies are in TSC cycles: histogram
+ * bucket 'i' counts those in [2^(i-1), 2^i), the last one all longer ones.
+ */
+#define	VIE_STATS_NOPS		16	/* op_type, see vie_stats_opname() */
+#define	VIE_STATS_NDECODE	16	/* see vie_stats_decode_error() */
+#define	VIE_STATS_NSIZES	4	/* 1, 2, 4 and 8 byte operands */
+#define	VIE_STATS_NBUCKETS	24
+
+struct vie_stats {
+	uint64_t	decoded;
+	uint64_t	decode_errors[VIE_STATS_NDECODE];
+	uint64_t	decode_hist[VIE_STATS_NBUCKETS];
+	uint64_t	emulated[VIE_STATS_NOPS][VIE_STATS_NSIZES];
+	uint64_t	emulate_errors[VIE_STATS_NOPS];
+	uint64_t	emulate_hist[VIE_STATS_NOPS][VIE_STATS_NBUCKETS];
+};
+
+/*
+ * Copy the statistics of 'vcpuid', or the sum over all vCPUs if it is -1,
+ * into 'st'. Returns EINVAL if 'vcpuid' is out of range.
+ */
+int vie_stats_snapshot(int vcpuid, struct vie_stats *st);
+void vie_stats_reset(void);
+
+/* Names of the indices of 'emulated' and 'decode_errors', NULL if unused */
+const char *vie_stats_opname(int op_type);
+const char *vie_stats_decode_error(int error);
+#endif	/* VIE_STATS */
+
+#ifdef VIE_TRACE
+/*
+ * Static tracepoints, compiled in with 'options VIE_TRACE' and recorded
+ * into the rings of vmm_trace.h while 'vie_trace_enabled' is set. Each
+ * event carries a 32-bit 'arg' and two 64-bit payloads:
+ *
+ *	FETCH		length, rip, cr3
+ *	FETCH_DONE	error, rip, fault
+ *	DECODE		num_valid | cpu_mode << 8 | cs_d << 16,
+ *			first 16 instruction bytes
+ *	PREFIXES	bytes consumed, opsize | addrsize << 4 | rex and rep
+ *			flags from bit 8, segment override or VM_REG_LAST
+ *	OPCODE		bytes consumed, op_byte, op_type
+ *	MODRM		bytes consumed, mod << 8 | reg << 4 | rm, base register
+ *	SIB		bytes consumed, ss << 8 | index << 4 | base, index
+ *			register
+ *	DISPLACEMENT	bytes consumed, disp_bytes, displacement
+ *	IMMEDIATE	bytes consumed, imm_bytes, immediate
+ *	MOFFSET		bytes consumed, disp_bytes, displacement
+ *	VERIFY_GLA	bytes consumed, gla, 0
+ *	DECODE_DONE	reason (0 on success), num_processed, gla
+ *	EMULATE		op_type | op_byte << 8 | opsize << 16 | addrsize << 24,
+ *			gpa, num_valid
+ *	EMULATE_DONE	error, gpa, 0
+ *	MMIO_READ	size, gpa, 0
+ *	MMIO_WRITE	size, gpa, value
+ *	MMIO_RMW	size | op << 8 | locked << 16, gpa, operand
+ *	MMIO_DONE	error, gpa, value read or written
+ *
+ * Stages that decode nothing for an instruction still fire.
+ */
+enum vie_trace_event {
+	VIE_TRACE_FETCH = 1,
+	VIE_TRACE_FETCH_DONE,
+	VIE_TRACE_DECODE,
+	VIE_TRACE_PREFIXES,
+	VIE_TRACE_OPCODE,
+	VIE_TRACE_MODRM,
+	VIE_TRACE_SIB,
+	VIE_TRACE_DISPLACEMENT,
+	VIE_TRACE_IMMEDIATE,
+	VIE_TRACE_MOFFSET,
+	VIE_TRACE_VERIFY_GLA,
+	VIE_TRACE_DECODE_DONE,
+	VIE_TRACE_EMULATE,
+	VIE_TRACE_EMULATE_DONE,
+	VIE_TRACE_MMIO_READ,
+	VIE_TRACE_MMIO_WRITE,
+	VIE_TRACE_MMIO_RMW,
+	VIE_TRACE_MMIO_DONE,
+	VIE_TRACE_LAST
+};
+
+extern volatile int vie_trace_enabled;
+void vie_trace_record(int vcpuid, int event, uint32_t arg, uint64_t a0,
+    uint64_t a1);
+#endif	/* VIE_TRACE */
+
+#ifdef VIE_STAGES
+/*
+ * Per-stage cost of each opcode, compiled in with 'options VIE_STAGES'.
+ *
+ * Stage boundaries are timestamped with an lfence-serialized TSC read and
+ * the cycles in between, less those of a boundary itself as calibrated on
+ * the first instruction, charged to the stage being left, accumulated over
+ * one instruction and added to the row of its opcode once it is emulated,
+ * or once it is known that it will not be. Callbacks made while emulating
+ * are stages of their own nested in VIE_STAGE_EMULATE, which only keeps
+ * the handler's own time. Time spent by the caller between fetching,
+ * decoding and emulating is not charged to anything.
+ *
+ * Opcodes are indexed by their last opcode byte, plus 256 for the 0x0f
+ * two-byte ones; VIE_STAGES_UNKNOWN collects instructions whose opcode
+ * was never decoded. Only the thread running a vCPU writes its counters.
+ */
+enum vie_stage {
+	VIE_STAGE_NONE = 0,		/* between stages, never reported */
+	VIE_STAGE_FETCH,		/* vmm_fetch_instruction() */
+	VIE_STAGE_PREFIXES,		/* decode_prefixes() */
+	VIE_STAGE_OPCODE,
+	VIE_STAGE_MODRM,
+	VIE_STAGE_SIB,
+	VIE_STAGE_DISPLACEMENT,
+	VIE_STAGE_IMMEDIATE,
+	VIE_STAGE_MOFFSET,
+	VIE_STAGE_LOCK,
+	VIE_STAGE_VERIFY_GLA,
+	VIE_STAGE_EMULATE,		/* the emulate_*() handler itself */
+	VIE_STAGE_GLA,			/* get_gla(), vie_calculate_gla() */
+	VIE_STAGE_GLA2GPA,		/* vm_gla2gpa(), vm_copy_setup() */
+	VIE_STAGE_MMIO_READ,		/* device model callbacks */
+	VIE_STAGE_MMIO_WRITE,
+	VIE_STAGE_MMIO_RMW,
+	VIE_STAGE_LAST
+};
+
+#define	VIE_STAGES_NKEYS	513
+#define	VIE_STAGES_UNKNOWN	512
+
+struct vie_stages {
+	uint64_t	count[VIE_STAGES_NKEYS];
+	uint64_t	cycles[VIE_STAGES_NKEYS][VIE_STAGE_LAST];
+};
+
+/*
+ * Copy the counters of 'vcpuid', or the sum over all vCPUs if it is -1,
+ * into 'st'. Returns EINVAL if 'vcpuid' is out of range.
+ */
+int vie_stages_snapshot(int vcpuid, struct vie_stages *st);
+void vie_stages_reset(void);
+
+/*
+ * Frame names for folded stacks: "decode;modrm" for a stage, "mov_89" or
+ * "movzx_0fb6" for an opcode.
+ */
+const char *vie_stages_name(int stage);
+int vie_stages_opname(int key, char *buf, size_t len);
+#endif	/* VIE_STAGES */
 
 #ifdef _KERNEL
 /*
  * APIs to fetch and decode the instruction from nested page fault handler.
+ *
+ * 'vie' must be initialized before calling 'vmm_fetch_instruction()'
  */
 int vmm_fetch_instruction(struct vm *vm, int cpuid,
-			  uint64_t rip, int inst_length, uint64_t cr3,
-			  struct vie *vie);
+			  struct vm_guest_paging *guest_paging,
+			  uint64_t rip, int inst_length, struct vie *vie,
+			  int *is_fault);
+
+/*
+ * Translate the guest linear address 'gla' to a guest physical address.
+ *
+ * retval	is_fault	Interpretation
+ *   0		   0		'gpa' contains result of the translation
+ *   0		   1		An exception was injected into the guest
+ * EFAULT	  N/A		An unrecoverable hypervisor error occurred
+ */
+int vm_gla2gpa(struct vm *vm, int vcpuid, struct vm_guest_paging *paging,
+    uint64_t gla, int prot, uint64_t *gpa, int *is_fault);
+
+/*
+ * Like vm_gla2gpa, but no exceptions are injected into the guest and
+ * PTEs are not changed.
+ */
+int vm_gla2gpa_nofault(struct vm *vm, int vcpuid,
+    struct vm_guest_paging *paging, uint64_t gla, int prot, uint64_t *gpa,
+    int *is_fault);
+
+void vie_init(struct vie *vie, const char *inst_bytes, int inst_length);
 #endif	/* _KERNEL */
 
 #if defined(_KERNEL) || defined(_VERIFICATION)
+/*
+ * Decode the instruction fetched into 'vie' so it can be emulated.
+ *
+ * 'gla' is the guest linear address provided by the hardware assist
+ * that caused the nested page table fault. It is used to verify that
+ * the software instruction decoding is in agreement with the hardware.
+ * 
+ * Some hardware assists do not provide the 'gla' to the hypervisor.
+ * To skip the 'gla' verification for this or any other reason pass
+ * in VIE_INVALID_GLA instead.
+ */
+#define	VIE_INVALID_GLA		(1UL << 63)	/* a non-canonical address */
 struct vm;
-int vmm_decode_instruction(struct vm *vm, int cpuid,
-			   uint64_t gla, struct vie *vie);
+int vmm_decode_instruction(struct vm *vm, int cpuid, uint64_t gla,
+			   enum vm_cpu_mode cpu_mode, int csd, struct vie *vie);
 #endif /* _KERNEL || _VERIFICATION */
 
 
@@ -0,0 +1,214 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Doorbell writes signalled through an eventfd.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/eventfd.h>
+
+#include <machine/atomic.h>
+
+#include <pthread.h>
+#include <string.h>
+
+#include "vmm_stubs.h"
+#include "vmm_ioevent.h"
+
+int
+vie_ioevents_init(struct vie_ioevents *tbl)
+{
+
+	memset(tbl, 0, sizeof(struct vie_ioevents));
+	return (pthread_mutex_init(&tbl->mtx, NULL));
+}
+
+void
+vie_ioevents_destroy(struct vie_ioevents *tbl)
+{
+
+	pthread_mutex_destroy(&tbl->mtx);
+}
+
+/*
+ * Return the index of the first registration whose gpa is not below 'gpa'.
+ */
+static int
+vie_ioevent_lower(struct vie_ioevents *tbl, int n, uint64_t gpa)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (tbl->ev[mid].gpa < gpa)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+static int
+vie_ioevent_find(struct vie_ioevents *tbl, uint64_t gpa, int len, int flags,
+    uint64_t data, int fd)
+{
+	struct vie_ioevent *ev;
+	int i;
+
+	for (i = vie_ioevent_lower(tbl, tbl->n, gpa); i < tbl->n; i++) {
+		ev = &tbl->ev[i];
+		if (ev->gpa != gpa)
+			break;
+		if (ev->len == len && ev->flags == flags &&
+		    ((flags & VIE_IOEVENT_F_DATAMATCH) == 0 ||
+		    ev->data == data) && (fd < 0 || ev->fd == fd))
+			return (i);
+	}
+	return (-1);
+}
+
+static void
+vie_ioevent_update_begin(struct vie_ioevents *tbl)
+{
+
+	pthread_mutex_lock(&tbl->mtx);
+	atomic_store_rel_32(&tbl->seq, tbl->seq + 1);
+	atomic_thread_fence_seq_cst();
+}
+
+static void
+vie_ioevent_update_end(struct vie_ioevents *tbl)
+{
+
+	atomic_store_rel_32(&tbl->seq, tbl->seq + 1);
+	pthread_mutex_unlock(&tbl->mtx);
+}
+
+int
+vie_ioevent_register(struct vie_ioevents *tbl, uint64_t gpa, int len,
+    int flags, uint64_t data, int fd)
+{
+	int error, i;
+
+	if (len != 0 && len != 1 && len != 2 && len != 4 && len != 8)
+		return (EINVAL);
+	if ((flags & ~VIE_IOEVENT_F_DATAMATCH) != 0 || fd < 0)
+		return (EINVAL);
+	if ((flags & VIE_IOEVENT_F_DATAMATCH) != 0 && len == 0)
+		return (EINVAL);
+
+	vie_ioevent_update_begin(tbl);
+	if (vie_ioevent_find(tbl, gpa, len, flags, data, -1) >= 0) {
+		error = EEXIST;
+	} else if (tbl->n >= VIE_IOEVENT_MAX) {
+		error = ENOSPC;
+	} else {
+		i = vie_ioevent_lower(tbl, tbl->n, gpa);
+		memmove(&tbl->ev[i + 1], &tbl->ev[i],
+		    (tbl->n - i) * sizeof(struct vie_ioevent));
+		tbl->ev[i].gpa = gpa;
+		tbl->ev[i].data = data;
+		tbl->ev[i].len = len;
+		tbl->ev[i].flags = flags;
+		tbl->ev[i].fd = fd;
+		tbl->n++;
+		error = 0;
+	}
+	vie_ioevent_update_end(tbl);
+
+	return (error);
+}
+
+int
+vie_ioevent_unregister(struct vie_ioevents *tbl, uint64_t gpa, int len,
+    int flags, uint64_t data, int fd)
+{
+	int error, i;
+
+	vie_ioevent_update_begin(tbl);
+	i = vie_ioevent_find(tbl, gpa, len, flags, data, fd);
+	if (i < 0) {
+		error = ENOENT;
+	} else {
+		memmove(&tbl->ev[i], &tbl->ev[i + 1],
+		    (tbl->n - i - 1) * sizeof(struct vie_ioevent));
+		tbl->n--;
+		error = 0;
+	}
+	vie_ioevent_update_end(tbl);
+
+	return (error);
+}
+
+/*
+ * Return the eventfd bound to a 'size' byte store of 'val' to 'gpa' or -1.
+ */
+static int
+vie_ioevent_match(struct vie_ioevents *tbl, uint64_t gpa, int size,
+    uint64_t val)
+{
+	struct vie_ioevent *ev;
+	uint32_t seq;
+	int fd, i, n;
+
+	for (;;) {
+		seq = atomic_load_acq_32(&tbl->seq);
+		if (seq & 1) {
+			__asm __volatile("pause");
+			continue;
+		}
+
+		fd = -1;
+		n = tbl->n;
+		if (n > VIE_IOEVENT_MAX)
+			n = VIE_IOEVENT_MAX;	/* torn read, retried below */
+		for (i = vie_ioevent_lower(tbl, n, gpa); i < n; i++) {
+			ev = &tbl->ev[i];
+			if (ev->gpa != gpa)
+				break;
+			if (ev->len != 0 && ev->len != size)
+				continue;
+			if ((ev->flags & VIE_IOEVENT_F_DATAMATCH) != 0 &&
+			    ev->data != val)
+				continue;
+			fd = ev->fd;
+			break;
+		}
+
+		atomic_thread_fence_acq();
+		if (tbl->seq == seq)
+			return (fd);
+	}
+}
+
+int
+vie_ioevent_emulate(struct vie_ioevents *tbl, void *vm, int vcpuid,
+    uint64_t gpa, struct vie *vie)
+{
+	uint64_t val;
+	int fd, size;
+
+	/* Cheap check that lets every other exit through untouched */
+	if (tbl->n == 0)
+		return (ENOENT);
+
+	if (vie_mov_store(vm, vcpuid, vie, &val, &size) != 0)
+		return (ENOENT);
+
+	fd = vie_ioevent_match(tbl, gpa, size, val);
+	if (fd < 0)
+		return (ENOENT);
+
+	/*
+	 * The only possible failure is EAGAIN when the counter is about to
+	 * overflow, in which case the backend already has a wakeup pending.
+	 */
+	(void)eventfd_write(fd, 1);
+	return (0);
+}
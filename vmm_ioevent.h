@@ -0,0 +1,57 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Doorbell writes signalled through an eventfd.
+ *
+ * A registered (gpa, length, optional value) tuple is bound to an eventfd.
+ * When a decoded MOV store hits a registration vie_ioevent_emulate() signals
+ * the eventfd and the store is considered complete; the device model callback
+ * is never called. This is the moral equivalent of KVM's ioeventfd and is
+ * meant for virtio queue notify registers.
+ *
+ * The table may be updated while vCPUs are emulating through it. Lookups are
+ * lock-free and retry if they race with an update.
+ */
+
+#ifndef	_VMM_IOEVENT_H_
+#define	_VMM_IOEVENT_H_
+
+#define	VIE_IOEVENT_MAX		64
+
+/* struct vie_ioevent.flags */
+#define	VIE_IOEVENT_F_DATAMATCH	(1 << 0)	/* 'data' must match */
+
+struct vie_ioevent {
+	uint64_t	gpa;
+	uint64_t	data;
+	int		len;		/* 1, 2, 4 or 8; 0 matches any size */
+	int		flags;
+	int		fd;		/* eventfd to signal */
+};
+
+struct vie_ioevents {
+	volatile uint32_t	seq;	/* odd while an update is in progress */
+	pthread_mutex_t		mtx;	/* serializes updates */
+	int			n;
+	struct vie_ioevent	ev[VIE_IOEVENT_MAX];	/* sorted by 'gpa' */
+};
+
+int	vie_ioevents_init(struct vie_ioevents *tbl);
+void	vie_ioevents_destroy(struct vie_ioevents *tbl);
+
+int	vie_ioevent_register(struct vie_ioevents *tbl, uint64_t gpa, int len,
+	    int flags, uint64_t data, int fd);
+int	vie_ioevent_unregister(struct vie_ioevents *tbl, uint64_t gpa, int len,
+	    int flags, uint64_t data, int fd);
+
+/*
+ * Complete the decoded instruction 'vie' that faulted on 'gpa' by signalling
+ * an eventfd if it is a MOV store that matches a registration.
+ *
+ * Returns 0 if the store was handled and ENOENT if it was not, in which case
+ * the caller must emulate it with vmm_emulate_instruction() as usual.
+ */
+int	vie_ioevent_emulate(struct vie_ioevents *tbl, void *vm, int vcpuid,
+	    uint64_t gpa, struct vie *vie);
+
+#endif	/* _VMM_IOEVENT_H_ */
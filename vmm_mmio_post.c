@@ -0,0 +1,199 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Posted MMIO writes on per-vCPU single-producer/single-consumer rings.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <machine/atomic.h>
+
+#include <sched.h>
+#include <string.h>
+
+#include "vmm_stubs.h"
+#include "vmm_mmio_post.h"
+
+#define	VIE_POST_SPINS		64	/* spins before yielding the cpu */
+
+static __inline void
+vie_post_pause(int *spins)
+{
+
+	if (++(*spins) < VIE_POST_SPINS)
+		__asm __volatile("pause");
+	else {
+		*spins = 0;
+		sched_yield();
+	}
+}
+
+void
+vie_post_init(struct vie_post *vp, void *vm, mem_region_read_t mrr,
+    mem_region_write_t mrw, void *arg)
+{
+
+	memset(vp, 0, sizeof(struct vie_post));
+	vp->vm = vm;
+	vp->mrr = mrr;
+	vp->mrw = mrw;
+	vp->arg = arg;
+}
+
+int
+vie_post_add_range(struct vie_post *vp, uint64_t base, uint64_t size,
+    int dev, int flags)
+{
+	struct vie_post_range *r;
+
+	if (size == 0 || base + size < base)
+		return (EINVAL);
+
+	if (dev < 0 || dev >= VIE_POST_MAXDEV)
+		return (EINVAL);
+
+	if (vp->nrange >= VIE_POST_MAXRANGE)
+		return (ENOSPC);
+
+	r = &vp->range[vp->nrange++];
+	r->base = base;
+	r->size = size;
+	r->dev = dev;
+	r->flags = flags;
+	return (0);
+}
+
+static struct vie_post_range *
+vie_post_lookup(struct vie_post *vp, uint64_t gpa)
+{
+	struct vie_post_range *r;
+	int i;
+
+	for (i = 0; i < vp->nrange; i++) {
+		r = &vp->range[i];
+		if (gpa - r->base < r->size)
+			return (r);
+	}
+	return (NULL);
+}
+
+void
+vie_post_flush(struct vie_post *vp, int cpuid, int dev)
+{
+	struct vie_post_ring *ring;
+	uint64_t target;
+	int spins;
+
+	KASSERT(cpuid >= 0 && cpuid < VIE_POST_MAXCPU,
+	    ("%s: invalid cpuid %d", __func__, cpuid));
+
+	ring = &vp->ring[cpuid];
+	target = (dev < 0) ? ring->head : ring->devseq[dev];
+
+	/* Fast path: nothing posted to 'dev' is still in flight */
+	if (target <= ring->cached_tail)
+		return;
+
+	spins = 0;
+	while ((ring->cached_tail = atomic_load_acq_64(&ring->tail)) < target)
+		vie_post_pause(&spins);
+}
+
+int
+vie_post_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+	struct vie_post *vp;
+	struct vie_post_range *r;
+
+	vp = arg;
+	r = vie_post_lookup(vp, gpa);
+	if (r != NULL)
+		vie_post_flush(vp, cpuid, r->dev);
+
+	return ((*vp->mrr)(vm, cpuid, gpa, rval, rsize, vp->arg));
+}
+
+int
+vie_post_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+	struct vie_post *vp;
+	struct vie_post_range *r;
+	struct vie_post_ring *ring;
+	struct vie_post_entry *ent;
+	uint64_t head;
+	int spins;
+
+	vp = arg;
+	r = vie_post_lookup(vp, gpa);
+	if (r == NULL)
+		return ((*vp->mrw)(vm, cpuid, gpa, wval, wsize, vp->arg));
+
+	if ((r->flags & VIE_POST_F_POSTED) == 0) {
+		vie_post_flush(vp, cpuid, r->dev);
+		return ((*vp->mrw)(vm, cpuid, gpa, wval, wsize, vp->arg));
+	}
+
+	KASSERT(cpuid >= 0 && cpuid < VIE_POST_MAXCPU,
+	    ("%s: invalid cpuid %d", __func__, cpuid));
+
+	ring = &vp->ring[cpuid];
+	head = ring->head;
+
+	/* Wait for the device thread to make room if the ring is full */
+	if (head - ring->cached_tail >= VIE_POST_RING_SIZE) {
+		spins = 0;
+		while (head - (ring->cached_tail =
+		    atomic_load_acq_64(&ring->tail)) >= VIE_POST_RING_SIZE)
+			vie_post_pause(&spins);
+	}
+
+	ent = &ring->ent[head & (VIE_POST_RING_SIZE - 1)];
+	ent->gpa = gpa;
+	ent->val = wval;
+	ent->size = wsize;
+	ent->dev = r->dev;
+
+	atomic_store_rel_64(&ring->head, head + 1);
+	ring->devseq[r->dev] = head + 1;
+	return (0);
+}
+
+int
+vie_post_drain(struct vie_post *vp, int cpuid, int budget)
+{
+	struct vie_post_ring *ring;
+	struct vie_post_entry *ent;
+	uint64_t tail;
+	int error, n;
+
+	KASSERT(cpuid >= 0 && cpuid < VIE_POST_MAXCPU,
+	    ("%s: invalid cpuid %d", __func__, cpuid));
+
+	ring = &vp->ring[cpuid];
+	tail = ring->tail;
+	if (tail == ring->cached_head) {
+		ring->cached_head = atomic_load_acq_64(&ring->head);
+		if (tail == ring->cached_head)
+			return (0);
+	}
+
+	n = 0;
+	while (tail != ring->cached_head && n < budget) {
+		ent = &ring->ent[tail & (VIE_POST_RING_SIZE - 1)];
+		error = (*vp->mrw)(vp->vm, cpuid, ent->gpa, ent->val,
+		    ent->size, vp->arg);
+		if (error)
+			ring->errors++;
+		tail++;
+		n++;
+	}
+
+	atomic_store_rel_64(&ring->tail, tail);
+	return (n);
+}
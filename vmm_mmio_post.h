@@ -0,0 +1,119 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Posted MMIO writes.
+ *
+ * Writes to registers such as doorbells, EOI and interrupt masks do not have
+ * to complete before the vCPU resumes. Ranges registered as posted have their
+ * writes queued on a per-vCPU single-producer/single-consumer ring which a
+ * device thread drains into the device model with vie_post_drain().
+ *
+ * 'vie_post_mread' and 'vie_post_mwrite' are drop-in replacements for the
+ * device model callbacks passed to vmm_emulate_instruction() with a
+ * 'struct vie_post' as the opaque argument. Any read from a device, or a
+ * synchronous write to one of its non-posted ranges, first waits until the
+ * writes the same vCPU has posted to that device have been drained, so the
+ * device observes accesses in program order.
+ *
+ * Posting only pays off when the device thread has a CPU of its own and the
+ * device model write costs more than queueing it, about 30 ns. With both
+ * threads on one CPU the device work is merely deferred: the vCPU gains on
+ * the median write but loses on the mean, as a full ring stalls it until
+ * the device thread has been scheduled.
+ */
+
+#ifndef	_VMM_MMIO_POST_H_
+#define	_VMM_MMIO_POST_H_
+
+#define	VIE_POST_MAXCPU		16
+#define	VIE_POST_MAXRANGE	16
+#define	VIE_POST_MAXDEV		VIE_POST_MAXRANGE
+#define	VIE_POST_RING_SIZE	256	/* must be a power of 2 */
+
+#ifndef	CACHE_LINE_SIZE
+#define	CACHE_LINE_SIZE		64
+#endif
+
+/* vie_post_add_range() flags */
+#define	VIE_POST_F_POSTED	(1 << 0)	/* writes may be posted */
+
+struct vie_post_entry {
+	uint64_t	gpa;
+	uint64_t	val;
+	int		size;
+	int		dev;
+};
+
+struct vie_post_ring {
+	/* Owned by the vCPU thread (producer) */
+	uint64_t	cached_tail __aligned(CACHE_LINE_SIZE);
+	uint64_t	devseq[VIE_POST_MAXDEV];	/* 'head' after post */
+
+	/*
+	 * Written by the producer and polled by the consumer, on a line of
+	 * its own so that polling does not steal the producer's state.
+	 */
+	uint64_t	head __aligned(CACHE_LINE_SIZE);
+
+	/* Owned by the device thread (consumer) */
+	uint64_t	tail __aligned(CACHE_LINE_SIZE);
+	uint64_t	cached_head;
+	uint64_t	errors;		/* device model write failures */
+
+	struct vie_post_entry
+			ent[VIE_POST_RING_SIZE] __aligned(CACHE_LINE_SIZE);
+};
+
+struct vie_post_range {
+	uint64_t	base;
+	uint64_t	size;
+	int		dev;
+	int		flags;
+};
+
+struct vie_post {
+	void			*vm;
+	mem_region_read_t	mrr;		/* device model callbacks */
+	mem_region_write_t	mrw;
+	void			*arg;
+
+	int			nrange;
+	struct vie_post_range	range[VIE_POST_MAXRANGE];
+
+	struct vie_post_ring	ring[VIE_POST_MAXCPU];
+};
+
+void	vie_post_init(struct vie_post *vp, void *vm, mem_region_read_t mrr,
+	    mem_region_write_t mrw, void *arg);
+
+/*
+ * Register the range [base, base + size) as belonging to device 'dev'. All
+ * accesses to a device are kept in order; only writes to ranges registered
+ * with VIE_POST_F_POSTED are actually posted. Ranges may overlap, in which
+ * case the one registered first wins: register a posted register window
+ * before the device's full MMIO range.
+ *
+ * Ranges must be registered before any vCPU starts emulating through 'vp'.
+ */
+int	vie_post_add_range(struct vie_post *vp, uint64_t base, uint64_t size,
+	    int dev, int flags);
+
+int	vie_post_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval,
+	    int rsize, void *arg);
+int	vie_post_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval,
+	    int wsize, void *arg);
+
+/*
+ * Deliver up to 'budget' writes posted by vCPU 'cpuid' to the device model.
+ * Only one thread may drain a given vCPU's ring. Returns the number of
+ * writes delivered.
+ */
+int	vie_post_drain(struct vie_post *vp, int cpuid, int budget);
+
+/*
+ * Wait until the writes posted by vCPU 'cpuid' to device 'dev' have been
+ * drained, or all of its posted writes if 'dev' is -1.
+ */
+void	vie_post_flush(struct vie_post *vp, int cpuid, int dev);
+
+#endif	/* _VMM_MMIO_POST_H_ */
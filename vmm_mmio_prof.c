@@ -0,0 +1,241 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * MMIO access profiling.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <machine/cpufunc.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "vmm_stubs.h"
+#include "vmm_mmio_prof.h"
+
+void
+vie_prof_init(struct vie_prof *prof, mem_region_read_t mrr,
+    mem_region_write_t mrw, void *arg)
+{
+
+	memset(prof, 0, sizeof(struct vie_prof));
+	prof->mrr = mrr;
+	prof->mrw = mrw;
+	prof->arg = arg;
+}
+
+int
+vie_prof_add_range(struct vie_prof *prof, const char *name, uint64_t base,
+    uint64_t size)
+{
+	struct vie_prof_range *r;
+
+	if (size == 0 || base + size < base)
+		return (EINVAL);
+
+	if (name == NULL || name[0] == '\0' || strchr(name, ' ') != NULL ||
+	    strlen(name) >= VIE_PROF_NAMELEN)
+		return (EINVAL);
+
+	if (prof->nrange >= VIE_PROF_MAXRANGE)
+		return (ENOSPC);
+
+	r = &prof->range[prof->nrange++];
+	r->base = base;
+	r->size = size;
+	strlcpy(r->name, name, sizeof(r->name));
+	return (0);
+}
+
+void
+vie_prof_reset(struct vie_prof *prof)
+{
+
+	memset(prof->vcpu, 0, sizeof(prof->vcpu));
+}
+
+static int
+vie_prof_lookup(struct vie_prof *prof, uint64_t gpa)
+{
+	int i;
+
+	for (i = 0; i < prof->nrange; i++) {
+		if (gpa - prof->range[i].base < prof->range[i].size)
+			return (i);
+	}
+	return (VIE_PROF_MAXRANGE);
+}
+
+static __inline void
+vie_prof_count(struct vie_prof_hist *h, int error, uint64_t cycles)
+{
+
+	h->calls++;
+	if (error != 0)
+		h->errors++;
+	h->cycles += cycles;
+	h->hist[MIN(flsll(cycles), VIE_PROF_NBUCKETS - 1)]++;
+}
+
+/* Charge a device model call of 'size' bytes at 'gpa' to 'cpuid' */
+static void
+vie_prof_access(struct vie_prof *prof, int cpuid, uint64_t gpa, int size,
+    int write, int error, uint64_t cycles)
+{
+	struct vie_prof_vcpu *vc;
+	struct vie_prof_access *acc;
+	int width;
+
+	KASSERT(cpuid >= 0 && cpuid < VIE_PROF_MAXCPU,
+	    ("%s: invalid cpuid %d", __func__, cpuid));
+
+	vc = &prof->vcpu[cpuid];
+	width = MIN(ffs(size) - 1, VIE_PROF_NWIDTH - 1);
+	acc = &vc->acc[vie_prof_lookup(prof, gpa)][write][MAX(width, 0)];
+	vie_prof_count(&acc->h, error, cycles);
+	if (error == 0)
+		acc->bytes += size;
+	vc->dev_cycles += cycles;
+}
+
+int
+vie_prof_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+	struct vie_prof *prof;
+	uint64_t t0;
+	int error;
+
+	prof = arg;
+	t0 = rdtsc();
+	error = (*prof->mrr)(vm, cpuid, gpa, rval, rsize, prof->arg);
+	vie_prof_access(prof, cpuid, gpa, rsize, 0, error, rdtsc() - t0);
+	return (error);
+}
+
+int
+vie_prof_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+	struct vie_prof *prof;
+	uint64_t t0;
+	int error;
+
+	prof = arg;
+	t0 = rdtsc();
+	error = (*prof->mrw)(vm, cpuid, gpa, wval, wsize, prof->arg);
+	vie_prof_access(prof, cpuid, gpa, wsize, 1, error, rdtsc() - t0);
+	return (error);
+}
+
+int
+vie_prof_emulate(struct vie_prof *prof, void *vm, int vcpuid, uint64_t gpa,
+    struct vie *vie, struct vm_guest_paging *paging)
+{
+	struct vie_prof_vcpu *vc;
+	uint64_t t0, total;
+	int error;
+
+	KASSERT(vcpuid >= 0 && vcpuid < VIE_PROF_MAXCPU,
+	    ("%s: invalid vcpuid %d", __func__, vcpuid));
+
+	vc = &prof->vcpu[vcpuid];
+	vc->dev_cycles = 0;
+	t0 = rdtsc();
+	error = vmm_emulate_instruction(vm, vcpuid, gpa, vie, paging,
+	    vie_prof_mread, vie_prof_mwrite, prof);
+	total = rdtsc() - t0;
+
+	vie_prof_count(&vc->total, error, total);
+	vie_prof_count(&vc->emul, error,
+	    total > vc->dev_cycles ? total - vc->dev_cycles : 0);
+	return (error);
+}
+
+static void
+vie_prof_sum(struct vie_prof_hist *dst, const struct vie_prof_hist *src)
+{
+	int i;
+
+	dst->calls += src->calls;
+	dst->errors += src->errors;
+	dst->cycles += src->cycles;
+	for (i = 0; i < VIE_PROF_NBUCKETS; i++)
+		dst->hist[i] += src->hist[i];
+}
+
+/* Upper bound of the bucket holding the 'pct' percentile */
+static uint64_t
+vie_prof_pct(const struct vie_prof_hist *h, double pct)
+{
+	uint64_t sum;
+	int i;
+
+	for (sum = 0, i = 0; i < VIE_PROF_NBUCKETS - 1; i++) {
+		sum += h->hist[i];
+		if (sum >= h->calls * pct)
+			break;
+	}
+	return (1UL << i);
+}
+
+static void
+vie_prof_print(FILE *fp, const struct vie_prof_hist *h)
+{
+
+	fprintf(fp, " calls=%ju errors=%ju mean=%.1f p50=%ju p99=%ju\n",
+	    (uintmax_t)h->calls, (uintmax_t)h->errors,
+	    h->calls ? (double)h->cycles / h->calls : 0,
+	    (uintmax_t)vie_prof_pct(h, .5), (uintmax_t)vie_prof_pct(h, .99));
+}
+
+void
+vie_prof_dump(struct vie_prof *prof, FILE *fp)
+{
+	struct vie_prof_access acc;
+	struct vie_prof_hist emul, total;
+	const struct vie_prof_access *src;
+	int r, v, w, write;
+
+	for (r = 0; r <= VIE_PROF_MAXRANGE; r++) {
+		if (r < VIE_PROF_MAXRANGE && r >= prof->nrange)
+			continue;
+		for (write = 0; write < 2; write++) {
+			for (w = 0; w < VIE_PROF_NWIDTH; w++) {
+				memset(&acc, 0, sizeof(acc));
+				for (v = 0; v < VIE_PROF_MAXCPU; v++) {
+					src = &prof->vcpu[v].acc[r][write][w];
+					vie_prof_sum(&acc.h, &src->h);
+					acc.bytes += src->bytes;
+				}
+				if (acc.h.calls == 0)
+					continue;
+				fprintf(fp, "mmio %s %s %d bytes=%ju",
+				    r < VIE_PROF_MAXRANGE ?
+				    prof->range[r].name : "other",
+				    write ? "write" : "read", 1 << w,
+				    (uintmax_t)acc.bytes);
+				vie_prof_print(fp, &acc.h);
+			}
+		}
+	}
+
+	memset(&emul, 0, sizeof(emul));
+	memset(&total, 0, sizeof(total));
+	for (v = 0; v < VIE_PROF_MAXCPU; v++) {
+		vie_prof_sum(&emul, &prof->vcpu[v].emul);
+		vie_prof_sum(&total, &prof->vcpu[v].total);
+	}
+	if (total.calls == 0)
+		return;
+	fprintf(fp, "emul emulator");
+	vie_prof_print(fp, &emul);
+	fprintf(fp, "emul total");
+	vie_prof_print(fp, &total);
+}
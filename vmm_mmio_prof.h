@@ -0,0 +1,111 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * MMIO access profiling.
+ *
+ * 'vie_prof_mread' and 'vie_prof_mwrite' are drop-in replacements for the
+ * device model callbacks passed to vmm_emulate_instruction() with a
+ * 'struct vie_prof' as the opaque argument. Every call is forwarded to the
+ * device model and attributed to the registered range containing the gpa,
+ * or to the unnamed "other" range: calls, bytes, errors and a histogram of
+ * the time spent in the device model, by direction and access width.
+ *
+ * vie_prof_emulate() additionally times the whole emulation and charges the
+ * part not spent in the device model to the emulator, so emulator overhead
+ * can be told apart from device model overhead. The emulator's share
+ * includes reading the TSC around each device model call.
+ *
+ * Each vCPU counts into its own slots; vie_prof_dump() sums them. Times are
+ * in TSC cycles. Histogram bucket 'i' counts the calls that took less than
+ * 2^i cycles and at least 2^(i-1), the last bucket all longer ones.
+ */
+
+#ifndef	_VMM_MMIO_PROF_H_
+#define	_VMM_MMIO_PROF_H_
+
+#define	VIE_PROF_MAXCPU		16
+#define	VIE_PROF_MAXRANGE	16
+#define	VIE_PROF_NAMELEN	24
+#define	VIE_PROF_NWIDTH		4	/* 1, 2, 4 and 8 byte accesses */
+#define	VIE_PROF_NBUCKETS	20
+
+#ifndef	CACHE_LINE_SIZE
+#define	CACHE_LINE_SIZE		64
+#endif
+
+struct vie_prof_hist {
+	uint64_t	calls;
+	uint64_t	errors;
+	uint64_t	cycles;
+	uint64_t	hist[VIE_PROF_NBUCKETS];
+};
+
+struct vie_prof_access {
+	struct vie_prof_hist h;
+	uint64_t	bytes;
+};
+
+struct vie_prof_vcpu {
+	/* [range][write][log2 width], range VIE_PROF_MAXRANGE is "other" */
+	struct vie_prof_access acc[VIE_PROF_MAXRANGE + 1][2][VIE_PROF_NWIDTH];
+	struct vie_prof_hist emul;	/* emulator time, vie_prof_emulate() */
+	struct vie_prof_hist total;	/* emulator plus device model time */
+	uint64_t	dev_cycles;	/* device model time of this emulation */
+} __aligned(CACHE_LINE_SIZE);
+
+struct vie_prof_range {
+	uint64_t	base;
+	uint64_t	size;
+	char		name[VIE_PROF_NAMELEN];
+};
+
+struct vie_prof {
+	mem_region_read_t	mrr;		/* device model callbacks */
+	mem_region_write_t	mrw;
+	void			*arg;
+
+	int			nrange;
+	struct vie_prof_range	range[VIE_PROF_MAXRANGE];
+
+	struct vie_prof_vcpu	vcpu[VIE_PROF_MAXCPU];
+};
+
+void	vie_prof_init(struct vie_prof *prof, mem_region_read_t mrr,
+	    mem_region_write_t mrw, void *arg);
+
+/*
+ * Attribute accesses to [base, base + size) to 'name'. Ranges must be
+ * registered before any vCPU starts emulating through 'prof'; the first
+ * range registered that contains a gpa wins.
+ */
+int	vie_prof_add_range(struct vie_prof *prof, const char *name,
+	    uint64_t base, uint64_t size);
+
+int	vie_prof_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval,
+	    int rsize, void *arg);
+int	vie_prof_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval,
+	    int wsize, void *arg);
+
+/* vmm_emulate_instruction() through 'prof', timing the emulator as well */
+int	vie_prof_emulate(struct vie_prof *prof, void *vm, int vcpuid,
+	    uint64_t gpa, struct vie *vie, struct vm_guest_paging *paging);
+
+/* Zero the counters of all vCPUs, which must not be emulating */
+void	vie_prof_reset(struct vie_prof *prof);
+
+/*
+ * Write the counters summed over all vCPUs to 'fp', one line per range,
+ * direction and width that saw any access, then one line each for the
+ * emulator and total times. Every line is a fixed key followed by
+ * 'name=value' fields so that dumps of different builds can be diffed or
+ * joined on the key:
+ *
+ *	mmio <range> <read|write> <width> bytes= calls= errors= mean= p50= p99=
+ *	emul emulator calls= errors= mean= p50= p99=
+ *	emul total calls= errors= mean= p50= p99=
+ *
+ * mean is in cycles; p50 and p99 are the upper bounds of their buckets.
+ */
+void	vie_prof_dump(struct vie_prof *prof, FILE *fp);
+
+#endif	/* _VMM_MMIO_PROF_H_ */
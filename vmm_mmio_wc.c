@@ -0,0 +1,234 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Write-combining MMIO regions.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <string.h>
+
+#include "vmm_stubs.h"
+#include "vmm_mmio_wc.h"
+
+void
+vie_wc_init(struct vie_wc *wc, void *vm, mem_region_read_t mrr,
+    mem_region_write_t mrw, mem_region_rmw_t mrmw,
+    mem_region_block_write_t mrbw, void *arg)
+{
+
+	memset(wc, 0, sizeof(struct vie_wc));
+	wc->vm = vm;
+	wc->mrr = mrr;
+	wc->mrw = mrw;
+	wc->mrmw = mrmw;
+	wc->mrbw = mrbw;
+	wc->arg = arg;
+}
+
+int
+vie_wc_add_range(struct vie_wc *wc, uint64_t base, uint64_t size,
+    size_t burst)
+{
+	struct vie_wc_range *r;
+
+	if (size == 0 || base + size < base)
+		return (EINVAL);
+
+	if (burst < 8 || burst > VIE_WC_MAXBURST || !powerof2(burst))
+		return (EINVAL);
+
+	if (wc->nrange >= VIE_WC_MAXRANGE)
+		return (ENOSPC);
+
+	r = &wc->range[wc->nrange++];
+	r->base = base;
+	r->size = size;
+	r->burst = burst;
+	return (0);
+}
+
+static int
+vie_wc_lookup(struct vie_wc *wc, uint64_t gpa)
+{
+	struct vie_wc_range *r;
+	int i;
+
+	for (i = 0; i < wc->nrange; i++) {
+		r = &wc->range[i];
+		if (gpa - r->base < r->size)
+			return (i);
+	}
+	return (-1);
+}
+
+static int
+vie_wc_deliver(struct vie_wc *wc, int cpuid, struct vie_wc_buf *buf)
+{
+	int error;
+
+	error = (*wc->mrbw)(wc->vm, cpuid, buf->gpa, buf->data, buf->len,
+	    wc->arg);
+	buf->len = 0;
+	buf->bursts++;
+	return (error);
+}
+
+int
+vie_wc_flush(struct vie_wc *wc, int cpuid)
+{
+	struct vie_wc_buf *buf;
+
+	KASSERT(cpuid >= 0 && cpuid < VIE_WC_MAXCPU,
+	    ("%s: invalid cpuid %d", __func__, cpuid));
+
+	buf = &wc->buf[cpuid];
+	if (buf->len == 0)
+		return (0);
+
+	return (vie_wc_deliver(wc, cpuid, buf));
+}
+
+int
+vie_wc_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval, int rsize,
+    void *arg)
+{
+	struct vie_wc *wc;
+	int error;
+
+	wc = arg;
+	error = vie_wc_flush(wc, cpuid);
+	if (error)
+		return (error);
+
+	return ((*wc->mrr)(vm, cpuid, gpa, rval, rsize, wc->arg));
+}
+
+/*
+ * A locked or unlocked read-modify-write is not combined: it drains the
+ * burst, so that the device sees the stores before it in order, and goes
+ * straight to the device model.
+ */
+int
+vie_wc_rmw(void *vm, int cpuid, uint64_t gpa, enum vie_rmw_op op,
+    uint64_t operand, uint64_t *oldval, int size, int locked, void *arg)
+{
+	struct vie_wc *wc;
+	uint64_t val;
+	int error;
+
+	wc = arg;
+	error = vie_wc_flush(wc, cpuid);
+	if (error)
+		return (error);
+
+	if (wc->mrmw != NULL)
+		return ((*wc->mrmw)(vm, cpuid, gpa, op, operand, oldval, size,
+		    locked, wc->arg));
+
+	error = (*wc->mrr)(vm, cpuid, gpa, oldval, size, wc->arg);
+	if (error)
+		return (error);
+	switch (op) {
+	case VIE_RMW_AND:
+		val = *oldval & operand;
+		break;
+	case VIE_RMW_OR:
+		val = *oldval | operand;
+		break;
+	case VIE_RMW_BTS:
+		val = *oldval | (1UL << operand);
+		break;
+	case VIE_RMW_BTR:
+		val = *oldval & ~(1UL << operand);
+		break;
+	default:
+		return (EINVAL);
+	}
+	return ((*wc->mrw)(vm, cpuid, gpa, val, size, wc->arg));
+}
+
+int
+vie_wc_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval, int wsize,
+    void *arg)
+{
+	struct vie_wc *wc;
+	struct vie_wc_range *r;
+	struct vie_wc_buf *buf;
+	uint64_t mask;
+	int error, idx;
+
+	wc = arg;
+
+	/*
+	 * Most stores directly follow the open burst in the same block,
+	 * which has to be in a write-combining range.
+	 */
+	KASSERT(cpuid >= 0 && cpuid < VIE_WC_MAXCPU,
+	    ("%s: invalid cpuid %d", __func__, cpuid));
+	buf = &wc->buf[cpuid];
+	if (buf->len != 0 && gpa == buf->gpa + buf->len) {
+		r = &wc->range[buf->range];
+		mask = ~((uint64_t)r->burst - 1);
+		if ((buf->gpa & mask) == ((gpa + wsize - 1) & mask) &&
+		    gpa + wsize - r->base <= r->size)
+			goto append;
+	}
+
+	idx = vie_wc_lookup(wc, gpa);
+	if (idx < 0 ||
+	    gpa + wsize - wc->range[idx].base > wc->range[idx].size) {
+		error = vie_wc_flush(wc, cpuid);
+		if (error)
+			return (error);
+		return ((*wc->mrw)(vm, cpuid, gpa, wval, wsize, wc->arg));
+	}
+
+	r = &wc->range[idx];
+	mask = ~((uint64_t)r->burst - 1);
+
+	/*
+	 * Extend the open burst if the store directly follows it and stays
+	 * within the same burst-aligned block, otherwise start a new one.
+	 */
+	if (buf->len != 0 && (buf->range != idx ||
+	    gpa != buf->gpa + buf->len ||
+	    (buf->gpa & mask) != ((gpa + wsize - 1) & mask))) {
+		error = vie_wc_deliver(wc, cpuid, buf);
+		if (error)
+			return (error);
+	}
+
+	if (buf->len == 0) {
+		buf->gpa = gpa;
+		buf->range = idx;
+	}
+
+append:
+	/* Guest memory is little-endian, as is the host */
+	switch (wsize) {
+	case 1:
+		buf->data[buf->len] = wval;
+		break;
+	case 2:
+		memcpy(&buf->data[buf->len], &wval, 2);
+		break;
+	case 4:
+		memcpy(&buf->data[buf->len], &wval, 4);
+		break;
+	default:
+		memcpy(&buf->data[buf->len], &wval, 8);
+		break;
+	}
+	buf->len += wsize;
+	buf->stores++;
+
+	if (((gpa + wsize) & ~mask) == 0)
+		return (vie_wc_deliver(wc, cpuid, buf));
+
+	return (0);
+}
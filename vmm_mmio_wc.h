@@ -0,0 +1,116 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Write-combining MMIO regions.
+ *
+ * Guests filling a linear framebuffer or a device queue issue long runs of
+ * adjacent stores, each of which would otherwise be a separate call into the
+ * device model. Stores to ranges registered as write-combining are collected
+ * in a per-vCPU buffer and delivered to the device model as one block write
+ * once the burst is complete.
+ *
+ * 'vie_wc_mread', 'vie_wc_mwrite' and 'vie_wc_rmw' are drop-in replacements
+ * for the device model callbacks passed to vmm_emulate_instruction_rmw()
+ * with a 'struct vie_wc' as the opaque argument. The buffered burst of a
+ * vCPU is delivered when:
+ *
+ * - the vCPU stores to an address that does not directly follow the burst or
+ *   that is in a different range;
+ * - the vCPU reads from any range, or stores to a range that is not
+ *   write-combining;
+ * - the vCPU does a read-modify-write, locked or not, which then goes to the
+ *   device model uncombined. Without 'vie_wc_rmw' the store of a locked
+ *   instruction would be buffered like any other;
+ * - the burst reaches a multiple of the range's burst size, so bursts are
+ *   aligned to cache lines or pages;
+ * - vie_wc_flush() is called. The caller must do so on every other
+ *   serializing event: a fence, an I/O port access, an interrupt window or
+ *   any exit to the device model that is not an MMIO access.
+ *
+ * Only ascending runs are combined; a store with EFLAGS.DF set starts a new
+ * burst each time.
+ */
+
+#ifndef	_VMM_MMIO_WC_H_
+#define	_VMM_MMIO_WC_H_
+
+#define	VIE_WC_MAXCPU		16
+#define	VIE_WC_MAXRANGE		16
+#define	VIE_WC_MAXBURST		4096	/* must be a power of 2 */
+
+#ifndef	CACHE_LINE_SIZE
+#define	CACHE_LINE_SIZE		64
+#endif
+
+/*
+ * Deliver the 'len' bytes in 'buf' to the memory region at 'gpa'.
+ */
+typedef int (*mem_region_block_write_t)(void *vm, int cpuid, uint64_t gpa,
+				       const void *buf, size_t len, void *arg);
+
+struct vie_wc_buf {
+	uint64_t	gpa;		/* start of the burst */
+	size_t		len;		/* 0 if no burst is open */
+	int		range;		/* index into 'vie_wc.range' */
+
+	/* Statistics */
+	uint64_t	stores;		/* stores combined into bursts */
+	uint64_t	bursts;		/* block writes delivered */
+
+	uint8_t		data[VIE_WC_MAXBURST] __aligned(CACHE_LINE_SIZE);
+};
+
+struct vie_wc_range {
+	uint64_t	base;
+	uint64_t	size;
+	size_t		burst;		/* 0 if not write-combining */
+};
+
+struct vie_wc {
+	void			*vm;
+	mem_region_read_t	mrr;		/* device model callbacks */
+	mem_region_write_t	mrw;
+	mem_region_rmw_t	mrmw;		/* optional */
+	mem_region_block_write_t mrbw;
+	void			*arg;
+
+	int			nrange;
+	struct vie_wc_range	range[VIE_WC_MAXRANGE];
+
+	struct vie_wc_buf	buf[VIE_WC_MAXCPU];
+};
+
+/*
+ * 'mrmw' may be NULL, read-modify-writes are then done with 'mrr' and
+ * 'mrw'.
+ */
+void	vie_wc_init(struct vie_wc *wc, void *vm, mem_region_read_t mrr,
+	    mem_region_write_t mrw, mem_region_rmw_t mrmw,
+	    mem_region_block_write_t mrbw, void *arg);
+
+/*
+ * Register [base, base + size) as write-combining. Stores are merged into
+ * bursts of up to 'burst' bytes, which must be a power of 2 between 8 and
+ * VIE_WC_MAXBURST. Addresses outside any registered range are passed
+ * straight through to the device model.
+ *
+ * Ranges must be registered before any vCPU starts emulating through 'wc'.
+ */
+int	vie_wc_add_range(struct vie_wc *wc, uint64_t base, uint64_t size,
+	    size_t burst);
+
+int	vie_wc_mread(void *vm, int cpuid, uint64_t gpa, uint64_t *rval,
+	    int rsize, void *arg);
+int	vie_wc_mwrite(void *vm, int cpuid, uint64_t gpa, uint64_t wval,
+	    int wsize, void *arg);
+int	vie_wc_rmw(void *vm, int cpuid, uint64_t gpa, enum vie_rmw_op op,
+	    uint64_t operand, uint64_t *oldval, int size, int locked,
+	    void *arg);
+
+/*
+ * Deliver the burst buffered for vCPU 'cpuid', if any. Returns the error
+ * from the block write callback.
+ */
+int	vie_wc_flush(struct vie_wc *wc, int cpuid);
+
+#endif	/* _VMM_MMIO_WC_H_ */
@@ -0,0 +1,298 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * vmm stubs for the test harnesses and benchmarks, backed by the per-vCPU
+ * machine state in vmm_stubs.h.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vmm_stubs.h"
+
+struct vm_stub	vm_stub_default;
+
+/* Flat 4GB read/write data segment with a 32-bit stack */
+static const struct seg_desc vm_stub_flat = {
+	.base = 0,
+	.limit = 0xffffffff,
+	.access = 0xc093,
+};
+
+static void __attribute__((__constructor__))
+vm_stub_default_init(void)
+{
+
+	vm_stub_init(&vm_stub_default);
+}
+
+void
+vm_stub_init(struct vm_stub *vm)
+{
+	int i;
+
+	for (i = 0; i < VM_STUB_MAXCPU; i++)
+		vm_stub_reset(&vm->vcpu[i]);
+}
+
+struct vm_stub_vcpu *
+vm_stub_vcpu(void *ctx, int vcpu)
+{
+	struct vm_stub *vm;
+
+	if (vcpu < 0 || vcpu >= VM_STUB_MAXCPU)
+		return (NULL);
+	vm = ctx != NULL ? ctx : &vm_stub_default;
+	return (&vm->vcpu[vcpu]);
+}
+
+void
+vm_stub_reset(struct vm_stub_vcpu *vc)
+{
+	int i;
+
+	memset(vc->regs, 0, sizeof(vc->regs));
+	for (i = 0; i < VM_STUB_NSEG; i++)
+		vc->segs[i] = vm_stub_flat;
+	vc->nmap = 0;
+	vc->exception = 0;
+	vc->errcode = 0;
+	vc->restart = 0;
+	vc->np_gla = 0;
+	vc->np_len = 0;
+	vc->ncopy_setup = 0;
+	vc->ngla2gpa = 0;
+}
+
+int
+vm_stub_map(struct vm_stub_vcpu *vc, uint64_t gpa, size_t len, void *host)
+{
+
+	if (vc->nmap == VM_STUB_MAXMAP)
+		return (ENOSPC);
+	vc->map[vc->nmap].gpa = gpa;
+	vc->map[vc->nmap].len = len;
+	vc->map[vc->nmap].host = host;
+	vc->nmap++;
+	return (0);
+}
+
+int
+vm_get_register(void *ctx, int vcpu, int reg, uint64_t *retval)
+{
+	struct vm_stub_vcpu *vc;
+
+	vc = vm_stub_vcpu(ctx, vcpu);
+	if (vc == NULL || reg < 0 || reg >= VM_REG_LAST)
+		return (EINVAL);
+
+	*retval = vc->regs[reg];
+	return (0);
+}
+
+int
+vm_set_register(void *ctx, int vcpu, int reg, uint64_t val)
+{
+	struct vm_stub_vcpu *vc;
+
+	vc = vm_stub_vcpu(ctx, vcpu);
+	if (vc == NULL || reg < 0 || reg >= VM_REG_LAST)
+		return (EINVAL);
+
+	vc->regs[reg] = val;
+	return (0);
+}
+
+int
+vm_get_seg_desc(void *ctx, int vcpu, int reg, struct seg_desc *desc)
+{
+	struct vm_stub_vcpu *vc;
+
+	vc = vm_stub_vcpu(ctx, vcpu);
+	if (vc == NULL || reg < VM_REG_GUEST_ES || reg > VM_REG_GUEST_GDTR)
+		return (EINVAL);
+
+	*desc = vc->segs[reg - VM_REG_GUEST_ES];
+	return (0);
+}
+
+int
+vm_set_seg_desc(void *ctx, int vcpu, int reg, struct seg_desc *desc)
+{
+	struct vm_stub_vcpu *vc;
+
+	vc = vm_stub_vcpu(ctx, vcpu);
+	if (vc == NULL || reg < VM_REG_GUEST_ES || reg > VM_REG_GUEST_GDTR)
+		return (EINVAL);
+
+	vc->segs[reg - VM_REG_GUEST_ES] = *desc;
+	return (0);
+}
+
+static void
+vm_stub_inject(void *ctx, int vcpu, int vector, int errcode)
+{
+	struct vm_stub_vcpu *vc;
+
+	vc = vm_stub_vcpu(ctx, vcpu);
+	KASSERT(vc != NULL, ("%s: invalid vcpu %d", __func__, vcpu));
+	vc->exception = vector;
+	vc->errcode = errcode;
+}
+
+void
+vm_inject_gp(void *ctx, int vcpu)
+{
+
+	vm_stub_inject(ctx, vcpu, VM_STUB_EXC_GP, 0);
+}
+
+void
+vm_inject_ss(void *ctx, int vcpu, int errcode)
+{
+
+	vm_stub_inject(ctx, vcpu, VM_STUB_EXC_SS, errcode);
+}
+
+void
+vm_inject_ac(void *ctx, int vcpu, int errcode)
+{
+
+	vm_stub_inject(ctx, vcpu, VM_STUB_EXC_AC, errcode);
+}
+
+void
+vm_inject_pf(void *ctx, int vcpu, int errcode, uint64_t cr2)
+{
+
+	vm_stub_inject(ctx, vcpu, VM_STUB_EXC_PF, errcode);
+}
+
+int
+vm_restart_instruction(void *ctx, int vcpu)
+{
+	struct vm_stub_vcpu *vc;
+
+	vc = vm_stub_vcpu(ctx, vcpu);
+	if (vc == NULL)
+		return (EINVAL);
+	vc->restart = 1;
+	return (0);
+}
+
+/*
+ * An access that touches the vCPU's not present range raises a #PF and
+ * reports a guest fault, the way _vm_gla2gpa() does.
+ */
+static int
+vm_stub_pf(void *ctx, int vcpu, struct vm_stub_vcpu *vc,
+    struct vm_guest_paging *paging, uint64_t gla, size_t len, int prot)
+{
+	int pfcode;
+
+	if (vc->np_len == 0 || gla + len <= vc->np_gla ||
+	    gla >= vc->np_gla + vc->np_len)
+		return (0);
+
+	pfcode = (prot & PROT_WRITE) ? 0x2 : 0;
+	if (paging->cpl == 3)
+		pfcode |= 0x4;
+	vm_inject_pf(ctx, vcpu, pfcode, gla);
+	return (1);
+}
+
+/*
+ * Guest linear addresses are identity mapped. An access is to system memory
+ * if it falls within one of the vCPU's mappings and to MMIO otherwise.
+ */
+int
+vm_copy_setup(void *ctx, int vcpu, struct vm_guest_paging *paging,
+    uint64_t gla, size_t len, int prot, struct iovec *iov, int iovcnt,
+    int *fault)
+{
+	struct vm_stub_vcpu *vc;
+	struct vm_stub_map *m;
+	int i;
+
+	*fault = 0;
+	vc = vm_stub_vcpu(ctx, vcpu);
+	if (vc == NULL)
+		return (EINVAL);
+	vc->ncopy_setup++;
+	if ((*fault = vm_stub_pf(ctx, vcpu, vc, paging, gla, len, prot)) != 0)
+		return (0);
+
+	for (m = NULL, i = 0; i < vc->nmap; i++) {
+		if (gla - vc->map[i].gpa < vc->map[i].len &&
+		    gla + len - vc->map[i].gpa <= vc->map[i].len) {
+			m = &vc->map[i];
+			break;
+		}
+	}
+	if (m == NULL)
+		return (EFAULT);
+
+	for (i = 0; i < iovcnt; i++) {
+		iov[i].iov_base = NULL;
+		iov[i].iov_len = 0;
+	}
+	iov[0].iov_base = (uint8_t *)m->host + (gla - m->gpa);
+	iov[0].iov_len = len;
+	return (0);
+}
+
+void
+vm_copyin(void *ctx, int vcpu, struct iovec *iov, void *dst, size_t len)
+{
+
+	memcpy(dst, iov[0].iov_base, len);
+}
+
+void
+vm_copyout(void *ctx, int vcpu, const void *src, struct iovec *iov,
+    size_t len)
+{
+
+	memcpy(iov[0].iov_base, src, len);
+}
+
+void
+vm_copy_teardown(void *ctx, int vcpu, struct iovec *iov, int iovcnt)
+{
+}
+
+int
+vm_gla2gpa(void *ctx, int vcpu, struct vm_guest_paging *paging,
+    uint64_t gla, int prot, uint64_t *gpa, int *fault)
+{
+	struct vm_stub_vcpu *vc;
+
+	*fault = 0;
+	vc = vm_stub_vcpu(ctx, vcpu);
+	if (vc == NULL)
+		return (EINVAL);
+	vc->ngla2gpa++;
+	if ((*fault = vm_stub_pf(ctx, vcpu, vc, paging, gla, 1, prot)) != 0)
+		return (0);
+
+	*gpa = gla;
+	return (0);
+}
+
+void
+panic(char *str, ...)
+{
+	va_list ap;
+
+	va_start(ap, str);
+	fprintf(stderr, "panic: ");
+	vfprintf(stderr, str, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	abort();
+}
@@ -1,3 +1,17 @@
+/*
+ * Userspace stand-ins for the bits of <machine/vmm.h> and <vmmapi.h> that the
+ * instruction emulator needs when it is built with _VERIFICATION.
+ */
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define	KASSERT(exp,msg)	assert((exp))
+
 /*
  * Identifiers for architecturally defined registers.
  */
@@ -38,10 +52,122 @@ enum vm_reg_name {
 	VM_REG_LAST
 };
 
+enum vm_cpu_mode {
+	CPU_MODE_REAL,
+	CPU_MODE_PROTECTED,
+	CPU_MODE_COMPATIBILITY,		/* IA-32E mode (CS.L = 0) */
+	CPU_MODE_64BIT,			/* IA-32E mode (CS.L = 1) */
+};
+
+enum vm_paging_mode {
+	PAGING_MODE_FLAT,
+	PAGING_MODE_32,
+	PAGING_MODE_PAE,
+	PAGING_MODE_64,
+};
+
+struct vm_guest_paging {
+	uint64_t	cr3;
+	int		cpl;
+	enum vm_cpu_mode cpu_mode;
+	enum vm_paging_mode paging_mode;
+};
+
+struct seg_desc {
+	uint64_t	base;
+	uint32_t	limit;
+	uint32_t	access;
+};
+#define	SEG_DESC_TYPE(access)		((access) & 0x001f)
+#define	SEG_DESC_DPL(access)		(((access) >> 5) & 0x3)
+#define	SEG_DESC_PRESENT(access)	(((access) & 0x0080) ? 1 : 0)
+#define	SEG_DESC_DEF32(access)		(((access) & 0x4000) ? 1 : 0)
+#define	SEG_DESC_GRANULARITY(access)	(((access) & 0x8000) ? 1 : 0)
+#define	SEG_DESC_UNUSABLE(access)	(((access) & 0x10000) ? 1 : 0)
+
+#ifndef	CACHE_LINE_SIZE
+#define	CACHE_LINE_SIZE		64
+#endif
+
+/*
+ * Machine state behind the stubs. The 'ctx' argument of the stubs is a
+ * 'struct vm_stub' or NULL for 'vm_stub_default'. Each vCPU has its own
+ * cache line aligned state which only the thread emulating on that vCPU
+ * touches, so any number of vCPUs may emulate concurrently.
+ */
+#define	VM_STUB_MAXCPU		64
+#define	VM_STUB_MAXMAP		8
+#define	VM_STUB_NSEG		(VM_REG_GUEST_GDTR - VM_REG_GUEST_ES + 1)
+
+/* Guest RAM visible to a vCPU; all other addresses are MMIO */
+struct vm_stub_map {
+	uint64_t	gpa;
+	size_t		len;
+	void		*host;
+};
+
+struct vm_stub_vcpu {
+	uint64_t	regs[VM_REG_LAST];
+	struct seg_desc	segs[VM_STUB_NSEG];	/* VM_REG_GUEST_ES and up */
+	struct vm_stub_map map[VM_STUB_MAXMAP];
+	int		nmap;
+	int		exception;	/* last exception injected, 0 if none */
+	int		errcode;
+	int		restart;	/* vm_restart_instruction() was called */
+	uint64_t	np_gla;		/* linear range that is not present */
+	uint64_t	np_len;
+	u_long		ncopy_setup;	/* vm_copy_setup() calls */
+	u_long		ngla2gpa;	/* vm_gla2gpa() calls */
+} __aligned(CACHE_LINE_SIZE);
+
+struct vm_stub {
+	struct vm_stub_vcpu vcpu[VM_STUB_MAXCPU];
+};
+
+/* Exception vectors recorded in 'vm_stub_vcpu.exception' */
+#define	VM_STUB_EXC_SS		12
+#define	VM_STUB_EXC_GP		13
+#define	VM_STUB_EXC_PF		14
+#define	VM_STUB_EXC_AC		17
+
+extern struct vm_stub vm_stub_default;
+
+void	vm_stub_init(struct vm_stub *vm);
+struct vm_stub_vcpu *vm_stub_vcpu(void *ctx, int vcpu);
+
+/*
+ * Clear the registers, load flat segments, drop the memory view and forget
+ * the pending exception and the call counts of a vCPU.
+ */
+void	vm_stub_reset(struct vm_stub_vcpu *vc);
+
+/* Make 'len' bytes at 'host' the guest RAM at 'gpa' for this vCPU */
+int	vm_stub_map(struct vm_stub_vcpu *vc, uint64_t gpa, size_t len,
+	    void *host);
+
 void	panic(char *str, ...);
 
 int	vm_get_register(void *ctx, int vcpu, int reg, uint64_t *retval);
 int	vm_set_register(void *ctx, int vcpu, int reg, uint64_t val);
+int	vm_get_seg_desc(void *ctx, int vcpu, int reg, struct seg_desc *desc);
+int	vm_set_seg_desc(void *ctx, int vcpu, int reg, struct seg_desc *desc);
+
+void	vm_inject_gp(void *ctx, int vcpu);
+void	vm_inject_ss(void *ctx, int vcpu, int errcode);
+void	vm_inject_ac(void *ctx, int vcpu, int errcode);
+void	vm_inject_pf(void *ctx, int vcpu, int errcode, uint64_t cr2);
+int	vm_restart_instruction(void *ctx, int vcpu);
+
+int	vm_copy_setup(void *ctx, int vcpu, struct vm_guest_paging *paging,
+	    uint64_t gla, size_t len, int prot, struct iovec *iov, int iovcnt,
+	    int *fault);
+void	vm_copyin(void *ctx, int vcpu, struct iovec *iov, void *dst,
+	    size_t len);
+void	vm_copyout(void *ctx, int vcpu, const void *src, struct iovec *iov,
+	    size_t len);
+void	vm_copy_teardown(void *ctx, int vcpu, struct iovec *iov, int iovcnt);
+int	vm_gla2gpa(void *ctx, int vcpu, struct vm_guest_paging *paging,
+	    uint64_t gla, int prot, uint64_t *gpa, int *fault);
 
 #include "vmm_instruction_emul.h"
 
@@ -0,0 +1,277 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Emulation event rings.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <machine/atomic.h>
+#include <machine/cpufunc.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmm_stubs.h"
+#include "vmm_trace.h"
+
+_Static_assert(sizeof(struct vie_trace_rec) == 32, "vie_trace_rec");
+_Static_assert(sizeof(struct vie_trace_hdr) <= VIE_TRACE_HDRSIZE,
+    "VIE_TRACE_HDRSIZE");
+
+volatile int vie_trace_enabled;
+
+/* The rings recorded into, set up by vie_trace_start() */
+static struct vie_trace_ring *vie_trace_rings[VIE_TRACE_MAXCPU];
+static int vie_trace_nvcpu;
+static uint32_t vie_trace_mask;
+
+static const char *const vie_trace_names[VIE_TRACE_LAST] = {
+	[VIE_TRACE_FETCH] = "fetch",
+	[VIE_TRACE_FETCH_DONE] = "fetch_done",
+	[VIE_TRACE_DECODE] = "decode",
+	[VIE_TRACE_PREFIXES] = "prefixes",
+	[VIE_TRACE_OPCODE] = "opcode",
+	[VIE_TRACE_MODRM] = "modrm",
+	[VIE_TRACE_SIB] = "sib",
+	[VIE_TRACE_DISPLACEMENT] = "displacement",
+	[VIE_TRACE_IMMEDIATE] = "immediate",
+	[VIE_TRACE_MOFFSET] = "moffset",
+	[VIE_TRACE_VERIFY_GLA] = "verify_gla",
+	[VIE_TRACE_DECODE_DONE] = "decode_done",
+	[VIE_TRACE_EMULATE] = "emulate",
+	[VIE_TRACE_EMULATE_DONE] = "emulate_done",
+	[VIE_TRACE_MMIO_READ] = "mmio_read",
+	[VIE_TRACE_MMIO_WRITE] = "mmio_write",
+	[VIE_TRACE_MMIO_RMW] = "mmio_rmw",
+	[VIE_TRACE_MMIO_DONE] = "mmio_done",
+};
+
+const char *
+vie_trace_event_name(int event)
+{
+
+	if (event < 0 || event >= VIE_TRACE_LAST)
+		return (NULL);
+	return (vie_trace_names[event]);
+}
+
+static __inline struct vie_trace_ring *
+vie_trace_ring(struct vie_trace *tr, int vcpuid)
+{
+
+	return ((struct vie_trace_ring *)((char *)tr->hdr + tr->hdr->hdrsize +
+	    vcpuid * tr->hdr->ringsize));
+}
+
+int
+vie_trace_create(struct vie_trace *tr, const char *path, int nvcpu,
+    uint32_t nrec)
+{
+	struct vie_trace_hdr *hdr;
+	uint64_t ringsize;
+	size_t len;
+	void *p;
+	int error, fd;
+
+	if (nvcpu < 1 || nvcpu > VIE_TRACE_MAXCPU || nrec < 2 ||
+	    !powerof2(nrec))
+		return (EINVAL);
+
+	ringsize = roundup2(sizeof(struct vie_trace_ring) +
+	    (uint64_t)nrec * sizeof(struct vie_trace_rec), CACHE_LINE_SIZE);
+	len = VIE_TRACE_HDRSIZE + nvcpu * ringsize;
+
+	if (path == NULL) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANON, -1, 0);
+	} else {
+		fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			return (errno);
+		if (ftruncate(fd, len) != 0) {
+			error = errno;
+			close(fd);
+			return (error);
+		}
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if (p == MAP_FAILED)
+		return (errno);
+
+	/* A reader that sees the magic sees a complete header */
+	hdr = p;
+	hdr->version = VIE_TRACE_VERSION;
+	hdr->nvcpu = nvcpu;
+	hdr->nrec = nrec;
+	hdr->recsize = sizeof(struct vie_trace_rec);
+	hdr->hdrsize = VIE_TRACE_HDRSIZE;
+	hdr->ringsize = ringsize;
+	atomic_store_rel_32(&hdr->magic, VIE_TRACE_MAGIC);
+
+	tr->hdr = hdr;
+	tr->len = len;
+	tr->mask = nrec - 1;
+	return (0);
+}
+
+int
+vie_trace_attach(struct vie_trace *tr, const char *path)
+{
+	struct vie_trace_hdr *hdr;
+	struct stat sb;
+	void *p;
+	int error, fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (errno);
+	if (fstat(fd, &sb) != 0) {
+		error = errno;
+		close(fd);
+		return (error);
+	}
+	if (sb.st_size < VIE_TRACE_HDRSIZE) {
+		close(fd);
+		return (EFTYPE);
+	}
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return (errno);
+
+	hdr = p;
+	if (atomic_load_acq_32(&hdr->magic) != VIE_TRACE_MAGIC ||
+	    hdr->version != VIE_TRACE_VERSION ||
+	    hdr->recsize != sizeof(struct vie_trace_rec) ||
+	    hdr->nvcpu < 1 || hdr->nvcpu > VIE_TRACE_MAXCPU ||
+	    hdr->nrec < 2 || !powerof2(hdr->nrec) ||
+	    hdr->hdrsize < sizeof(struct vie_trace_hdr) ||
+	    hdr->ringsize < sizeof(struct vie_trace_ring) +
+	    (uint64_t)hdr->nrec * sizeof(struct vie_trace_rec) ||
+	    hdr->hdrsize + hdr->nvcpu * hdr->ringsize > (uint64_t)sb.st_size) {
+		munmap(p, sb.st_size);
+		return (EFTYPE);
+	}
+
+	tr->hdr = hdr;
+	tr->len = sb.st_size;
+	tr->mask = hdr->nrec - 1;
+	return (0);
+}
+
+void
+vie_trace_close(struct vie_trace *tr)
+{
+
+	munmap(tr->hdr, tr->len);
+	tr->hdr = NULL;
+}
+
+void
+vie_trace_start(struct vie_trace *tr)
+{
+	int i;
+
+	vie_trace_enabled = 0;
+	for (i = 0; i < VIE_TRACE_MAXCPU; i++)
+		vie_trace_rings[i] = i < (int)tr->hdr->nvcpu ?
+		    vie_trace_ring(tr, i) : NULL;
+	vie_trace_nvcpu = tr->hdr->nvcpu;
+	vie_trace_mask = tr->mask;
+	vie_trace_enabled = 1;
+}
+
+void
+vie_trace_stop(void)
+{
+
+	vie_trace_enabled = 0;
+}
+
+void
+vie_trace_record(int vcpuid, int event, uint32_t arg, uint64_t a0,
+    uint64_t a1)
+{
+	struct vie_trace_ring *ring;
+	struct vie_trace_rec *rec;
+	uint64_t head;
+
+	if (vcpuid < 0 || vcpuid >= vie_trace_nvcpu)
+		return;
+
+	/*
+	 * Only this vCPU writes 'head'. The fence keeps the record stores
+	 * from passing the previous update of 'head', which a reader needs
+	 * to notice that the oldest record is being overwritten.
+	 */
+	ring = vie_trace_rings[vcpuid];
+	head = ring->head;
+	atomic_thread_fence_rel();
+	rec = &ring->rec[head & vie_trace_mask];
+	rec->tsc = rdtsc();
+	rec->event = event;
+	rec->vcpuid = vcpuid;
+	rec->arg = arg;
+	rec->a0 = a0;
+	rec->a1 = a1;
+	atomic_store_rel_64(&ring->head, head + 1);
+}
+
+uint64_t
+vie_trace_written(struct vie_trace *tr, int vcpuid)
+{
+
+	if (vcpuid < 0 || vcpuid >= (int)tr->hdr->nvcpu)
+		return (0);
+	return (atomic_load_acq_64(&vie_trace_ring(tr, vcpuid)->head));
+}
+
+size_t
+vie_trace_drain(struct vie_trace *tr, int vcpuid, uint64_t *tail,
+    struct vie_trace_rec *buf, size_t n, uint64_t *lost)
+{
+	struct vie_trace_ring *ring;
+	uint64_t head, first, nrec, t;
+	size_t cnt, i, skip;
+
+	if (vcpuid < 0 || vcpuid >= (int)tr->hdr->nvcpu)
+		return (0);
+
+	ring = vie_trace_ring(tr, vcpuid);
+	nrec = tr->hdr->nrec;
+	head = atomic_load_acq_64(&ring->head);
+	t = *tail;
+	if (t > head)
+		t = head;
+	if (head - t > nrec) {
+		*lost += head - nrec - t;
+		t = head - nrec;
+	}
+	cnt = MIN(head - t, n);
+	for (i = 0; i < cnt; i++)
+		buf[i] = ring->rec[(t + i) & tr->mask];
+
+	/*
+	 * While 'head' reads 'h' the writer may be overwriting record
+	 * 'h - nrec', so only the records from 'h - nrec + 1' on are known
+	 * to be intact.
+	 */
+	atomic_thread_fence_acq();
+	head = atomic_load_acq_64(&ring->head);
+	first = head >= nrec ? head - nrec + 1 : 0;
+	skip = t < first ? MIN(first - t, cnt) : 0;
+	if (skip != 0) {
+		*lost += skip;
+		memmove(buf, buf + skip, (cnt - skip) * sizeof(buf[0]));
+	}
+	*tail = t + cnt;
+	return (cnt - skip);
+}
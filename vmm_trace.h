@@ -0,0 +1,103 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Emulation event rings.
+ *
+ * The tracepoints of an emulator built with VIE_TRACE (see
+ * vmm_instruction_emul.h) write fixed-size records into one ring per vCPU.
+ * The rings live in a shared mapping, usually of a file, that another
+ * process can map read-only with vie_trace_attach() and drain while the
+ * vCPUs keep running:
+ *
+ *	header page	struct vie_trace_hdr
+ *	ring 0		struct vie_trace_ring, then 'nrec' records
+ *	...
+ *	ring nvcpu - 1
+ *
+ * A ring is written only by the thread emulating on its vCPU and never
+ * waits for readers: once full, each record overwrites the oldest one.
+ * 'head' counts the records ever written to the ring and is stored with
+ * release semantics after the record, so a reader that copies records and
+ * then re-reads 'head' knows which ones may have been overwritten under it
+ * and drops them, see vie_trace_drain().
+ */
+
+#ifndef	_VMM_TRACE_H_
+#define	_VMM_TRACE_H_
+
+#define	VIE_TRACE_MAGIC		0x54454956	/* "VIET" */
+#define	VIE_TRACE_VERSION	1
+#define	VIE_TRACE_MAXCPU	16
+#define	VIE_TRACE_HDRSIZE	4096
+
+#ifndef	CACHE_LINE_SIZE
+#define	CACHE_LINE_SIZE		64
+#endif
+
+struct vie_trace_rec {
+	uint64_t	tsc;
+	uint16_t	event;		/* enum vie_trace_event */
+	uint16_t	vcpuid;
+	uint32_t	arg;
+	uint64_t	a0;
+	uint64_t	a1;
+};
+
+struct vie_trace_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	nvcpu;
+	uint32_t	nrec;		/* records per ring, a power of 2 */
+	uint32_t	recsize;	/* sizeof(struct vie_trace_rec) */
+	uint32_t	hdrsize;	/* offset of ring 0 */
+	uint64_t	ringsize;	/* distance between rings */
+};
+
+struct vie_trace_ring {
+	volatile uint64_t head;		/* records written */
+	struct vie_trace_rec rec[] __aligned(CACHE_LINE_SIZE);
+};
+
+/* A mapping of the rings, by the writer or by a reader */
+struct vie_trace {
+	struct vie_trace_hdr *hdr;
+	size_t		len;
+	uint32_t	mask;		/* nrec - 1 */
+};
+
+/*
+ * Create the rings of 'nvcpu' vCPUs with 'nrec' records each in 'path',
+ * which is truncated, or in anonymous shared memory if 'path' is NULL.
+ */
+int	vie_trace_create(struct vie_trace *tr, const char *path, int nvcpu,
+	    uint32_t nrec);
+
+/* Map the rings in 'path' read-only, EFTYPE if they are not rings */
+int	vie_trace_attach(struct vie_trace *tr, const char *path);
+void	vie_trace_close(struct vie_trace *tr);
+
+/*
+ * Make the tracepoints record into 'tr', or stop them recording. Only one
+ * trace is recorded at a time. vie_trace_start() must not race with
+ * emulation; vie_trace_stop() may, and 'tr' must stay open until no vCPU
+ * can still be recording into it.
+ */
+void	vie_trace_start(struct vie_trace *tr);
+void	vie_trace_stop(void);
+
+/*
+ * Copy up to 'n' records of ring 'vcpuid' from index '*tail' on into
+ * 'buf' and advance '*tail' past them. Records that were overwritten
+ * before or while they were copied are skipped and added to '*lost'.
+ * Returns the number of records copied.
+ */
+size_t	vie_trace_drain(struct vie_trace *tr, int vcpuid, uint64_t *tail,
+	    struct vie_trace_rec *buf, size_t n, uint64_t *lost);
+
+/* Number of records ever written to ring 'vcpuid' */
+uint64_t vie_trace_written(struct vie_trace *tr, int vcpuid);
+
+/* Name of 'event', NULL if there is no such event */
+const char *vie_trace_event_name(int event);
+
+#endif	/* _VMM_TRACE_H_ */